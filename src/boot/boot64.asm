@@ -1,9 +1,22 @@
 [bits 16]
-[org 0x7c00]
+[org 0x0600]
 
 ; Constants
+BIOS_LOAD_ADDR equ 0x7c00
+RELOC_ADDR equ 0x0600       ; We move ourselves here so the kernel can grow past 0x7C00
 KERNEL_OFFSET equ 0x1000
-STACK_BASE equ 0x9000
+KERNEL_LIMIT equ 0x60000    ; Page tables start here (see kernel_entry_64.asm)
+STACK_BASE equ 0x1000       ; Stack grows down from just below the kernel
+LOAD_CHUNK equ 64           ; Sectors per extended read (32KB)
+BOOT_STAGES equ 0x500       ; TSC stamps handed to the kernel (boottime.h)
+
+; The build passes the kernel size in sectors (-DKERNEL_SECTORS=n)
+%ifndef KERNEL_SECTORS
+    %define KERNEL_SECTORS 120
+%endif
+%if KERNEL_SECTORS * 512 > KERNEL_LIMIT - KERNEL_OFFSET
+    %error "kernel image overlaps the page tables"
+%endif
 
 ; Boot entry point
 boot_start:
@@ -14,9 +27,26 @@ boot_start:
     mov es, ax              ; Set ES=0
     mov ss, ax              ; Set SS=0
     mov sp, STACK_BASE      ; Set stack
+    
+    ; Relocate the boot sector out of the kernel's way and continue there
+    cld
+    mov si, BIOS_LOAD_ADDR
+    mov di, RELOC_ADDR
+    mov cx, 256             ; 512 bytes as words
+    rep movsw
+    jmp 0x0000:relocated
 
-    ; Enable A20 line
-    call enable_a20
+relocated:
+    mov [boot_drive], dl    ; BIOS passes the boot drive (0x00 floppy, 0x80 disk)
+    
+    ; Boot stage 0: boot sector entry
+    rdtsc
+    mov [BOOT_STAGES], eax
+    mov [BOOT_STAGES + 4], edx
+    
+    ; Enable A20 line through the BIOS - required to access memory above 1MB
+    mov ax, 0x2401
+    int 0x15
     
     ; Check if CPUID is supported
     call check_cpuid
@@ -25,24 +55,15 @@ boot_start:
     call check_long_mode
     
     ; Load the kernel
-    mov si, MSG_LOAD_KERNEL
-    call print_string
     call load_kernel
     
+    ; Boot stage 1: kernel loaded
+    rdtsc
+    mov [BOOT_STAGES + 8], eax
+    mov [BOOT_STAGES + 12], edx
+    
     ; Switch to 32-bit protected mode first
-    mov si, MSG_PROT_MODE
-    call print_string
     jmp switch_to_protected_mode
-    
-    ; This should never be reached
-    jmp $
-
-; Enable A20 line - required to access memory above 1MB
-enable_a20:
-    ; Use BIOS to enable A20
-    mov ax, 0x2401
-    int 0x15
-    ret
 
 ; Check if CPUID instruction is available
 check_cpuid:
@@ -65,8 +86,7 @@ check_cpuid:
     
 no_cpuid_error:
     mov si, MSG_NO_CPUID
-    call print_string
-    jmp $
+    jmp boot_error
 
 ; Check if long mode is available
 check_long_mode:
@@ -84,26 +104,113 @@ check_long_mode:
     
 no_long_mode_error:
     mov si, MSG_NO_LONG_MODE
-    call print_string
-    jmp $
+    jmp boot_error
 
-; Load kernel from disk
+; Load kernel from disk. Uses INT 13h extended reads (AH=42h) in 32KB
+; chunks when the BIOS supports them for the boot drive, otherwise CHS reads
+; of up to a track.
 load_kernel:
-    mov ah, 0x02            ; BIOS read sector function
-    mov al, 40              ; Number of sectors to read (increased for 64-bit kernel)
-    mov ch, 0               ; Cylinder 0
-    mov cl, 2               ; Start from sector 2
-    mov dh, 0               ; Head 0
-    mov dl, 0x00            ; Drive number (floppy)
-    mov bx, KERNEL_OFFSET   ; Buffer to load to
-    int 0x13                ; BIOS interrupt
+    ; Check for INT 13h extensions (hard disks only - floppy DMA can't cross
+    ; a 64KB boundary, which large reads would)
+    mov dl, [boot_drive]
+    test dl, dl
+    jns .geometry
+    mov ah, 0x41
+    mov bx, 0x55AA
+    int 0x13
+    jc .geometry
+    cmp bx, 0xAA55
+    jne .geometry
+    test cl, 1              ; Fixed disk access subset (AH=42h)
+    jz .geometry
+    mov byte [use_lba], 1
+    jmp .next
+    
+.geometry:
+    ; CHS fallback: ask the BIOS for sectors per track and heads
+    mov ah, 0x08
+    mov dl, [boot_drive]
+    xor di, di              ; Work around buggy BIOSes (ES:DI = 0)
+    int 0x13
     jc disk_error
+    and cx, 0x3F
+    mov [sectors_per_track], cx
+    movzx dx, dh
+    inc dx
+    mov [heads], dx
+    
+.next:
+    mov cx, [sectors_left]
+    test cx, cx
+    jz .done
+    cmp byte [use_lba], 0
+    je .chs_read
+    
+    ; Extended read through the disk address packet
+    cmp cx, LOAD_CHUNK
+    jbe .sized
+    mov cx, LOAD_CHUNK
+.sized:
+    mov [dap_count], cx
+    mov si, dap
+    mov ah, 0x42
+    mov dl, [boot_drive]
+    int 0x13
+    jc disk_error
+    jmp .advance
+    
+.chs_read:
+    ; From the current sector to the end of its track, but no further than
+    ; the sectors left (CX) or the next 64KB boundary, which floppy DMA
+    ; can't cross. Sector n loads at KERNEL_OFFSET + (n - 1) * 512, so the
+    ; sectors before the boundary are 1 + (128 - KERNEL_OFFSET / 512 - n) % 128.
+    ; (CMOV is there: long mode was checked.)
+    mov al, 128 - KERNEL_OFFSET / 512
+    sub al, [dap_lba]
+    and ax, 127
+    inc ax
+    cmp cx, ax
+    cmova cx, ax
+    mov ax, [dap_lba]
+    mov di, [sectors_per_track]
+    cwd                     ; DX = 0, the LBA is below 32768
+    div di                  ; AX = track, DX = sector - 1
+    sub di, dx              ; Sectors to the end of the track
+    cmp cx, di
+    cmova cx, di
+    push cx
+    inc dx
+    mov bl, dl
+    cwd
+    div word [heads]        ; AX = cylinder, DX = head
+    mov ch, al
+    mov cl, ah
+    shl cl, 6               ; Cylinder bits 8-9
+    or cl, bl
+    mov dh, dl
+    pop ax                  ; AL = sectors to read
+    push ax
+    mov ah, 0x02
+    mov dl, [boot_drive]
+    mov es, [dap_segment]
+    xor bx, bx
+    int 0x13
+    pop cx
+    jc disk_error
+    
+.advance:
+    add [dap_lba], cx
+    sub [sectors_left], cx
+    shl cx, 5               ; Sectors to paragraphs
+    add [dap_segment], cx
+    jmp .next
+    
+.done:
     ret
     
 disk_error:
     mov si, MSG_DISK_ERROR
-    call print_string
-    jmp $
+    jmp boot_error
 
 ; Set up the GDT
 gdt_start:
@@ -169,27 +276,38 @@ start_protected_mode:
     ; This will be loaded as part of the kernel
     jmp KERNEL_OFFSET
 
-; Utility: Print string (SI = pointer to string)
+; Print the message at SI and stop - every error ends here
 [bits 16]
-print_string:
-    pusha
+boot_error:
     mov ah, 0x0E            ; BIOS teletype
 .loop:
     lodsb                   ; Load byte from SI into AL
     test al, al             ; Check if end of string
-    jz .done                ; If zero, we're done
+    jz $                    ; If zero, stop here
     int 0x10                ; Print character
     jmp .loop               ; Next character
-.done:
-    popa
-    ret
 
 ; Messages
-MSG_LOAD_KERNEL db 'Loading 64-bit kernel...', 0x0D, 0x0A, 0
-MSG_PROT_MODE db 'Switching to protected mode...', 0x0D, 0x0A, 0
-MSG_NO_CPUID db 'ERROR: CPUID not supported', 0x0D, 0x0A, 0
-MSG_NO_LONG_MODE db 'ERROR: Long mode not supported', 0x0D, 0x0A, 0
-MSG_DISK_ERROR db 'ERROR: Failed to load kernel', 0x0D, 0x0A, 0
+MSG_NO_CPUID db 'No CPUID', 0x0D, 0x0A, 0
+MSG_NO_LONG_MODE db 'No long mode', 0x0D, 0x0A, 0
+MSG_DISK_ERROR db 'Disk error', 0x0D, 0x0A, 0
+
+; Disk address packet for INT 13h AH=42h. Its buffer and LBA fields also
+; track the load position for the CHS path.
+dap:
+    db 0x10                 ; Packet size
+    db 0
+dap_count dw 0              ; Sectors to read
+    dw 0                    ; Buffer offset
+dap_segment dw KERNEL_OFFSET >> 4
+dap_lba dd 1, 0             ; The kernel follows the boot sector
+
+; Loader state
+boot_drive db 0
+use_lba db 0
+sectors_left dw KERNEL_SECTORS
+sectors_per_track dw 18
+heads dw 2
 
 ; Boot sector padding
 times 510-($-$$) db 0
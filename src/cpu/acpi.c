@@ -0,0 +1,238 @@
+#include "../include/types.h"
+#include "acpi.h"
+
+// Root System Description Pointer
+typedef struct {
+    char signature[8];          // "RSD PTR "
+    u8 checksum;                // Covers the first 20 bytes
+    char oem_id[6];
+    u8 revision;                // 0 = ACPI 1.0, 2+ = has XSDT
+    u32 rsdt_address;
+    // ACPI 2.0+ fields
+    u32 length;
+    u64 xsdt_address;
+    u8 extended_checksum;       // Covers the whole structure
+    u8 reserved[3];
+} __attribute__((packed)) acpi_rsdp_t;
+
+// Common header of every system description table
+typedef struct {
+    char signature[4];
+    u32 length;
+    u8 revision;
+    u8 checksum;
+    char oem_id[6];
+    char oem_table_id[8];
+    u32 oem_revision;
+    u32 creator_id;
+    u32 creator_revision;
+} __attribute__((packed)) acpi_sdt_header_t;
+
+// Multiple APIC Description Table
+typedef struct {
+    acpi_sdt_header_t header;
+    u32 lapic_address;
+    u32 flags;                  // Bit 0: PCAT_COMPAT
+} __attribute__((packed)) acpi_madt_t;
+
+// MADT entry types we care about
+#define MADT_ENTRY_LAPIC          0
+#define MADT_ENTRY_IOAPIC         1
+#define MADT_ENTRY_OVERRIDE       2
+#define MADT_ENTRY_LAPIC_ADDRESS  5
+
+typedef struct {
+    u8 type;
+    u8 length;
+} __attribute__((packed)) madt_entry_header_t;
+
+typedef struct {
+    madt_entry_header_t header;
+    u8 acpi_id;
+    u8 apic_id;
+    u32 flags;                  // Bit 0: enabled, bit 1: online capable
+} __attribute__((packed)) madt_lapic_t;
+
+typedef struct {
+    madt_entry_header_t header;
+    u8 id;
+    u8 reserved;
+    u32 address;
+    u32 gsi_base;
+} __attribute__((packed)) madt_ioapic_t;
+
+typedef struct {
+    madt_entry_header_t header;
+    u8 bus;
+    u8 source;
+    u32 gsi;
+    u16 flags;
+} __attribute__((packed)) madt_override_t;
+
+typedef struct {
+    madt_entry_header_t header;
+    u16 reserved;
+    u64 address;
+} __attribute__((packed)) madt_lapic_address_t;
+
+static acpi_rsdp_t* rsdp = NULL;
+static acpi_madt_info_t madt_info;
+
+// Sum the bytes of a structure - valid ACPI structures sum to zero
+static u8 acpi_checksum(const void* data, u32 length) {
+    const u8* bytes = (const u8*)data;
+    u8 sum = 0;
+    for (u32 i = 0; i < length; i++) {
+        sum += bytes[i];
+    }
+    return sum;
+}
+
+// Compare a fixed-length signature
+static bool acpi_signature_equals(const char* a, const char* b, int length) {
+    for (int i = 0; i < length; i++) {
+        if (a[i] != b[i]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Scan a memory range on 16-byte boundaries for a valid RSDP
+static acpi_rsdp_t* acpi_scan_rsdp(u64 start, u64 end) {
+    for (u64 addr = start; addr < end; addr += 16) {
+        acpi_rsdp_t* candidate = (acpi_rsdp_t*)addr;
+        if (acpi_signature_equals(candidate->signature, "RSD PTR ", 8) &&
+            acpi_checksum(candidate, 20) == 0) {
+            return candidate;
+        }
+    }
+    return NULL;
+}
+
+// Find the RSDP in the EBDA or the BIOS read-only area
+static acpi_rsdp_t* acpi_find_rsdp() {
+    // The EBDA segment is stored in the BIOS data area at 0x40E
+    u64 ebda = (u64)(*(volatile u16*)0x40E) << 4;
+    if (ebda) {
+        acpi_rsdp_t* found = acpi_scan_rsdp(ebda, ebda + 1024);
+        if (found) {
+            return found;
+        }
+    }
+
+    return acpi_scan_rsdp(0xE0000, 0x100000);
+}
+
+// Find an ACPI table by its 4-character signature
+void* acpi_find_table(const char* signature) {
+    if (!rsdp) {
+        return NULL;
+    }
+
+    // Prefer the XSDT (64-bit pointers) when the firmware provides one
+    bool use_xsdt = rsdp->revision >= 2 && rsdp->xsdt_address != 0;
+    acpi_sdt_header_t* root = use_xsdt ? (acpi_sdt_header_t*)rsdp->xsdt_address
+                                       : (acpi_sdt_header_t*)(u64)rsdp->rsdt_address;
+    if (acpi_checksum(root, root->length) != 0) {
+        return NULL;
+    }
+
+    u32 entry_size = use_xsdt ? 8 : 4;
+    u32 entries = (root->length - sizeof(acpi_sdt_header_t)) / entry_size;
+    u8* table_list = (u8*)root + sizeof(acpi_sdt_header_t);
+
+    for (u32 i = 0; i < entries; i++) {
+        u64 address = use_xsdt ? *(u64*)(table_list + i * 8)
+                               : *(u32*)(table_list + i * 4);
+        acpi_sdt_header_t* table = (acpi_sdt_header_t*)address;
+        if (acpi_signature_equals(table->signature, signature, 4) &&
+            acpi_checksum(table, table->length) == 0) {
+            return table;
+        }
+    }
+
+    return NULL;
+}
+
+// Walk the MADT entries and record CPUs, I/O APICs and IRQ overrides
+static void acpi_parse_madt(acpi_madt_t* madt) {
+    madt_info.lapic_address = madt->lapic_address;
+    madt_info.has_8259 = (madt->flags & 1) != 0;
+
+    u8* entry = (u8*)madt + sizeof(acpi_madt_t);
+    u8* end = (u8*)madt + madt->header.length;
+
+    while (entry + sizeof(madt_entry_header_t) <= end) {
+        madt_entry_header_t* header = (madt_entry_header_t*)entry;
+        if (header->length < sizeof(madt_entry_header_t)) {
+            break;  // Malformed entry, stop parsing
+        }
+
+        switch (header->type) {
+            case MADT_ENTRY_LAPIC: {
+                madt_lapic_t* lapic = (madt_lapic_t*)entry;
+                if ((lapic->flags & 1) && madt_info.cpu_count < MAX_CPUS) {
+                    acpi_cpu_t* cpu = &madt_info.cpus[madt_info.cpu_count++];
+                    cpu->acpi_id = lapic->acpi_id;
+                    cpu->apic_id = lapic->apic_id;
+                }
+                break;
+            }
+            case MADT_ENTRY_IOAPIC: {
+                madt_ioapic_t* ioapic = (madt_ioapic_t*)entry;
+                if (madt_info.ioapic_count < MAX_IOAPICS) {
+                    acpi_ioapic_t* info = &madt_info.ioapics[madt_info.ioapic_count++];
+                    info->id = ioapic->id;
+                    info->address = ioapic->address;
+                    info->gsi_base = ioapic->gsi_base;
+                }
+                break;
+            }
+            case MADT_ENTRY_OVERRIDE: {
+                madt_override_t* override = (madt_override_t*)entry;
+                if (override->bus == 0 && madt_info.override_count < MAX_IRQ_OVERRIDES) {
+                    acpi_irq_override_t* info = &madt_info.overrides[madt_info.override_count++];
+                    info->source_irq = override->source;
+                    info->gsi = override->gsi;
+                    info->flags = override->flags;
+                }
+                break;
+            }
+            case MADT_ENTRY_LAPIC_ADDRESS: {
+                madt_lapic_address_t* address = (madt_lapic_address_t*)entry;
+                madt_info.lapic_address = address->address;
+                break;
+            }
+            default:
+                break;
+        }
+
+        entry += header->length;
+    }
+}
+
+// Locate the RSDP and parse the MADT
+bool acpi_init() {
+    madt_info.cpu_count = 0;
+    madt_info.ioapic_count = 0;
+    madt_info.override_count = 0;
+
+    rsdp = acpi_find_rsdp();
+    if (!rsdp) {
+        return false;
+    }
+
+    acpi_madt_t* madt = (acpi_madt_t*)acpi_find_table("APIC");
+    if (!madt) {
+        return false;
+    }
+
+    acpi_parse_madt(madt);
+    return madt_info.cpu_count > 0 && madt_info.ioapic_count > 0;
+}
+
+// Get the parsed MADT
+const acpi_madt_info_t* acpi_get_madt_info() {
+    return &madt_info;
+}
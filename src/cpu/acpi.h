@@ -0,0 +1,61 @@
+#ifndef ACPI_H
+#define ACPI_H
+
+#include "../include/types.h"
+
+// Limits for the interrupt controller topology we track
+#define MAX_CPUS             16
+#define MAX_IOAPICS          4
+#define MAX_IRQ_OVERRIDES    16
+
+// MADT interrupt source override flags
+#define MADT_POLARITY_MASK   0x03
+#define MADT_POLARITY_LOW    0x03
+#define MADT_TRIGGER_MASK    0x0C
+#define MADT_TRIGGER_LEVEL   0x0C
+
+// A processor local APIC listed in the MADT
+typedef struct {
+    u8 acpi_id;         // ACPI processor UID
+    u8 apic_id;         // Local APIC ID
+} acpi_cpu_t;
+
+// An I/O APIC listed in the MADT
+typedef struct {
+    u8 id;              // I/O APIC ID
+    u32 address;        // Physical MMIO base
+    u32 gsi_base;       // First global system interrupt it handles
+} acpi_ioapic_t;
+
+// A legacy ISA IRQ that is wired to a different GSI or polarity/trigger
+typedef struct {
+    u8 source_irq;      // ISA IRQ number
+    u32 gsi;            // Global system interrupt it is connected to
+    u16 flags;          // Polarity and trigger mode
+} acpi_irq_override_t;
+
+// Interrupt controller information gathered from the MADT
+typedef struct {
+    u64 lapic_address;
+    bool has_8259;      // PCAT_COMPAT: legacy PICs are present
+
+    u32 cpu_count;
+    acpi_cpu_t cpus[MAX_CPUS];
+
+    u32 ioapic_count;
+    acpi_ioapic_t ioapics[MAX_IOAPICS];
+
+    u32 override_count;
+    acpi_irq_override_t overrides[MAX_IRQ_OVERRIDES];
+} acpi_madt_info_t;
+
+// Locate the RSDP and parse the MADT, returns false if no MADT was found
+bool acpi_init();
+
+// Get the parsed MADT (only valid after acpi_init() returned true)
+const acpi_madt_info_t* acpi_get_madt_info();
+
+// Find an ACPI table by its 4-character signature, returns NULL if absent
+void* acpi_find_table(const char* signature);
+
+#endif
@@ -0,0 +1,108 @@
+; Application processor startup code.
+; smp_init() copies this to AP_TRAMPOLINE_ADDR and sends a startup IPI, so the
+; AP starts executing here in real mode with CS = AP_TRAMPOLINE_ADDR >> 4.
+; All addresses are computed relative to ap_trampoline_start.
+
+AP_TRAMPOLINE_ADDR equ 0x70000     ; Keep in sync with smp.h
+
+%define TRAMPOLINE(label) (AP_TRAMPOLINE_ADDR + (label) - ap_trampoline_start)
+
+section .text
+
+global ap_trampoline_start
+global ap_trampoline_end
+global ap_trampoline_cr3
+global ap_trampoline_stack
+global ap_trampoline_entry
+
+[bits 16]
+ap_trampoline_start:
+    cli
+    cld
+    mov ax, cs
+    mov ds, ax
+
+    ; Load the temporary GDT and enter protected mode
+    lgdt [ap_gdt_pointer - ap_trampoline_start]
+    mov eax, cr0
+    or eax, 1
+    mov cr0, eax
+    jmp dword 0x08:TRAMPOLINE(ap_protected_mode)
+
+[bits 32]
+ap_protected_mode:
+    mov ax, 0x10
+    mov ds, ax
+    mov es, ax
+    mov ss, ax
+
+    ; Enable PAE
+    mov eax, cr4
+    or eax, 1 << 5
+    mov cr4, eax
+
+    ; Use the page tables of the bootstrap processor
+    mov eax, [TRAMPOLINE(ap_trampoline_cr3)]
+    mov cr3, eax
+
+    ; Set long mode bit in EFER MSR, and NXE if the CPU has it - the page
+    ; tables mark data no-execute
+    mov eax, 0x80000001
+    cpuid
+    mov ebx, edx
+    mov ecx, 0xC0000080
+    rdmsr
+    or eax, 1 << 8
+    test ebx, 1 << 20
+    jz .no_nx
+    or eax, 1 << 11
+.no_nx:
+    wrmsr
+
+    ; Enable paging (this activates long mode) and write protection
+    mov eax, cr0
+    or eax, (1 << 31) | (1 << 16)
+    mov cr0, eax
+
+    jmp 0x18:TRAMPOLINE(ap_long_mode)
+
+[bits 64]
+ap_long_mode:
+    mov ax, 0x10
+    mov ds, ax
+    mov es, ax
+    mov ss, ax
+
+    ; Switch to this CPU's stack and enter the kernel
+    mov rsp, [TRAMPOLINE(ap_trampoline_stack)]
+    mov rax, [TRAMPOLINE(ap_trampoline_entry)]
+    call rax
+
+.halt:
+    cli
+    hlt
+    jmp .halt
+
+; Temporary GDT: null, 32-bit code, data, 64-bit code
+align 8
+ap_gdt:
+    dq 0
+    dq 0x00CF9A000000FFFF
+    dq 0x00CF92000000FFFF
+    dq 0x00AF9A000000FFFF
+ap_gdt_end:
+
+ap_gdt_pointer:
+    dw ap_gdt_end - ap_gdt - 1
+    dd TRAMPOLINE(ap_gdt)
+
+; Filled in by smp_init() before each startup IPI
+align 8
+ap_trampoline_cr3:
+    dq 0
+ap_trampoline_stack:
+    dq 0
+ap_trampoline_entry:
+    dq 0
+
+ap_trampoline_end:
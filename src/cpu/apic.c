@@ -0,0 +1,275 @@
+#include "../include/types.h"
+#include "apic.h"
+#include "acpi.h"
+#include "../kernel/low_level.h"
+#include "../drivers/timer.h"
+
+// IA32_APIC_BASE MSR and its global enable bit
+#define MSR_APIC_BASE         0x1B
+#define APIC_BASE_ENABLE      (1 << 11)
+
+// I/O APIC register window
+#define IOAPIC_REGSEL         0x00
+#define IOAPIC_WINDOW         0x10
+#define IOAPIC_REG_VERSION    0x01
+#define IOAPIC_REG_REDTBL     0x10
+
+// Redirection entry bits (low dword)
+#define IOAPIC_ACTIVE_LOW     (1 << 13)
+#define IOAPIC_LEVEL          (1 << 15)
+#define IOAPIC_MASKED         (1 << 16)
+
+#define LEGACY_IRQ_COUNT      16
+
+// Mapping of a legacy ISA IRQ onto an I/O APIC pin
+typedef struct {
+    u64 ioapic_base;    // 0 if the IRQ is not routable
+    u8 pin;             // Redirection table index
+} irq_route_t;
+
+// Timer calibration: count down for this long against the TSC
+#define LAPIC_CALIBRATE_US    10000
+
+static u64 lapic_base = 0;
+static u64 lapic_timer_rate = 0;
+static irq_route_t irq_routes[LEGACY_IRQ_COUNT];
+
+// Read a local APIC register
+u32 lapic_read(u32 reg) {
+    return mmio_read32(lapic_base + reg);
+}
+
+// Write a local APIC register
+void lapic_write(u32 reg, u32 value) {
+    mmio_write32(lapic_base + reg, value);
+}
+
+// Signal end-of-interrupt - a single MMIO store instead of PIC port writes
+void lapic_eoi() {
+    mmio_write32(lapic_base + LAPIC_REG_EOI, 0);
+}
+
+// Get the local APIC ID of the calling CPU
+u32 lapic_get_id() {
+    return lapic_read(LAPIC_REG_ID) >> 24;
+}
+
+// Send an IPI to a local APIC ID and wait for it to be accepted
+void lapic_send_ipi(u32 apic_id, u32 icr_low) {
+    // An interrupt between the two ICR writes could clobber the destination
+    u64 flags = cpu_irq_save();
+    lapic_write(LAPIC_REG_ICR_HIGH, apic_id << 24);
+    lapic_write(LAPIC_REG_ICR_LOW, icr_low);
+    while (lapic_read(LAPIC_REG_ICR_LOW) & LAPIC_ICR_PENDING) {
+        __asm__ __volatile__("pause");
+    }
+    cpu_irq_restore(flags);
+}
+
+// Enable the local APIC of the calling CPU
+void lapic_init() {
+    // Make sure the APIC is globally enabled in the base MSR
+    u64 base = cpu_read_msr(MSR_APIC_BASE);
+    cpu_write_msr(MSR_APIC_BASE, base | APIC_BASE_ENABLE);
+
+    // Accept all priorities
+    lapic_write(LAPIC_REG_TPR, 0);
+
+    // LINT0 carries ExtINT from the 8259s, which we no longer use
+    lapic_write(LAPIC_REG_LVT_LINT0, LAPIC_LVT_MASKED);
+    lapic_write(LAPIC_REG_LVT_LINT1, LAPIC_LVT_NMI);
+    lapic_write(LAPIC_REG_LVT_TIMER, LAPIC_LVT_MASKED);
+    lapic_write(LAPIC_REG_LVT_ERROR, LAPIC_LVT_MASKED);
+
+    // Clear any stale errors (ESR needs a write before it can be read)
+    lapic_write(LAPIC_REG_ESR, 0);
+    lapic_write(LAPIC_REG_ESR, 0);
+
+    // Software-enable the APIC with our spurious vector
+    lapic_write(LAPIC_REG_SVR, LAPIC_SVR_ENABLE | LAPIC_SPURIOUS_VECTOR);
+
+    // Acknowledge anything left in service
+    lapic_eoi();
+}
+
+// Rate the local APIC timer counts down at (divide by 16), measured once
+u64 lapic_timer_hz() {
+    u64 tsc_hz = timer_get_tsc_hz();
+    if (lapic_timer_rate || !tsc_hz || !lapic_base) {
+        return lapic_timer_rate;
+    }
+
+    // One-shot from the top of the counter, masked so it raises nothing
+    lapic_write(LAPIC_REG_TIMER_DIV, LAPIC_TIMER_DIV_16);
+    lapic_write(LAPIC_REG_LVT_TIMER, LAPIC_LVT_MASKED);
+    lapic_write(LAPIC_REG_TIMER_INIT, 0xFFFFFFFF);
+
+    // Both clocks are read with interrupts off so they belong together
+    u64 flags = cpu_irq_save();
+    u32 count_start = lapic_read(LAPIC_REG_TIMER_COUNT);
+    u64 tsc_start = cpu_read_tsc();
+    cpu_irq_restore(flags);
+
+    timer_delay_us(LAPIC_CALIBRATE_US);
+
+    flags = cpu_irq_save();
+    u32 count_end = lapic_read(LAPIC_REG_TIMER_COUNT);
+    u64 tsc_end = cpu_read_tsc();
+    cpu_irq_restore(flags);
+
+    lapic_write(LAPIC_REG_TIMER_INIT, 0);
+    if (tsc_end > tsc_start && count_start > count_end) {
+        lapic_timer_rate = (u64)(count_start - count_end) * tsc_hz / (tsc_end - tsc_start);
+    }
+    return lapic_timer_rate;
+}
+
+// Run the local APIC timer of the calling CPU periodically
+bool lapic_timer_start(u8 vector, u32 hz) {
+    u64 rate = lapic_timer_hz();
+    if (!rate || !hz) {
+        return false;
+    }
+    u64 count = rate / hz;
+    if (count == 0) {
+        count = 1;
+    } else if (count > 0xFFFFFFFF) {
+        count = 0xFFFFFFFF;
+    }
+
+    lapic_write(LAPIC_REG_TIMER_DIV, LAPIC_TIMER_DIV_16);
+    lapic_write(LAPIC_REG_LVT_TIMER, LAPIC_TIMER_PERIODIC | vector);
+    lapic_write(LAPIC_REG_TIMER_INIT, (u32)count);
+    return true;
+}
+
+// Stop the local APIC timer of the calling CPU
+void lapic_timer_stop() {
+    lapic_write(LAPIC_REG_LVT_TIMER, LAPIC_LVT_MASKED);
+    lapic_write(LAPIC_REG_TIMER_INIT, 0);
+}
+
+// Read an I/O APIC register
+static u32 ioapic_read(u64 base, u8 reg) {
+    mmio_write32(base + IOAPIC_REGSEL, reg);
+    return mmio_read32(base + IOAPIC_WINDOW);
+}
+
+// Write an I/O APIC register
+static void ioapic_write(u64 base, u8 reg, u32 value) {
+    mmio_write32(base + IOAPIC_REGSEL, reg);
+    mmio_write32(base + IOAPIC_WINDOW, value);
+}
+
+// Work out which I/O APIC pin a legacy IRQ is wired to, honouring overrides
+static void ioapic_resolve_irq(const acpi_madt_info_t* madt, u8 irq, u32* redir_flags) {
+    u32 gsi = irq;
+    u16 flags = 0;  // ISA default: edge triggered, active high
+
+    for (u32 i = 0; i < madt->override_count; i++) {
+        if (madt->overrides[i].source_irq == irq) {
+            gsi = madt->overrides[i].gsi;
+            flags = madt->overrides[i].flags;
+            break;
+        }
+    }
+
+    *redir_flags = 0;
+    if ((flags & MADT_POLARITY_MASK) == MADT_POLARITY_LOW) {
+        *redir_flags |= IOAPIC_ACTIVE_LOW;
+    }
+    if ((flags & MADT_TRIGGER_MASK) == MADT_TRIGGER_LEVEL) {
+        *redir_flags |= IOAPIC_LEVEL;
+    }
+
+    irq_routes[irq].ioapic_base = 0;
+    for (u32 i = 0; i < madt->ioapic_count; i++) {
+        u64 base = madt->ioapics[i].address;
+        u32 pins = ((ioapic_read(base, IOAPIC_REG_VERSION) >> 16) & 0xFF) + 1;
+        u32 first = madt->ioapics[i].gsi_base;
+        if (gsi >= first && gsi < first + pins) {
+            irq_routes[irq].ioapic_base = base;
+            irq_routes[irq].pin = (u8)(gsi - first);
+            return;
+        }
+    }
+}
+
+// Route a legacy ISA IRQ to a vector on a CPU (left masked)
+bool ioapic_route_irq(u8 irq, u8 vector, u32 apic_id) {
+    if (irq >= LEGACY_IRQ_COUNT) {
+        return false;
+    }
+
+    u32 flags;
+    ioapic_resolve_irq(acpi_get_madt_info(), irq, &flags);
+    irq_route_t* route = &irq_routes[irq];
+    if (!route->ioapic_base) {
+        return false;
+    }
+
+    // Fixed delivery, physical destination
+    u8 reg = IOAPIC_REG_REDTBL + route->pin * 2;
+    ioapic_write(route->ioapic_base, reg, IOAPIC_MASKED);
+    ioapic_write(route->ioapic_base, reg + 1, apic_id << 24);
+    ioapic_write(route->ioapic_base, reg, IOAPIC_MASKED | flags | vector);
+    return true;
+}
+
+// Mask a legacy ISA IRQ at the I/O APIC
+void ioapic_mask_irq(u8 irq) {
+    if (irq >= LEGACY_IRQ_COUNT || !irq_routes[irq].ioapic_base) {
+        return;
+    }
+
+    irq_route_t* route = &irq_routes[irq];
+    u8 reg = IOAPIC_REG_REDTBL + route->pin * 2;
+    ioapic_write(route->ioapic_base, reg, ioapic_read(route->ioapic_base, reg) | IOAPIC_MASKED);
+}
+
+// Unmask a legacy ISA IRQ at the I/O APIC
+void ioapic_unmask_irq(u8 irq) {
+    if (irq >= LEGACY_IRQ_COUNT || !irq_routes[irq].ioapic_base) {
+        return;
+    }
+
+    irq_route_t* route = &irq_routes[irq];
+    u8 reg = IOAPIC_REG_REDTBL + route->pin * 2;
+    ioapic_write(route->ioapic_base, reg, ioapic_read(route->ioapic_base, reg) & ~IOAPIC_MASKED);
+}
+
+// Change the destination CPU of a legacy ISA IRQ
+bool ioapic_set_irq_affinity(u8 irq, u32 apic_id) {
+    if (irq >= LEGACY_IRQ_COUNT || !irq_routes[irq].ioapic_base) {
+        return false;
+    }
+
+    irq_route_t* route = &irq_routes[irq];
+    u8 reg = IOAPIC_REG_REDTBL + route->pin * 2 + 1;
+    ioapic_write(route->ioapic_base, reg, apic_id << 24);
+    return true;
+}
+
+// Find the APICs via ACPI and enable the local APIC of the calling CPU
+bool apic_init() {
+    // CPUID.1:EDX bit 9 reports an on-chip local APIC
+    u32 eax, ebx, ecx, edx;
+    cpu_cpuid(1, 0, &eax, &ebx, &ecx, &edx);
+    if (!(edx & (1 << 9))) {
+        return false;
+    }
+
+    if (!acpi_init()) {
+        return false;
+    }
+
+    lapic_base = acpi_get_madt_info()->lapic_address;
+    lapic_init();
+
+    // Every legacy IRQ starts out unroutable until ioapic_route_irq() is called
+    for (int i = 0; i < LEGACY_IRQ_COUNT; i++) {
+        irq_routes[i].ioapic_base = 0;
+    }
+
+    return true;
+}
@@ -0,0 +1,83 @@
+#ifndef APIC_H
+#define APIC_H
+
+#include "../include/types.h"
+
+// Local APIC register offsets (xAPIC MMIO layout)
+#define LAPIC_REG_ID          0x020
+#define LAPIC_REG_VERSION     0x030
+#define LAPIC_REG_TPR         0x080
+#define LAPIC_REG_EOI         0x0B0
+#define LAPIC_REG_SVR         0x0F0
+#define LAPIC_REG_ESR         0x280
+#define LAPIC_REG_ICR_LOW     0x300
+#define LAPIC_REG_ICR_HIGH    0x310
+#define LAPIC_REG_LVT_TIMER   0x320
+#define LAPIC_REG_LVT_LINT0   0x350
+#define LAPIC_REG_LVT_LINT1   0x360
+#define LAPIC_REG_LVT_ERROR   0x370
+#define LAPIC_REG_TIMER_INIT  0x380
+#define LAPIC_REG_TIMER_COUNT 0x390
+#define LAPIC_REG_TIMER_DIV   0x3E0
+
+// Interrupt command register bits
+#define LAPIC_ICR_INIT        (5 << 8)
+#define LAPIC_ICR_STARTUP     (6 << 8)
+#define LAPIC_ICR_PENDING     (1 << 12)
+#define LAPIC_ICR_ASSERT      (1 << 14)
+#define LAPIC_ICR_LEVEL       (1 << 15)
+
+#define LAPIC_LVT_MASKED      (1 << 16)
+#define LAPIC_LVT_NMI         (4 << 8)
+#define LAPIC_SVR_ENABLE      (1 << 8)
+
+// Timer LVT mode and divide configuration
+#define LAPIC_TIMER_PERIODIC  (1 << 17)
+#define LAPIC_TIMER_DIV_16    0x3
+
+// Vector the local APIC reports spurious interrupts on (low nibble must be 0xF)
+#define LAPIC_SPURIOUS_VECTOR 0xFF
+
+// Find the APICs via ACPI and enable the local APIC of the calling CPU.
+// Returns false if the machine has no usable APIC, in which case the
+// caller should keep using the 8259 PICs.
+bool apic_init();
+
+// Enable the local APIC of the calling CPU (also used by application processors)
+void lapic_init();
+
+// Signal end-of-interrupt to the local APIC
+void lapic_eoi();
+
+// Get the local APIC ID of the calling CPU
+u32 lapic_get_id();
+
+// Send an IPI (ICR low dword: vector and delivery mode) to a local APIC ID
+void lapic_send_ipi(u32 apic_id, u32 icr_low);
+
+// Run the local APIC timer of the calling CPU periodically, raising vector
+// hz times a second. Returns false if the timer rate could not be measured.
+bool lapic_timer_start(u8 vector, u32 hz);
+
+// Stop (mask) the local APIC timer of the calling CPU
+void lapic_timer_stop();
+
+// Rate the local APIC timer counts down at, measured against the TSC on
+// first use (0 if that failed). The bus clock is shared by all CPUs.
+u64 lapic_timer_hz();
+
+// Read/write a local APIC register
+u32 lapic_read(u32 reg);
+void lapic_write(u32 reg, u32 value);
+
+// Route a legacy ISA IRQ to a vector on a CPU (left masked)
+bool ioapic_route_irq(u8 irq, u8 vector, u32 apic_id);
+
+// Mask/unmask a legacy ISA IRQ at the I/O APIC
+void ioapic_mask_irq(u8 irq);
+void ioapic_unmask_irq(u8 irq);
+
+// Change the destination CPU of a legacy ISA IRQ
+bool ioapic_set_irq_affinity(u8 irq, u32 apic_id);
+
+#endif
@@ -0,0 +1,60 @@
+#include "../include/types.h"
+#include "gdt.h"
+
+// GDT pointer structure
+typedef struct {
+    u16 limit;
+    u64 base;
+} __attribute__((packed)) gdt_ptr_t;
+
+// Flat 64-bit code and data descriptors, and the same with DPL 3
+#define GDT_CODE_64       0x00AF9A000000FFFFULL
+#define GDT_DATA_64       0x00CF92000000FFFFULL
+#define GDT_USER_CODE_64  0x00AFFA000000FFFFULL
+#define GDT_USER_DATA_64  0x00CFF2000000FFFFULL
+
+// Build a GDT with a TSS in the given storage and load it on this CPU
+void gdt_load(u64* gdt, tss_t* tss) {
+    // Start with an empty TSS - no I/O permission bitmap
+    u8* bytes = (u8*)tss;
+    for (u32 i = 0; i < sizeof(tss_t); i++) {
+        bytes[i] = 0;
+    }
+    tss->iomap_base = sizeof(tss_t);
+
+    gdt[0] = 0;
+    gdt[GDT_KERNEL_CODE / 8] = GDT_CODE_64;
+    gdt[GDT_KERNEL_DATA / 8] = GDT_DATA_64;
+    gdt[GDT_USER_CODE32 / 8] = 0;
+    gdt[GDT_USER_DATA / 8] = GDT_USER_DATA_64;
+    gdt[GDT_USER_CODE / 8] = GDT_USER_CODE_64;
+
+    // A 64-bit TSS descriptor takes two GDT slots
+    u64 base = (u64)tss;
+    u64 limit = sizeof(tss_t) - 1;
+    gdt[GDT_TSS / 8] = (limit & 0xFFFF) |
+                       ((base & 0xFFFFFF) << 16) |
+                       (0x89ULL << 40) |                 // Present, available 64-bit TSS
+                       (((limit >> 16) & 0xF) << 48) |
+                       (((base >> 24) & 0xFF) << 56);
+    gdt[GDT_TSS / 8 + 1] = base >> 32;
+
+    gdt_ptr_t ptr;
+    ptr.limit = GDT_ENTRIES * 8 - 1;
+    ptr.base = (u64)gdt;
+    __asm__ __volatile__("lgdt %0" : : "m"(ptr));
+
+    // Reload CS with a far return, then the data segments
+    __asm__ __volatile__("pushq %0\n"
+                         "leaq 1f(%%rip), %%rax\n"
+                         "pushq %%rax\n"
+                         "lretq\n"
+                         "1:\n"
+                         : : "i"(GDT_KERNEL_CODE) : "rax", "memory");
+    __asm__ __volatile__("mov %0, %%ds\n"
+                         "mov %0, %%es\n"
+                         "mov %0, %%ss\n"
+                         : : "r"((u16)GDT_KERNEL_DATA));
+
+    __asm__ __volatile__("ltr %0" : : "r"((u16)GDT_TSS));
+}
@@ -0,0 +1,40 @@
+#ifndef GDT_H
+#define GDT_H
+
+#include "../include/types.h"
+
+// Segment selectors (same layout as the boot GDT for the kernel segments).
+// SYSRET takes the user selectors from one base in MSR STAR: SS is the
+// descriptor after the base and CS the one after that, so the user data
+// segment must sit between an unused 32-bit code slot and the 64-bit code.
+#define GDT_KERNEL_CODE  0x08
+#define GDT_KERNEL_DATA  0x10
+#define GDT_USER_CODE32  0x18       // Null - no 32-bit user code
+#define GDT_USER_DATA    0x20
+#define GDT_USER_CODE    0x28
+#define GDT_TSS          0x30
+
+// Selectors as loaded in ring 3
+#define USER_CS          (GDT_USER_CODE | 3)
+#define USER_DS          (GDT_USER_DATA | 3)
+
+// Null, kernel code and data, the user slots and a 16-byte TSS descriptor
+#define GDT_ENTRIES      8
+
+// 64-bit task state segment
+typedef struct {
+    u32 reserved0;
+    u64 rsp0;           // Stack loaded on a privilege change to ring 0
+    u64 rsp1;
+    u64 rsp2;
+    u64 reserved1;
+    u64 ist[7];         // Interrupt stack table
+    u64 reserved2;
+    u16 reserved3;
+    u16 iomap_base;
+} __attribute__((packed)) tss_t;
+
+// Build a GDT with a TSS in the given storage and load it on this CPU
+void gdt_load(u64* gdt, tss_t* tss);
+
+#endif
@@ -64,6 +64,25 @@ ISR_NOERRCODE 29  ; Reserved
 ISR_NOERRCODE 30  ; Reserved
 ISR_NOERRCODE 31  ; Reserved
 
+; Export our IPI handlers (routed through the IRQ path for the EOI)
+%macro IPI 2
+global ipi_%1
+ipi_%1:
+    push 0      ; Push dummy error code
+    push %2     ; Push vector number
+    jmp irq_common_stub
+%endmacro
+
+; Export our MSI handlers (PCI devices signal the local APIC directly, the
+; IRQ path does the EOI)
+%macro MSI 2
+global msi%1
+msi%1:
+    push 0      ; Push dummy error code
+    push %2     ; Push vector number
+    jmp irq_common_stub
+%endmacro
+
 ; Define IRQs
 IRQ 0, 32   ; Timer
 IRQ 1, 33   ; Keyboard
@@ -82,12 +101,47 @@ IRQ 13, 45  ; FPU, coprocessor or inter-processor
 IRQ 14, 46  ; Primary ATA channel
 IRQ 15, 47  ; Secondary ATA channel
 
+; Define MSI vectors
+MSI 0, 0x50
+MSI 1, 0x51
+MSI 2, 0x52
+MSI 3, 0x53
+MSI 4, 0x54
+MSI 5, 0x55
+MSI 6, 0x56
+MSI 7, 0x57
+
+; Define IPIs
+IPI call, 0xF0  ; Run a function posted by another CPU
+IPI wake, 0xF1  ; Wake an idle CPU to look for tasks
+
+; Local APIC timer of each CPU, the sampling profiler's clock (IRQ path)
+global irq_lapic_timer
+irq_lapic_timer:
+    push 0      ; Push dummy error code
+    push 0xF2   ; Push vector number
+    jmp irq_common_stub
+
+; Local APIC spurious interrupt - no EOI is required, just count and return
+extern irq_spurious_count
+global isr_spurious
+isr_spurious:
+    lock inc qword [rel irq_spurious_count]
+    iretq
+
 ; Import our C handlers
 extern isr_handler
 extern irq_handler
 
 ; Common ISR handler
 isr_common_stub:
+    ; Coming from user mode, switch to the kernel's GS base (the saved CS
+    ; is above the vector and error code)
+    test qword [rsp + 24], 3
+    jz .kernel_entry
+    swapgs
+.kernel_entry:
+
     ; Save all registers
     push rax
     push rcx
@@ -109,12 +163,11 @@ isr_common_stub:
     mov ax, ds
     push rax
 
-    ; Load kernel data segment
+    ; Load kernel data segment (FS/GS are left alone: reloading GS
+    ; would wipe the per-CPU base)
     mov ax, 0x10
     mov ds, ax
     mov es, ax
-    mov fs, ax
-    mov gs, ax
 
     ; Call C handler
     mov rdi, rsp    ; Pass pointer to registers as argument
@@ -124,8 +177,6 @@ isr_common_stub:
     pop rax
     mov ds, ax
     mov es, ax
-    mov fs, ax
-    mov gs, ax
 
     ; Restore registers
     pop r15
@@ -146,10 +197,23 @@ isr_common_stub:
 
     ; Remove error code and interrupt number
     add rsp, 16
+
+    ; Going back to user mode, restore its GS base
+    test qword [rsp + 8], 3
+    jz .kernel_exit
+    swapgs
+.kernel_exit:
     iretq
 
 ; Common IRQ handler
 irq_common_stub:
+    ; Coming from user mode, switch to the kernel's GS base (the saved CS
+    ; is above the vector and error code)
+    test qword [rsp + 24], 3
+    jz .kernel_entry
+    swapgs
+.kernel_entry:
+
     ; Save all registers
     push rax
     push rcx
@@ -171,12 +235,11 @@ irq_common_stub:
     mov ax, ds
     push rax
 
-    ; Load kernel data segment
+    ; Load kernel data segment (FS/GS are left alone: reloading GS
+    ; would wipe the per-CPU base)
     mov ax, 0x10
     mov ds, ax
     mov es, ax
-    mov fs, ax
-    mov gs, ax
 
     ; Call C handler
     mov rdi, rsp    ; Pass pointer to registers as argument
@@ -186,8 +249,6 @@ irq_common_stub:
     pop rax
     mov ds, ax
     mov es, ax
-    mov fs, ax
-    mov gs, ax
 
     ; Restore registers
     pop r15
@@ -208,4 +269,10 @@ irq_common_stub:
 
     ; Remove error code and interrupt number
     add rsp, 16
+
+    ; Going back to user mode, restore its GS base
+    test qword [rsp + 8], 3
+    jz .kernel_exit
+    swapgs
+.kernel_exit:
     iretq
\ No newline at end of file
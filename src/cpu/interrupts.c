@@ -1,6 +1,23 @@
 #include "../include/types.h"
 #include "../cpu/interrupts.h"
+#include "../cpu/apic.h"
+#include "../cpu/acpi.h"
+#include "../cpu/percpu.h"
+#include "../memory/kmalloc.h"
 #include "../kernel/low_level.h"
+#include "../kernel/softirq.h"
+#include "../kernel/thread.h"
+#include "../kernel/idle.h"
+#include "../kernel/process.h"
+#include "../kernel/util.h"
+#include "../kernel/trace.h"
+
+// 8259 PIC I/O ports
+#define PIC1_COMMAND 0x20
+#define PIC1_DATA    0x21
+#define PIC2_COMMAND 0xA0
+#define PIC2_DATA    0xA1
+#define PIC_EOI      0x20
 
 // Declare an array of interrupt handlers
 isr_handler_t interrupt_handlers[256];
@@ -9,6 +26,22 @@ isr_handler_t interrupt_handlers[256];
 idt_entry_t idt[256];
 idt_ptr_t idt_ptr;
 
+// True once legacy IRQs are delivered through the I/O APIC
+static bool apic_enabled = false;
+
+// Shadow of the 8259 mask registers (bit set = masked)
+static u16 pic_mask = 0xFFFF;
+
+// MSI vectors handed out so far (allocated at boot, never released)
+static u32 msi_vectors_used = 0;
+
+// Per-CPU, per-vector statistics: irq_stats[cpu * 256 + vector]
+static irq_stats_t* irq_stats = NULL;
+static u32 irq_stats_cpus = 0;
+
+// Bumped directly by the spurious interrupt stub as well
+volatile u64 irq_spurious_count = 0;
+
 // External ISR handlers
 extern void isr0();
 extern void isr1();
@@ -61,6 +94,26 @@ extern void irq13();
 extern void irq14();
 extern void irq15();
 
+// Inter-processor interrupt handlers
+extern void ipi_call();
+extern void ipi_wake();
+
+// Local APIC timer handler
+extern void irq_lapic_timer();
+
+// Message signalled interrupt handlers
+extern void msi0();
+extern void msi1();
+extern void msi2();
+extern void msi3();
+extern void msi4();
+extern void msi5();
+extern void msi6();
+extern void msi7();
+
+// Local APIC spurious interrupt handler
+extern void isr_spurious();
+
 // Set an entry in the IDT
 static void idt_set_gate(u8 num, u64 handler, u16 selector, u8 flags) {
     idt[num].low_offset = handler & 0xFFFF;
@@ -72,27 +125,85 @@ static void idt_set_gate(u8 num, u64 handler, u16 selector, u8 flags) {
     idt[num].reserved = 0;
 }
 
-// Common handler for all ISRs - MODIFIED to not write to screen
-void isr_handler(registers_t regs) {
-    // Remove debug output to screen
+// Dispatch to the registered handler and account its cost
+static inline void dispatch_interrupt(registers_t* regs) {
+    u8 vector = (u8)regs->int_no;
+    u64 start = cpu_read_tsc();
+    TRACE(TRACE_IRQ_ENTRY, vector);
     
     // Call the interrupt handler if one exists
-    if (interrupt_handlers[regs.int_no]) {
-        interrupt_handlers[regs.int_no](regs);
+    if (interrupt_handlers[vector]) {
+        interrupt_handlers[vector](regs);
+    }
+    
+    TRACE(TRACE_IRQ_EXIT, vector);
+    if (irq_stats) {
+        u64 cycles = cpu_read_tsc() - start;
+        irq_stats_t* stats = &irq_stats[cpu_current_index() * 256 + vector];
+        stats->count++;
+        stats->cycles_total += cycles;
+        if (cycles > stats->cycles_max) {
+            stats->cycles_max = cycles;
+        }
     }
 }
 
-// Common handler for all IRQs - MODIFIED to not write to screen
-void irq_handler(registers_t regs) {
-    // Send EOI (End of Interrupt) to the PICs
-    if (regs.int_no >= 40) {
-        port_byte_out(0xA0, 0x20);  // Send EOI to slave PIC
+// Check the 8259 in-service register to tell real IRQ7/IRQ15 from spurious ones
+static bool pic_is_spurious(u64 vector) {
+    if (vector != IRQ7 && vector != IRQ15) {
+        return false;
     }
-    port_byte_out(0x20, 0x20);      // Send EOI to master PIC
     
-    // Call handler if one exists
-    if (interrupt_handlers[regs.int_no]) {
-        interrupt_handlers[regs.int_no](regs);
+    u16 command = (vector == IRQ15) ? PIC2_COMMAND : PIC1_COMMAND;
+    port_byte_out(command, 0x0B);  // Read ISR on next read
+    if (port_byte_in(command) & 0x80) {
+        return false;
+    }
+    
+    // A spurious slave IRQ still raised the cascade line on the master
+    if (vector == IRQ15) {
+        port_byte_out(PIC1_COMMAND, PIC_EOI);
+    }
+    irq_spurious_count++;
+    return true;
+}
+
+// Common handler for all ISRs
+void isr_handler(registers_t* regs) {
+    // An exception in user mode ends the process, not the kernel
+    if (regs->cs & 3) {
+        process_fault(regs);
+    }
+    dispatch_interrupt(regs);
+}
+
+// Common handler for all IRQs
+void irq_handler(registers_t* regs) {
+    // Note the wakeup if this interrupt ended an idle period
+    idle_interrupt((u8)regs->int_no);
+    
+    // Send EOI (End of Interrupt) - one MMIO store on the APIC path
+    if (apic_enabled) {
+        lapic_eoi();
+    } else {
+        if (pic_is_spurious(regs->int_no)) {
+            return;
+        }
+        if (regs->int_no >= 40) {
+            port_byte_out(PIC2_COMMAND, PIC_EOI);  // Send EOI to slave PIC
+        }
+        port_byte_out(PIC1_COMMAND, PIC_EOI);      // Send EOI to master PIC
+    }
+    
+    dispatch_interrupt(regs);
+    
+    // Run bottom halves the handler raised, with interrupts re-enabled
+    softirq_run();
+    
+    // Switch threads if the time slice ran out or a higher priority thread
+    // woke up - never from inside a softirq that an interrupt nested into
+    if (!softirq_in_progress()) {
+        kthread_preempt();
     }
 }
 
@@ -101,6 +212,120 @@ void register_interrupt_handler(u8 n, isr_handler_t handler) {
     interrupt_handlers[n] = handler;
 }
 
+// Remap the PICs to vectors 32-47 and leave every line masked. Even when the
+// APIC takes over, the remap keeps stray PIC interrupts off exception vectors.
+static void pic_remap_and_mask() {
+    // Initialize the PICs
+    port_byte_out(PIC1_COMMAND, 0x11);  // Initialize master PIC
+    port_byte_out(PIC2_COMMAND, 0x11);  // Initialize slave PIC
+    
+    // Set vector offsets
+    port_byte_out(PIC1_DATA, IRQ0);     // Master PIC starts at 32
+    port_byte_out(PIC2_DATA, IRQ8);     // Slave PIC starts at 40
+    
+    // Tell PICs their relationship
+    port_byte_out(PIC1_DATA, 0x04);     // Tell master PIC that slave is at IRQ2
+    port_byte_out(PIC2_DATA, 0x02);     // Tell slave PIC its cascade identity
+    
+    // Set operation mode
+    port_byte_out(PIC1_DATA, 0x01);     // 8086 mode for master
+    port_byte_out(PIC2_DATA, 0x01);     // 8086 mode for slave
+    
+    // Mask everything
+    pic_mask = 0xFFFF;
+    port_byte_out(PIC1_DATA, 0xFF);
+    port_byte_out(PIC2_DATA, 0xFF);
+}
+
+// Write the shadow mask out to the PICs
+static void pic_update_mask() {
+    port_byte_out(PIC1_DATA, pic_mask & 0xFF);
+    port_byte_out(PIC2_DATA, (pic_mask >> 8) & 0xFF);
+}
+
+// Mask a legacy IRQ line
+void irq_mask(u8 irq) {
+    if (irq >= 16) return;
+    
+    if (apic_enabled) {
+        ioapic_mask_irq(irq);
+    } else {
+        pic_mask |= (1 << irq);
+        pic_update_mask();
+    }
+}
+
+// Unmask a legacy IRQ line
+void irq_unmask(u8 irq) {
+    if (irq >= 16) return;
+    
+    if (apic_enabled) {
+        ioapic_unmask_irq(irq);
+    } else {
+        pic_mask &= ~(1 << irq);
+        if (irq >= 8) {
+            pic_mask &= ~(1 << 2);  // Slave IRQs need the cascade line
+        }
+        pic_update_mask();
+    }
+}
+
+// Deliver a legacy IRQ to a specific CPU
+bool irq_set_affinity(u8 irq, u32 apic_id) {
+    if (!apic_enabled) {
+        return false;
+    }
+    return ioapic_set_irq_affinity(irq, apic_id);
+}
+
+// Check whether interrupts are routed through the local/I/O APIC
+bool interrupts_using_apic() {
+    return apic_enabled;
+}
+
+// Reserve a vector for a device's message signalled interrupt
+u8 irq_alloc_msi_vector() {
+    if (!apic_enabled || msi_vectors_used >= IRQ_MSI_COUNT) {
+        return 0;
+    }
+    return IRQ_MSI_BASE + msi_vectors_used++;
+}
+
+// Get the statistics of a vector on a CPU
+const irq_stats_t* irq_get_stats(u32 cpu, u8 vector) {
+    if (!irq_stats || cpu >= irq_stats_cpus) {
+        return NULL;
+    }
+    return &irq_stats[cpu * 256 + vector];
+}
+
+// Number of CPUs statistics are kept for
+u32 irq_stats_cpu_count() {
+    return irq_stats_cpus;
+}
+
+// Number of spurious interrupts seen
+u64 irq_get_spurious_count() {
+    return irq_spurious_count;
+}
+
+// Allocate the per-CPU statistics tables
+static void irq_stats_init() {
+    irq_stats_cpus = apic_enabled ? acpi_get_madt_info()->cpu_count : 1;
+    
+    int size = irq_stats_cpus * 256 * sizeof(irq_stats_t);
+    irq_stats_t* table = (irq_stats_t*)kmalloc(size);
+    if (table) {
+        memory_set((char*)table, 0, size);
+        irq_stats = table;
+    }
+}
+
+// Load the shared IDT on an application processor
+void interrupts_init_cpu() {
+    __asm__ __volatile__("lidt %0" : : "m"(idt_ptr));
+}
+
 // Initialize the interrupt system
 void interrupts_init() {
     // Set up the IDT pointer
@@ -165,26 +390,45 @@ void interrupts_init() {
     idt_set_gate(46, (u64)irq14, 0x08, 0x8E);
     idt_set_gate(47, (u64)irq15, 0x08, 0x8E);
     
-   // Remap the PIC
-    // Initialize the PICs
-    port_byte_out(0x20, 0x11);  // Initialize master PIC
-    port_byte_out(0xA0, 0x11);  // Initialize slave PIC
+    // Message signalled interrupts
+    idt_set_gate(IRQ_MSI_BASE + 0, (u64)msi0, 0x08, 0x8E);
+    idt_set_gate(IRQ_MSI_BASE + 1, (u64)msi1, 0x08, 0x8E);
+    idt_set_gate(IRQ_MSI_BASE + 2, (u64)msi2, 0x08, 0x8E);
+    idt_set_gate(IRQ_MSI_BASE + 3, (u64)msi3, 0x08, 0x8E);
+    idt_set_gate(IRQ_MSI_BASE + 4, (u64)msi4, 0x08, 0x8E);
+    idt_set_gate(IRQ_MSI_BASE + 5, (u64)msi5, 0x08, 0x8E);
+    idt_set_gate(IRQ_MSI_BASE + 6, (u64)msi6, 0x08, 0x8E);
+    idt_set_gate(IRQ_MSI_BASE + 7, (u64)msi7, 0x08, 0x8E);
     
-    // Set vector offsets
-    port_byte_out(0x21, 0x20);  // Master PIC starts at 32
-    port_byte_out(0xA1, 0x28);  // Slave PIC starts at 40
+    // Inter-processor interrupts
+    idt_set_gate(IPI_CALL, (u64)ipi_call, 0x08, 0x8E);
+    idt_set_gate(IPI_WAKE, (u64)ipi_wake, 0x08, 0x8E);
+    idt_set_gate(IRQ_LAPIC_TIMER, (u64)irq_lapic_timer, 0x08, 0x8E);
     
-    // Tell PICs their relationship
-    port_byte_out(0x21, 0x04);  // Tell master PIC that slave is at IRQ2
-    port_byte_out(0xA1, 0x02);  // Tell slave PIC its cascade identity
+    // Local APIC spurious interrupts must not be acknowledged
+    idt_set_gate(IRQ_SPURIOUS, (u64)isr_spurious, 0x08, 0x8E);
     
-    // Set operation mode
-    port_byte_out(0x21, 0x01);  // 8086 mode for master
-    port_byte_out(0xA1, 0x01);  // 8086 mode for slave
+    // The 8259s stay fully masked unless we have to fall back to them
+    pic_remap_and_mask();
+    
+    // Route legacy IRQs through the I/O APIC to this CPU, all masked
+    apic_enabled = apic_init();
+    if (apic_enabled) {
+        u32 bsp = lapic_get_id();
+        for (u8 irq = 0; irq < 16; irq++) {
+            if (irq != 2) {  // IRQ2 is the PIC cascade, never raised
+                ioapic_route_irq(irq, IRQ0 + irq, bsp);
+            }
+        }
+    }
+    
+    irq_stats_init();
     
-    // Unmask all interrupts
-    port_byte_out(0x21, 0x00);  // Enable all on master
-    port_byte_out(0xA1, 0x00);  // Enable all on slave
+    // Enable the lines we have devices for: timer, keyboard and serial
+    irq_unmask(0);
+    irq_unmask(1);
+    irq_unmask(3);
+    irq_unmask(4);
     
     // Load the IDT
     __asm__ __volatile__("lidt %0" : : "m"(idt_ptr));
@@ -3,10 +3,12 @@
 
 #include "../include/types.h"
 
-// Define the structure for register state when an interrupt occurs
+// Define the structure for register state when an interrupt occurs.
+// The layout mirrors the push order in interrupt_stubs.asm.
 typedef struct {
     u64 ds;                                  // Data segment selector
-    u64 rdi, rsi, rbp, rsp, rbx, rdx, rcx, rax; // Preserved by caller
+    u64 r15, r14, r13, r12, r11, r10, r9, r8;
+    u64 rdi, rsi, rbp, rbx, rdx, rcx, rax;   // Saved general purpose registers
     u64 int_no, err_code;                    // Interrupt number and error code
     u64 rip, cs, rflags, user_rsp, ss;       // Pushed by processor automatically
 } registers_t;
@@ -46,13 +48,62 @@ typedef struct {
 #define IRQ14 46  // Primary ATA channel
 #define IRQ15 47  // Secondary ATA channel
 
-// Function pointer type for interrupt handlers
-typedef void (*isr_handler_t)(registers_t);
+// Message signalled interrupt vectors handed out to PCI devices
+#define IRQ_MSI_BASE  0x50
+#define IRQ_MSI_COUNT 8
+
+// Inter-processor interrupt vectors
+#define IPI_CALL 0xF0     // Run a function posted by another CPU
+#define IPI_WAKE 0xF1     // Wake an idle CPU to look for tasks
+
+// Local APIC timer vector (each CPU's own, drives the sampling profiler)
+#define IRQ_LAPIC_TIMER 0xF2
+
+// Spurious interrupt vector of the local APIC
+#define IRQ_SPURIOUS 0xFF
+
+// Per-vector interrupt statistics, kept separately for each CPU
+typedef struct {
+    u64 count;          // Interrupts delivered
+    u64 cycles_total;   // TSC cycles spent in the handler
+    u64 cycles_max;     // Most expensive single invocation
+} irq_stats_t;
+
+// Function pointer type for interrupt handlers (the frame is passed by
+// reference so dispatch does not copy it)
+typedef void (*isr_handler_t)(registers_t*);
 
 // Initialize the interrupt system
 void interrupts_init();
 
+// Load the shared IDT on an application processor
+void interrupts_init_cpu();
+
 // Register a handler for a specific interrupt
 void register_interrupt_handler(u8 n, isr_handler_t handler);
 
+// Mask/unmask a legacy IRQ line (0-15) at whichever controller is active
+void irq_mask(u8 irq);
+void irq_unmask(u8 irq);
+
+// Deliver a legacy IRQ to the CPU with the given local APIC ID.
+// Returns false when running on the 8259 PICs, which cannot do this.
+bool irq_set_affinity(u8 irq, u32 apic_id);
+
+// Check whether interrupts are routed through the local/I/O APIC
+bool interrupts_using_apic();
+
+// Reserve a vector for a device's message signalled interrupt. Returns 0
+// when none are left or there is no local APIC to deliver it.
+u8 irq_alloc_msi_vector();
+
+// Get the statistics of a vector on a CPU (NULL if not collected)
+const irq_stats_t* irq_get_stats(u32 cpu, u8 vector);
+
+// Number of CPUs statistics are kept for
+u32 irq_stats_cpu_count();
+
+// Number of spurious interrupts seen (local APIC and 8259)
+u64 irq_get_spurious_count();
+
 #endif
@@ -0,0 +1,54 @@
+#ifndef PERCPU_H
+#define PERCPU_H
+
+#include "../include/types.h"
+#include "gdt.h"
+
+// Function run on another CPU through an IPI
+typedef void (*smp_call_func_t)(u64 arg);
+
+// Data private to one CPU, reached through the GS base
+typedef struct percpu {
+    struct percpu* self;            // Must stay first: read via %gs:0
+
+    // Used by syscall_entry.asm at fixed offsets (PERCPU_SYSCALL_RSP and
+    // PERCPU_USER_RSP there), so they must stay right after self
+    u64 syscall_rsp;                // Kernel stack of a system call
+    u64 user_rsp;                   // User stack pointer during one
+
+    u32 index;                      // Dense CPU number, 0 = bootstrap processor
+    u32 apic_id;                    // Local APIC ID
+    volatile bool online;           // Set by the CPU once it is ready for work
+    u64 stack_top;                  // Kernel stack of this CPU
+
+    // Cross-CPU function call mailbox
+    volatile u32 call_busy;         // Claimed by a sender until the call starts
+    volatile smp_call_func_t call_func;
+    volatile u64 call_arg;
+    volatile u64 ipi_count;         // Call IPIs handled
+
+    // Descriptor tables of this CPU
+    u64 gdt[GDT_ENTRIES] __attribute__((aligned(16)));
+    tss_t tss __attribute__((aligned(16)));
+} percpu_t;
+
+_Static_assert(__builtin_offsetof(percpu_t, syscall_rsp) == 8, "syscall_entry.asm offset");
+_Static_assert(__builtin_offsetof(percpu_t, user_rsp) == 16, "syscall_entry.asm offset");
+
+// Get the per-CPU area of the calling CPU
+static inline percpu_t* this_cpu() {
+    percpu_t* cpu;
+    __asm__ __volatile__("movq %%gs:0, %0" : "=r"(cpu));
+    return cpu;
+}
+
+// Get the dense index of the calling CPU
+static inline u32 cpu_current_index() {
+    u32 index;
+    __asm__ __volatile__("movl %%gs:%c1, %0"
+                         : "=r"(index)
+                         : "i"(__builtin_offsetof(percpu_t, index)));
+    return index;
+}
+
+#endif
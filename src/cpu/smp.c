@@ -0,0 +1,222 @@
+#include "../include/types.h"
+#include "smp.h"
+#include "acpi.h"
+#include "apic.h"
+#include "interrupts.h"
+#include "../kernel/low_level.h"
+#include "../kernel/syscall.h"
+#include "../kernel/task.h"
+#include "../kernel/util.h"
+#include "../memory/kmalloc.h"
+#include "../drivers/timer.h"
+
+// Model-specific register holding the GS base
+#define MSR_GS_BASE 0xC0000101
+
+// INIT-SIPI-SIPI timing. The waits for an AP end as soon as it is online.
+#define SMP_INIT_DELAY_US       10000   // INIT deassert settle time (Intel MP spec)
+#define SMP_SIPI_WAIT_US        20000
+#define SMP_SIPI_RETRY_WAIT_US  200000
+
+// Real-mode startup code and its parameter slots (ap_trampoline.asm)
+extern u8 ap_trampoline_start[];
+extern u8 ap_trampoline_end[];
+extern u8 ap_trampoline_cr3[];
+extern u8 ap_trampoline_stack[];
+extern u8 ap_trampoline_entry[];
+
+// Address of a trampoline symbol once copied to AP_TRAMPOLINE_ADDR
+#define TRAMPOLINE_VAR(sym) ((u64*)(AP_TRAMPOLINE_ADDR + ((sym) - ap_trampoline_start)))
+
+static percpu_t percpu_areas[MAX_CPUS];
+static u32 cpu_count = 1;
+
+// The CPU currently being started (read by ap_main)
+static percpu_t* volatile ap_boot_cpu = NULL;
+
+// Load the descriptor tables of a CPU, point GS at its per-CPU area and
+// set up its system call entry
+static void percpu_setup(percpu_t* cpu) {
+    gdt_load(cpu->gdt, &cpu->tss);
+    cpu_write_msr(MSR_GS_BASE, (u64)cpu);
+    syscall_init_cpu();
+}
+
+// Reset a per-CPU area
+static void percpu_clear(percpu_t* cpu, u32 index) {
+    cpu->self = cpu;
+    cpu->syscall_rsp = 0;
+    cpu->user_rsp = 0;
+    cpu->index = index;
+    cpu->apic_id = 0;
+    cpu->online = false;
+    cpu->stack_top = 0;
+    cpu->call_busy = 0;
+    cpu->call_func = 0;
+    cpu->call_arg = 0;
+    cpu->ipi_count = 0;
+}
+
+// Set up the per-CPU area, GDT and TSS of the bootstrap processor
+void percpu_init_bsp() {
+    percpu_t* cpu = &percpu_areas[0];
+    percpu_clear(cpu, 0);
+    cpu->stack_top = 0x90000;  // Set up by kernel_entry_64.asm
+    cpu->online = true;
+    percpu_setup(cpu);
+}
+
+// IPI handler - run the function another CPU posted to our mailbox
+static void smp_call_handler(registers_t* regs) {
+    percpu_t* cpu = this_cpu();
+    smp_call_func_t func = cpu->call_func;
+    u64 arg = cpu->call_arg;
+
+    cpu->ipi_count++;
+    if (func) {
+        cpu->call_func = 0;
+        cpu->call_busy = 0;  // The mailbox may be reused while func runs
+        func(arg);
+    }
+}
+
+// First C code run by an application processor
+static void ap_main() {
+    percpu_t* cpu = ap_boot_cpu;
+
+    percpu_setup(cpu);
+    interrupts_init_cpu();
+    lapic_init();
+
+    cpu->online = true;
+    __asm__ __volatile__("sti");
+
+    // Run parallel tasks, halting until an IPI when there are none
+    task_worker();
+}
+
+// Wait up to the given number of microseconds for a CPU to come online.
+// Polls the TSC rather than halting until the next tick, so the next AP
+// can be started as soon as this one is up.
+static bool smp_wait_online(percpu_t* cpu, u64 us) {
+    u64 hz = timer_get_tsc_hz();
+    u64 start = timer_get_ticks();
+    u64 deadline = cpu_read_tsc() + us * hz / 1000000;
+    
+    while (!cpu->online) {
+        if (hz ? cpu_read_tsc() >= deadline
+               : timer_get_ticks() - start > us * timer_get_frequency() / 1000000) {
+            break;
+        }
+        __asm__ __volatile__("pause");
+    }
+    return cpu->online;
+}
+
+// Start one application processor with INIT-SIPI-SIPI
+static bool smp_start_ap(percpu_t* cpu) {
+    *TRAMPOLINE_VAR(ap_trampoline_stack) = cpu->stack_top;
+    ap_boot_cpu = cpu;
+
+    // INIT resets the AP into wait-for-SIPI state
+    lapic_send_ipi(cpu->apic_id, LAPIC_ICR_INIT | LAPIC_ICR_ASSERT | LAPIC_ICR_LEVEL);
+    timer_delay_us(SMP_INIT_DELAY_US);
+
+    // The startup vector is the page number of the trampoline
+    for (int attempt = 0; attempt < 2; attempt++) {
+        lapic_send_ipi(cpu->apic_id, LAPIC_ICR_STARTUP | (AP_TRAMPOLINE_ADDR >> 12));
+        if (smp_wait_online(cpu, attempt == 0 ? SMP_SIPI_WAIT_US : SMP_SIPI_RETRY_WAIT_US)) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// Start every application processor listed in the MADT
+void smp_init() {
+    percpu_t* bsp = &percpu_areas[0];
+    register_interrupt_handler(IPI_CALL, smp_call_handler);
+
+    // Without an APIC there is nobody to start
+    if (!interrupts_using_apic()) {
+        return;
+    }
+    bsp->apic_id = lapic_get_id();
+
+    // Install the startup code and the parameters shared by all APs
+    u64 cr3;
+    __asm__ __volatile__("mov %%cr3, %0" : "=r"(cr3));
+    memory_copy((char*)ap_trampoline_start, (char*)AP_TRAMPOLINE_ADDR,
+                (int)(ap_trampoline_end - ap_trampoline_start));
+    *TRAMPOLINE_VAR(ap_trampoline_cr3) = cr3;
+    *TRAMPOLINE_VAR(ap_trampoline_entry) = (u64)ap_main;
+
+    // Bring the APs up one at a time, they share the trampoline slots
+    const acpi_madt_info_t* madt = acpi_get_madt_info();
+    for (u32 i = 0; i < madt->cpu_count && cpu_count < MAX_CPUS; i++) {
+        if (madt->cpus[i].apic_id == bsp->apic_id) {
+            continue;
+        }
+
+        u64 stack = (u64)kmalloc(AP_STACK_SIZE);
+        if (!stack) {
+            break;
+        }
+        percpu_t* cpu = &percpu_areas[cpu_count];
+        percpu_clear(cpu, cpu_count);
+        cpu->apic_id = madt->cpus[i].apic_id;
+        cpu->stack_top = (stack + AP_STACK_SIZE) & ~0xFULL;
+        cpu_count++;
+
+        smp_start_ap(cpu);
+    }
+}
+
+// Number of CPUs known (online or not)
+u32 smp_cpu_count() {
+    return cpu_count;
+}
+
+// Number of CPUs that are online
+u32 smp_online_count() {
+    u32 online = 0;
+    for (u32 i = 0; i < cpu_count; i++) {
+        if (percpu_areas[i].online) {
+            online++;
+        }
+    }
+    return online;
+}
+
+// Get the per-CPU area of a CPU by index
+percpu_t* smp_get_cpu(u32 index) {
+    return index < cpu_count ? &percpu_areas[index] : NULL;
+}
+
+// Ask another CPU to run func(arg) from its IPI handler
+bool smp_call_function(u32 index, smp_call_func_t func, u64 arg) {
+    percpu_t* cpu = smp_get_cpu(index);
+    if (!cpu || !cpu->online) {
+        return false;
+    }
+
+    // Claim the mailbox, fill it in, then publish the function
+    if (!__sync_bool_compare_and_swap(&cpu->call_busy, 0, 1)) {
+        return false;
+    }
+    cpu->call_arg = arg;
+    __sync_synchronize();
+    cpu->call_func = func;
+
+    lapic_send_ipi(cpu->apic_id, IPI_CALL);
+    return true;
+}
+
+// Send a fixed IPI with the given vector to a CPU
+void smp_send_ipi(u32 index, u8 vector) {
+    percpu_t* cpu = smp_get_cpu(index);
+    if (cpu && cpu->online) {
+        lapic_send_ipi(cpu->apic_id, vector);
+    }
+}
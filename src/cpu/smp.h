@@ -0,0 +1,36 @@
+#ifndef SMP_H
+#define SMP_H
+
+#include "../include/types.h"
+#include "percpu.h"
+
+// Where the real-mode AP startup code is copied (must be below 1MB, 4KB aligned)
+#define AP_TRAMPOLINE_ADDR  0x70000
+
+// Kernel stack size of each application processor
+#define AP_STACK_SIZE       (16 * 1024)
+
+// Set up the per-CPU area, GDT and TSS of the bootstrap processor.
+// Must run before anything uses this_cpu().
+void percpu_init_bsp();
+
+// Start every application processor listed in the MADT
+void smp_init();
+
+// Number of CPUs known (online or not)
+u32 smp_cpu_count();
+
+// Number of CPUs that are online
+u32 smp_online_count();
+
+// Get the per-CPU area of a CPU by index (NULL if out of range)
+percpu_t* smp_get_cpu(u32 index);
+
+// Ask another CPU to run func(arg) from its IPI handler.
+// Returns false if the CPU is offline or still busy with an earlier call.
+bool smp_call_function(u32 cpu, smp_call_func_t func, u64 arg);
+
+// Send a fixed IPI with the given vector to a CPU
+void smp_send_ipi(u32 cpu, u8 vector);
+
+#endif
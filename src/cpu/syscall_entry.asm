@@ -0,0 +1,109 @@
+[bits 64]
+
+global syscall_entry
+global user_enter
+global user_return
+extern syscall_dispatch
+extern process_set_kernel_stack
+
+; Offsets in percpu_t (src/cpu/percpu.h)
+PERCPU_SYSCALL_RSP  equ 8
+PERCPU_USER_RSP     equ 16
+
+; RFLAGS a process starts with: interrupts enabled
+USER_RFLAGS         equ 0x202
+
+; SYSCALL lands here (MSR LSTAR) in ring 0 with the user RIP in rcx, the
+; user RFLAGS in r11 and interrupts masked (MSR FMASK), but still on the
+; user stack with the user GS base. See src/kernel/syscall.h for the ABI.
+syscall_entry:
+    swapgs
+    mov [gs:PERCPU_USER_RSP], rsp
+    mov rsp, [gs:PERCPU_SYSCALL_RSP]
+    push qword [gs:PERCPU_USER_RSP]
+    push r11
+    push rcx
+    sub rsp, 8          ; Keeps the stack 16-byte aligned at the call
+    sti
+
+    ; syscall_dispatch(a0, a1, a2, a3, a4, number): the fourth argument
+    ; came in r10 and the number in rax
+    mov rcx, r10
+    mov r9, rax
+    call syscall_dispatch
+
+    ; Don't hand kernel values back in the scratch registers
+    xor edi, edi
+    xor esi, esi
+    xor edx, edx
+    xor r8d, r8d
+    xor r9d, r9d
+    xor r10d, r10d
+
+    cli
+    add rsp, 8
+    pop rcx
+    pop r11
+    pop rsp
+    swapgs
+    o64 sysret
+
+; u64 user_enter(process_t* process, u64 rip, u64 rsp, u64 arg)
+; Saves the kernel context in process->rsp and drops to ring 3 at rip on
+; the stack rsp, with arg in rdi. Returns what user_return is given for the
+; same process. Called with interrupts disabled.
+user_enter:
+    pushfq
+    push rbx
+    push rbp
+    push r12
+    push r13
+    push r14
+    push r15
+    mov [rdi], rsp
+
+    ; System calls and interrupts from user mode start below this frame
+    mov r12, rsi
+    mov r13, rdx
+    mov r14, rcx
+    mov rdi, rsp
+    and rdi, -16
+    call process_set_kernel_stack
+
+    mov rcx, r12        ; SYSRET jumps to rcx
+    mov r11, USER_RFLAGS ; and loads RFLAGS from r11
+    mov rdi, r14
+    mov rsp, r13
+
+    ; Start from a clean slate
+    xor eax, eax
+    xor ebx, ebx
+    xor edx, edx
+    xor esi, esi
+    xor ebp, ebp
+    xor r8d, r8d
+    xor r9d, r9d
+    xor r10d, r10d
+    xor r12d, r12d
+    xor r13d, r13d
+    xor r14d, r14d
+    xor r15d, r15d
+
+    swapgs
+    o64 sysret
+
+; void user_return(process_t* process, u64 code)
+; Leave user mode for good: drop everything on the kernel stack above the
+; frame user_enter saved and return code from it. Called with interrupts
+; disabled, on the kernel GS.
+user_return:
+    mov rsp, [rdi]
+    mov rax, rsi
+    pop r15
+    pop r14
+    pop r13
+    pop r12
+    pop rbp
+    pop rbx
+    popfq
+    ret
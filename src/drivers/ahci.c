@@ -0,0 +1,534 @@
+#include "ahci.h"
+#include "block.h"
+#include "pci.h"
+#include "timer.h"
+#include "../cpu/interrupts.h"
+#include "../cpu/apic.h"
+#include "../kernel/low_level.h"
+#include "../kernel/sync.h"
+#include "../kernel/util.h"
+#include "../memory/physical.h"
+
+// PCI class of an AHCI controller: mass storage, SATA, AHCI 1.0
+#define AHCI_PCI_CLASS     0x01
+#define AHCI_PCI_SUBCLASS  0x06
+#define AHCI_PCI_PROG_IF   0x01
+#define AHCI_PCI_BAR       5
+
+// Generic host control registers
+#define HBA_CAP            0x00
+#define HBA_GHC            0x04
+#define HBA_IS             0x08
+#define HBA_PI             0x0C
+
+#define HBA_CAP_NCS_SHIFT  8
+#define HBA_CAP_NCS_MASK   0x1F
+#define HBA_CAP_SNCQ       (1u << 30)
+#define HBA_GHC_IE         (1u << 1)
+#define HBA_GHC_AE         (1u << 31)
+
+// Port registers, 0x80 bytes per port from 0x100
+#define AHCI_PORT_BASE     0x100
+#define AHCI_PORT_SIZE     0x80
+#define PORT_CLB           0x00
+#define PORT_CLBU          0x04
+#define PORT_FB            0x08
+#define PORT_FBU           0x0C
+#define PORT_IS            0x10
+#define PORT_IE            0x14
+#define PORT_CMD           0x18
+#define PORT_TFD           0x20
+#define PORT_SIG           0x24
+#define PORT_SSTS          0x28
+#define PORT_SERR          0x30
+#define PORT_SACT          0x34
+#define PORT_CI            0x38
+
+#define PORT_CMD_ST        (1u << 0)
+#define PORT_CMD_FRE       (1u << 4)
+#define PORT_CMD_FR        (1u << 14)
+#define PORT_CMD_CR        (1u << 15)
+
+#define PORT_IS_DHRS       (1u << 0)    // Device to host register FIS
+#define PORT_IS_SDBS       (1u << 3)    // Set device bits FIS (NCQ completion)
+#define PORT_IS_ERRORS     (0xFu << 27) // Interface, bus data, bus fatal, task file
+
+#define PORT_TFD_ERR       0x01
+#define PORT_TFD_DRQ       0x08
+#define PORT_TFD_BSY       0x80
+
+#define PORT_SSTS_DET_MASK 0x0F
+#define PORT_SSTS_PRESENT  3            // Device present, link up
+#define SATA_SIG_DISK      0x00000101
+
+// ATA commands
+#define ATA_CMD_READ_DMA_EXT     0x25
+#define ATA_CMD_WRITE_DMA_EXT    0x35
+#define ATA_CMD_READ_FPDMA       0x60   // NCQ
+#define ATA_CMD_WRITE_FPDMA      0x61
+#define ATA_CMD_IDENTIFY         0xEC
+#define ATA_DEVICE_LBA           0x40
+
+#define FIS_TYPE_H2D             0x27
+#define FIS_H2D_COMMAND          0x80
+
+// Command header flags
+#define CMD_HEADER_WRITE         (1 << 6)
+
+#define AHCI_MAX_DISKS     8
+#define AHCI_SLOTS         32
+// A PRD's byte count is 22 bits, so one segment moves at most 4MB; capping
+// whole requests there keeps every segment within it
+#define AHCI_MAX_SECTORS   (4 * 1024 * 1024 / 512)
+#define AHCI_TIMEOUT_US    1000000
+
+// Host to device register FIS
+typedef struct {
+    u8 fis_type;
+    u8 flags;
+    u8 command;
+    u8 feature_low;
+    u8 lba0, lba1, lba2;
+    u8 device;
+    u8 lba3, lba4, lba5;
+    u8 feature_high;
+    u8 count_low;
+    u8 count_high;
+    u8 icc;
+    u8 control;
+    u32 reserved;
+} __attribute__((packed)) fis_h2d_t;
+
+// One entry of the command list
+typedef struct {
+    u16 flags;                  // FIS length in dwords, write, ...
+    u16 prdtl;                  // Scatter-gather entries
+    volatile u32 prdbc;         // Bytes transferred
+    u32 ctba;
+    u32 ctbau;
+    u32 reserved[4];
+} __attribute__((packed)) ahci_cmd_header_t;
+
+// Physical region descriptor
+typedef struct {
+    u32 dba;
+    u32 dbau;
+    u32 reserved;
+    u32 dbc;                    // Byte count - 1
+} __attribute__((packed)) ahci_prd_t;
+
+// Command table: the FIS plus the scatter-gather list (128-byte aligned)
+typedef struct {
+    u8 cfis[64];
+    u8 acmd[16];
+    u8 reserved[48];
+    ahci_prd_t prdt[BLK_MAX_SEGMENTS];
+} __attribute__((packed)) ahci_cmd_table_t;
+
+typedef struct {
+    u32 number;                 // Port number on the HBA
+    u64 regs;
+    ahci_cmd_header_t* cmd_list;
+    ahci_cmd_table_t* tables[AHCI_SLOTS];
+    blk_request_t* slot_req[AHCI_SLOTS];
+    u32 slot_mask;              // Slots the drive accepts
+    u32 busy;                   // Slots with a command in flight
+    bool ncq;
+    blk_request_t* queue_head;  // Waiting for a free slot
+    blk_request_t* queue_tail;
+    spinlock_t lock;
+    char model[41];
+    blk_device_t blk;
+} ahci_port_t;
+
+static u64 hba = 0;
+static ahci_port_t ports[AHCI_MAX_DISKS];
+static u32 port_count = 0;
+static lock_stats_t ahci_lock_stats;
+
+// Command lists, FIS areas and tables are carved out of whole pages so none
+// of them crosses a page
+static u64 dma_page = 0;
+static u32 dma_used = PAGE_SIZE;
+
+static void* ahci_dma_alloc(u32 size, u32 align) {
+    dma_used = (dma_used + align - 1) & ~(align - 1);
+    if (dma_used + size > PAGE_SIZE) {
+        dma_page = pmm_alloc_page();
+        if (!dma_page) {
+            return NULL;
+        }
+        memory_set((char*)dma_page, 0, PAGE_SIZE);
+        dma_used = 0;
+    }
+    void* ptr = (void*)(dma_page + dma_used);
+    dma_used += size;
+    return ptr;
+}
+
+// Poll a register until the masked bits read back as value
+static bool ahci_wait(u64 reg, u32 mask, u32 value, u64 timeout_us) {
+    for (u64 waited = 0; (mmio_read32(reg) & mask) != value; waited += 10) {
+        if (waited >= timeout_us) {
+            return false;
+        }
+        timer_delay_us(10);
+    }
+    return true;
+}
+
+// Stop command processing and FIS reception. Clearing ST also clears PxCI
+// and PxSACT.
+static bool ahci_port_stop(u64 regs) {
+    u32 cmd = mmio_read32(regs + PORT_CMD);
+    mmio_write32(regs + PORT_CMD, cmd & ~(PORT_CMD_ST | PORT_CMD_FRE));
+    return ahci_wait(regs + PORT_CMD, PORT_CMD_CR | PORT_CMD_FR, 0, AHCI_TIMEOUT_US / 2);
+}
+
+static void ahci_port_start(u64 regs) {
+    ahci_wait(regs + PORT_TFD, PORT_TFD_BSY | PORT_TFD_DRQ, 0, AHCI_TIMEOUT_US);
+    u32 cmd = mmio_read32(regs + PORT_CMD);
+    mmio_write32(regs + PORT_CMD, cmd | PORT_CMD_FRE);
+    mmio_write32(regs + PORT_CMD, cmd | PORT_CMD_FRE | PORT_CMD_ST);
+}
+
+// Fill in a slot's scatter-gather list and return its zeroed FIS
+static fis_h2d_t* ahci_setup_slot(ahci_port_t* port, u32 slot, const blk_segment_t* segments, u32 count, bool write) {
+    ahci_cmd_header_t* header = &port->cmd_list[slot];
+    ahci_cmd_table_t* table = port->tables[slot];
+
+    for (u32 i = 0; i < count; i++) {
+        table->prdt[i].dba = (u32)segments[i].addr;
+        table->prdt[i].dbau = (u32)(segments[i].addr >> 32);
+        table->prdt[i].reserved = 0;
+        table->prdt[i].dbc = segments[i].length - 1;
+    }
+    header->flags = sizeof(fis_h2d_t) / 4 | (write ? CMD_HEADER_WRITE : 0);
+    header->prdtl = count;
+    header->prdbc = 0;
+
+    fis_h2d_t* fis = (fis_h2d_t*)table->cfis;
+    memory_set((char*)fis, 0, sizeof(fis_h2d_t));
+    fis->fis_type = FIS_TYPE_H2D;
+    fis->flags = FIS_H2D_COMMAND;
+    return fis;
+}
+
+// Put a request in a free slot (port lock held). Queued commands carry the
+// sector count in the features field and the tag in the count field.
+static void ahci_start(ahci_port_t* port, u32 slot, blk_request_t* req) {
+    bool write = req->op == BLK_WRITE;
+    fis_h2d_t* fis = ahci_setup_slot(port, slot, req->segments, req->segment_count, write);
+
+    fis->lba0 = (u8)req->lba;
+    fis->lba1 = (u8)(req->lba >> 8);
+    fis->lba2 = (u8)(req->lba >> 16);
+    fis->lba3 = (u8)(req->lba >> 24);
+    fis->lba4 = (u8)(req->lba >> 32);
+    fis->lba5 = (u8)(req->lba >> 40);
+    fis->device = ATA_DEVICE_LBA;
+
+    if (port->ncq) {
+        fis->command = write ? ATA_CMD_WRITE_FPDMA : ATA_CMD_READ_FPDMA;
+        fis->feature_low = (u8)req->sectors;
+        fis->feature_high = (u8)(req->sectors >> 8);
+        fis->count_low = (u8)(slot << 3);
+    } else {
+        fis->command = write ? ATA_CMD_WRITE_DMA_EXT : ATA_CMD_READ_DMA_EXT;
+        fis->count_low = (u8)req->sectors;
+        fis->count_high = (u8)(req->sectors >> 8);
+    }
+
+    port->slot_req[slot] = req;
+    port->busy |= 1u << slot;
+}
+
+// Move queued requests into free slots and issue them with one write of
+// PxSACT/PxCI for the whole batch (port lock held)
+static void ahci_dispatch(ahci_port_t* port) {
+    u32 issue = 0;
+
+    while (port->queue_head && (port->busy & port->slot_mask) != port->slot_mask) {
+        u32 slot = __builtin_ctz(~port->busy & port->slot_mask);
+        blk_request_t* req = port->queue_head;
+        port->queue_head = req->next;
+        if (!port->queue_head) {
+            port->queue_tail = NULL;
+        }
+        ahci_start(port, slot, req);
+        issue |= 1u << slot;
+    }
+
+    if (issue) {
+        if (port->ncq) {
+            mmio_write32(port->regs + PORT_SACT, issue);
+        }
+        mmio_write32(port->regs + PORT_CI, issue);
+        port->blk.kicks++;
+    }
+}
+
+static void ahci_submit(blk_device_t* dev, blk_request_t* req) {
+    ahci_port_t* port = (ahci_port_t*)dev->driver;
+    req->next = NULL;
+
+    u64 flags = spin_lock_irqsave(&port->lock);
+    if (port->queue_tail) {
+        port->queue_tail->next = req;
+    } else {
+        port->queue_head = req;
+    }
+    port->queue_tail = req;
+    if (!dev->plugged) {
+        ahci_dispatch(port);
+    }
+    spin_unlock_irqrestore(&port->lock, flags);
+}
+
+static void ahci_unplug(blk_device_t* dev) {
+    ahci_port_t* port = (ahci_port_t*)dev->driver;
+
+    u64 flags = spin_lock_irqsave(&port->lock);
+    ahci_dispatch(port);
+    spin_unlock_irqrestore(&port->lock, flags);
+}
+
+// Restart a port after a task file or bus error
+static void ahci_port_recover(ahci_port_t* port) {
+    ahci_port_stop(port->regs);
+    mmio_write32(port->regs + PORT_SERR, 0xFFFFFFFF);
+    mmio_write32(port->regs + PORT_IS, 0xFFFFFFFF);
+    ahci_port_start(port->regs);
+}
+
+// Reap finished slots, refill them from the queue, then run the completion
+// callbacks without the lock so they can submit again - plugged, so what
+// they submit is issued together
+static void ahci_port_complete(ahci_port_t* port) {
+    blk_request_t* finished = NULL;
+    u32 failed;
+
+    u64 flags = spin_lock_irqsave(&port->lock);
+    u32 status = mmio_read32(port->regs + PORT_IS);
+    mmio_write32(port->regs + PORT_IS, status);
+
+    u32 done;
+    if (status & PORT_IS_ERRORS) {
+        // Finding the failed NCQ tag needs READ LOG EXT; fail everything in
+        // flight instead
+        done = port->busy;
+        ahci_port_recover(port);
+    } else {
+        u32 active = mmio_read32(port->regs + (port->ncq ? PORT_SACT : PORT_CI));
+        done = port->busy & ~active;
+    }
+    failed = (status & PORT_IS_ERRORS) ? done : 0;
+
+    // Completion order within one interrupt doesn't matter, chain them up
+    for (u32 pending = done; pending; pending &= pending - 1) {
+        u32 slot = __builtin_ctz(pending);
+        blk_request_t* req = port->slot_req[slot];
+        port->slot_req[slot] = NULL;
+        req->status = (failed & (1u << slot)) ? BLK_ERROR : BLK_OK;
+        req->next = finished;
+        finished = req;
+    }
+    port->busy &= ~done;
+    ahci_dispatch(port);
+    spin_unlock_irqrestore(&port->lock, flags);
+
+    blk_plug(&port->blk);
+    while (finished) {
+        blk_request_t* req = finished;
+        finished = req->next;
+        blk_complete(req, req->status);
+    }
+    blk_unplug(&port->blk);
+}
+
+// MSI handler shared by every port of the controller
+static void ahci_interrupt(registers_t* regs) {
+    u32 pending = mmio_read32(hba + HBA_IS);
+
+    for (u32 i = 0; i < port_count; i++) {
+        if (pending & (1u << ports[i].number)) {
+            ports[i].blk.irqs++;
+            ahci_port_complete(&ports[i]);
+        }
+    }
+    mmio_write32(hba + HBA_IS, pending);
+}
+
+static void ahci_poll(blk_device_t* dev) {
+    ahci_port_complete((ahci_port_t*)dev->driver);
+}
+
+// Run IDENTIFY DEVICE on slot 0 by polling (interrupts are still off)
+static bool ahci_identify(ahci_port_t* port, u16* data) {
+    blk_segment_t segment = { (u64)data, BLK_SECTOR_SIZE };
+    fis_h2d_t* fis = ahci_setup_slot(port, 0, &segment, 1, false);
+    fis->command = ATA_CMD_IDENTIFY;
+
+    mmio_write32(port->regs + PORT_CI, 1);
+    for (u64 waited = 0; mmio_read32(port->regs + PORT_CI) & 1; waited += 10) {
+        if (waited >= AHCI_TIMEOUT_US || (mmio_read32(port->regs + PORT_IS) & PORT_IS_ERRORS)) {
+            ahci_port_recover(port);
+            return false;
+        }
+        timer_delay_us(10);
+    }
+    mmio_write32(port->regs + PORT_IS, 0xFFFFFFFF);
+    return !(mmio_read32(port->regs + PORT_TFD) & PORT_TFD_ERR);
+}
+
+// Copy the model string out of IDENTIFY data (bytes are swapped in each word)
+static void ahci_copy_model(char* model, const u16* data) {
+    int length = 0;
+    for (int i = 0; i < 20; i++) {
+        model[i * 2] = (char)(data[27 + i] >> 8);
+        model[i * 2 + 1] = (char)data[27 + i];
+    }
+    for (int i = 0; i < 40; i++) {
+        if (model[i] != ' ') {
+            length = i + 1;
+        }
+    }
+    model[length] = '\0';
+}
+
+// Bring up one port if a disk is attached
+static bool ahci_port_init(ahci_port_t* port, u32 number, u32 hba_slots, bool hba_ncq, u16* identify) {
+    u64 regs = hba + AHCI_PORT_BASE + number * AHCI_PORT_SIZE;
+
+    if ((mmio_read32(regs + PORT_SSTS) & PORT_SSTS_DET_MASK) != PORT_SSTS_PRESENT ||
+        mmio_read32(regs + PORT_SIG) != SATA_SIG_DISK) {
+        return false;
+    }
+    if (!ahci_port_stop(regs)) {
+        return false;
+    }
+
+    port->number = number;
+    port->regs = regs;
+    port->cmd_list = (ahci_cmd_header_t*)ahci_dma_alloc(AHCI_SLOTS * sizeof(ahci_cmd_header_t), 1024);
+    void* fis_area = ahci_dma_alloc(256, 256);
+    if (!port->cmd_list || !fis_area) {
+        return false;
+    }
+    for (u32 slot = 0; slot < hba_slots; slot++) {
+        ahci_cmd_table_t* table = (ahci_cmd_table_t*)ahci_dma_alloc(sizeof(ahci_cmd_table_t), 128);
+        if (!table) {
+            return false;
+        }
+        port->tables[slot] = table;
+        port->cmd_list[slot].ctba = (u32)(u64)table;
+        port->cmd_list[slot].ctbau = (u32)((u64)table >> 32);
+    }
+
+    mmio_write32(regs + PORT_CLB, (u32)(u64)port->cmd_list);
+    mmio_write32(regs + PORT_CLBU, (u32)((u64)port->cmd_list >> 32));
+    mmio_write32(regs + PORT_FB, (u32)(u64)fis_area);
+    mmio_write32(regs + PORT_FBU, (u32)((u64)fis_area >> 32));
+    mmio_write32(regs + PORT_SERR, 0xFFFFFFFF);
+    mmio_write32(regs + PORT_IS, 0xFFFFFFFF);
+    ahci_port_start(regs);
+
+    if (!ahci_identify(port, identify)) {
+        ahci_port_stop(regs);
+        return false;
+    }
+
+    // NCQ needs both ends; the drive reports its queue depth minus one
+    u32 depth = 1;
+    port->ncq = hba_ncq && (identify[76] & (1 << 8));
+    if (port->ncq) {
+        depth = (identify[75] & 0x1F) + 1;
+        if (depth > hba_slots) {
+            depth = hba_slots;
+        }
+    }
+    port->slot_mask = depth == 32 ? 0xFFFFFFFF : (1u << depth) - 1;
+    port->busy = 0;
+    port->queue_head = NULL;
+    port->queue_tail = NULL;
+    spin_lock_init(&port->lock, &ahci_lock_stats);
+    ahci_copy_model(port->model, identify);
+
+    blk_device_t* blk = &port->blk;
+    if (identify[83] & (1 << 10)) {
+        blk->sectors = identify[100] | ((u64)identify[101] << 16) |
+                       ((u64)identify[102] << 32) | ((u64)identify[103] << 48);
+    } else {
+        blk->sectors = identify[60] | ((u64)identify[61] << 16);
+    }
+    blk->name[0] = 's';
+    blk->name[1] = 'a';
+    blk->name[2] = 't';
+    blk->name[3] = 'a';
+    blk->name[4] = '0' + port_count;
+    blk->name[5] = '\0';
+    blk->model = port->model;
+    blk->max_sectors = AHCI_MAX_SECTORS;
+    blk->max_segments = BLK_MAX_SEGMENTS;
+    blk->queue_depth = depth;
+    blk->submit = ahci_submit;
+    blk->poll = ahci_poll;
+    blk->unplug = ahci_unplug;
+    blk->driver = port;
+
+    // Completions: D2H register FIS for plain DMA, set device bits for NCQ
+    mmio_write32(regs + PORT_IE, PORT_IS_DHRS | PORT_IS_SDBS | PORT_IS_ERRORS);
+    return true;
+}
+
+u32 ahci_init() {
+    const pci_device_t* pci = pci_find_class(AHCI_PCI_CLASS, AHCI_PCI_SUBCLASS, AHCI_PCI_PROG_IF, 0);
+    if (!pci) {
+        return 0;
+    }
+
+    // Firmware puts the registers in the PCI window in the top GB, which the
+    // identity map has uncached
+    hba = pci_get_bar(pci, AHCI_PCI_BAR);
+    if (!hba || hba >= 0x100000000ull) {
+        return 0;
+    }
+    pci_enable_bus_master(pci);
+    lock_stats_init(&ahci_lock_stats, "ahci");
+
+    mmio_write32(hba + HBA_GHC, (mmio_read32(hba + HBA_GHC) | HBA_GHC_AE) & ~HBA_GHC_IE);
+    u32 cap = mmio_read32(hba + HBA_CAP);
+    u32 slots = ((cap >> HBA_CAP_NCS_SHIFT) & HBA_CAP_NCS_MASK) + 1;
+    bool ncq = (cap & HBA_CAP_SNCQ) != 0;
+
+    u16* identify = (u16*)ahci_dma_alloc(BLK_SECTOR_SIZE, 2);
+    if (!identify) {
+        return 0;
+    }
+
+    u32 implemented = mmio_read32(hba + HBA_PI);
+    for (u32 number = 0; number < 32 && port_count < AHCI_MAX_DISKS; number++) {
+        if ((implemented & (1u << number)) &&
+            ahci_port_init(&ports[port_count], number, slots, ncq, identify)) {
+            port_count++;
+        }
+    }
+    if (port_count == 0) {
+        return 0;
+    }
+
+    // Without MSI (or without a local APIC) the waiters poll the ports
+    u8 vector = irq_alloc_msi_vector();
+    bool msi = vector && pci_enable_msi(pci, vector, lapic_get_id());
+    if (msi) {
+        register_interrupt_handler(vector, ahci_interrupt);
+        mmio_write32(hba + HBA_IS, 0xFFFFFFFF);
+        mmio_write32(hba + HBA_GHC, mmio_read32(hba + HBA_GHC) | HBA_GHC_IE);
+    }
+
+    for (u32 i = 0; i < port_count; i++) {
+        ports[i].blk.interrupts = msi;
+        blk_register(&ports[i].blk);
+    }
+    return port_count;
+}
@@ -0,0 +1,11 @@
+#ifndef AHCI_H
+#define AHCI_H
+
+#include "../include/types.h"
+
+// Find the first AHCI controller on the PCI bus, bring up every port with a
+// SATA disk behind it and register the disks as block devices (sata0, ...).
+// Returns the number of disks found.
+u32 ahci_init();
+
+#endif
@@ -0,0 +1,271 @@
+#include "block.h"
+#include "timer.h"
+#include "../kernel/low_level.h"
+#include "../kernel/thread.h"
+#include "../memory/physical.h"
+
+static blk_device_t* devices = NULL;
+
+// Threads waiting for blk_transfer() or blk_bench() requests
+static wait_queue_t blk_waiters = { NULL };
+
+void blk_register(blk_device_t* dev) {
+    dev->plugged = 0;
+    dev->completed = 0;
+    dev->errors = 0;
+    dev->kicks = 0;
+    dev->irqs = 0;
+    dev->next = NULL;
+
+    blk_device_t** link = &devices;
+    while (*link) {
+        link = &(*link)->next;
+    }
+    *link = dev;
+}
+
+blk_device_t* blk_first() {
+    return devices;
+}
+
+blk_device_t* blk_find(const char* name) {
+    for (blk_device_t* dev = devices; dev; dev = dev->next) {
+        int i = 0;
+        while (i < BLK_NAME_LEN && dev->name[i] && dev->name[i] == name[i]) {
+            i++;
+        }
+        if (i == BLK_NAME_LEN || (dev->name[i] == '\0' && name[i] == '\0')) {
+            return dev;
+        }
+    }
+    return NULL;
+}
+
+int blk_submit(blk_request_t* req) {
+    blk_device_t* dev = req->dev;
+    if (!dev) {
+        return BLK_ENODEV;
+    }
+
+    // The segments have to describe exactly the sectors asked for
+    u64 bytes = 0;
+    for (u32 i = 0; i < req->segment_count; i++) {
+        if (req->segments[i].length == 0 || (req->segments[i].length & 1)) {
+            return BLK_EINVAL;
+        }
+        bytes += req->segments[i].length;
+    }
+    if (req->sectors == 0 || req->sectors > dev->max_sectors ||
+        req->lba + req->sectors > dev->sectors ||
+        req->segment_count == 0 || req->segment_count > dev->max_segments ||
+        bytes != (u64)req->sectors * BLK_SECTOR_SIZE) {
+        return BLK_EINVAL;
+    }
+
+    req->status = BLK_PENDING;
+    req->submit_tsc = cpu_read_tsc();
+    dev->submit(dev, req);
+    return BLK_SUBMITTED;
+}
+
+void blk_plug(blk_device_t* dev) {
+    __atomic_add_fetch(&dev->plugged, 1, __ATOMIC_SEQ_CST);
+}
+
+void blk_unplug(blk_device_t* dev) {
+    if (__atomic_sub_fetch(&dev->plugged, 1, __ATOMIC_SEQ_CST) == 0 && dev->unplug) {
+        dev->unplug(dev);
+    }
+}
+
+void blk_complete(blk_request_t* req, u8 status) {
+    if (status == BLK_OK) {
+        req->dev->completed++;
+    } else {
+        req->dev->errors++;
+    }
+    req->status = status;
+    if (req->done) {
+        req->done(req);
+    }
+}
+
+// Sleep until a counter of outstanding requests drops to zero, reaping
+// completions by hand on devices without interrupts
+static void blk_wait(blk_device_t* dev, volatile u32* outstanding) {
+    if (!dev->interrupts) {
+        while (*outstanding) {
+            dev->poll(dev);
+        }
+        return;
+    }
+
+    u64 flags = cpu_irq_save();
+    while (*outstanding) {
+        kthread_wait(&blk_waiters);
+    }
+    cpu_irq_restore(flags);
+}
+
+// data points at the waiter's outstanding count
+static void blk_transfer_done(blk_request_t* req) {
+    *(volatile u32*)req->data = 0;
+    kthread_wake_all(&blk_waiters);
+}
+
+bool blk_transfer(blk_device_t* dev, u8 op, u64 lba, u32 sectors, void* buffer) {
+    u64 addr = (u64)buffer;
+    volatile u32 outstanding;
+
+    while (sectors) {
+        u32 count = sectors < dev->max_sectors ? sectors : dev->max_sectors;
+
+        blk_request_t req;
+        req.dev = dev;
+        req.op = op;
+        req.lba = lba;
+        req.sectors = count;
+        req.segments[0].addr = addr;
+        req.segments[0].length = count * BLK_SECTOR_SIZE;
+        req.segment_count = 1;
+        req.done = blk_transfer_done;
+        req.data = (u64)&outstanding;
+
+        outstanding = 1;
+        if (blk_submit(&req) != BLK_SUBMITTED) {
+            return false;
+        }
+        blk_wait(dev, &outstanding);
+        if (req.status != BLK_OK) {
+            return false;
+        }
+
+        lba += count;
+        addr += count * BLK_SECTOR_SIZE;
+        sectors -= count;
+    }
+    return true;
+}
+
+// Benchmark state - one run at a time, driven from the completion callback
+static blk_request_t bench_requests[BLK_BENCH_MAX_DEPTH];
+static u64 bench_pages[BLK_BENCH_MAX_DEPTH][BLK_MAX_SEGMENTS];
+static blk_bench_result_t* bench_result;
+static volatile u32 bench_outstanding;
+static u64 bench_end_tsc;
+static u64 bench_slots;             // Request-sized slots on the disk
+static u64 bench_seed = 0x9E3779B97F4A7C15ull;
+
+// xorshift64 - good enough to scatter the offsets
+static u64 blk_bench_random() {
+    bench_seed ^= bench_seed << 13;
+    bench_seed ^= bench_seed >> 7;
+    bench_seed ^= bench_seed << 17;
+    return bench_seed;
+}
+
+// Point a request at its buffer pages, merging the ones that happen to be
+// physically adjacent
+static void blk_bench_prepare(blk_request_t* req, u64* pages, u32 sectors) {
+    u32 bytes = sectors * BLK_SECTOR_SIZE;
+    u32 count = 0;
+
+    for (u32 i = 0; bytes; i++) {
+        u32 length = bytes < PAGE_SIZE ? bytes : PAGE_SIZE;
+        if (count && req->segments[count - 1].addr + req->segments[count - 1].length == pages[i]) {
+            req->segments[count - 1].length += length;
+        } else {
+            req->segments[count].addr = pages[i];
+            req->segments[count].length = length;
+            count++;
+        }
+        bytes -= length;
+    }
+    req->segment_count = count;
+    req->sectors = sectors;
+    req->op = BLK_READ;
+}
+
+// Account a finished read and keep the queue full until time is up
+static void blk_bench_done(blk_request_t* req) {
+    u64 now = cpu_read_tsc();
+
+    bench_result->ios++;
+    bench_result->latency_cycles += now - req->submit_tsc;
+    if (req->status == BLK_OK) {
+        bench_result->bytes += (u64)req->sectors * BLK_SECTOR_SIZE;
+    } else {
+        bench_result->errors++;
+    }
+
+    if (now < bench_end_tsc) {
+        req->lba = (blk_bench_random() % bench_slots) * req->sectors;
+        if (blk_submit(req) == BLK_SUBMITTED) {
+            return;
+        }
+    }
+
+    if (--bench_outstanding == 0) {
+        kthread_wake_all(&blk_waiters);
+    }
+}
+
+bool blk_bench(blk_device_t* dev, u32 depth, u32 sectors, u32 duration_ms, blk_bench_result_t* result) {
+    u64 tsc_hz = timer_get_tsc_hz();
+    u32 pages = (sectors * BLK_SECTOR_SIZE + PAGE_SIZE - 1) / PAGE_SIZE;
+    if (depth == 0 || depth > BLK_BENCH_MAX_DEPTH || sectors == 0 ||
+        sectors > BLK_BENCH_MAX_SECTORS || sectors > dev->max_sectors ||
+        pages > dev->max_segments || dev->sectors < sectors || tsc_hz == 0) {
+        return false;
+    }
+
+    // Buffers are allocated on first use and kept for later runs: at most
+    // BLK_BENCH_MAX_DEPTH * BLK_MAX_SEGMENTS pages (2MB) of the physical
+    // allocator, which hands out nothing in the kmalloc heap
+    for (u32 i = 0; i < depth; i++) {
+        for (u32 j = 0; j < pages; j++) {
+            if (!bench_pages[i][j]) {
+                bench_pages[i][j] = pmm_alloc_page();
+                if (!bench_pages[i][j]) {
+                    return false;
+                }
+            }
+        }
+    }
+
+    result->ios = 0;
+    result->bytes = 0;
+    result->errors = 0;
+    result->latency_cycles = 0;
+    u64 kicks = dev->kicks;
+    u64 irqs = dev->irqs;
+    bench_result = result;
+    bench_slots = dev->sectors / sectors;
+
+    // Count every request in before the first can complete
+    bench_outstanding = depth;
+    u64 start = cpu_read_tsc();
+    bench_end_tsc = start + tsc_hz / 1000 * duration_ms;
+
+    // Start the whole queue with one doorbell
+    blk_plug(dev);
+    for (u32 i = 0; i < depth; i++) {
+        blk_request_t* req = &bench_requests[i];
+        req->dev = dev;
+        req->done = blk_bench_done;
+        req->lba = (blk_bench_random() % bench_slots) * sectors;
+        blk_bench_prepare(req, bench_pages[i], sectors);
+        if (blk_submit(req) != BLK_SUBMITTED) {
+            u64 flags = cpu_irq_save();
+            bench_outstanding--;
+            cpu_irq_restore(flags);
+        }
+    }
+    blk_unplug(dev);
+
+    blk_wait(dev, &bench_outstanding);
+    result->cycles = cpu_read_tsc() - start;
+    result->kicks = dev->kicks - kicks;
+    result->irqs = dev->irqs - irqs;
+    return true;
+}
@@ -0,0 +1,124 @@
+#ifndef BLOCK_H
+#define BLOCK_H
+
+#include "../include/types.h"
+
+#define BLK_SECTOR_SIZE   512
+#define BLK_NAME_LEN      8
+
+// Scatter-gather entries one request can carry
+#define BLK_MAX_SEGMENTS  16
+
+// Request operations
+#define BLK_READ          0
+#define BLK_WRITE         1
+
+// Request status
+#define BLK_PENDING       0
+#define BLK_OK            1
+#define BLK_ERROR         2
+
+// blk_submit() results
+#define BLK_SUBMITTED     0
+#define BLK_EINVAL        -1    // Out of range, empty or badly described
+#define BLK_ENODEV        -2
+
+// A physically contiguous piece of a transfer. Memory is identity mapped, so
+// the address is also the kernel pointer. Lengths must be even.
+typedef struct {
+    u64 addr;
+    u32 length;
+} blk_segment_t;
+
+struct blk_device;
+
+// One read or write. The caller owns the request until done() is called;
+// done() runs in interrupt context (or from the polling waiter) and may
+// submit the request again.
+typedef struct blk_request {
+    struct blk_device* dev;
+    u8 op;
+    u64 lba;
+    u32 sectors;
+    blk_segment_t segments[BLK_MAX_SEGMENTS];
+    u32 segment_count;              // The segments must add up to sectors
+    void (*done)(struct blk_request* req);
+    u64 data;                       // For the submitter
+    volatile u8 status;
+    u64 submit_tsc;                 // Stamped by blk_submit()
+    struct blk_request* next;       // Driver queue link
+} blk_request_t;
+
+// A disk registered by a driver
+typedef struct blk_device {
+    char name[BLK_NAME_LEN];
+    const char* model;
+    u64 sectors;
+    u32 max_sectors;                // Largest single request
+    u32 max_segments;               // Most segments in one request (<= BLK_MAX_SEGMENTS)
+    u32 queue_depth;                // Requests the device works on at once
+    bool interrupts;                // Completions arrive by interrupt
+
+    // Queue a validated request (never fails - requests wait for a free
+    // slot inside the driver)
+    void (*submit)(struct blk_device* dev, blk_request_t* req);
+
+    // Reap completions without an interrupt (used when interrupts is false)
+    void (*poll)(struct blk_device* dev);
+
+    // Issue what was queued while plugged (NULL if the driver never holds
+    // requests back)
+    void (*unplug)(struct blk_device* dev);
+
+    void* driver;
+    volatile u32 plugged;           // Nesting count of blk_plug()
+    u64 completed;
+    u64 errors;
+    u64 kicks;                      // Doorbell writes (VM exits under a hypervisor)
+    u64 irqs;                       // Completion interrupts taken
+    struct blk_device* next;
+} blk_device_t;
+
+// Results of one blk_bench() run
+typedef struct {
+    u64 ios;
+    u64 bytes;
+    u64 errors;
+    u64 cycles;                     // Wall time of the run
+    u64 latency_cycles;             // Sum over every request
+    u64 kicks;
+    u64 irqs;
+} blk_bench_result_t;
+
+// Largest request and queue depth blk_bench() supports
+#define BLK_BENCH_MAX_SECTORS (BLK_MAX_SEGMENTS * 4096 / BLK_SECTOR_SIZE)
+#define BLK_BENCH_MAX_DEPTH   32
+
+// Add a disk to the device list
+void blk_register(blk_device_t* dev);
+
+// Iterate over the registered disks
+blk_device_t* blk_first();
+
+// Find a disk by name
+blk_device_t* blk_find(const char* name);
+
+// Check and queue a request on req->dev; done() is called when it finishes
+int blk_submit(blk_request_t* req);
+
+// Hold back the device doorbell so several submissions go out with one
+// notification at the matching blk_unplug(). Plugs nest and may be taken from
+// completion callbacks.
+void blk_plug(blk_device_t* dev);
+void blk_unplug(blk_device_t* dev);
+
+// Finish a request - called by drivers
+void blk_complete(blk_request_t* req, u8 status);
+
+// Read or write a contiguous buffer and wait for it
+bool blk_transfer(blk_device_t* dev, u8 op, u64 lba, u32 sectors, void* buffer);
+
+// Keep depth random reads of a size in flight for a time and measure them
+bool blk_bench(blk_device_t* dev, u32 depth, u32 sectors, u32 duration_ms, blk_bench_result_t* result);
+
+#endif
@@ -1,5 +1,9 @@
 #include "keyboard.h"
 #include "../kernel/low_level.h"
+#include "../kernel/async.h"
+#include "../kernel/sync.h"
+#include "../kernel/trace.h"
+#include "../cpu/interrupts.h"
 
 #define KEYBOARD_DATA_PORT 0x60
 #define KEYBOARD_STATUS_PORT 0x64
@@ -10,14 +14,22 @@
 #define SCAN_LEFT_SHIFT_RELEASE 0xAA
 #define SCAN_RIGHT_SHIFT_RELEASE 0xB6
 #define SCAN_CAPS_LOCK 0x3A
+#define SCAN_CTRL 0x1D
+#define SCAN_CTRL_RELEASE 0x9D
+#define SCAN_ALT 0x38
+#define SCAN_ALT_RELEASE 0xB8
+#define SCAN_F1 0x3B
+#define SCAN_F10 0x44
 
-// Special key codes for arrow keys
-#define SPECIAL_LEFT_ARROW 0x4B
-#define SPECIAL_RIGHT_ARROW 0x4D
+// Extended (E0-prefixed) scan codes
+#define SCAN_UP_ARROW 0x48
+#define SCAN_DOWN_ARROW 0x50
+#define SCAN_LEFT_ARROW 0x4B
+#define SCAN_RIGHT_ARROW 0x4D
 
 // US keyboard layout - regular (unshifted) keys
 static char keyboard_map[128] = {
-    0, 0, '1', '2', '3', '4', '5', '6', '7', '8', '9', '0', '-', '=', '\b',
+    0, KEY_ESCAPE, '1', '2', '3', '4', '5', '6', '7', '8', '9', '0', '-', '=', '\b',
     '\t', 'q', 'w', 'e', 'r', 't', 'y', 'u', 'i', 'o', 'p', '[', ']', '\n',
     0, 'a', 's', 'd', 'f', 'g', 'h', 'j', 'k', 'l', ';', '\'', '`', 0,
     '\\', 'z', 'x', 'c', 'v', 'b', 'n', 'm', ',', '.', '/', 0, '*', 0,
@@ -27,7 +39,7 @@ static char keyboard_map[128] = {
 
 // US keyboard layout - shifted keys
 static char keyboard_map_shifted[128] = {
-    0, 0, '!', '@', '#', '$', '%', '^', '&', '*', '(', ')', '_', '+', '\b',
+    0, KEY_ESCAPE, '!', '@', '#', '$', '%', '^', '&', '*', '(', ')', '_', '+', '\b',
     '\t', 'Q', 'W', 'E', 'R', 'T', 'Y', 'U', 'I', 'O', 'P', '{', '}', '\n',
     0, 'A', 'S', 'D', 'F', 'G', 'H', 'J', 'K', 'L', ':', '"', '~', 0,
     '|', 'Z', 'X', 'C', 'V', 'B', 'N', 'M', '<', '>', '?', 0, '*', 0,
@@ -35,15 +47,55 @@ static char keyboard_map_shifted[128] = {
     0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0
 };
 
-static char last_key = 0;
+// Raw scancodes captured by the interrupt handler (produced by the IRQ,
+// consumed by the bottom half)
+#define SCANCODE_BUFFER_SIZE 64
+static u64 scancode_slots[SCANCODE_BUFFER_SIZE];
+static spsc_queue_t scancode_queue;
+
+// Decoded keys waiting for the terminal
+#define KEY_BUFFER_SIZE 64
+static char key_buffer[KEY_BUFFER_SIZE];
+static u32 key_head = 0;
+static u32 key_tail = 0;
+
+// Signalled by the interrupt handler / when decoded keys are queued
+static async_event_t scancode_event;
+static async_event_t key_event;
+static async_task_t keyboard_task;
+
 static bool shift_pressed = false;
+static bool ctrl_pressed = false;
+static bool alt_pressed = false;
 static bool caps_lock_on = false;
 static bool extended_key_mode = false;  // Flag for extended key sequences
 
+// Keyboard interrupt top half - grab the scancode and defer decoding
+static void keyboard_callback(registers_t* regs) {
+    u8 scancode = port_byte_in(KEYBOARD_DATA_PORT);
+    TRACE(TRACE_KEY, scancode);
+    
+    spsc_push(&scancode_queue, scancode);  // Dropped if the buffer is full
+    async_signal(&scancode_event);
+}
+
+// Decoding task - runs on the async executor whenever scancodes arrive
+static int keyboard_task_poll(async_task_t* task) {
+    ASYNC_BEGIN(task);
+    while (1) {
+        AWAIT_EVENT(task, &scancode_event, !spsc_empty(&scancode_queue));
+        keyboard_poll();
+    }
+    ASYNC_END(task);
+}
+
 void keyboard_init() {
     // Initialize state
-    last_key = 0;
+    spsc_init(&scancode_queue, scancode_slots, SCANCODE_BUFFER_SIZE);
+    key_head = key_tail = 0;
     shift_pressed = false;
+    ctrl_pressed = false;
+    alt_pressed = false;
     caps_lock_on = false;
     extended_key_mode = false;
     
@@ -53,6 +105,22 @@ void keyboard_init() {
         port_byte_in(KEYBOARD_DATA_PORT);
         status = port_byte_in(KEYBOARD_STATUS_PORT);
     }
+    
+    // Capture in the interrupt handler, decode in an async task
+    async_event_init(&scancode_event);
+    async_event_init(&key_event);
+    async_spawn(&keyboard_task, "keyboard", keyboard_task_poll, 0);
+    register_interrupt_handler(IRQ1, keyboard_callback);
+}
+
+// Queue a decoded key for the terminal
+static void keyboard_push_key(char key) {
+    u32 next = (key_head + 1) % KEY_BUFFER_SIZE;
+    if (next != key_tail) {
+        key_buffer[key_head] = key;
+        key_head = next;
+    }
+    async_signal(&key_event);
 }
 
 // Determines if a key is a letter (a-z, A-Z)
@@ -62,87 +130,134 @@ static bool is_letter(u8 scancode) {
            (scancode >= 0x2C && scancode <= 0x32);    // Z-M row
 }
 
-// Updated keyboard_poll function with arrow key support
-void keyboard_poll() {
-    // Check if data is available
-    u8 status = port_byte_in(KEYBOARD_STATUS_PORT);
+// Decode one scancode, with arrow key support
+static void keyboard_process_scancode(u8 scancode) {
+    // Check for extended key sequence (E0 prefix)
+    if (scancode == 0xE0) {
+        extended_key_mode = true;
+        return;
+    }
     
-    // If bit 0 is set, there's data to read
-    if (status & 1) {
-        u8 scancode = port_byte_in(KEYBOARD_DATA_PORT);
-
-        // Check for extended key sequence (E0 prefix)
-        if (scancode == 0xE0) {
-            extended_key_mode = true;
+    // If we're in extended key mode, handle extended keys
+    if (extended_key_mode) {
+        extended_key_mode = false;  // Reset extended key mode
+        
+        // Right Ctrl is the extended twin of left Ctrl
+        if (scancode == SCAN_CTRL || scancode == SCAN_CTRL_RELEASE) {
+            ctrl_pressed = scancode == SCAN_CTRL;
             return;
         }
         
-        // If we're in extended key mode, handle extended keys
-        if (extended_key_mode) {
-            extended_key_mode = false;  // Reset extended key mode
-            
-            // Only process key presses (not releases)
-            if (!(scancode & 0x80)) {
-                // Check for arrow keys
-                if (scancode == 0x4B) {  // Left arrow key
-                    last_key = SPECIAL_LEFT_ARROW;
-                    return;
-                }
-                else if (scancode == 0x4D) {  // Right arrow key
-                    last_key = SPECIAL_RIGHT_ARROW;
-                    return;
-                }
-                // Ignore other extended keys for now
-            }
+        // And right Alt (AltGr) of left Alt
+        if (scancode == SCAN_ALT || scancode == SCAN_ALT_RELEASE) {
+            alt_pressed = scancode == SCAN_ALT;
             return;
         }
         
-        // Handle regular keys
-        if (scancode == SCAN_LEFT_SHIFT || scancode == SCAN_RIGHT_SHIFT) {
-            shift_pressed = true;
-        } 
-        else if (scancode == SCAN_LEFT_SHIFT_RELEASE || scancode == SCAN_RIGHT_SHIFT_RELEASE) {
-            shift_pressed = false;
+        // Only process key presses (not releases)
+        if (!(scancode & 0x80)) {
+            if (scancode == SCAN_UP_ARROW) {
+                keyboard_push_key(KEY_UP);
+            }
+            else if (scancode == SCAN_DOWN_ARROW) {
+                keyboard_push_key(KEY_DOWN);
+            }
+            else if (scancode == SCAN_LEFT_ARROW) {
+                keyboard_push_key(KEY_LEFT);
+            }
+            else if (scancode == SCAN_RIGHT_ARROW) {
+                keyboard_push_key(KEY_RIGHT);
+            }
+            // Ignore other extended keys for now
         }
-        else if (scancode == SCAN_CAPS_LOCK) {
-            caps_lock_on = !caps_lock_on;
+        return;
+    }
+    
+    // Handle regular keys
+    if (scancode == SCAN_LEFT_SHIFT || scancode == SCAN_RIGHT_SHIFT) {
+        shift_pressed = true;
+    } 
+    else if (scancode == SCAN_LEFT_SHIFT_RELEASE || scancode == SCAN_RIGHT_SHIFT_RELEASE) {
+        shift_pressed = false;
+    }
+    else if (scancode == SCAN_CTRL || scancode == SCAN_CTRL_RELEASE) {
+        ctrl_pressed = scancode == SCAN_CTRL;
+    }
+    else if (scancode == SCAN_ALT || scancode == SCAN_ALT_RELEASE) {
+        alt_pressed = scancode == SCAN_ALT;
+    }
+    else if (scancode >= SCAN_F1 && scancode <= SCAN_F10) {
+        // Only Alt+Fn means anything (switch virtual console)
+        if (alt_pressed) {
+            keyboard_push_key(KEY_CONSOLE(scancode - SCAN_F1));
         }
-        else if (!(scancode & 0x80)) {  // Key press event (not release)
-            // Get the appropriate character
-            char key = 0;
-            
-            if (scancode < 128) {
-                if (is_letter(scancode)) {
-                    // For letters, shift XOR caps lock determines case
-                    if (shift_pressed ^ caps_lock_on) {
-                        key = keyboard_map_shifted[scancode];
-                    } else {
-                        key = keyboard_map[scancode];
-                    }
+    }
+    else if (scancode == SCAN_CAPS_LOCK) {
+        caps_lock_on = !caps_lock_on;
+    }
+    else if (!(scancode & 0x80)) {  // Key press event (not release)
+        // Get the appropriate character
+        char key = 0;
+        
+        if (scancode < 128) {
+            if (is_letter(scancode)) {
+                // For letters, shift XOR caps lock determines case
+                if (shift_pressed ^ caps_lock_on) {
+                    key = keyboard_map_shifted[scancode];
                 } else {
-                    // Non-letter keys only respond to shift
-                    if (shift_pressed) {
-                        key = keyboard_map_shifted[scancode];
-                    } else {
-                        key = keyboard_map[scancode];
-                    }
+                    key = keyboard_map[scancode];
                 }
-                
-                if (key) {
-                    last_key = key;
+            } else {
+                // Non-letter keys only respond to shift
+                if (shift_pressed) {
+                    key = keyboard_map_shifted[scancode];
+                } else {
+                    key = keyboard_map[scancode];
                 }
             }
+            
+            // Ctrl with a letter gives its control code
+            if (ctrl_pressed && is_letter(scancode)) {
+                key = KEY_CTRL(keyboard_map[scancode]);
+            }
+            
+            if (key) {
+                keyboard_push_key(key);
+            }
         }
     }
 }
 
-// Get the last key (and clear it)
+// Decode the scancodes queued by the keyboard interrupt
+void keyboard_poll() {
+    u64 scancode;
+    while (spsc_pop(&scancode_queue, &scancode)) {
+        keyboard_process_scancode((u8)scancode);
+    }
+}
+
+// Get the next decoded key (0 if none)
 char keyboard_get_last_key() {
-    char key = last_key;
-    last_key = 0;
+    u64 flags = cpu_irq_save();
+    char key = 0;
+    if (key_tail != key_head) {
+        key = key_buffer[key_tail];
+        key_tail = (key_tail + 1) % KEY_BUFFER_SIZE;
+    }
+    cpu_irq_restore(flags);
     return key;
 }
 
+// Check whether a decoded key is waiting
+bool keyboard_has_key() {
+    return key_tail != key_head;
+}
+
+// Event signalled whenever a decoded key is queued
+async_event_t* keyboard_get_key_event() {
+    return &key_event;
+}
+
 // Return current shift state
 bool keyboard_is_shift_pressed() {
     return shift_pressed;
@@ -155,10 +270,10 @@ bool keyboard_is_caps_lock_on() {
 
 // Check if key is left arrow
 bool keyboard_is_left_arrow(char key) {
-    return key == SPECIAL_LEFT_ARROW;
+    return key == KEY_LEFT;
 }
 
 // Check if key is right arrow
 bool keyboard_is_right_arrow(char key) {
-    return key == SPECIAL_RIGHT_ARROW;
+    return key == KEY_RIGHT;
 }
\ No newline at end of file
@@ -2,16 +2,39 @@
 #define KEYBOARD_H
 
 #include "../include/types.h"
+#include "../kernel/async.h"
+
+// Keys without an ASCII code are queued as values above 0x7F
+#define KEY_UP      ((char)0x80)
+#define KEY_DOWN    ((char)0x81)
+#define KEY_LEFT    ((char)0x82)
+#define KEY_RIGHT   ((char)0x83)
+#define KEY_ESCAPE  0x1B
+
+// Control with a letter is queued as the ASCII control code (Ctrl-R = 0x12)
+#define KEY_CTRL(c) ((c) & 0x1F)
+
+// Alt+F1..Alt+F10 are queued as KEY_CONSOLE(0)..KEY_CONSOLE(9)
+#define KEY_CONSOLE(n)      ((char)(0x90 + (n)))
+#define KEY_CONSOLE_COUNT   10
+#define KEY_IS_CONSOLE(key) ((u8)(key) >= 0x90 && (u8)(key) < 0x90 + KEY_CONSOLE_COUNT)
 
 // Initialize the keyboard
 void keyboard_init();
 
-// Poll keyboard for input
+// Decode scancodes captured by the keyboard interrupt (run by the keyboard
+// async task)
 void keyboard_poll();
 
-// Get the last pressed key (ASCII value)
+// Get the next pressed key (ASCII value), 0 if none is queued
 char keyboard_get_last_key();
 
+// Check whether a decoded key is waiting
+bool keyboard_has_key();
+
+// Event signalled whenever a decoded key is queued
+async_event_t* keyboard_get_key_event();
+
 // Return current shift state
 bool keyboard_is_shift_pressed();
 
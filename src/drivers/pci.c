@@ -0,0 +1,251 @@
+#include "pci.h"
+#include "../kernel/low_level.h"
+
+// Configuration mechanism #1 ports
+#define PCI_CONFIG_ADDRESS 0xCF8
+#define PCI_CONFIG_DATA    0xCFC
+
+// Header type bit set on function 0 of a multi-function device
+#define PCI_HEADER_MULTIFUNCTION 0x80
+#define PCI_HEADER_BRIDGE        0x01
+
+// Status register bit: the capability list pointer is valid
+#define PCI_STATUS_CAPABILITIES  (1 << 4)
+
+// MSI capability layout
+#define PCI_MSI_CONTROL       0x02
+#define PCI_MSI_ADDRESS       0x04
+#define PCI_MSI_64BIT         (1 << 7)
+#define PCI_MSI_ENABLE        (1 << 0)
+#define PCI_MSI_MULTI_MASK    (7 << 4)
+#define MSI_ADDRESS_BASE      0xFEE00000
+
+// MSI-X capability layout
+#define PCI_MSIX_CONTROL      0x02
+#define PCI_MSIX_TABLE        0x04
+#define PCI_MSIX_SIZE_MASK    0x7FF
+#define PCI_MSIX_MASK_ALL     (1 << 14)
+#define PCI_MSIX_ENABLE       (1 << 15)
+#define MSIX_ENTRY_SIZE       16
+#define MSIX_ENTRY_MASKED     1
+
+static pci_device_t devices[PCI_MAX_DEVICES];
+static u32 device_count = 0;
+
+// Select a dword of a function's configuration space
+static void pci_select(u8 bus, u8 device, u8 function, u8 offset) {
+    u32 address = (1u << 31) | ((u32)bus << 16) | ((u32)device << 11) |
+                  ((u32)function << 8) | (offset & 0xFC);
+    port_long_out(PCI_CONFIG_ADDRESS, address);
+}
+
+static u32 pci_config_read(u8 bus, u8 device, u8 function, u8 offset) {
+    pci_select(bus, device, function, offset);
+    return port_long_in(PCI_CONFIG_DATA);
+}
+
+u32 pci_read32(const pci_device_t* dev, u8 offset) {
+    return pci_config_read(dev->bus, dev->device, dev->function, offset);
+}
+
+u16 pci_read16(const pci_device_t* dev, u8 offset) {
+    return (u16)(pci_read32(dev, offset) >> ((offset & 2) * 8));
+}
+
+u8 pci_read8(const pci_device_t* dev, u8 offset) {
+    return (u8)(pci_read32(dev, offset) >> ((offset & 3) * 8));
+}
+
+void pci_write32(const pci_device_t* dev, u8 offset, u32 value) {
+    pci_select(dev->bus, dev->device, dev->function, offset);
+    port_long_out(PCI_CONFIG_DATA, value);
+}
+
+// Word writes go through the data port's upper half for odd words
+void pci_write16(const pci_device_t* dev, u8 offset, u16 value) {
+    pci_select(dev->bus, dev->device, dev->function, offset);
+    port_word_out(PCI_CONFIG_DATA + (offset & 2), value);
+}
+
+static void pci_scan_bus(u8 bus);
+
+// Remember one function, and follow it if it is a PCI-to-PCI bridge
+static void pci_scan_function(u8 bus, u8 device, u8 function) {
+    u32 id = pci_config_read(bus, device, function, PCI_VENDOR_ID);
+    u32 class_rev = pci_config_read(bus, device, function, PCI_CLASS_REVISION);
+    u8 header = (u8)(pci_config_read(bus, device, function, PCI_HEADER_TYPE & 0xFC) >> 16);
+
+    if (device_count < PCI_MAX_DEVICES) {
+        pci_device_t* dev = &devices[device_count++];
+        dev->bus = bus;
+        dev->device = device;
+        dev->function = function;
+        dev->vendor_id = id & 0xFFFF;
+        dev->device_id = id >> 16;
+        dev->class_code = class_rev >> 24;
+        dev->subclass = (class_rev >> 16) & 0xFF;
+        dev->prog_if = (class_rev >> 8) & 0xFF;
+        dev->irq_line = pci_config_read(bus, device, function, PCI_INTERRUPT_LINE) & 0xFF;
+    }
+
+    if ((header & 0x7F) == PCI_HEADER_BRIDGE) {
+        u8 secondary = (u8)(pci_config_read(bus, device, function, PCI_SECONDARY_BUS & 0xFC) >> 8);
+        if (secondary > bus) {
+            pci_scan_bus(secondary);
+        }
+    }
+}
+
+// Probe the 32 device numbers of a bus
+static void pci_scan_bus(u8 bus) {
+    for (u8 device = 0; device < 32; device++) {
+        if ((pci_config_read(bus, device, 0, PCI_VENDOR_ID) & 0xFFFF) == 0xFFFF) {
+            continue;
+        }
+
+        pci_scan_function(bus, device, 0);
+
+        u8 header = (u8)(pci_config_read(bus, device, 0, PCI_HEADER_TYPE & 0xFC) >> 16);
+        if (!(header & PCI_HEADER_MULTIFUNCTION)) {
+            continue;
+        }
+        for (u8 function = 1; function < 8; function++) {
+            if ((pci_config_read(bus, device, function, PCI_VENDOR_ID) & 0xFFFF) != 0xFFFF) {
+                pci_scan_function(bus, device, function);
+            }
+        }
+    }
+}
+
+// Walk from bus 0 through the bridges rather than probing all 256 buses,
+// which would cost thousands of port accesses at boot
+void pci_init() {
+    device_count = 0;
+    pci_scan_bus(0);
+}
+
+u32 pci_device_count() {
+    return device_count;
+}
+
+const pci_device_t* pci_get_device(u32 index) {
+    return index < device_count ? &devices[index] : NULL;
+}
+
+const pci_device_t* pci_find_class(u8 class_code, u8 subclass, u8 prog_if, u32 index) {
+    for (u32 i = 0; i < device_count; i++) {
+        const pci_device_t* dev = &devices[i];
+        if (dev->class_code == class_code && dev->subclass == subclass &&
+            dev->prog_if == prog_if && index-- == 0) {
+            return dev;
+        }
+    }
+    return NULL;
+}
+
+const pci_device_t* pci_find_device(u16 vendor_id, u16 device_id, u32 index) {
+    for (u32 i = 0; i < device_count; i++) {
+        const pci_device_t* dev = &devices[i];
+        if (dev->vendor_id == vendor_id && dev->device_id == device_id && index-- == 0) {
+            return dev;
+        }
+    }
+    return NULL;
+}
+
+u64 pci_get_bar(const pci_device_t* dev, u32 bar) {
+    u8 offset = PCI_BAR0 + bar * 4;
+    u32 low = pci_read32(dev, offset);
+
+    if (low & 1) {
+        return 0;   // I/O space
+    }
+
+    u64 address = low & ~0xFu;
+    if (((low >> 1) & 3) == 2 && bar < 5) {
+        address |= (u64)pci_read32(dev, offset + 4) << 32;
+    }
+    return address;
+}
+
+void pci_enable_bus_master(const pci_device_t* dev) {
+    u16 command = pci_read16(dev, PCI_COMMAND);
+    pci_write16(dev, PCI_COMMAND, command | PCI_COMMAND_MEMORY | PCI_COMMAND_MASTER);
+}
+
+// Follow the capability list from the header (start 0) or from the capability
+// after the one at start
+u8 pci_find_capability(const pci_device_t* dev, u8 id, u8 start) {
+    if (!(pci_read16(dev, PCI_STATUS) & PCI_STATUS_CAPABILITIES)) {
+        return 0;
+    }
+
+    u8 offset = start ? pci_read8(dev, start + 1) : pci_read8(dev, PCI_CAPABILITIES);
+
+    // The list lives above the standard header; the bound stops a loop in
+    // a broken one
+    for (int i = 0; i < 48 && offset >= 0x40; i++) {
+        offset &= 0xFC;
+        if (pci_read8(dev, offset) == id) {
+            return offset;
+        }
+        offset = pci_read8(dev, offset + 1);
+    }
+    return 0;
+}
+
+bool pci_enable_msi(const pci_device_t* dev, u8 vector, u32 apic_id) {
+    u8 cap = pci_find_capability(dev, PCI_CAP_MSI, 0);
+    if (!cap) {
+        return false;
+    }
+
+    // Fixed delivery, edge triggered, one message
+    u16 control = pci_read16(dev, cap + PCI_MSI_CONTROL);
+    pci_write32(dev, cap + PCI_MSI_ADDRESS, MSI_ADDRESS_BASE | (apic_id << 12));
+    if (control & PCI_MSI_64BIT) {
+        pci_write32(dev, cap + PCI_MSI_ADDRESS + 4, 0);
+        pci_write16(dev, cap + PCI_MSI_ADDRESS + 8, vector);
+    } else {
+        pci_write16(dev, cap + PCI_MSI_ADDRESS + 4, vector);
+    }
+    control &= ~PCI_MSI_MULTI_MASK;
+    pci_write16(dev, cap + PCI_MSI_CONTROL, control | PCI_MSI_ENABLE);
+
+    u16 command = pci_read16(dev, PCI_COMMAND);
+    pci_write16(dev, PCI_COMMAND, command | PCI_COMMAND_INTX_DISABLE);
+    return true;
+}
+
+bool pci_enable_msix(const pci_device_t* dev, u32 entry, u8 vector, u32 apic_id) {
+    u8 cap = pci_find_capability(dev, PCI_CAP_MSIX, 0);
+    if (!cap) {
+        return false;
+    }
+
+    u16 control = pci_read16(dev, cap + PCI_MSIX_CONTROL);
+    if (entry > (control & PCI_MSIX_SIZE_MASK)) {
+        return false;
+    }
+
+    // The table lives in one of the memory BARs, which must be in the
+    // identity map
+    u32 table = pci_read32(dev, cap + PCI_MSIX_TABLE);
+    u64 base = pci_get_bar(dev, table & 7);
+    if (!base || base >= 0x100000000ull) {
+        return false;
+    }
+    u64 address = base + (table & ~7u) + entry * MSIX_ENTRY_SIZE;
+
+    // Keep the function masked while its entry is half written
+    pci_write16(dev, cap + PCI_MSIX_CONTROL, control | PCI_MSIX_ENABLE | PCI_MSIX_MASK_ALL);
+    mmio_write32(address, MSI_ADDRESS_BASE | (apic_id << 12));
+    mmio_write32(address + 4, 0);
+    mmio_write32(address + 8, vector);
+    mmio_write32(address + 12, mmio_read32(address + 12) & ~MSIX_ENTRY_MASKED);
+    pci_write16(dev, cap + PCI_MSIX_CONTROL, (control | PCI_MSIX_ENABLE) & ~PCI_MSIX_MASK_ALL);
+
+    u16 command = pci_read16(dev, PCI_COMMAND);
+    pci_write16(dev, PCI_COMMAND, command | PCI_COMMAND_INTX_DISABLE);
+    return true;
+}
@@ -0,0 +1,84 @@
+#ifndef PCI_H
+#define PCI_H
+
+#include "../include/types.h"
+
+// Limit on the functions remembered by the bus scan
+#define PCI_MAX_DEVICES      32
+
+// Configuration space offsets
+#define PCI_VENDOR_ID        0x00
+#define PCI_DEVICE_ID        0x02
+#define PCI_COMMAND          0x04
+#define PCI_STATUS           0x06
+#define PCI_CLASS_REVISION   0x08
+#define PCI_HEADER_TYPE      0x0E
+#define PCI_BAR0             0x10
+#define PCI_SECONDARY_BUS    0x19
+#define PCI_CAPABILITIES     0x34
+#define PCI_INTERRUPT_LINE   0x3C
+
+// Command register bits
+#define PCI_COMMAND_MEMORY        (1 << 1)
+#define PCI_COMMAND_MASTER        (1 << 2)
+#define PCI_COMMAND_INTX_DISABLE  (1 << 10)
+
+// Capability IDs
+#define PCI_CAP_MSI          0x05
+#define PCI_CAP_VENDOR       0x09
+#define PCI_CAP_MSIX         0x11
+
+// A function found on the bus
+typedef struct {
+    u8 bus;
+    u8 device;
+    u8 function;
+    u16 vendor_id;
+    u16 device_id;
+    u8 class_code;
+    u8 subclass;
+    u8 prog_if;
+    u8 irq_line;        // Legacy interrupt line the firmware assigned
+} pci_device_t;
+
+// Scan the buses behind the host bridge and remember every function
+void pci_init();
+
+// Number of functions found by the scan
+u32 pci_device_count();
+
+// Get a function by index (NULL past the end)
+const pci_device_t* pci_get_device(u32 index);
+
+// Find the nth function with a class, subclass and programming interface
+const pci_device_t* pci_find_class(u8 class_code, u8 subclass, u8 prog_if, u32 index);
+
+// Find the nth function with a vendor and device ID
+const pci_device_t* pci_find_device(u16 vendor_id, u16 device_id, u32 index);
+
+// Configuration space access (offsets are naturally aligned)
+u32 pci_read32(const pci_device_t* dev, u8 offset);
+u16 pci_read16(const pci_device_t* dev, u8 offset);
+u8 pci_read8(const pci_device_t* dev, u8 offset);
+void pci_write32(const pci_device_t* dev, u8 offset, u32 value);
+void pci_write16(const pci_device_t* dev, u8 offset, u16 value);
+
+// Get the address a memory BAR decodes (64-bit BARs span two slots).
+// Returns 0 for I/O BARs and unassigned ones.
+u64 pci_get_bar(const pci_device_t* dev, u32 bar);
+
+// Enable memory decoding and bus mastering so the device can do DMA
+void pci_enable_bus_master(const pci_device_t* dev);
+
+// Find a capability in the capability list, returning its offset (0 if absent)
+u8 pci_find_capability(const pci_device_t* dev, u8 id, u8 start);
+
+// Point the device's MSI at a vector on the CPU with the given local APIC ID
+// and turn off its legacy interrupt. Returns false without an MSI capability.
+bool pci_enable_msi(const pci_device_t* dev, u8 vector, u32 apic_id);
+
+// Program one MSI-X table entry with a vector on a CPU and enable MSI-X.
+// Returns false without an MSI-X capability or if the entry doesn't exist.
+bool pci_enable_msix(const pci_device_t* dev, u32 entry, u8 vector, u32 apic_id);
+
+#endif
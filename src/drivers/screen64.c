@@ -1,17 +1,39 @@
 #include "screen64.h"
 #include "../kernel/low_level.h"
+#include "../kernel/sync.h"
 
 // Direct VGA memory access - standard location
 static volatile u16* const video_memory = (volatile u16*)0xB8000;
 
-// Current cursor position
-static u16 cursor_x = 0;
-static u16 cursor_y = 0;
-static u8 current_color = 0x07; // Light gray on black - basic, safe color
+// CRTC registers holding the cell the display starts at
+#define CRTC_START_HIGH 0x0C
+#define CRTC_START_LOW  0x0D
 
-// Set the hardware cursor position
-static void update_cursor() {
-    u16 pos = cursor_y * VGA_WIDTH + cursor_x;
+// Cursor position and color of each page
+typedef struct {
+    u16 cursor_x;
+    u16 cursor_y;
+    u8 color;
+} screen_page_t;
+
+static screen_page_t pages[SCREEN_PAGES];
+static u32 visible_page = 0;
+
+// Guards the pages' cursors and colors and the text buffer. A zeroed lock
+// is valid, so printing works even before screen_init.
+static spinlock_t console_lock;
+static lock_stats_t console_lock_stats;
+
+static volatile u16* page_memory(u32 page) {
+    return video_memory + page * SCREEN_PAGE_CELLS;
+}
+
+// Set the hardware cursor position (only the visible page has it)
+static void update_cursor(u32 page) {
+    if (page != visible_page) {
+        return;
+    }
+    u16 pos = page * SCREEN_PAGE_CELLS + pages[page].cursor_y * VGA_WIDTH + pages[page].cursor_x;
     
     // Tell the VGA controller we're setting the cursor position
     port_byte_out(0x3D4, 0x0F);  // Low byte index
@@ -21,143 +43,170 @@ static void update_cursor() {
     port_byte_out(0x3D5, (u8)((pos >> 8) & 0xFF));
 }
 
-// Clear the screen with basic color
-void screen_clear() {
-    // Clear the entire screen with space characters
+// Clear a page with basic color (console lock held)
+static void screen_clear_locked(u32 page) {
+    volatile u16* memory = page_memory(page);
     for (int i = 0; i < VGA_WIDTH * VGA_HEIGHT; i++) {
-        video_memory[i] = ' ' | (0x07 << 8); // Light gray on black
+        memory[i] = ' ' | (0x07 << 8); // Light gray on black
     }
     
-    cursor_x = 0;
-    cursor_y = 0;
-    update_cursor();
+    pages[page].cursor_x = 0;
+    pages[page].cursor_y = 0;
+    update_cursor(page);
+}
+
+// Clear the screen with basic color
+void screen_clear() {
+    u64 flags = spin_lock_irqsave(&console_lock);
+    screen_clear_locked(visible_page);
+    spin_unlock_irqrestore(&console_lock, flags);
+}
+
+void screen_page_clear(u32 page) {
+    if (page >= SCREEN_PAGES) return;
+    
+    u64 flags = spin_lock_irqsave(&console_lock);
+    screen_clear_locked(page);
+    spin_unlock_irqrestore(&console_lock, flags);
 }
 
 // Print a character at a specific location - basic version
 void screen_put_char(char c, u16 x, u16 y, u8 color) {
     if (x < VGA_WIDTH && y < VGA_HEIGHT) {
-        video_memory[y * VGA_WIDTH + x] = c | (color << 8);
+        page_memory(visible_page)[y * VGA_WIDTH + x] = c | (color << 8);
     }
 }
 
-// Print a string at the current cursor position
-void screen_print(const char* str) {
-    if (!str) return;
+// Write one character at a page's cursor and scroll if needed (console
+// lock held, hardware cursor not updated)
+static void screen_emit_char(u32 page, char c) {
+    screen_page_t* state = &pages[page];
+    volatile u16* memory = page_memory(page);
     
-    while (*str) {
-        if (*str == '\n') {
-            cursor_y++;
-            cursor_x = 0;
-        } else {
-            screen_put_char(*str, cursor_x, cursor_y, current_color);
-            cursor_x++;
-            if (cursor_x >= VGA_WIDTH) {
-                cursor_x = 0;
-                cursor_y++;
-            }
+    if (c == '\n') {
+        state->cursor_y++;
+        state->cursor_x = 0;
+    } else {
+        memory[state->cursor_y * VGA_WIDTH + state->cursor_x] = c | (state->color << 8);
+        state->cursor_x++;
+        if (state->cursor_x >= VGA_WIDTH) {
+            state->cursor_x = 0;
+            state->cursor_y++;
         }
-        
-        // Handle scrolling if needed
-        if (cursor_y >= VGA_HEIGHT) {
-            // Move lines up
-            for (int y = 0; y < VGA_HEIGHT - 1; y++) {
-                for (int x = 0; x < VGA_WIDTH; x++) {
-                    video_memory[y * VGA_WIDTH + x] = video_memory[(y + 1) * VGA_WIDTH + x];
-                }
-            }
-            
-            // Clear the bottom line
+    }
+    
+    // Handle scrolling if needed
+    if (state->cursor_y >= VGA_HEIGHT) {
+        // Move lines up
+        for (int y = 0; y < VGA_HEIGHT - 1; y++) {
             for (int x = 0; x < VGA_WIDTH; x++) {
-                video_memory[(VGA_HEIGHT - 1) * VGA_WIDTH + x] = ' ' | (current_color << 8);
+                memory[y * VGA_WIDTH + x] = memory[(y + 1) * VGA_WIDTH + x];
             }
-            
-            cursor_y = VGA_HEIGHT - 1;
         }
         
+        // Clear the bottom line
+        for (int x = 0; x < VGA_WIDTH; x++) {
+            memory[(VGA_HEIGHT - 1) * VGA_WIDTH + x] = ' ' | (state->color << 8);
+        }
+        
+        state->cursor_y = VGA_HEIGHT - 1;
+    }
+}
+
+// Print a string at a page's cursor position
+void screen_page_print(u32 page, const char* str) {
+    if (!str || page >= SCREEN_PAGES) return;
+    
+    u64 flags = spin_lock_irqsave(&console_lock);
+    while (*str) {
+        screen_emit_char(page, *str);
         str++;
     }
     
     // Update hardware cursor
-    update_cursor();
+    update_cursor(page);
+    spin_unlock_irqrestore(&console_lock, flags);
+}
+
+// Print a string at the current cursor position
+void screen_print(const char* str) {
+    screen_page_print(visible_page, str);
 }
 
 // Initialize the screen - simple initialization
 void screen_init() {
-    // Set basic color
-    current_color = 0x07; // Light gray on black
+    lock_stats_init(&console_lock_stats, "console");
+    spin_lock_init(&console_lock, &console_lock_stats);
     
-    // Clear screen
-    screen_clear();
+    // Set basic color
+    for (u32 page = 0; page < SCREEN_PAGES; page++) {
+        pages[page].color = 0x07; // Light gray on black
+        screen_page_clear(page);
+    }
     
-    // Initialize cursor position
-    cursor_x = 0;
-    cursor_y = 0;
-    update_cursor();
+    // Start on the first page
+    screen_show_page(0);
 }
 
 // Print a string at a specific position
 void screen_print_at(const char* str, u16 x, u16 y) {
-    cursor_x = x;
-    cursor_y = y;
-    screen_print(str);
+    if (!str) return;
+    
+    u64 flags = spin_lock_irqsave(&console_lock);
+    pages[visible_page].cursor_x = x;
+    pages[visible_page].cursor_y = y;
+    while (*str) {
+        screen_emit_char(visible_page, *str);
+        str++;
+    }
+    update_cursor(visible_page);
+    spin_unlock_irqrestore(&console_lock, flags);
 }
 
 // Print a single character
 void screen_print_char(char c) {
-    if (c == '\n') {
-        cursor_y++;
-        cursor_x = 0;
-    } else {
-        screen_put_char(c, cursor_x, cursor_y, current_color);
-        cursor_x++;
-        if (cursor_x >= VGA_WIDTH) {
-            cursor_x = 0;
-            cursor_y++;
-        }
-    }
+    u64 flags = spin_lock_irqsave(&console_lock);
+    screen_emit_char(visible_page, c);
+    update_cursor(visible_page);
+    spin_unlock_irqrestore(&console_lock, flags);
+}
+
+// Handle backspace on a page
+void screen_page_backspace(u32 page) {
+    if (page >= SCREEN_PAGES) return;
     
-    // Handle scrolling if needed
-    if (cursor_y >= VGA_HEIGHT) {
-        // Move lines up
-        for (int y = 0; y < VGA_HEIGHT - 1; y++) {
-            for (int x = 0; x < VGA_WIDTH; x++) {
-                video_memory[y * VGA_WIDTH + x] = video_memory[(y + 1) * VGA_WIDTH + x];
-            }
-        }
-        
-        // Clear the bottom line
-        for (int x = 0; x < VGA_WIDTH; x++) {
-            video_memory[(VGA_HEIGHT - 1) * VGA_WIDTH + x] = ' ' | (current_color << 8);
-        }
-        
-        cursor_y = VGA_HEIGHT - 1;
+    u64 flags = spin_lock_irqsave(&console_lock);
+    screen_page_t* state = &pages[page];
+    if (state->cursor_x > 0) {
+        state->cursor_x--;
+        page_memory(page)[state->cursor_y * VGA_WIDTH + state->cursor_x] = ' ' | (state->color << 8);
+        update_cursor(page);
     }
-    
-    update_cursor();
+    spin_unlock_irqrestore(&console_lock, flags);
 }
 
 // Handle backspace
 void screen_backspace() {
-    if (cursor_x > 0) {
-        cursor_x--;
-        screen_put_char(' ', cursor_x, cursor_y, current_color);
-        update_cursor();
-    }
+    screen_page_backspace(visible_page);
 }
 
 // Set cursor position
 void screen_set_cursor(u16 x, u16 y) {
     if (x < VGA_WIDTH && y < VGA_HEIGHT) {
-        cursor_x = x;
-        cursor_y = y;
-        update_cursor();
+        u64 flags = spin_lock_irqsave(&console_lock);
+        pages[visible_page].cursor_x = x;
+        pages[visible_page].cursor_y = y;
+        update_cursor(visible_page);
+        spin_unlock_irqrestore(&console_lock, flags);
     }
 }
 
 // Get cursor position
 void screen_get_cursor(u16* x, u16* y) {
-    *x = cursor_x;
-    *y = cursor_y;
+    u64 flags = spin_lock_irqsave(&console_lock);
+    *x = pages[visible_page].cursor_x;
+    *y = pages[visible_page].cursor_y;
+    spin_unlock_irqrestore(&console_lock, flags);
 }
 
 // Set the text color - simplified
@@ -165,5 +214,25 @@ void screen_set_color(u8 bg, u8 fg) {
     // Make sure we're using valid color values (0-15)
     bg &= 0x07; // Use only the first 3 bits for background (0-7)
     fg &= 0x0F; // Use only the first 4 bits for foreground (0-15)
-    current_color = (bg << 4) | fg;
-}
\ No newline at end of file
+    pages[visible_page].color = (bg << 4) | fg;
+}
+
+// Show a page: point the CRTC at it and move the cursor there. Nothing is
+// copied, so this costs the same however much the page holds.
+void screen_show_page(u32 page) {
+    if (page >= SCREEN_PAGES) return;
+    
+    u64 flags = spin_lock_irqsave(&console_lock);
+    visible_page = page;
+    u16 start = page * SCREEN_PAGE_CELLS;
+    port_byte_out(CURSOR_PORT_CMD, CRTC_START_HIGH);
+    port_byte_out(CURSOR_PORT_DATA, (u8)(start >> 8));
+    port_byte_out(CURSOR_PORT_CMD, CRTC_START_LOW);
+    port_byte_out(CURSOR_PORT_DATA, (u8)(start & 0xFF));
+    update_cursor(page);
+    spin_unlock_irqrestore(&console_lock, flags);
+}
+
+u32 screen_visible_page() {
+    return visible_page;
+}
@@ -31,6 +31,11 @@
 #define CURSOR_PORT_CMD    0x3D4
 #define CURSOR_PORT_DATA   0x3D5
 
+// The 32 KB of text memory holds several screens. Each page keeps its own
+// cursor and color; showing one only moves the CRTC start address.
+#define SCREEN_PAGES       4
+#define SCREEN_PAGE_CELLS  2048    // 4 KB per page
+
 // Function prototypes
 void screen_init();
 void screen_clear();
@@ -46,4 +51,14 @@ void screen_newline();
 void screen_backspace();
 void screen_put_char(char c, u16 x, u16 y, u8 color);
 
+// The functions above work on the visible page; these on any page, without
+// disturbing the visible one
+void screen_page_clear(u32 page);
+void screen_page_print(u32 page, const char* str);
+void screen_page_backspace(u32 page);
+
+// Show a page (and its cursor), and which page is showing
+void screen_show_page(u32 page);
+u32 screen_visible_page();
+
 #endif // SCREEN64_H
\ No newline at end of file
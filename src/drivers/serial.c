@@ -0,0 +1,75 @@
+#include "serial.h"
+#include "../kernel/low_level.h"
+
+// UART registers, as offsets from the base port
+#define UART_DATA           0       // DLAB=0: transmit/receive
+#define UART_INT_ENABLE     1       // DLAB=0
+#define UART_DIVISOR_LOW    0       // DLAB=1
+#define UART_DIVISOR_HIGH   1       // DLAB=1
+#define UART_FIFO_CONTROL   2
+#define UART_LINE_CONTROL   3
+#define UART_MODEM_CONTROL  4
+#define UART_LINE_STATUS    5
+#define UART_SCRATCH        7
+
+#define UART_LCR_DLAB       0x80
+#define UART_LCR_8N1        0x03
+#define UART_LSR_THR_EMPTY  0x20
+
+static bool serial_present = false;
+
+bool serial_init() {
+    // A UART keeps what is written to its scratch register
+    port_byte_out(SERIAL_COM1 + UART_SCRATCH, 0x5A);
+    if (port_byte_in(SERIAL_COM1 + UART_SCRATCH) != 0x5A) {
+        return false;
+    }
+
+    port_byte_out(SERIAL_COM1 + UART_INT_ENABLE, 0);
+    port_byte_out(SERIAL_COM1 + UART_LINE_CONTROL, UART_LCR_DLAB);
+    port_byte_out(SERIAL_COM1 + UART_DIVISOR_LOW, 1);       // 115200 baud
+    port_byte_out(SERIAL_COM1 + UART_DIVISOR_HIGH, 0);
+    port_byte_out(SERIAL_COM1 + UART_LINE_CONTROL, UART_LCR_8N1);
+    port_byte_out(SERIAL_COM1 + UART_FIFO_CONTROL, 0xC7);   // Enable and clear the FIFOs
+    port_byte_out(SERIAL_COM1 + UART_MODEM_CONTROL, 0x03);  // DTR and RTS, no interrupts
+    serial_present = true;
+    return true;
+}
+
+void serial_write_char(char c) {
+    if (!serial_present) {
+        return;
+    }
+    while (!(port_byte_in(SERIAL_COM1 + UART_LINE_STATUS) & UART_LSR_THR_EMPTY)) {
+        __asm__ __volatile__("pause");
+    }
+    port_byte_out(SERIAL_COM1 + UART_DATA, c);
+}
+
+void serial_write(const char* str) {
+    while (*str) {
+        serial_write_char(*str++);
+    }
+}
+
+void serial_write_number(u64 value) {
+    char digits[20];
+    int count = 0;
+    do {
+        digits[count++] = '0' + value % 10;
+        value /= 10;
+    } while (value);
+    while (count) {
+        serial_write_char(digits[--count]);
+    }
+}
+
+void serial_write_hex(u64 value) {
+    int shift = 60;
+    while (shift > 0 && !((value >> shift) & 0xF)) {
+        shift -= 4;
+    }
+    for (; shift >= 0; shift -= 4) {
+        serial_write_char("0123456789abcdef"[(value >> shift) & 0xF]);
+    }
+}
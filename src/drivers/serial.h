@@ -0,0 +1,24 @@
+#ifndef SERIAL_H
+#define SERIAL_H
+
+#include "../include/types.h"
+
+// COM1, polled output only (115200 8N1). Used for machine-readable output
+// such as benchmark results; QEMU's -serial sends it to the host.
+#define SERIAL_COM1 0x3F8
+
+// Program the UART. Returns false if no UART answers at COM1.
+bool serial_init();
+
+// Write a string / character, waiting for the transmitter as needed.
+// Does nothing without a UART.
+void serial_write(const char* str);
+void serial_write_char(char c);
+
+// Write a number in decimal
+void serial_write_number(u64 value);
+
+// Write a number in hexadecimal, without a prefix or leading zeros
+void serial_write_hex(u64 value);
+
+#endif
@@ -2,22 +2,82 @@
 #include "../drivers/timer.h"
 #include "../kernel/low_level.h"
 #include "../cpu/interrupts.h"
+#include "../kernel/thread.h"
+#include "../kernel/sync.h"
+#include "../kernel/async.h"
+#include "../kernel/prof.h"
 
 // The PIT uses a crystal oscillator running at 1.193182 MHz
 #define PIT_FREQUENCY 1193182
 
+// TSC calibration: count PIT channel 2 down over this many milliseconds
+#define CALIBRATE_MS 2
+#define CALIBRATE_MAX_LOOPS 10000000
+
 // Timer tick counter
 static volatile u64 timer_ticks = 0;
+static u32 timer_frequency = 100;
+
+// TSC at the last tick and TSC cycles per tick, for time between ticks.
+// Written by the tick handler, read from any CPU under clock_lock.
+static u64 tick_tsc = 0;
+static u64 tsc_per_tick = 0;
+static seqlock_t clock_lock;
+
+// TSC cycles per second, measured against the PIT at init
+static u64 tsc_hz = 0;
 
 // Timer interrupt handler - simplified to avoid conflicts
-static void timer_callback(registers_t regs) {
+static void timer_callback(registers_t* regs) {
+    u64 now = cpu_read_tsc();
+    
+    write_seqlock(&clock_lock);
+    if (tick_tsc) {
+        tsc_per_tick = now - tick_tsc;
+    }
+    tick_tsc = now;
     timer_ticks++;
+    write_sequnlock(&clock_lock);
+    
+    // Wake sleeping threads and charge the running one's time slice
+    kthread_tick();
+    async_tick();
+    
+    // The profiler samples on the tick when there is no local APIC timer
+    prof_timer_tick(regs);
+}
+
+// Measure the TSC rate with a one-shot countdown on PIT channel 2, whose
+// output can be polled through port 0x61 without interrupts
+static u64 timer_calibrate_tsc() {
+    u32 count = PIT_FREQUENCY * CALIBRATE_MS / 1000;
+    
+    // Gate channel 2 on, keep the speaker off
+    port_byte_out(0x61, (port_byte_in(0x61) & ~0x02) | 0x01);
+    port_byte_out(0x43, 0xB0);  // Channel 2, lobyte/hibyte, mode 0 (interrupt on terminal count)
+    port_byte_out(0x42, count & 0xFF);
+    port_byte_out(0x42, (count >> 8) & 0xFF);
+    
+    u64 start = cpu_read_tsc();
+    u32 loops = 0;
+    while (!(port_byte_in(0x61) & 0x20)) {
+        if (++loops == CALIBRATE_MAX_LOOPS) {
+            return 0;  // No channel 2 - fall back to measuring ticks
+        }
+    }
+    return (cpu_read_tsc() - start) * 1000 / CALIBRATE_MS;
 }
 
 // Initialize the timer with a specific frequency
 void timer_init(u32 frequency) {
+    // Measure the TSC first so early delays can be exact
+    tsc_hz = timer_calibrate_tsc();
+    
     // Register the timer handler
-    register_interrupt_handler(32, timer_callback);
+    seqlock_init(&clock_lock, NULL);
+    register_interrupt_handler(IRQ0, timer_callback);
+    
+    timer_frequency = frequency;
     
     // Calculate the divisor
     u32 divisor = PIT_FREQUENCY / frequency;
@@ -35,10 +95,68 @@ u64 timer_get_ticks() {
     return timer_ticks;
 }
 
+// Get the tick frequency in Hz
+u32 timer_get_frequency() {
+    return timer_frequency;
+}
+
+// Get the time since the timer started in microseconds, interpolated
+// between ticks with the TSC
+u64 timer_get_time_us() {
+    u64 ticks, last_tsc, per_tick, now;
+    u32 seq;
+    
+    do {
+        seq = read_seqbegin(&clock_lock);
+        ticks = timer_ticks;
+        last_tsc = tick_tsc;
+        per_tick = tsc_per_tick;
+        now = cpu_read_tsc();
+    } while (read_seqretry(&clock_lock, seq));
+    
+    u64 us = ticks * 1000000 / timer_frequency;
+    if (per_tick && now > last_tsc) {
+        u64 partial = (now - last_tsc) * (1000000 / timer_frequency) / per_tick;
+        us += partial < 1000000 / timer_frequency ? partial : 1000000 / timer_frequency;
+    }
+    return us;
+}
+
+// TSC cycles per second (0 until known)
+u64 timer_get_tsc_hz() {
+    if (tsc_hz) {
+        return tsc_hz;
+    }
+    
+    // Calibration failed: use the TSC measured between two ticks
+    u64 per_tick;
+    u32 seq;
+    do {
+        seq = read_seqbegin(&clock_lock);
+        per_tick = tsc_per_tick;
+    } while (read_seqretry(&clock_lock, seq));
+    return per_tick * timer_frequency;
+}
+
+// Busy-wait for a number of microseconds using the calibrated TSC
+void timer_delay_us(u64 us) {
+    u64 hz = timer_get_tsc_hz();
+    if (!hz) {
+        // Not calibrated yet: fall back to whole ticks
+        timer_sleep((u32)((us + 999) / 1000));
+        return;
+    }
+    
+    u64 end = cpu_read_tsc() + us * hz / 1000000;
+    while (cpu_read_tsc() < end) {
+        __asm__ __volatile__("pause");
+    }
+}
+
 // Sleep for a specified number of milliseconds
 void timer_sleep(u32 ms) {
     u64 start_ticks = timer_ticks;
-    u64 ticks_to_wait = ms / 10;  // Assuming 100Hz timer
+    u64 ticks_to_wait = (u64)ms * timer_frequency / 1000;
     
     while (timer_ticks - start_ticks < ticks_to_wait) {
         __asm__ __volatile__("hlt");  // Halt until next interrupt
@@ -9,6 +9,19 @@ void timer_init(u32 frequency);
 // Get the number of ticks since the system started
 u64 timer_get_ticks();
 
+// Get the tick frequency in Hz
+u32 timer_get_frequency();
+
+// Get the time since the timer started in microseconds, interpolated
+// between ticks with the TSC
+u64 timer_get_time_us();
+
+// TSC cycles per second, calibrated against the PIT (0 until known)
+u64 timer_get_tsc_hz();
+
+// Busy-wait for a number of microseconds using the calibrated TSC
+void timer_delay_us(u64 us);
+
 // Sleep for a specified number of milliseconds
 void timer_sleep(u32 ms);
 
@@ -0,0 +1,553 @@
+#include "virtio_blk.h"
+#include "block.h"
+#include "pci.h"
+#include "../cpu/interrupts.h"
+#include "../cpu/apic.h"
+#include "../kernel/low_level.h"
+#include "../kernel/sync.h"
+#include "../kernel/util.h"
+#include "../memory/physical.h"
+
+// PCI IDs: modern-only and transitional virtio block devices
+#define VIRTIO_VENDOR_ID          0x1AF4
+#define VIRTIO_BLK_DEVICE_MODERN  0x1042
+#define VIRTIO_BLK_DEVICE_TRANS   0x1001
+
+// Vendor capability types locating the configuration structures
+#define VIRTIO_PCI_CAP_COMMON     1
+#define VIRTIO_PCI_CAP_NOTIFY     2
+#define VIRTIO_PCI_CAP_DEVICE     4
+
+// Vendor capability layout
+#define VIRTIO_CAP_TYPE           3
+#define VIRTIO_CAP_BAR            4
+#define VIRTIO_CAP_OFFSET         8
+#define VIRTIO_CAP_NOTIFY_MULT    16
+
+// Common configuration registers
+#define COMMON_DEVICE_FEATURE_SEL 0x00
+#define COMMON_DEVICE_FEATURE     0x04
+#define COMMON_DRIVER_FEATURE_SEL 0x08
+#define COMMON_DRIVER_FEATURE     0x0C
+#define COMMON_MSIX_CONFIG        0x10
+#define COMMON_STATUS             0x14
+#define COMMON_QUEUE_SELECT       0x16
+#define COMMON_QUEUE_SIZE         0x18
+#define COMMON_QUEUE_MSIX_VECTOR  0x1A
+#define COMMON_QUEUE_ENABLE       0x1C
+#define COMMON_QUEUE_NOTIFY_OFF   0x1E
+#define COMMON_QUEUE_DESC         0x20
+#define COMMON_QUEUE_DRIVER       0x28
+#define COMMON_QUEUE_DEVICE       0x30
+
+// Device status bits
+#define STATUS_ACKNOWLEDGE        1
+#define STATUS_DRIVER             2
+#define STATUS_DRIVER_OK          4
+#define STATUS_FEATURES_OK        8
+#define STATUS_FAILED             128
+
+// Feature bits
+#define VIRTIO_F_INDIRECT_DESC    (1ull << 28)
+#define VIRTIO_F_EVENT_IDX        (1ull << 29)
+#define VIRTIO_F_VERSION_1        (1ull << 32)
+
+#define VIRTIO_MSI_NO_VECTOR      0xFFFF
+
+// Descriptor flags
+#define VRING_DESC_F_NEXT         1
+#define VRING_DESC_F_WRITE        2     // Device writes the buffer
+#define VRING_DESC_F_INDIRECT     4
+
+#define VRING_USED_F_NO_NOTIFY    1
+
+// Block request types and status
+#define VIRTIO_BLK_T_IN           0
+#define VIRTIO_BLK_T_OUT          1
+#define VIRTIO_BLK_S_OK           0
+
+#define VIRTIO_BLK_MAX_DISKS      4
+#define VIRTIO_QUEUE_MAX          128   // Ring entries used (power of two)
+#define VIRTIO_BLK_SLOTS          64    // Requests in flight per disk
+
+// Completions gathered per interrupt while the queue is deep. Only ever
+// asks for as many as are in flight, so a completion is never stranded.
+#define VIRTIO_BLK_COALESCE       4
+
+typedef struct {
+    u64 addr;
+    u32 len;
+    u16 flags;
+    u16 next;
+} __attribute__((packed)) vring_desc_t;
+
+typedef struct {
+    u16 flags;
+    u16 idx;
+    u16 ring[];                 // Followed by used_event
+} __attribute__((packed)) vring_avail_t;
+
+typedef struct {
+    u32 id;
+    u32 len;
+} __attribute__((packed)) vring_used_elem_t;
+
+typedef struct {
+    u16 flags;
+    u16 idx;
+    vring_used_elem_t ring[];   // Followed by avail_event
+} __attribute__((packed)) vring_used_t;
+
+typedef struct {
+    u32 type;
+    u32 reserved;
+    u64 sector;
+} __attribute__((packed)) virtio_blk_header_t;
+
+// What one request needs in DMA memory: its indirect descriptor table,
+// the request header and the status byte the device fills in
+typedef struct {
+    vring_desc_t table[BLK_MAX_SEGMENTS + 2];
+    virtio_blk_header_t header;
+    volatile u8 status;
+} __attribute__((aligned(16))) virtio_blk_slot_t;
+
+typedef struct {
+    u64 common;
+    u64 notify;                 // This queue's doorbell
+    u64 device_cfg;
+    u16 queue_size;
+    bool indirect;
+    bool event_idx;
+
+    volatile vring_desc_t* desc;
+    volatile vring_avail_t* avail;
+    volatile vring_used_t* used;
+    volatile u16* used_event;   // Driver: interrupt me when used idx passes this
+    volatile u16* avail_event;  // Device: notify me when avail idx passes this
+
+    u16 free_head;              // Free descriptors, linked through next
+    u16 free_count;
+    u16 avail_idx;              // Shadow of avail->idx
+    u16 last_used;              // Next used entry to reap
+    u32 inflight;
+
+    virtio_blk_slot_t* slots[VIRTIO_BLK_SLOTS];
+    blk_request_t* slot_req[VIRTIO_BLK_SLOTS];
+    u64 free_slots;
+    u8 head_slot[VIRTIO_QUEUE_MAX];     // Request slot of each chain head
+
+    blk_request_t* queue_head;  // Waiting for a slot or descriptors
+    blk_request_t* queue_tail;
+    spinlock_t lock;
+    blk_device_t blk;
+} virtio_blk_t;
+
+static virtio_blk_t disks[VIRTIO_BLK_MAX_DISKS];
+static u32 disk_count = 0;
+static lock_stats_t virtio_lock_stats;
+
+// Stores to the ring must be visible before the device's event index is read
+static inline void virtio_mb() {
+    __asm__ __volatile__("mfence" : : : "memory");
+}
+
+// Has the published index moved past the other side's event index since old?
+static inline bool vring_need_event(u16 event, u16 new_idx, u16 old_idx) {
+    return (u16)(new_idx - event - 1) < (u16)(new_idx - old_idx);
+}
+
+static void virtio_write64(u64 reg, u64 value) {
+    mmio_write32(reg, (u32)value);
+    mmio_write32(reg + 4, (u32)(value >> 32));
+}
+
+static void virtio_fill(volatile vring_desc_t* desc, u64 addr, u32 len, u16 flags) {
+    desc->addr = addr;
+    desc->len = len;
+    desc->flags = flags;
+}
+
+// Describe a request and return the head of its descriptor chain (lock
+// held). With indirect descriptors the ring only ever holds one entry per
+// request; otherwise the chain is taken straight off the free list, which is
+// linked through the same next fields.
+static u16 virtio_blk_build(virtio_blk_t* vb, u32 slot, blk_request_t* req) {
+    virtio_blk_slot_t* s = vb->slots[slot];
+    u16 data_flags = req->op == BLK_WRITE ? 0 : VRING_DESC_F_WRITE;
+    u32 count = req->segment_count + 2;
+    u16 head = vb->free_head;
+
+    s->header.type = req->op == BLK_WRITE ? VIRTIO_BLK_T_OUT : VIRTIO_BLK_T_IN;
+    s->header.reserved = 0;
+    s->header.sector = req->lba;
+    s->status = 0xFF;
+
+    if (vb->indirect) {
+        vring_desc_t* table = s->table;
+        virtio_fill(&table[0], (u64)&s->header, sizeof(virtio_blk_header_t), VRING_DESC_F_NEXT);
+        table[0].next = 1;
+        for (u32 i = 0; i < req->segment_count; i++) {
+            virtio_fill(&table[i + 1], req->segments[i].addr, req->segments[i].length, data_flags | VRING_DESC_F_NEXT);
+            table[i + 1].next = i + 2;
+        }
+        virtio_fill(&table[count - 1], (u64)&s->status, 1, VRING_DESC_F_WRITE);
+        table[count - 1].next = 0;
+
+        virtio_fill(&vb->desc[head], (u64)table, count * sizeof(vring_desc_t), VRING_DESC_F_INDIRECT);
+        vb->free_head = vb->desc[head].next;
+        vb->free_count--;
+    } else {
+        u16 index = head;
+        virtio_fill(&vb->desc[index], (u64)&s->header, sizeof(virtio_blk_header_t), VRING_DESC_F_NEXT);
+        for (u32 i = 0; i < req->segment_count; i++) {
+            index = vb->desc[index].next;
+            virtio_fill(&vb->desc[index], req->segments[i].addr, req->segments[i].length, data_flags | VRING_DESC_F_NEXT);
+        }
+        index = vb->desc[index].next;
+        virtio_fill(&vb->desc[index], (u64)&s->status, 1, VRING_DESC_F_WRITE);
+        vb->free_head = vb->desc[index].next;
+        vb->free_count -= count;
+    }
+
+    vb->head_slot[head] = slot;
+    vb->slot_req[slot] = req;
+    return head;
+}
+
+// Give a finished chain back to the free list (lock held)
+static void virtio_blk_free_chain(virtio_blk_t* vb, u16 head) {
+    u16 index = head;
+    u16 count = 1;
+    while (vb->desc[index].flags & VRING_DESC_F_NEXT) {
+        index = vb->desc[index].next;
+        count++;
+    }
+    vb->desc[index].next = vb->free_head;
+    vb->free_head = head;
+    vb->free_count += count;
+}
+
+// Publish every queued request that fits, then ring the doorbell once for
+// the batch - and only if the device asked to be told (lock held)
+static void virtio_blk_dispatch(virtio_blk_t* vb) {
+    u16 old_idx = vb->avail_idx;
+    bool was_idle = vb->inflight == 0;
+
+    while (vb->queue_head && vb->free_slots) {
+        blk_request_t* req = vb->queue_head;
+        u32 needed = vb->indirect ? 1 : req->segment_count + 2;
+        if (vb->free_count < needed) {
+            break;
+        }
+        vb->queue_head = req->next;
+        if (!vb->queue_head) {
+            vb->queue_tail = NULL;
+        }
+
+        u32 slot = __builtin_ctzll(vb->free_slots);
+        vb->free_slots &= ~(1ull << slot);
+        u16 head = virtio_blk_build(vb, slot, req);
+        vb->avail->ring[vb->avail_idx & (vb->queue_size - 1)] = head;
+        vb->avail_idx++;
+        vb->inflight++;
+    }
+    if (vb->avail_idx == old_idx) {
+        return;
+    }
+
+    // An idle queue wants to hear about the very next completion
+    if (was_idle && vb->event_idx) {
+        *vb->used_event = vb->last_used;
+    }
+    vb->avail->idx = vb->avail_idx;
+    virtio_mb();
+
+    bool notify = vb->event_idx ? vring_need_event(*vb->avail_event, vb->avail_idx, old_idx)
+                                : !(vb->used->flags & VRING_USED_F_NO_NOTIFY);
+    if (notify) {
+        mmio_write16(vb->notify, 0);
+        vb->blk.kicks++;
+    }
+}
+
+static void virtio_blk_submit(blk_device_t* dev, blk_request_t* req) {
+    virtio_blk_t* vb = (virtio_blk_t*)dev->driver;
+    req->next = NULL;
+
+    u64 flags = spin_lock_irqsave(&vb->lock);
+    if (vb->queue_tail) {
+        vb->queue_tail->next = req;
+    } else {
+        vb->queue_head = req;
+    }
+    vb->queue_tail = req;
+    if (!dev->plugged) {
+        virtio_blk_dispatch(vb);
+    }
+    spin_unlock_irqrestore(&vb->lock, flags);
+}
+
+static void virtio_blk_unplug(blk_device_t* dev) {
+    virtio_blk_t* vb = (virtio_blk_t*)dev->driver;
+
+    u64 flags = spin_lock_irqsave(&vb->lock);
+    virtio_blk_dispatch(vb);
+    spin_unlock_irqrestore(&vb->lock, flags);
+}
+
+// Reap the used ring, ask for the next interrupt a few completions out, and
+// run the callbacks plugged so their resubmissions share one doorbell
+static void virtio_blk_complete(virtio_blk_t* vb) {
+    blk_request_t* finished = NULL;
+
+    u64 flags = spin_lock_irqsave(&vb->lock);
+    do {
+        while (vb->last_used != vb->used->idx) {
+            volatile vring_used_elem_t* elem = &vb->used->ring[vb->last_used & (vb->queue_size - 1)];
+            u16 head = (u16)elem->id;
+            u32 slot = vb->head_slot[head];
+            blk_request_t* req = vb->slot_req[slot];
+
+            req->status = vb->slots[slot]->status == VIRTIO_BLK_S_OK ? BLK_OK : BLK_ERROR;
+            req->next = finished;
+            finished = req;
+
+            vb->slot_req[slot] = NULL;
+            vb->free_slots |= 1ull << slot;
+            virtio_blk_free_chain(vb, head);
+            vb->inflight--;
+            vb->last_used++;
+        }
+        if (!vb->event_idx) {
+            break;
+        }
+
+        // Re-check after moving the event index, or a completion that landed
+        // in between would never raise an interrupt
+        u32 batch = vb->inflight < VIRTIO_BLK_COALESCE ? vb->inflight : VIRTIO_BLK_COALESCE;
+        *vb->used_event = vb->last_used + (batch ? batch - 1 : 0);
+        virtio_mb();
+    } while (vb->last_used != vb->used->idx);
+    spin_unlock_irqrestore(&vb->lock, flags);
+
+    blk_plug(&vb->blk);
+    while (finished) {
+        blk_request_t* req = finished;
+        finished = req->next;
+        blk_complete(req, req->status);
+    }
+    blk_unplug(&vb->blk);
+}
+
+// MSI-X handler shared by every disk
+static void virtio_blk_interrupt(registers_t* regs) {
+    for (u32 i = 0; i < disk_count; i++) {
+        if (disks[i].last_used != disks[i].used->idx) {
+            disks[i].blk.irqs++;
+            virtio_blk_complete(&disks[i]);
+        }
+    }
+}
+
+static void virtio_blk_poll(blk_device_t* dev) {
+    virtio_blk_complete((virtio_blk_t*)dev->driver);
+}
+
+// Find the common, notify and device configuration structures
+static bool virtio_blk_find_config(virtio_blk_t* vb, const pci_device_t* pci, u32* notify_mult) {
+    u64 notify_base = 0;
+
+    for (u8 cap = pci_find_capability(pci, PCI_CAP_VENDOR, 0); cap;
+         cap = pci_find_capability(pci, PCI_CAP_VENDOR, cap)) {
+        u8 type = pci_read8(pci, cap + VIRTIO_CAP_TYPE);
+        u64 base = pci_get_bar(pci, pci_read8(pci, cap + VIRTIO_CAP_BAR));
+        if (!base || base >= 0x100000000ull) {
+            continue;   // Must be inside the (uncached) identity map
+        }
+        base += pci_read32(pci, cap + VIRTIO_CAP_OFFSET);
+
+        if (type == VIRTIO_PCI_CAP_COMMON && !vb->common) {
+            vb->common = base;
+        } else if (type == VIRTIO_PCI_CAP_NOTIFY && !notify_base) {
+            notify_base = base;
+            *notify_mult = pci_read32(pci, cap + VIRTIO_CAP_NOTIFY_MULT);
+        } else if (type == VIRTIO_PCI_CAP_DEVICE && !vb->device_cfg) {
+            vb->device_cfg = base;
+        }
+    }
+    vb->notify = notify_base;
+    return vb->common && notify_base && vb->device_cfg;
+}
+
+// Lay out queue 0 in one page and carve the request slots from more
+static bool virtio_blk_setup_queue(virtio_blk_t* vb, u8 vector) {
+    u64 common = vb->common;
+
+    mmio_write16(common + COMMON_QUEUE_SELECT, 0);
+    u16 size = mmio_read16(common + COMMON_QUEUE_SIZE);
+    if (size == 0) {
+        return false;
+    }
+    while (size > VIRTIO_QUEUE_MAX || (size & (size - 1))) {
+        size = size > VIRTIO_QUEUE_MAX ? VIRTIO_QUEUE_MAX : size & (size - 1);
+    }
+    // A direct chain needs the header, one segment and the status
+    if (!vb->indirect && size < 3) {
+        return false;
+    }
+    vb->queue_size = size;
+
+    u64 ring = pmm_alloc_page();
+    if (!ring) {
+        return false;
+    }
+    memory_set((char*)ring, 0, PAGE_SIZE);
+    u64 avail = ring + size * sizeof(vring_desc_t);
+    u64 used = (avail + 6 + 2 * size + 3) & ~3ull;
+    vb->desc = (volatile vring_desc_t*)ring;
+    vb->avail = (volatile vring_avail_t*)avail;
+    vb->used = (volatile vring_used_t*)used;
+    vb->used_event = (volatile u16*)(avail + 4 + 2 * size);
+    vb->avail_event = (volatile u16*)(used + 4 + sizeof(vring_used_elem_t) * size);
+
+    for (u16 i = 0; i < size; i++) {
+        vb->desc[i].next = i + 1;
+    }
+    vb->free_head = 0;
+    vb->free_count = size;
+    vb->avail_idx = 0;
+    vb->last_used = 0;
+    vb->inflight = 0;
+
+    u32 per_page = PAGE_SIZE / sizeof(virtio_blk_slot_t);
+    for (u32 i = 0; i < VIRTIO_BLK_SLOTS; i++) {
+        if (i % per_page == 0) {
+            u64 page = pmm_alloc_page();
+            if (!page) {
+                return false;
+            }
+            memory_set((char*)page, 0, PAGE_SIZE);
+            vb->slots[i] = (virtio_blk_slot_t*)page;
+        } else {
+            vb->slots[i] = vb->slots[i - 1] + 1;
+        }
+    }
+    vb->free_slots = VIRTIO_BLK_SLOTS == 64 ? ~0ull : (1ull << VIRTIO_BLK_SLOTS) - 1;
+
+    mmio_write16(common + COMMON_QUEUE_SIZE, size);
+    virtio_write64(common + COMMON_QUEUE_DESC, ring);
+    virtio_write64(common + COMMON_QUEUE_DRIVER, avail);
+    virtio_write64(common + COMMON_QUEUE_DEVICE, used);
+
+    // The device reads back NO_VECTOR if it couldn't take the MSI-X entry
+    vb->blk.interrupts = false;
+    if (vector) {
+        mmio_write16(common + COMMON_QUEUE_MSIX_VECTOR, 0);
+        vb->blk.interrupts = mmio_read16(common + COMMON_QUEUE_MSIX_VECTOR) == 0;
+    }
+    mmio_write16(common + COMMON_QUEUE_ENABLE, 1);
+    return true;
+}
+
+// Reset the device, negotiate features and bring queue 0 up
+static bool virtio_blk_probe(virtio_blk_t* vb, const pci_device_t* pci) {
+    u32 notify_mult = 0;
+    if (!virtio_blk_find_config(vb, pci, &notify_mult)) {
+        return false;   // Legacy-only device
+    }
+    pci_enable_bus_master(pci);
+
+    u64 common = vb->common;
+    mmio_write8(common + COMMON_STATUS, 0);
+    for (int i = 0; i < 100000 && mmio_read8(common + COMMON_STATUS) != 0; i++) {
+        __asm__ __volatile__("pause");
+    }
+    mmio_write8(common + COMMON_STATUS, STATUS_ACKNOWLEDGE | STATUS_DRIVER);
+
+    mmio_write32(common + COMMON_DEVICE_FEATURE_SEL, 0);
+    u64 offered = mmio_read32(common + COMMON_DEVICE_FEATURE);
+    mmio_write32(common + COMMON_DEVICE_FEATURE_SEL, 1);
+    offered |= (u64)mmio_read32(common + COMMON_DEVICE_FEATURE) << 32;
+    if (!(offered & VIRTIO_F_VERSION_1)) {
+        mmio_write8(common + COMMON_STATUS, STATUS_FAILED);
+        return false;
+    }
+
+    u64 features = VIRTIO_F_VERSION_1 | (offered & (VIRTIO_F_INDIRECT_DESC | VIRTIO_F_EVENT_IDX));
+    mmio_write32(common + COMMON_DRIVER_FEATURE_SEL, 0);
+    mmio_write32(common + COMMON_DRIVER_FEATURE, (u32)features);
+    mmio_write32(common + COMMON_DRIVER_FEATURE_SEL, 1);
+    mmio_write32(common + COMMON_DRIVER_FEATURE, (u32)(features >> 32));
+    mmio_write8(common + COMMON_STATUS, STATUS_ACKNOWLEDGE | STATUS_DRIVER | STATUS_FEATURES_OK);
+    if (!(mmio_read8(common + COMMON_STATUS) & STATUS_FEATURES_OK)) {
+        mmio_write8(common + COMMON_STATUS, STATUS_FAILED);
+        return false;
+    }
+    vb->indirect = (features & VIRTIO_F_INDIRECT_DESC) != 0;
+    vb->event_idx = (features & VIRTIO_F_EVENT_IDX) != 0;
+
+    // Config changes are not interesting; queue 0 gets MSI-X entry 0
+    u8 vector = irq_alloc_msi_vector();
+    if (vector && !pci_enable_msix(pci, 0, vector, lapic_get_id())) {
+        vector = 0;
+    }
+    mmio_write16(common + COMMON_MSIX_CONFIG, VIRTIO_MSI_NO_VECTOR);
+    if (!virtio_blk_setup_queue(vb, vector)) {
+        mmio_write8(common + COMMON_STATUS, STATUS_FAILED);
+        return false;
+    }
+    if (vb->blk.interrupts) {
+        register_interrupt_handler(vector, virtio_blk_interrupt);
+    }
+    vb->notify += mmio_read16(common + COMMON_QUEUE_NOTIFY_OFF) * notify_mult;
+
+    mmio_write8(common + COMMON_STATUS, STATUS_ACKNOWLEDGE | STATUS_DRIVER | STATUS_FEATURES_OK | STATUS_DRIVER_OK);
+    return true;
+}
+
+u32 virtio_blk_init() {
+    lock_stats_init(&virtio_lock_stats, "virtio-blk");
+
+    for (u32 i = 0; i < pci_device_count() && disk_count < VIRTIO_BLK_MAX_DISKS; i++) {
+        const pci_device_t* pci = pci_get_device(i);
+        if (pci->vendor_id != VIRTIO_VENDOR_ID ||
+            (pci->device_id != VIRTIO_BLK_DEVICE_MODERN && pci->device_id != VIRTIO_BLK_DEVICE_TRANS)) {
+            continue;
+        }
+
+        virtio_blk_t* vb = &disks[disk_count];
+        memory_set((char*)vb, 0, sizeof(virtio_blk_t));
+        if (!virtio_blk_probe(vb, pci)) {
+            continue;
+        }
+        spin_lock_init(&vb->lock, &virtio_lock_stats);
+
+        // Capacity is in 512-byte sectors whatever the logical block size
+        blk_device_t* blk = &vb->blk;
+        blk->sectors = mmio_read32(vb->device_cfg) | ((u64)mmio_read32(vb->device_cfg + 4) << 32);
+        blk->name[0] = 'v';
+        blk->name[1] = 'b';
+        blk->name[2] = 'l';
+        blk->name[3] = 'k';
+        blk->name[4] = '0' + disk_count;
+        blk->name[5] = '\0';
+        blk->model = "virtio-blk";
+        blk->max_sectors = 0xFFFF;
+        blk->max_segments = BLK_MAX_SEGMENTS;
+        if (!vb->indirect && vb->queue_size - 2 < BLK_MAX_SEGMENTS) {
+            // Without indirect tables a request takes its segments plus the
+            // header and status descriptors from the ring
+            blk->max_segments = vb->queue_size - 2;
+        }
+        blk->queue_depth = VIRTIO_BLK_SLOTS;
+        blk->submit = virtio_blk_submit;
+        blk->poll = virtio_blk_poll;
+        blk->unplug = virtio_blk_unplug;
+        blk->driver = vb;
+
+        disk_count++;
+        blk_register(blk);
+    }
+    return disk_count;
+}
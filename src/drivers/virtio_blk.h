@@ -0,0 +1,11 @@
+#ifndef VIRTIO_BLK_H
+#define VIRTIO_BLK_H
+
+#include "../include/types.h"
+
+// Find the virtio block devices on the PCI bus, set them up through the
+// modern (virtio 1.0) interface and register them as block devices
+// (vblk0, ...). Returns the number of disks found.
+u32 virtio_blk_init();
+
+#endif
@@ -0,0 +1,387 @@
+#include "bcache.h"
+#include "../drivers/timer.h"
+#include "../kernel/async.h"
+#include "../kernel/sync.h"
+#include "../kernel/thread.h"
+#include "../memory/kmalloc.h"
+
+#define BCACHE_HASH_SIZE      1024    // Power of two
+
+// The cache may grow to an eighth of memory, and stops growing while less
+// than a sixteenth is free
+#define BCACHE_MAX_SHARE      8
+#define BCACHE_RESERVE_SHARE  16
+#define BCACHE_MIN_BUFFERS    16
+
+// Sequential streams: reads of the next block twice in a row start
+// read-ahead, whose window doubles up to the maximum
+#define BCACHE_STREAMS        4
+#define BCACHE_SEQ_THRESHOLD  2
+#define BCACHE_RA_MIN         4
+#define BCACHE_RA_MAX         32
+
+// Write-back: every second, write what has been dirty for a while
+#define BCACHE_FLUSH_MS       1000
+#define BCACHE_DIRTY_AGE_MS   3000
+
+typedef struct {
+    blk_device_t* dev;
+    u64 next;                       // Block a sequential reader asks for next
+    u32 run;                        // Sequential reads so far
+    u32 window;                     // Blocks to keep read ahead
+    u64 ra_end;                     // First block not read ahead yet
+} bcache_stream_t;
+
+static buffer_t* hash_table[BCACHE_HASH_SIZE];
+static buffer_t* lru_head = NULL;
+static buffer_t* lru_tail = NULL;
+static bcache_stream_t streams[BCACHE_STREAMS];
+static u32 stream_victim = 0;
+static bcache_stats_t stats;
+
+static spinlock_t bcache_lock;
+static lock_stats_t bcache_lock_stats;
+static wait_queue_t bcache_waiters = { NULL };
+static async_task_t flush_task;
+
+static u32 bcache_hash(blk_device_t* dev, u64 block) {
+    u64 key = ((u64)dev >> 4) ^ (block * 0x9E3779B97F4A7C15ull);
+    return (u32)(key >> 32) & (BCACHE_HASH_SIZE - 1);
+}
+
+static buffer_t* bcache_lookup(blk_device_t* dev, u64 block) {
+    for (buffer_t* buf = hash_table[bcache_hash(dev, block)]; buf; buf = buf->hash_next) {
+        if (buf->dev == dev && buf->block == block) {
+            return buf;
+        }
+    }
+    return NULL;
+}
+
+static void bcache_unhash(buffer_t* buf) {
+    buffer_t** link = &hash_table[bcache_hash(buf->dev, buf->block)];
+    while (*link != buf) {
+        link = &(*link)->hash_next;
+    }
+    *link = buf->hash_next;
+}
+
+static void bcache_lru_remove(buffer_t* buf) {
+    if (buf->lru_prev) {
+        buf->lru_prev->lru_next = buf->lru_next;
+    } else {
+        lru_head = buf->lru_next;
+    }
+    if (buf->lru_next) {
+        buf->lru_next->lru_prev = buf->lru_prev;
+    } else {
+        lru_tail = buf->lru_prev;
+    }
+}
+
+static void bcache_lru_push(buffer_t* buf) {
+    buf->lru_prev = NULL;
+    buf->lru_next = lru_head;
+    if (lru_head) {
+        lru_head->lru_prev = buf;
+    } else {
+        lru_tail = buf;
+    }
+    lru_head = buf;
+}
+
+// Is there room to take another page from the allocator?
+static bool bcache_can_grow() {
+    if (stats.buffers >= stats.max_buffers) {
+        return false;
+    }
+    u64 total, free, used;
+    pmm_get_stats(&total, &free, &used);
+    return free > total / BCACHE_RESERVE_SHARE;
+}
+
+// Get a buffer for a block that isn't cached: a new one while memory allows,
+// otherwise the least recently used clean, unpinned one (lock held)
+static buffer_t* bcache_alloc(blk_device_t* dev, u64 block) {
+    buffer_t* buf = NULL;
+
+    if (bcache_can_grow()) {
+        u64 page = pmm_alloc_page();
+        buf = page ? (buffer_t*)kmalloc(sizeof(buffer_t)) : NULL;
+        if (buf) {
+            buf->data = (u8*)page;
+            stats.buffers++;
+        } else if (page) {
+            pmm_free_page(page);
+        }
+    }
+    if (!buf) {
+        for (buf = lru_tail; buf; buf = buf->lru_prev) {
+            if (buf->pins == 0 && !(buf->flags & (BUF_DIRTY | BUF_IO))) {
+                break;
+            }
+        }
+        if (!buf) {
+            return NULL;
+        }
+        bcache_unhash(buf);
+        bcache_lru_remove(buf);
+        stats.evictions++;
+    }
+
+    buf->dev = dev;
+    buf->block = block;
+    buf->flags = 0;
+    buf->pins = 0;
+    u32 bucket = bcache_hash(dev, block);
+    buf->hash_next = hash_table[bucket];
+    hash_table[bucket] = buf;
+    bcache_lru_push(buf);
+    return buf;
+}
+
+// Runs when a buffer's read or write finishes (interrupt context)
+static void bcache_io_done(blk_request_t* req) {
+    buffer_t* buf = (buffer_t*)req->data;
+
+    u64 flags = spin_lock_irqsave(&bcache_lock);
+    if (req->status != BLK_OK) {
+        stats.errors++;
+        if (req->op == BLK_READ) {
+            buf->flags |= BUF_ERROR;
+        } else {
+            buf->flags |= BUF_DIRTY;    // Try again at the next flush
+            stats.dirty++;
+        }
+    } else if (req->op == BLK_READ) {
+        buf->flags = (buf->flags | BUF_VALID) & ~BUF_ERROR;
+    }
+    buf->flags &= ~BUF_IO;
+    buf->pins--;
+    spin_unlock_irqrestore(&bcache_lock, flags);
+
+    kthread_wake_all(&bcache_waiters);
+}
+
+// Start a read or write of a whole buffer; the I/O holds a pin (lock held)
+static void bcache_start_io(buffer_t* buf, u8 op) {
+    blk_request_t* req = &buf->req;
+    req->dev = buf->dev;
+    req->op = op;
+    req->lba = buf->block * BCACHE_SECTORS;
+    req->sectors = BCACHE_SECTORS;
+    req->segments[0].addr = (u64)buf->data;
+    req->segments[0].length = BCACHE_BLOCK_SIZE;
+    req->segment_count = 1;
+    req->done = bcache_io_done;
+    req->data = (u64)buf;
+
+    buf->flags |= BUF_IO;
+    buf->pins++;
+    if (blk_submit(req) != BLK_SUBMITTED) {
+        buf->flags = (buf->flags & ~BUF_IO) | (op == BLK_READ ? BUF_ERROR : 0);
+        buf->pins--;
+        stats.errors++;
+    }
+}
+
+// Sleep until a buffer's I/O is done, reaping by hand on polled devices
+// (lock held, interrupts off - both dropped only while waiting)
+static void bcache_wait_io(buffer_t* buf) {
+    while (buf->flags & BUF_IO) {
+        spin_unlock(&bcache_lock);
+        if (buf->dev->interrupts) {
+            kthread_wait(&bcache_waiters);
+        } else {
+            buf->dev->poll(buf->dev);
+        }
+        spin_lock(&bcache_lock);
+    }
+}
+
+// Follow sequential readers and keep their read-ahead window filled. The
+// window is refilled once the reader is halfway into it, so the next reads
+// are already in flight when it gets there (lock held).
+static void bcache_readahead(blk_device_t* dev, u64 block) {
+    bcache_stream_t* stream = NULL;
+    for (u32 i = 0; i < BCACHE_STREAMS; i++) {
+        if (streams[i].dev == dev && streams[i].next == block) {
+            stream = &streams[i];
+            break;
+        }
+    }
+    if (stream) {
+        stream->run++;
+    } else {
+        stream = &streams[stream_victim++ % BCACHE_STREAMS];
+        stream->dev = dev;
+        stream->run = 0;
+        stream->window = BCACHE_RA_MIN;
+        stream->ra_end = block + 1;
+    }
+    stream->next = block + 1;
+
+    if (stream->run < BCACHE_SEQ_THRESHOLD || stream->ra_end > block + stream->window / 2) {
+        return;
+    }
+
+    u64 blocks = dev->sectors / BCACHE_SECTORS;
+    u64 start = stream->ra_end > block + 1 ? stream->ra_end : block + 1;
+    u64 end = block + 1 + stream->window;
+    if (end > blocks) {
+        end = blocks;
+    }
+    for (u64 b = start; b < end; b++) {
+        if (bcache_lookup(dev, b)) {
+            continue;
+        }
+        buffer_t* buf = bcache_alloc(dev, b);
+        if (!buf) {
+            end = b;
+            break;
+        }
+        buf->flags = BUF_READAHEAD;
+        bcache_start_io(buf, BLK_READ);
+        stats.readahead++;
+    }
+    stream->ra_end = end;
+    if (stream->window < BCACHE_RA_MAX) {
+        stream->window *= 2;
+    }
+}
+
+buffer_t* bcache_read(blk_device_t* dev, u64 block) {
+    if (block >= dev->sectors / BCACHE_SECTORS) {
+        return NULL;
+    }
+
+    // The demand read and any read-ahead go out with one doorbell
+    blk_plug(dev);
+    u64 flags = spin_lock_irqsave(&bcache_lock);
+
+    buffer_t* buf = bcache_lookup(dev, block);
+    if (buf && (buf->flags & (BUF_VALID | BUF_IO))) {
+        stats.hits++;
+        if (buf->flags & BUF_READAHEAD) {
+            stats.readahead_hits++;
+        }
+        buf->flags &= ~BUF_READAHEAD;
+        bcache_lru_remove(buf);
+        bcache_lru_push(buf);
+    } else {
+        // Not cached, or an earlier read of it failed
+        stats.misses++;
+        if (!buf) {
+            buf = bcache_alloc(dev, block);
+        }
+        if (buf) {
+            bcache_start_io(buf, BLK_READ);
+        }
+    }
+    if (buf) {
+        buf->pins++;
+    }
+    bcache_readahead(dev, block);
+
+    spin_unlock(&bcache_lock);
+    blk_unplug(dev);
+    spin_lock(&bcache_lock);
+
+    if (buf) {
+        bcache_wait_io(buf);
+        if (!(buf->flags & BUF_VALID)) {
+            buf->pins--;
+            buf = NULL;
+        }
+    }
+    spin_unlock_irqrestore(&bcache_lock, flags);
+    return buf;
+}
+
+void bcache_release(buffer_t* buf) {
+    u64 flags = spin_lock_irqsave(&bcache_lock);
+    buf->pins--;
+    spin_unlock_irqrestore(&bcache_lock, flags);
+}
+
+void bcache_mark_dirty(buffer_t* buf) {
+    u64 flags = spin_lock_irqsave(&bcache_lock);
+    if (!(buf->flags & BUF_DIRTY)) {
+        buf->dirty_tick = timer_get_ticks();
+        stats.dirty++;
+    }
+    buf->flags |= BUF_DIRTY | BUF_VALID;
+    spin_unlock_irqrestore(&bcache_lock, flags);
+}
+
+// Start writing dirty buffers that are idle and at least min_age ticks old
+static void bcache_writeback(u64 min_age) {
+    u64 now = timer_get_ticks();
+
+    for (blk_device_t* dev = blk_first(); dev; dev = dev->next) {
+        blk_plug(dev);
+    }
+    u64 flags = spin_lock_irqsave(&bcache_lock);
+    for (buffer_t* buf = lru_head; buf; buf = buf->lru_next) {
+        if ((buf->flags & (BUF_DIRTY | BUF_IO)) == BUF_DIRTY && now - buf->dirty_tick >= min_age) {
+            buf->flags &= ~BUF_DIRTY;
+            stats.dirty--;
+            stats.writebacks++;
+            bcache_start_io(buf, BLK_WRITE);
+        }
+    }
+    spin_unlock_irqrestore(&bcache_lock, flags);
+    for (blk_device_t* dev = blk_first(); dev; dev = dev->next) {
+        blk_unplug(dev);
+    }
+}
+
+void bcache_sync() {
+    bcache_writeback(0);
+
+    // The list may change while the lock is dropped, so rescan after each wait
+    u64 flags = spin_lock_irqsave(&bcache_lock);
+    buffer_t* buf = lru_head;
+    while (buf) {
+        if (buf->flags & BUF_IO) {
+            buf->pins++;
+            bcache_wait_io(buf);
+            buf->pins--;
+            buf = lru_head;
+        } else {
+            buf = buf->lru_next;
+        }
+    }
+    spin_unlock_irqrestore(&bcache_lock, flags);
+}
+
+// Periodic write-back on the async executor
+static int bcache_flush_poll(async_task_t* task) {
+    ASYNC_BEGIN(task);
+    while (1) {
+        AWAIT_SLEEP(task, BCACHE_FLUSH_MS);
+        if (stats.dirty) {
+            bcache_writeback((u64)BCACHE_DIRTY_AGE_MS * timer_get_frequency() / 1000);
+        }
+    }
+    ASYNC_END(task);
+}
+
+const bcache_stats_t* bcache_get_stats() {
+    return &stats;
+}
+
+void bcache_init() {
+    lock_stats_init(&bcache_lock_stats, "bcache");
+    spin_lock_init(&bcache_lock, &bcache_lock_stats);
+
+    // Buffers are only allocated as blocks are read, up to a share of memory
+    u64 total, free, used;
+    pmm_get_stats(&total, &free, &used);
+    stats.max_buffers = total / BCACHE_MAX_SHARE;
+    if (stats.max_buffers < BCACHE_MIN_BUFFERS) {
+        stats.max_buffers = BCACHE_MIN_BUFFERS;
+    }
+
+    async_spawn(&flush_task, "bflush", bcache_flush_poll, 0);
+}
@@ -0,0 +1,67 @@
+#ifndef BCACHE_H
+#define BCACHE_H
+
+#include "../include/types.h"
+#include "../drivers/block.h"
+#include "../memory/physical.h"
+
+// Cache blocks are one page, read straight into by DMA
+#define BCACHE_BLOCK_SIZE   PAGE_SIZE
+#define BCACHE_SECTORS      (BCACHE_BLOCK_SIZE / BLK_SECTOR_SIZE)
+
+// Buffer flags
+#define BUF_VALID       (1 << 0)    // Data matches (or is newer than) the disk
+#define BUF_DIRTY       (1 << 1)    // Modified, not yet written back
+#define BUF_IO          (1 << 2)    // A read or write is in flight
+#define BUF_ERROR       (1 << 3)    // The last read failed
+#define BUF_READAHEAD   (1 << 4)    // Read ahead and not asked for yet
+
+// One cached block. Pinned buffers (pins > 0) are never evicted; an
+// in-flight I/O holds a pin of its own.
+typedef struct buffer {
+    blk_device_t* dev;
+    u64 block;
+    u8* data;
+    volatile u32 flags;
+    u32 pins;
+    u64 dirty_tick;                 // When it was first dirtied
+    struct buffer* hash_next;
+    struct buffer* lru_prev;        // Most recently used at the head
+    struct buffer* lru_next;
+    blk_request_t req;
+} buffer_t;
+
+typedef struct {
+    u64 hits;
+    u64 misses;
+    u64 evictions;
+    u64 readahead;                  // Blocks read ahead
+    u64 readahead_hits;             // ...that were asked for later
+    u64 writebacks;
+    u64 errors;
+    u32 buffers;                    // Buffers allocated so far
+    u32 max_buffers;
+    u32 dirty;
+} bcache_stats_t;
+
+// Size the cache from free memory and start the write-back task
+void bcache_init();
+
+// Get a block, reading it (and maybe the blocks after it) if it isn't
+// cached. Returns it pinned, or NULL on a read error or when every buffer is
+// pinned.
+buffer_t* bcache_read(blk_device_t* dev, u64 block);
+
+// Drop the pin taken by bcache_read()
+void bcache_release(buffer_t* buf);
+
+// Note that a pinned buffer was modified; it is written back later
+void bcache_mark_dirty(buffer_t* buf);
+
+// Write every dirty buffer and wait for the writes
+void bcache_sync();
+
+// Get the cache counters
+const bcache_stats_t* bcache_get_stats();
+
+#endif
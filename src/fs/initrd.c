@@ -0,0 +1,140 @@
+#include "initrd.h"
+#include "../kernel/bootinfo.h"
+
+static const u8* image = NULL;
+static const initrd_header_t* header = NULL;
+static const initrd_entry_t* entries = NULL;
+static const char* names = NULL;
+
+// Check every offset once, so lookups can trust the image
+static bool initrd_valid(const u8* base, u64 length) {
+    const initrd_header_t* hdr = (const initrd_header_t*)base;
+    if (length < sizeof(initrd_header_t) || hdr->magic != INITRD_MAGIC ||
+        hdr->size > length || hdr->count == 0) {
+        return false;
+    }
+
+    u64 table_end = sizeof(initrd_header_t) + (u64)hdr->count * sizeof(initrd_entry_t);
+    if (table_end > hdr->names_offset || (u64)hdr->names_offset + hdr->names_size > hdr->size ||
+        hdr->names_size == 0 || base[hdr->names_offset + hdr->names_size - 1] != '\0') {
+        return false;
+    }
+
+    const initrd_entry_t* table = (const initrd_entry_t*)(base + sizeof(initrd_header_t));
+    if (table[0].type != INITRD_DIR) {
+        return false;
+    }
+    for (u32 i = 0; i < hdr->count; i++) {
+        const initrd_entry_t* entry = &table[i];
+        if (entry->name >= hdr->names_size) {
+            return false;
+        }
+        if (entry->type == INITRD_FILE) {
+            if (entry->offset % INITRD_ALIGN || entry->offset > hdr->size ||
+                entry->size > hdr->size - entry->offset) {
+                return false;
+            }
+        } else if (entry->type == INITRD_DIR) {
+            // Children come after their directory, which rules out cycles
+            if (entry->offset <= i || entry->offset > hdr->count ||
+                entry->size > hdr->count - entry->offset) {
+                return false;
+            }
+        } else {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool initrd_init() {
+    const boot_info_t* info = bootinfo_get();
+
+    // Take the first module that looks like an initrd, whatever its name
+    for (u32 i = 0; i < info->module_count; i++) {
+        const boot_module_t* module = &info->modules[i];
+        const u8* base = (const u8*)module->start;
+        if (module->end > module->start && initrd_valid(base, module->end - module->start)) {
+            image = base;
+            header = (const initrd_header_t*)base;
+            entries = (const initrd_entry_t*)(base + sizeof(initrd_header_t));
+            names = (const char*)(base + header->names_offset);
+            return true;
+        }
+    }
+    return false;
+}
+
+u32 initrd_count() {
+    return header ? header->count : 0;
+}
+
+const initrd_entry_t* initrd_entry(u32 index) {
+    return index < initrd_count() ? &entries[index] : NULL;
+}
+
+const char* initrd_name(const initrd_entry_t* entry) {
+    return names + entry->name;
+}
+
+const u8* initrd_data(const initrd_entry_t* entry) {
+    return image + entry->offset;
+}
+
+// Compare a path component with a NUL-terminated name
+static int initrd_compare(const char* component, u32 length, const char* name) {
+    for (u32 i = 0; i < length; i++) {
+        if (name[i] == '\0') {
+            return 1;
+        }
+        if (component[i] != name[i]) {
+            return (u8)component[i] < (u8)name[i] ? -1 : 1;
+        }
+    }
+    return name[length] == '\0' ? 0 : -1;
+}
+
+// Binary search a directory's children for one component
+static const initrd_entry_t* initrd_find_child(const initrd_entry_t* dir, const char* component, u32 length) {
+    u64 low = dir->offset;
+    u64 high = dir->offset + dir->size;
+    while (low < high) {
+        u64 middle = low + (high - low) / 2;
+        int order = initrd_compare(component, length, initrd_name(&entries[middle]));
+        if (order == 0) {
+            return &entries[middle];
+        }
+        if (order < 0) {
+            high = middle;
+        } else {
+            low = middle + 1;
+        }
+    }
+    return NULL;
+}
+
+const initrd_entry_t* initrd_lookup(const char* path) {
+    if (!header) {
+        return NULL;
+    }
+
+    const initrd_entry_t* entry = &entries[0];
+    while (*path) {
+        while (*path == '/') path++;
+        if (*path == '\0') {
+            break;
+        }
+        if (entry->type != INITRD_DIR) {
+            return NULL;
+        }
+
+        u32 length = 0;
+        while (path[length] && path[length] != '/') length++;
+        entry = initrd_find_child(entry, path, length);
+        if (!entry) {
+            return NULL;
+        }
+        path += length;
+    }
+    return entry;
+}
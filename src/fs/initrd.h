@@ -0,0 +1,56 @@
+#ifndef INITRD_H
+#define INITRD_H
+
+#include "../include/types.h"
+
+// Initial RAM disk image, loaded by the bootloader as a Multiboot module and
+// used in place: file data is never copied. Built by tools/mkinitrd.c (keep
+// the layout in sync).
+//
+//   header | entries[count] | names | file data
+//
+// Entry 0 is the root directory. The children of every directory are
+// contiguous and sorted by name, so each path component is found with a
+// binary search. File data starts on a page boundary.
+#define INITRD_MAGIC        0x31445249  // "IRD1"
+#define INITRD_ALIGN        4096
+
+// Entry types
+#define INITRD_FILE         1
+#define INITRD_DIR          2
+
+typedef struct {
+    u32 magic;
+    u32 count;                      // Entries, including the root
+    u32 names_offset;               // NUL-terminated names
+    u32 names_size;
+    u64 size;                       // Whole image
+} __attribute__((packed)) initrd_header_t;
+
+typedef struct {
+    u32 name;                       // Offset into the names
+    u32 type;
+    u64 offset;                     // File: data offset. Dir: first child index.
+    u64 size;                       // File: bytes. Dir: number of children.
+} __attribute__((packed)) initrd_entry_t;
+
+// Find the initrd among the boot modules and check it. Returns false if
+// there is none.
+bool initrd_init();
+
+// Number of entries, 0 without an initrd
+u32 initrd_count();
+
+// Get an entry by index (0 is the root)
+const initrd_entry_t* initrd_entry(u32 index);
+
+// Look up an absolute or root-relative path ("/" and "" are the root)
+const initrd_entry_t* initrd_lookup(const char* path);
+
+// Get an entry's name (NUL-terminated, inside the image)
+const char* initrd_name(const initrd_entry_t* entry);
+
+// Get a file's data (inside the image, page aligned)
+const u8* initrd_data(const initrd_entry_t* entry);
+
+#endif
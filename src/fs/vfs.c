@@ -0,0 +1,123 @@
+#include "vfs.h"
+#include "initrd.h"
+#include "../kernel/sync.h"
+
+typedef struct {
+    const initrd_entry_t* entry;    // NULL when the slot is free
+    u64 position;                   // Byte offset, or next child for a directory
+} vfs_file_t;
+
+static vfs_file_t files[VFS_MAX_OPEN];
+static spinlock_t vfs_lock;
+static lock_stats_t vfs_lock_stats;
+
+bool vfs_init() {
+    lock_stats_init(&vfs_lock_stats, "vfs");
+    spin_lock_init(&vfs_lock, &vfs_lock_stats);
+    return initrd_init();
+}
+
+// Get an open file (lock held)
+static vfs_file_t* vfs_get(int fd) {
+    if (fd < 0 || fd >= VFS_MAX_OPEN || !files[fd].entry) {
+        return NULL;
+    }
+    return &files[fd];
+}
+
+int vfs_open(const char* path) {
+    const initrd_entry_t* entry = initrd_lookup(path);
+    if (!entry) {
+        return VFS_ENOENT;
+    }
+
+    u64 flags = spin_lock_irqsave(&vfs_lock);
+    int fd = VFS_EMFILE;
+    for (int i = 0; i < VFS_MAX_OPEN; i++) {
+        if (!files[i].entry) {
+            files[i].entry = entry;
+            files[i].position = 0;
+            fd = i;
+            break;
+        }
+    }
+    spin_unlock_irqrestore(&vfs_lock, flags);
+    return fd;
+}
+
+int vfs_close(int fd) {
+    u64 flags = spin_lock_irqsave(&vfs_lock);
+    vfs_file_t* file = vfs_get(fd);
+    if (file) {
+        file->entry = NULL;
+    }
+    spin_unlock_irqrestore(&vfs_lock, flags);
+    return file ? 0 : VFS_EBADF;
+}
+
+s64 vfs_read(int fd, const void** data, u64 size) {
+    u64 flags = spin_lock_irqsave(&vfs_lock);
+    vfs_file_t* file = vfs_get(fd);
+    s64 result;
+    if (!file) {
+        result = VFS_EBADF;
+    } else if (file->entry->type != INITRD_FILE) {
+        result = VFS_EISDIR;
+    } else {
+        u64 left = file->entry->size - file->position;
+        if (size > left) {
+            size = left;
+        }
+        *data = initrd_data(file->entry) + file->position;
+        file->position += size;
+        result = (s64)size;
+    }
+    spin_unlock_irqrestore(&vfs_lock, flags);
+    return result;
+}
+
+int vfs_stat(const char* path, vfs_stat_t* stat) {
+    const initrd_entry_t* entry = initrd_lookup(path);
+    if (!entry) {
+        return VFS_ENOENT;
+    }
+    stat->type = entry->type == INITRD_DIR ? VFS_DIR : VFS_FILE;
+    stat->size = entry->size;
+    return 0;
+}
+
+int vfs_readdir(int fd, vfs_dirent_t* dirent) {
+    u64 flags = spin_lock_irqsave(&vfs_lock);
+    vfs_file_t* file = vfs_get(fd);
+    int result;
+    if (!file) {
+        result = VFS_EBADF;
+    } else if (file->entry->type != INITRD_DIR) {
+        result = VFS_ENOTDIR;
+    } else if (file->position >= file->entry->size) {
+        result = 0;
+    } else {
+        const initrd_entry_t* child = initrd_entry(file->entry->offset + file->position++);
+        dirent->name = initrd_name(child);
+        dirent->type = child->type == INITRD_DIR ? VFS_DIR : VFS_FILE;
+        dirent->size = child->size;
+        result = 1;
+    }
+    spin_unlock_irqrestore(&vfs_lock, flags);
+    return result;
+}
+
+const void* vfs_mmap(int fd, u64 offset, u64 length) {
+    u64 flags = spin_lock_irqsave(&vfs_lock);
+    vfs_file_t* file = vfs_get(fd);
+    const void* result = NULL;
+
+    // File data is page aligned in the image and identity mapped, so the
+    // mapping is the image itself
+    if (file && file->entry->type == INITRD_FILE && offset % INITRD_ALIGN == 0 &&
+        offset <= file->entry->size && length <= file->entry->size - offset) {
+        result = initrd_data(file->entry) + offset;
+    }
+    spin_unlock_irqrestore(&vfs_lock, flags);
+    return result;
+}
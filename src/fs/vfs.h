@@ -0,0 +1,58 @@
+#ifndef VFS_H
+#define VFS_H
+
+#include "../include/types.h"
+
+// A small read-only VFS over the initrd. Nothing is copied: read() and
+// mmap() hand out pointers into the image, which stays mapped for good.
+#define VFS_MAX_OPEN        32
+
+// Results (file descriptors are >= 0)
+#define VFS_ENOENT          -1      // No such file or directory
+#define VFS_EBADF           -2      // Not an open descriptor
+#define VFS_EMFILE          -3      // Too many open files
+#define VFS_EISDIR          -4
+#define VFS_ENOTDIR         -5
+#define VFS_EINVAL          -6
+
+// File types
+#define VFS_FILE            1
+#define VFS_DIR             2
+
+typedef struct {
+    u32 type;
+    u64 size;                       // Bytes, or entries for a directory
+} vfs_stat_t;
+
+typedef struct {
+    const char* name;               // Points into the image
+    u32 type;
+    u64 size;
+} vfs_dirent_t;
+
+// Mount the initrd if the loader provided one. Returns false if there is none.
+bool vfs_init();
+
+// Open a file or directory
+int vfs_open(const char* path);
+
+// Close a descriptor
+int vfs_close(int fd);
+
+// Read up to size bytes from the current position without copying them:
+// *data is pointed at the bytes and the position moves past them. Returns
+// the number of bytes (0 at the end) or an error.
+s64 vfs_read(int fd, const void** data, u64 size);
+
+// Get the type and size of a path
+int vfs_stat(const char* path, vfs_stat_t* stat);
+
+// Get the next entry of an open directory. Returns 1 for an entry, 0 at
+// the end, or an error.
+int vfs_readdir(int fd, vfs_dirent_t* entry);
+
+// Map length bytes of a file from offset, which must be page aligned.
+// Returns a read-only pointer into the image, or NULL if out of range.
+const void* vfs_mmap(int fd, u64 offset, u64 length);
+
+#endif
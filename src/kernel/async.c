@@ -0,0 +1,182 @@
+#include "../include/types.h"
+#include "async.h"
+#include "low_level.h"
+#include "thread.h"
+#include "../drivers/timer.h"
+
+// The executor runs in one kernel thread on the bootstrap processor. Its
+// lists are shared with interrupt handlers there, so they are only touched
+// with interrupts disabled.
+static async_task_t* ready_head = NULL;
+static async_task_t* ready_tail = NULL;
+static async_task_t* sleepers = NULL;       // Sorted by wake_tick
+static async_task_t* all_tasks = NULL;
+static wait_queue_t executor_waiters = { NULL };
+
+// Append a task to the ready list (interrupts disabled)
+static void ready_push(async_task_t* task) {
+    task->state = ASYNC_READY;
+    task->next = NULL;
+    if (ready_tail) {
+        ready_tail->next = task;
+    } else {
+        ready_head = task;
+    }
+    ready_tail = task;
+}
+
+// Take the first ready task (interrupts disabled)
+static async_task_t* ready_pop() {
+    async_task_t* task = ready_head;
+    if (task) {
+        ready_head = task->next;
+        if (!ready_head) {
+            ready_tail = NULL;
+        }
+        task->next = NULL;
+    }
+    return task;
+}
+
+// Move sleepers whose time has come to the ready list (interrupts disabled)
+static void wake_sleepers() {
+    u64 now = timer_get_ticks();
+    while (sleepers && sleepers->wake_tick <= now) {
+        async_task_t* task = sleepers;
+        sleepers = task->next;
+        ready_push(task);
+    }
+}
+
+// Reset the executor
+void async_init() {
+    ready_head = NULL;
+    ready_tail = NULL;
+    sleepers = NULL;
+    all_tasks = NULL;
+    executor_waiters.head = NULL;
+}
+
+// Prepare a task and make it ready
+void async_spawn(async_task_t* task, const char* name, int (*poll)(async_task_t*), u64 arg) {
+    task->name = name;
+    task->poll = poll;
+    task->arg = arg;
+    task->resume = 0;
+    task->event_seq = 0;
+    task->polls = 0;
+    task->cycles = 0;
+
+    u64 flags = cpu_irq_save();
+    // A finished task may be spawned again; list it only once
+    async_task_t* known = all_tasks;
+    while (known && known != task) {
+        known = known->all_next;
+    }
+    if (!known) {
+        task->all_next = all_tasks;
+        all_tasks = task;
+    }
+    ready_push(task);
+    cpu_irq_restore(flags);
+
+    kthread_wake_all(&executor_waiters);
+}
+
+// Prepare an event
+void async_event_init(async_event_t* event) {
+    event->seq = 0;
+    event->waiters = NULL;
+}
+
+// Wake every task waiting on an event
+void async_signal(async_event_t* event) {
+    u64 flags = cpu_irq_save();
+    event->seq++;
+
+    async_task_t* task = event->waiters;
+    event->waiters = NULL;
+    bool woke = task != NULL;
+    while (task) {
+        async_task_t* next = task->next;
+        ready_push(task);
+        task = next;
+    }
+    cpu_irq_restore(flags);
+
+    if (woke) {
+        kthread_wake_all(&executor_waiters);
+    }
+}
+
+// Park a task on an event
+void async_block(async_task_t* task, async_event_t* event) {
+    u64 flags = cpu_irq_save();
+    // A signal between the condition check and now would be lost - stay
+    // ready and check again instead
+    if (event->seq == task->event_seq) {
+        task->state = ASYNC_BLOCKED;
+        task->next = event->waiters;
+        event->waiters = task;
+    }
+    cpu_irq_restore(flags);
+}
+
+// Put a task to sleep
+void async_sleep(async_task_t* task, u32 ms) {
+    u64 ticks = ((u64)ms * timer_get_frequency() + 999) / 1000;
+
+    u64 flags = cpu_irq_save();
+    task->state = ASYNC_SLEEPING;
+    task->wake_tick = timer_get_ticks() + (ticks ? ticks : 1);
+
+    async_task_t** link = &sleepers;
+    while (*link && (*link)->wake_tick <= task->wake_tick) {
+        link = &(*link)->next;
+    }
+    task->next = *link;
+    *link = task;
+    cpu_irq_restore(flags);
+}
+
+// Timer tick hook: wake the executor when a sleeping task is due
+void async_tick() {
+    if (sleepers && sleepers->wake_tick <= timer_get_ticks()) {
+        kthread_wake_all(&executor_waiters);
+    }
+}
+
+// Run tasks forever, blocking the calling thread while none are ready
+void async_loop() {
+    while (1) {
+        u64 flags = cpu_irq_save();
+        wake_sleepers();
+        async_task_t* task = ready_pop();
+        if (!task) {
+            // Nothing to do until an interrupt signals an event
+            kthread_wait(&executor_waiters);
+            cpu_irq_restore(flags);
+            continue;
+        }
+        task->state = ASYNC_RUNNING;
+        cpu_irq_restore(flags);
+
+        u64 start = cpu_read_tsc();
+        int result = task->poll(task);
+        task->cycles += cpu_read_tsc() - start;
+        task->polls++;
+
+        flags = cpu_irq_save();
+        if (result == ASYNC_DONE) {
+            task->state = ASYNC_FINISHED;
+        } else if (task->state == ASYNC_RUNNING) {
+            ready_push(task);  // Yielded, or an event fired before it could block
+        }
+        cpu_irq_restore(flags);
+    }
+}
+
+// Iterate over every task spawned
+async_task_t* async_first() {
+    return all_tasks;
+}
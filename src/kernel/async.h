@@ -0,0 +1,114 @@
+#ifndef ASYNC_H
+#define ASYNC_H
+
+#include "../include/types.h"
+
+// Cooperative executor for stackless tasks. A task is a function that is
+// polled repeatedly; the ASYNC_* macros turn its body into a state machine
+// that resumes after the last await. Locals do not survive an await - keep
+// state in the task (arg) or in statics.
+//
+//     static int blink(async_task_t* task) {
+//         ASYNC_BEGIN(task);
+//         while (1) {
+//             AWAIT_EVENT(task, &some_event, something_ready());
+//             ...
+//             AWAIT_SLEEP(task, 100);
+//         }
+//         ASYNC_END(task);
+//     }
+
+// Poll results
+#define ASYNC_WAITING 0
+#define ASYNC_DONE    1
+
+// Task states
+#define ASYNC_READY    0   // On the ready list
+#define ASYNC_RUNNING  1   // Being polled
+#define ASYNC_BLOCKED  2   // Waiting on an event
+#define ASYNC_SLEEPING 3
+#define ASYNC_FINISHED 4
+
+typedef struct async_task {
+    const char* name;
+    int (*poll)(struct async_task* task);
+    u64 arg;
+    u32 resume;                     // Where to continue (source line of the last await)
+    volatile u8 state;
+    u32 event_seq;                  // Event sequence seen before the last condition check
+    u64 wake_tick;                  // When a sleeping task becomes ready
+    u64 polls;                      // Times polled
+    u64 cycles;                     // TSC cycles spent in poll
+    struct async_task* next;        // Ready, wait or sleep list link
+    struct async_task* all_next;    // List of every task ever spawned
+} async_task_t;
+
+// Something tasks can wait for
+typedef struct {
+    volatile u32 seq;               // Bumped by every signal
+    async_task_t* waiters;
+} async_event_t;
+
+#define ASYNC_BEGIN(task)  switch ((task)->resume) { case 0:
+
+#define ASYNC_END(task)    } (task)->resume = 0; return ASYNC_DONE
+
+// Let the other ready tasks run, then continue here
+#define ASYNC_YIELD(task)                                                   \
+    do {                                                                    \
+        (task)->resume = __LINE__;                                          \
+        return ASYNC_WAITING;                                               \
+        case __LINE__:;                                                     \
+    } while (0)
+
+// Wait until cond is true, re-checking it whenever event is signalled
+#define AWAIT_EVENT(task, event, cond)                                      \
+    do {                                                                    \
+        (task)->resume = __LINE__;                                          \
+        case __LINE__:                                                      \
+        (task)->event_seq = (event)->seq;                                   \
+        if (!(cond)) {                                                      \
+            async_block((task), (event));                                   \
+            return ASYNC_WAITING;                                           \
+        }                                                                   \
+    } while (0)
+
+// Wait for at least the given number of milliseconds
+#define AWAIT_SLEEP(task, ms)                                               \
+    do {                                                                    \
+        async_sleep((task), (ms));                                          \
+        (task)->resume = __LINE__;                                          \
+        return ASYNC_WAITING;                                               \
+        case __LINE__:;                                                     \
+    } while (0)
+
+// Reset the executor
+void async_init();
+
+// Prepare a task and make it ready
+void async_spawn(async_task_t* task, const char* name, int (*poll)(async_task_t*), u64 arg);
+
+// Prepare an event
+void async_event_init(async_event_t* event);
+
+// Wake every task waiting on an event (safe from interrupt handlers on the
+// bootstrap processor, where the executor runs)
+void async_signal(async_event_t* event);
+
+// Park a task on an event - used by AWAIT_EVENT. If the event fired since the
+// task checked its condition, the task stays ready instead.
+void async_block(async_task_t* task, async_event_t* event);
+
+// Put a task to sleep - used by AWAIT_SLEEP
+void async_sleep(async_task_t* task, u32 ms);
+
+// Timer tick hook: wake the executor when a sleeping task is due
+void async_tick();
+
+// Run tasks forever, blocking the calling thread while none are ready
+void async_loop();
+
+// Iterate over every task spawned
+async_task_t* async_first();
+
+#endif
@@ -0,0 +1,340 @@
+#include "bench.h"
+#include "low_level.h"
+#include "process.h"
+#include "thread.h"
+#include "util.h"
+#include "../cpu/apic.h"
+#include "../cpu/interrupts.h"
+#include "../cpu/smp.h"
+#include "../drivers/screen64.h"
+#include "../drivers/serial.h"
+#include "../drivers/timer.h"
+#include "../memory/physical.h"
+#include "../memory/virtual.h"
+#include "../memory/kmalloc.h"
+
+// Operations per sample for the cheap paths, so the timer overhead is
+// spread out
+#define BENCH_BATCH         16
+
+// Pages are mapped in a PML4 slot of their own (512 GB), away from the
+// identity map
+#define BENCH_VMM_BASE      0x8000000000ull
+
+#define BENCH_COPY_MAX      65536
+
+// Samples the syscall benchmark's program takes per run, within its data
+// page
+#define BENCH_SYSCALL_CHUNK 256
+
+typedef struct {
+    const char* name;
+    void (*run)(u32 count, u64 arg);    // Take count samples
+    u64 arg;
+    u32 batch;
+} bench_t;
+
+static u64 samples[BENCH_SAMPLES];
+static u32 sample_count;
+static bool recording;
+
+static u8* copy_source = NULL;
+static u8* copy_dest = NULL;
+static u64 map_page = 0;
+static u8 irq_vector = 0;
+static volatile bool irq_seen;
+static process_t syscall_process;
+
+// TSC read that neither earlier nor later instructions move across
+static inline u64 bench_tsc() {
+    u32 low, high;
+    __asm__ __volatile__("lfence; rdtsc; lfence" : "=a"(low), "=d"(high) : : "memory");
+    return ((u64)high << 32) | low;
+}
+
+static void bench_record(u64 cycles) {
+    if (recording && sample_count < BENCH_SAMPLES) {
+        samples[sample_count++] = cycles;
+    }
+}
+
+// Time allocating a batch of pages, or freeing them again
+static void bench_pmm(u32 count, u64 time_free) {
+    u64 pages[BENCH_BATCH];
+    for (u32 s = 0; s < count; s++) {
+        u64 start = bench_tsc();
+        for (u32 i = 0; i < BENCH_BATCH; i++) {
+            pages[i] = pmm_alloc_page();
+        }
+        u64 middle = bench_tsc();
+        for (u32 i = 0; i < BENCH_BATCH; i++) {
+            if (pages[i]) {
+                pmm_free_page(pages[i]);
+            }
+        }
+        u64 end = bench_tsc();
+        bench_record(time_free ? end - middle : middle - start);
+    }
+}
+
+// kmalloc never frees, so every run of this leaks what it allocates
+static void bench_kmalloc(u32 count, u64 size) {
+    for (u32 s = 0; s < count; s++) {
+        u64 start = bench_tsc();
+        for (u32 i = 0; i < BENCH_BATCH; i++) {
+            void* volatile sink = kmalloc(size);
+            (void)sink;
+        }
+        bench_record(bench_tsc() - start);
+    }
+}
+
+// Time mapping one page at a batch of addresses, or unmapping them
+static void bench_vmm(u32 count, u64 time_unmap) {
+    for (u32 s = 0; s < count; s++) {
+        u64 start = bench_tsc();
+        for (u32 i = 0; i < BENCH_BATCH; i++) {
+            vmm_map_page(BENCH_VMM_BASE + i * PAGE_SIZE, map_page, PAGE_WRITABLE);
+        }
+        u64 middle = bench_tsc();
+        for (u32 i = 0; i < BENCH_BATCH; i++) {
+            vmm_unmap_page(BENCH_VMM_BASE + i * PAGE_SIZE);
+        }
+        u64 end = bench_tsc();
+        bench_record(time_unmap ? end - middle : middle - start);
+    }
+}
+
+static void bench_copy(u32 count, u64 size) {
+    for (u32 s = 0; s < count; s++) {
+        u64 start = bench_tsc();
+        memory_copy((char*)copy_source, (char*)copy_dest, (int)size);
+        bench_record(bench_tsc() - start);
+    }
+}
+
+static void bench_set(u32 count, u64 size) {
+    for (u32 s = 0; s < count; s++) {
+        u64 start = bench_tsc();
+        memory_set((char*)copy_dest, (char)s, (int)size);
+        bench_record(bench_tsc() - start);
+    }
+}
+
+// Print 64 characters on the top line, or a line on the bottom row so the
+// screen scrolls every time
+static void bench_screen(u32 count, u64 scroll) {
+    static const char line[] = "0123456789abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ+-";
+    static const char line_newline[] = "0123456789abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ+\n";
+    for (u32 s = 0; s < count; s++) {
+        screen_set_cursor(0, scroll ? VGA_HEIGHT - 1 : 0);
+        u64 start = bench_tsc();
+        screen_print(scroll ? line_newline : line);
+        bench_record(bench_tsc() - start);
+    }
+}
+
+static void bench_irq_handler(registers_t* regs) {
+    irq_seen = true;
+}
+
+// Send an interrupt to this CPU and wait for its handler to run
+static void bench_irq(u32 count, u64 arg) {
+    u32 apic_id = lapic_get_id();
+    for (u32 s = 0; s < count; s++) {
+        irq_seen = false;
+        u64 start = bench_tsc();
+        lapic_send_ipi(apic_id, irq_vector);
+        while (!irq_seen) {
+            __asm__ __volatile__("pause");
+        }
+        bench_record(bench_tsc() - start);
+    }
+}
+
+// Round trips of SYSCALL/SYSRET to a system call that does nothing, timed
+// in user mode by the sysbench program in runs of up to a data page of
+// samples
+static void bench_syscall(u32 count, u64 arg) {
+    u64* block = (u64*)syscall_process.data_page;
+    while (count > 0) {
+        u32 chunk = count < BENCH_SYSCALL_CHUNK ? count : BENCH_SYSCALL_CHUNK;
+        block[0] = chunk;
+        block[1] = BENCH_BATCH;
+        if (process_run(&syscall_process, USER_DATA_BASE) != 0) {
+            return;
+        }
+        for (u32 i = 0; i < chunk; i++) {
+            bench_record(block[2 + i]);
+        }
+        count -= chunk;
+    }
+}
+
+static const bench_t benchmarks[] = {
+    { "pmm_alloc_page",         bench_pmm,      0,      BENCH_BATCH },
+    { "pmm_free_page",          bench_pmm,      1,      BENCH_BATCH },
+    { "kmalloc_16",             bench_kmalloc,  16,     BENCH_BATCH },
+    { "vmm_map_page",           bench_vmm,      0,      BENCH_BATCH },
+    { "vmm_unmap_page",         bench_vmm,      1,      BENCH_BATCH },
+    { "memory_copy_64",         bench_copy,     64,     1 },
+    { "memory_copy_4096",       bench_copy,     4096,   1 },
+    { "memory_copy_65536",      bench_copy,     65536,  1 },
+    { "memory_set_64",          bench_set,      64,     1 },
+    { "memory_set_4096",        bench_set,      4096,   1 },
+    { "memory_set_65536",       bench_set,      65536,  1 },
+    { "screen_print_64",        bench_screen,   0,      1 },
+    { "screen_print_64_scroll", bench_screen,   1,      1 },
+    { "irq_roundtrip",          bench_irq,      0,      1 },
+    { "syscall_null",           bench_syscall,  0,      BENCH_BATCH },
+};
+
+// Set up what the benchmarks need; false if one can't run here
+static bool bench_prepare(const bench_t* bench) {
+    if (bench->run == bench_copy || bench->run == bench_set) {
+        if (!copy_source) {
+            copy_source = (u8*)kmalloc(BENCH_COPY_MAX);
+            copy_dest = (u8*)kmalloc(BENCH_COPY_MAX);
+        }
+        return copy_source && copy_dest;
+    } else if (bench->run == bench_vmm) {
+        if (!map_page) {
+            map_page = pmm_alloc_page();
+        }
+        return map_page != 0;
+    } else if (bench->run == bench_irq) {
+        // Needs a local APIC, a free vector and interrupts enabled
+        u64 flags = cpu_irq_save();
+        cpu_irq_restore(flags);
+        if (!(flags & (1 << 9))) {
+            return false;
+        }
+        if (!irq_vector) {
+            irq_vector = irq_alloc_msi_vector();
+            if (irq_vector) {
+                register_interrupt_handler(irq_vector, bench_irq_handler);
+            }
+        }
+        return irq_vector != 0;
+    } else if (bench->run == bench_syscall) {
+        // Processes run on a kernel thread
+        if (!kthread_current()) {
+            return false;
+        }
+        if (!syscall_process.space) {
+            process_create(&syscall_process, process_find_program("sysbench"));
+        }
+        return syscall_process.space != NULL;
+    }
+    return true;
+}
+
+// Shell sort - the samples are sorted once per benchmark
+static void bench_sort(u64* values, u32 count) {
+    for (u32 gap = count / 2; gap > 0; gap /= 2) {
+        for (u32 i = gap; i < count; i++) {
+            u64 value = values[i];
+            u32 j = i;
+            for (; j >= gap && values[j - gap] > value; j -= gap) {
+                values[j] = values[j - gap];
+            }
+            values[j] = value;
+        }
+    }
+}
+
+static bool bench_matches(const char* name, const char* filter) {
+    if (filter[0] == '\0' || (filter[0] == 'a' && filter[1] == 'l' && filter[2] == 'l' && filter[3] == '\0')) {
+        return true;
+    }
+    while (*filter && *filter == *name) {
+        filter++;
+        name++;
+    }
+    return *filter == '\0';
+}
+
+static void bench_serial_field(const char* key, u64 value) {
+    serial_write(",\"");
+    serial_write(key);
+    serial_write("\":");
+    serial_write_number(value);
+}
+
+u32 bench_run(const char* filter, void (*report)(const bench_result_t*)) {
+    u32 count = 0;
+    bool screen_used = false;
+
+    for (u32 b = 0; b < sizeof(benchmarks) / sizeof(benchmarks[0]); b++) {
+        const bench_t* bench = &benchmarks[b];
+        if (!bench_matches(bench->name, filter) || !bench_prepare(bench)) {
+            continue;
+        }
+        screen_used |= bench->run == bench_screen;
+
+        recording = false;
+        bench->run(BENCH_WARMUP, bench->arg);
+        recording = true;
+        sample_count = 0;
+        bench->run(BENCH_SAMPLES, bench->arg);
+        recording = false;
+
+        // A run can fail part way (a process that won't start) and leave
+        // nothing to take statistics of: note it on the serial port only
+        if (sample_count == 0) {
+            serial_write("{\"bench\":\"");
+            serial_write(bench->name);
+            serial_write("\"");
+            bench_serial_field("samples", 0);
+            serial_write("}\n");
+            continue;
+        }
+        bench_sort(samples, sample_count);
+
+        bench_result_t result;
+        result.name = bench->name;
+        result.batch = bench->batch;
+        result.samples = sample_count;
+        result.min = samples[0] / bench->batch;
+        result.median = samples[sample_count / 2] / bench->batch;
+        result.p99 = samples[sample_count * 99 / 100] / bench->batch;
+        result.max = samples[sample_count - 1] / bench->batch;
+        count++;
+
+        serial_write("{\"bench\":\"");
+        serial_write(result.name);
+        serial_write("\"");
+        bench_serial_field("batch", result.batch);
+        bench_serial_field("samples", result.samples);
+        bench_serial_field("min", result.min);
+        bench_serial_field("median", result.median);
+        bench_serial_field("p99", result.p99);
+        bench_serial_field("max", result.max);
+        serial_write("}\n");
+
+        if (report) {
+            report(&result);
+        }
+    }
+
+    // The screen benchmarks scribbled over the display
+    if (screen_used) {
+        screen_clear();
+    }
+    return count;
+}
+
+void bench_boot(const char* filter) {
+    serial_write("{\"suite\":\"begin\"");
+    bench_serial_field("tsc_hz", timer_get_tsc_hz());
+    bench_serial_field("cpus", smp_online_count());
+    serial_write("}\n");
+
+    u32 count = bench_run(filter, NULL);
+
+    serial_write("{\"suite\":\"end\"");
+    bench_serial_field("benchmarks", count);
+    serial_write("}\n");
+
+    port_long_out(BENCH_EXIT_PORT, BENCH_EXIT_SUCCESS);
+}
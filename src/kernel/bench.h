@@ -0,0 +1,36 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+#include "../include/types.h"
+
+// Microbenchmarks of kernel hot paths. Each one is warmed up, then timed
+// over BENCH_SAMPLES samples of a batch of operations, and reported as
+// cycles per operation.
+#define BENCH_WARMUP        64
+#define BENCH_SAMPLES       1024
+
+// Value written to QEMU's isa-debug-exit device (iobase 0xf4) after an
+// unattended run; QEMU exits with status (value << 1) | 1 = 33
+#define BENCH_EXIT_PORT     0xF4
+#define BENCH_EXIT_SUCCESS  0x10
+
+typedef struct {
+    const char* name;
+    u32 batch;                      // Operations per sample
+    u32 samples;
+    u64 min;                        // Cycles per operation
+    u64 median;
+    u64 p99;
+    u64 max;
+} bench_result_t;
+
+// Run the benchmarks whose names start with filter ("" or "all" for every
+// one). Each result is written to the serial port as a JSON line and passed
+// to report, if given. Returns the number of benchmarks run.
+u32 bench_run(const char* filter, void (*report)(const bench_result_t*));
+
+// Unattended run for "bench=<filter>" on the command line: run, then exit
+// QEMU through isa-debug-exit. Returns only if there is no such device.
+void bench_boot(const char* filter);
+
+#endif
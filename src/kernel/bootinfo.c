@@ -0,0 +1,269 @@
+#include "../include/types.h"
+#include "bootinfo.h"
+
+// Multiboot (version 1) information, the fields used here
+#define MB1_INFO_MEMORY     (1 << 0)
+#define MB1_INFO_CMDLINE    (1 << 2)
+#define MB1_INFO_MODS       (1 << 3)
+#define MB1_INFO_MMAP       (1 << 6)
+#define MB1_INFO_LOADER     (1 << 9)
+
+typedef struct {
+    u32 flags;
+    u32 mem_lower;
+    u32 mem_upper;
+    u32 boot_device;
+    u32 cmdline;
+    u32 mods_count;
+    u32 mods_addr;
+    u32 syms[4];
+    u32 mmap_length;
+    u32 mmap_addr;
+    u32 drives_length;
+    u32 drives_addr;
+    u32 config_table;
+    u32 boot_loader_name;
+} __attribute__((packed)) mb1_info_t;
+
+typedef struct {
+    u32 size;                   // Of the rest of the entry
+    u64 base;
+    u64 length;
+    u32 type;
+} __attribute__((packed)) mb1_mmap_entry_t;
+
+typedef struct {
+    u32 start;
+    u32 end;
+    u32 string;
+    u32 reserved;
+} __attribute__((packed)) mb1_module_t;
+
+// Multiboot2 information: a list of 8-byte aligned tags
+#define MB2_TAG_END         0
+#define MB2_TAG_CMDLINE     1
+#define MB2_TAG_LOADER      2
+#define MB2_TAG_MODULE      3
+#define MB2_TAG_MMAP        6
+
+typedef struct {
+    u32 type;
+    u32 size;
+} __attribute__((packed)) mb2_tag_t;
+
+typedef struct {
+    mb2_tag_t tag;
+    u32 start;
+    u32 end;
+    char name[];
+} __attribute__((packed)) mb2_module_t;
+
+typedef struct {
+    mb2_tag_t tag;
+    u32 entry_size;
+    u32 entry_version;
+} __attribute__((packed)) mb2_mmap_t;
+
+typedef struct {
+    u64 base;
+    u64 length;
+    u32 type;
+    u32 reserved;
+} __attribute__((packed)) mb2_mmap_entry_t;
+
+static boot_info_t boot_info;
+
+// Copy a NUL-terminated string, truncating to size
+static void copy_string(char* dest, const char* src, u32 size) {
+    u32 i = 0;
+    if (src) {
+        for (; i + 1 < size && src[i]; i++) {
+            dest[i] = src[i];
+        }
+    }
+    dest[i] = '\0';
+}
+
+// Where a loader structure at addr can be read: conventional memory was
+// overwritten after kernel_entry_64.asm saved it
+static u64 boot_ptr(u64 addr) {
+    if (boot_info.loader != BOOT_LOADER_SECTOR && addr < BOOT_LOW_SAVE_SIZE) {
+        return BOOT_LOW_SAVE_ADDR + addr;
+    }
+    return addr;
+}
+
+static void add_mmap(u64 base, u64 length, u32 type) {
+    if (boot_info.mmap_count < BOOT_MMAP_MAX) {
+        boot_mmap_entry_t* entry = &boot_info.mmap[boot_info.mmap_count++];
+        entry->base = base;
+        entry->length = length;
+        entry->type = type;
+    }
+}
+
+static void add_module(u64 start, u64 end, const char* name) {
+    // A module in conventional memory now lives in the saved copy
+    if (start < end && end <= BOOT_LOW_SAVE_SIZE) {
+        start = boot_ptr(start);
+        end = boot_ptr(end - 1) + 1;
+    }
+    if (boot_info.module_count < BOOT_MODULES_MAX) {
+        boot_module_t* module = &boot_info.modules[boot_info.module_count++];
+        module->start = start;
+        module->end = end;
+        copy_string(module->name, name, BOOT_NAME_SIZE);
+    }
+}
+
+static void parse_multiboot1(const mb1_info_t* info) {
+    if (info->flags & MB1_INFO_CMDLINE) {
+        copy_string(boot_info.cmdline, (const char*)boot_ptr(info->cmdline), BOOT_CMDLINE_SIZE);
+    }
+    if (info->flags & MB1_INFO_LOADER) {
+        copy_string(boot_info.loader_name, (const char*)boot_ptr(info->boot_loader_name), BOOT_NAME_SIZE);
+    }
+
+    if (info->flags & MB1_INFO_MMAP) {
+        u64 addr = boot_ptr(info->mmap_addr);
+        u64 end = addr + info->mmap_length;
+        while (addr < end) {
+            const mb1_mmap_entry_t* entry = (const mb1_mmap_entry_t*)addr;
+            add_mmap(entry->base, entry->length, entry->type);
+            addr += entry->size + sizeof(entry->size);
+        }
+    } else if (info->flags & MB1_INFO_MEMORY) {
+        // Only the sizes of conventional and extended memory
+        add_mmap(0, (u64)info->mem_lower * 1024, BOOT_MMAP_AVAILABLE);
+        add_mmap(0x100000, (u64)info->mem_upper * 1024, BOOT_MMAP_AVAILABLE);
+    }
+
+    if (info->flags & MB1_INFO_MODS) {
+        const mb1_module_t* modules = (const mb1_module_t*)boot_ptr(info->mods_addr);
+        for (u32 i = 0; i < info->mods_count; i++) {
+            add_module(modules[i].start, modules[i].end, (const char*)boot_ptr(modules[i].string));
+        }
+    }
+}
+
+static void parse_multiboot2(u64 info) {
+    u32 total_size = *(const u32*)info;
+    u64 addr = info + 8;
+
+    while (addr + sizeof(mb2_tag_t) <= info + total_size) {
+        const mb2_tag_t* tag = (const mb2_tag_t*)addr;
+        if (tag->type == MB2_TAG_END) {
+            break;
+        }
+
+        if (tag->type == MB2_TAG_CMDLINE) {
+            copy_string(boot_info.cmdline, (const char*)(tag + 1), BOOT_CMDLINE_SIZE);
+        } else if (tag->type == MB2_TAG_LOADER) {
+            copy_string(boot_info.loader_name, (const char*)(tag + 1), BOOT_NAME_SIZE);
+        } else if (tag->type == MB2_TAG_MODULE) {
+            const mb2_module_t* module = (const mb2_module_t*)tag;
+            add_module(module->start, module->end, module->name);
+        } else if (tag->type == MB2_TAG_MMAP) {
+            const mb2_mmap_t* mmap = (const mb2_mmap_t*)tag;
+            for (u64 entry = addr + sizeof(mb2_mmap_t); entry + mmap->entry_size <= addr + tag->size;
+                 entry += mmap->entry_size) {
+                const mb2_mmap_entry_t* e = (const mb2_mmap_entry_t*)entry;
+                add_mmap(e->base, e->length, e->type);
+            }
+        }
+
+        addr += (tag->size + 7) & ~7ULL;
+    }
+}
+
+// Copy what the loader handed over into kernel memory
+void bootinfo_init() {
+    u32 magic = *(volatile u32*)BOOT_MB_MAGIC_ADDR;
+    u64 info = *(volatile u64*)BOOT_MB_INFO_ADDR;
+    boot_info.loader = BOOT_LOADER_SECTOR;
+
+    if (magic == MULTIBOOT1_LOADER_MAGIC) {
+        boot_info.loader = BOOT_LOADER_MULTIBOOT1;
+        parse_multiboot1((const mb1_info_t*)boot_ptr(info));
+    } else if (magic == MULTIBOOT2_LOADER_MAGIC) {
+        boot_info.loader = BOOT_LOADER_MULTIBOOT2;
+        parse_multiboot2(boot_ptr(info));
+    } else {
+        copy_string(boot_info.loader_name, "boot sector", BOOT_NAME_SIZE);
+    }
+}
+
+// Get the boot information
+const boot_info_t* bootinfo_get() {
+    return &boot_info;
+}
+
+// Look up "key=value" on the command line
+bool bootinfo_get_param(const char* key, char* value, u32 size) {
+    const char* p = boot_info.cmdline;
+
+    while (*p) {
+        // Compare the key at the start of this word
+        const char* k = key;
+        const char* q = p;
+        while (*k && *q == *k) {
+            k++;
+            q++;
+        }
+        if (*k == '\0' && *q == '=') {
+            q++;
+            u32 i = 0;
+            while (*q && *q != ' ' && i + 1 < size) {
+                value[i++] = *q++;
+            }
+            value[i] = '\0';
+            return true;
+        }
+
+        // Skip to the next word
+        while (*p && *p != ' ') p++;
+        while (*p == ' ') p++;
+    }
+    return false;
+}
+
+// Look up a decimal "key=value" on the command line
+u64 bootinfo_get_number(const char* key, u64 fallback) {
+    char value[24];
+    if (!bootinfo_get_param(key, value, sizeof(value)) || value[0] < '0' || value[0] > '9') {
+        return fallback;
+    }
+
+    u64 number = 0;
+    for (char* c = value; *c >= '0' && *c <= '9'; c++) {
+        number = number * 10 + (*c - '0');
+    }
+    return number;
+}
+
+// Lowest address from min, a multiple of align, with size bytes clear of
+// every boot module
+u64 bootinfo_find_free(u64 min, u64 size, u64 align) {
+    u64 addr = (min + align - 1) & ~(align - 1);
+    for (u32 i = 0; i < boot_info.module_count; i++) {
+        const boot_module_t* module = &boot_info.modules[i];
+        if (addr < module->end && module->start < addr + size) {
+            // Past this module, then check them all again
+            addr = (module->end + align - 1) & ~(align - 1);
+            i = (u32)-1;
+        }
+    }
+    return addr;
+}
+
+// Top of usable RAM from the memory map, or 0 if the loader gave none
+u64 bootinfo_memory_size() {
+    u64 top = 0;
+    for (u32 i = 0; i < boot_info.mmap_count; i++) {
+        const boot_mmap_entry_t* entry = &boot_info.mmap[i];
+        if (entry->type == BOOT_MMAP_AVAILABLE && entry->base + entry->length > top) {
+            top = entry->base + entry->length;
+        }
+    }
+    return top;
+}
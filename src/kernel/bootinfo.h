@@ -0,0 +1,78 @@
+#ifndef BOOTINFO_H
+#define BOOTINFO_H
+
+#include "../include/types.h"
+
+// Where kernel_entry_64.asm leaves the Multiboot magic and information
+// address (keep in sync). The magic is 0 when the boot sector loaded us.
+#define BOOT_MB_MAGIC_ADDR  0x520
+#define BOOT_MB_INFO_ADDR   0x528
+
+// Multiboot loaders put the image 2MB above its link address. Before
+// copying it down, kernel_entry_64.asm saves conventional memory, where
+// the loader's structures may sit, at BOOT_LOW_SAVE_ADDR (keep in sync).
+#define BOOT_LOW_SAVE_ADDR  0x300000
+#define BOOT_LOW_SAVE_SIZE  0xA0000
+
+// Magic values passed in EAX by the loader
+#define MULTIBOOT1_LOADER_MAGIC 0x2BADB002
+#define MULTIBOOT2_LOADER_MAGIC 0x36D76289
+
+// How the kernel was loaded
+#define BOOT_LOADER_SECTOR      0   // Our own boot sector
+#define BOOT_LOADER_MULTIBOOT1  1
+#define BOOT_LOADER_MULTIBOOT2  2
+
+#define BOOT_CMDLINE_SIZE   256
+#define BOOT_NAME_SIZE      64
+#define BOOT_MMAP_MAX       32
+#define BOOT_MODULES_MAX    8
+
+// Memory map entry types (same numbering as BIOS E820)
+#define BOOT_MMAP_AVAILABLE 1
+
+typedef struct {
+    u64 base;
+    u64 length;
+    u32 type;
+} boot_mmap_entry_t;
+
+// A file loaded next to the kernel (e.g. an initrd)
+typedef struct {
+    u64 start;
+    u64 end;                        // Exclusive
+    char name[BOOT_NAME_SIZE];      // The module's command line
+} boot_module_t;
+
+typedef struct {
+    u32 loader;
+    char loader_name[BOOT_NAME_SIZE];
+    char cmdline[BOOT_CMDLINE_SIZE];
+    u32 mmap_count;
+    boot_mmap_entry_t mmap[BOOT_MMAP_MAX];
+    u32 module_count;
+    boot_module_t modules[BOOT_MODULES_MAX];
+} boot_info_t;
+
+// Copy what the loader handed over into kernel memory. Call early in
+// kernel_main, before the allocators can reuse the loader's structures.
+void bootinfo_init();
+
+// Get the boot information
+const boot_info_t* bootinfo_get();
+
+// Look up "key=value" on the command line, copying the value. Returns
+// false if the key isn't there.
+bool bootinfo_get_param(const char* key, char* value, u32 size);
+
+// Look up a decimal "key=value" on the command line
+u64 bootinfo_get_number(const char* key, u64 fallback);
+
+// Lowest address from min, a multiple of align, with size bytes clear of
+// every boot module
+u64 bootinfo_find_free(u64 min, u64 size, u64 align);
+
+// Top of usable RAM from the memory map, or 0 if the loader gave none
+u64 bootinfo_memory_size();
+
+#endif
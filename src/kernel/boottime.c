@@ -0,0 +1,44 @@
+#include "../include/types.h"
+#include "boottime.h"
+#include "low_level.h"
+
+static const char* early_stage_names[BOOT_STAGES_EARLY] = {
+    "boot sector",
+    "kernel load",
+    "kernel entry",
+    "long mode",
+};
+
+static boot_stage_t stages[BOOT_STAGES_MAX];
+static u32 stage_count = 0;
+
+// Pick up the stamps left by the boot sector and entry code
+void boottime_init() {
+    volatile u64* early = (volatile u64*)BOOT_STAGE_ADDR;
+
+    stage_count = 0;
+    for (u32 i = 0; i < BOOT_STAGES_EARLY; i++) {
+        stages[stage_count].name = early_stage_names[i];
+        stages[stage_count].tsc = early[i];
+        stage_count++;
+    }
+}
+
+// Record that a boot stage has just finished
+void boot_stage(const char* name) {
+    if (stage_count < BOOT_STAGES_MAX) {
+        stages[stage_count].name = name;
+        stages[stage_count].tsc = cpu_read_tsc();
+        stage_count++;
+    }
+}
+
+// Number of stages recorded
+u32 boot_stage_count() {
+    return stage_count;
+}
+
+// Get a recorded stage, in the order they happened
+const boot_stage_t* boot_stage_get(u32 index) {
+    return index < stage_count ? &stages[index] : NULL;
+}
@@ -0,0 +1,30 @@
+#ifndef BOOTTIME_H
+#define BOOTTIME_H
+
+#include "../include/types.h"
+
+// TSC stamps of the stages before kernel_main, written by boot64.asm and
+// kernel_entry_64.asm into free conventional memory (keep in sync)
+#define BOOT_STAGE_ADDR   0x500
+#define BOOT_STAGES_EARLY 4     // Boot sector, kernel loaded, kernel entry, long mode
+
+#define BOOT_STAGES_MAX   32
+
+typedef struct {
+    const char* name;
+    u64 tsc;
+} boot_stage_t;
+
+// Pick up the stamps left by the boot sector and entry code. Call first.
+void boottime_init();
+
+// Record that a boot stage has just finished
+void boot_stage(const char* name);
+
+// Number of stages recorded
+u32 boot_stage_count();
+
+// Get a recorded stage, in the order they happened
+const boot_stage_t* boot_stage_get(u32 index);
+
+#endif
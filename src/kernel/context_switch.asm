@@ -0,0 +1,38 @@
+[bits 64]
+
+global context_switch
+global kthread_start
+extern kthread_entry
+
+; void context_switch(u64* old_rsp, u64 new_rsp)
+; Saves the callee-saved registers of the running thread on its stack,
+; stores its stack pointer in *old_rsp and resumes the thread whose saved
+; stack pointer is new_rsp. Called with interrupts disabled.
+context_switch:
+    push rbx
+    push rbp
+    push r12
+    push r13
+    push r14
+    push r15
+
+    mov [rdi], rsp      ; Save the old stack
+    mov rsp, rsi        ; Switch to the new one
+
+    pop r15
+    pop r14
+    pop r13
+    pop r12
+    pop rbp
+    pop rbx
+    ret
+
+; First return target of a new thread. kthread_create leaves the thread
+; function in r12 and its argument in r13.
+kthread_start:
+    mov rdi, r12
+    mov rsi, r13
+    call kthread_entry
+.hang:
+    hlt                 ; kthread_entry never returns
+    jmp .hang
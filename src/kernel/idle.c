@@ -0,0 +1,120 @@
+#include "../include/types.h"
+#include "idle.h"
+#include "low_level.h"
+#include "../cpu/acpi.h"
+#include "../cpu/interrupts.h"
+#include "../cpu/percpu.h"
+#include "../cpu/smp.h"
+
+// CPUID.1:ECX - MONITOR/MWAIT supported
+#define CPUID_ECX_MONITOR (1 << 3)
+
+// Per-CPU idle state. The wake flag is the monitored location, so it gets
+// a cache line of its own: unrelated stores must not end the MWAIT.
+typedef struct {
+    volatile u32 wake_flag;     // Set by idle_wake_cpu, cleared after waking
+    volatile bool sleeping;     // Inside cpu_idle and not yet woken
+    u64 sleep_start;            // TSC when the current sleep began
+    idle_stats_t stats;
+} __attribute__((aligned(64))) idle_cpu_t;
+
+static idle_cpu_t idle_cpus[MAX_CPUS];
+static bool use_mwait = false;
+static u64 idle_start_tsc = 0;
+
+// Close the current idle period and count why it ended
+static void idle_end(idle_cpu_t* cpu, u32 reason) {
+    cpu->sleeping = false;
+    cpu->stats.idle_cycles += cpu_read_tsc() - cpu->sleep_start;
+    cpu->stats.wakeups[reason]++;
+}
+
+// Pick the sleep instruction
+void idle_init() {
+    u32 eax, ebx, ecx, edx;
+    cpu_cpuid(1, 0, &eax, &ebx, &ecx, &edx);
+    use_mwait = (ecx & CPUID_ECX_MONITOR) != 0;
+    idle_start_tsc = cpu_read_tsc();
+}
+
+// Sleep until an interrupt or a wake request
+void cpu_idle() {
+    idle_cpu_t* cpu = &idle_cpus[cpu_current_index()];
+
+    cpu->stats.entries++;
+    cpu->sleep_start = cpu_read_tsc();
+    cpu->sleeping = true;
+
+    if (use_mwait) {
+        // Arm the monitor, then re-check the flag: a wake that landed before
+        // the MONITOR would otherwise be missed
+        __asm__ __volatile__("monitor" : : "a"(&cpu->wake_flag), "c"(0), "d"(0));
+        if (!cpu->wake_flag) {
+            // STI takes effect after the next instruction, so no interrupt can
+            // slip in between and leave us asleep with work pending
+            __asm__ __volatile__("sti; mwait" : : "a"(0), "c"(0) : "memory");
+        } else {
+            __asm__ __volatile__("sti");
+        }
+    } else {
+        __asm__ __volatile__("sti; hlt" : : : "memory");
+    }
+
+    // Woken without an interrupt handler seeing us asleep
+    if (cpu->sleeping) {
+        idle_end(cpu, cpu->wake_flag ? IDLE_WAKE_MONITOR : IDLE_WAKE_OTHER);
+    }
+    cpu->wake_flag = 0;
+}
+
+// Wake a CPU sitting in cpu_idle
+void idle_wake_cpu(u32 cpu) {
+    if (cpu >= MAX_CPUS) {
+        return;
+    }
+
+    if (use_mwait) {
+        // The store ends the MWAIT - or makes the next cpu_idle return at once
+        idle_cpus[cpu].wake_flag = 1;
+    } else {
+        smp_send_ipi(cpu, IPI_WAKE);
+    }
+}
+
+// Interrupt entry hook: ends the idle period and records the wakeup reason
+void idle_interrupt(u8 vector) {
+    idle_cpu_t* cpu = &idle_cpus[cpu_current_index()];
+    if (!cpu->sleeping) {
+        return;
+    }
+
+    u32 reason;
+    if (vector == IRQ0) {
+        reason = IDLE_WAKE_TIMER;
+    } else if (vector == IRQ1) {
+        reason = IDLE_WAKE_KEYBOARD;
+    } else if (vector >= IPI_CALL && vector < IRQ_SPURIOUS) {
+        reason = IDLE_WAKE_IPI;
+    } else {
+        reason = IDLE_WAKE_IRQ;
+    }
+
+    // Accounted here rather than after the HLT: the interrupt may switch
+    // threads before the idle loop runs again
+    idle_end(cpu, reason);
+}
+
+// Check whether idle uses MWAIT rather than HLT
+bool idle_using_mwait() {
+    return use_mwait;
+}
+
+// Get the idle statistics of a CPU
+const idle_stats_t* idle_get_stats(u32 cpu) {
+    return &idle_cpus[cpu < MAX_CPUS ? cpu : 0].stats;
+}
+
+// TSC when idle accounting started
+u64 idle_get_start_tsc() {
+    return idle_start_tsc;
+}
@@ -0,0 +1,44 @@
+#ifndef IDLE_H
+#define IDLE_H
+
+#include "../include/types.h"
+
+// Why a CPU left the idle state
+#define IDLE_WAKE_TIMER     0   // Timer interrupt
+#define IDLE_WAKE_KEYBOARD  1   // Keyboard interrupt
+#define IDLE_WAKE_IPI       2   // Inter-processor interrupt
+#define IDLE_WAKE_IRQ       3   // Any other device interrupt
+#define IDLE_WAKE_MONITOR   4   // Store to the monitored wake flag (MWAIT only)
+#define IDLE_WAKE_OTHER     5   // NMI, SMI or a spurious interrupt
+#define IDLE_WAKE_REASONS   6
+
+// Per-CPU idle statistics
+typedef struct {
+    u64 entries;                // Times the CPU went to sleep
+    u64 idle_cycles;            // TSC cycles spent asleep
+    u64 wakeups[IDLE_WAKE_REASONS];
+} idle_stats_t;
+
+// Pick the sleep instruction: MONITOR/MWAIT when CPUID reports it, else HLT
+void idle_init();
+
+// Sleep until an interrupt or a wake request. Call with interrupts disabled
+// after checking there is no work; returns with interrupts enabled.
+void cpu_idle();
+
+// Wake a CPU sitting in cpu_idle (a flag store under MWAIT, an IPI under HLT)
+void idle_wake_cpu(u32 cpu);
+
+// Interrupt entry hook: ends the idle period and records the wakeup reason
+void idle_interrupt(u8 vector);
+
+// Check whether idle uses MWAIT rather than HLT
+bool idle_using_mwait();
+
+// Get the idle statistics of a CPU
+const idle_stats_t* idle_get_stats(u32 cpu);
+
+// TSC when idle accounting started, to turn idle cycles into residency
+u64 idle_get_start_tsc();
+
+#endif
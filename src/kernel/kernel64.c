@@ -1,14 +1,104 @@
 #include "../include/types.h"
 #include "../memory/physical.h"
 #include "../memory/kmalloc.h"
+#include "../memory/virtual.h"
 #include "../cpu/interrupts.h"
+#include "../cpu/smp.h"
 #include "../drivers/timer.h"
 #include "../drivers/keyboard.h"
 #include "../drivers/screen64.h"
+#include "../drivers/serial.h"
+#include "../drivers/pci.h"
+#include "../drivers/ahci.h"
+#include "../drivers/virtio_blk.h"
+#include "../fs/bcache.h"
+#include "../fs/vfs.h"
 #include "../terminal/terminal64.h"
+#include "../terminal/console.h"
 #include "../kernel/low_level.h"
+#include "../kernel/softirq.h"
+#include "../kernel/thread.h"
+#include "../kernel/task.h"
+#include "../kernel/idle.h"
+#include "../kernel/async.h"
+#include "../kernel/boottime.h"
+#include "../kernel/bootinfo.h"
+#include "../kernel/bench.h"
+
+// Memory assumed when the loader gives no memory map, and the most the
+// identity map covers
+#define DEFAULT_MEMORY_SIZE (128ULL * 1024 * 1024)
+#define MAX_MEMORY_SIZE     (4ULL * 1024 * 1024 * 1024)
+
+// Where kmalloc's heap went, clear of the boot modules
+static u64 kernel_heap_base;
+
+// Size the physical allocator from the memory map, put its bitmap clear of
+// the boot modules and the kmalloc heap, and keep it away from the heap,
+// holes, firmware areas and boot modules
+static void kernel_init_memory() {
+    const boot_info_t* info = bootinfo_get();
+    u64 size = bootinfo_memory_size();
+    if (size == 0) {
+        size = DEFAULT_MEMORY_SIZE;
+    }
+    if (size > MAX_MEMORY_SIZE) {
+        size = MAX_MEMORY_SIZE;
+    }
+    
+    u64 bitmap_size = (size / PAGE_SIZE + 7) / 8;
+    u64 bitmap = bootinfo_find_free(PMM_BITMAP_ADDR, bitmap_size, PAGE_SIZE);
+    if (bitmap < kernel_heap_base + KMALLOC_HEAP_SIZE && kernel_heap_base < bitmap + bitmap_size) {
+        bitmap = bootinfo_find_free(kernel_heap_base + KMALLOC_HEAP_SIZE, bitmap_size, PAGE_SIZE);
+    }
+    
+    pmm_init(size, bitmap);
+    pmm_reserve_range(kernel_heap_base, KMALLOC_HEAP_SIZE);
+    
+    if (info->mmap_count) {
+        // Walk the available ranges in address order, reserving the gaps
+        boot_mmap_entry_t ranges[BOOT_MMAP_MAX];
+        u32 count = 0;
+        for (u32 i = 0; i < info->mmap_count; i++) {
+            if (info->mmap[i].type == BOOT_MMAP_AVAILABLE) {
+                u32 j = count++;
+                while (j > 0 && ranges[j - 1].base > info->mmap[i].base) {
+                    ranges[j] = ranges[j - 1];
+                    j--;
+                }
+                ranges[j] = info->mmap[i];
+            }
+        }
+        
+        u64 cursor = 0;
+        for (u32 i = 0; i < count; i++) {
+            if (ranges[i].base > cursor) {
+                pmm_reserve_range(cursor, ranges[i].base - cursor);
+            }
+            if (ranges[i].base + ranges[i].length > cursor) {
+                cursor = ranges[i].base + ranges[i].length;
+            }
+        }
+        
+        // Reserved entries may overlap available ones
+        for (u32 i = 0; i < info->mmap_count; i++) {
+            if (info->mmap[i].type != BOOT_MMAP_AVAILABLE) {
+                pmm_reserve_range(info->mmap[i].base, info->mmap[i].length);
+            }
+        }
+    }
+    
+    for (u32 i = 0; i < info->module_count; i++) {
+        pmm_reserve_range(info->modules[i].start, info->modules[i].end - info->modules[i].start);
+    }
+}
 
 void kernel_main() {
+    // Take over the boot stage stamps and the loader's information before
+    // anything can overwrite them
+    boottime_init();
+    bootinfo_init();
+    
     // Clear screen immediately
     volatile u16* video_mem = (volatile u16*)0xB8000;
     for (int i = 0; i < 80*25; i++) {
@@ -17,40 +107,78 @@ void kernel_main() {
     
     // Initialize systems in the correct order
     
-    // 1. Memory management first
-    pmm_init(128 * 1024 * 1024); // Assume 128MB RAM
-    kmalloc_init();
+    // 1. Memory management first (the physical allocator is built once
+    // every CPU can help, below)
+    kernel_heap_base = bootinfo_find_free(KMALLOC_HEAP_BASE, KMALLOC_HEAP_SIZE, PAGE_SIZE);
+    kmalloc_init(kernel_heap_base);
+    boot_stage("kmalloc_init");
     
-    // 2. Interrupt system
+    // 2. Per-CPU data, then the interrupt system
+    percpu_init_bsp();
+    softirq_init();
     interrupts_init();
+    boot_stage("interrupts_init");
     
-    // 3. Screen driver before terminal
+    // 3. Screen driver before terminal, and the serial port for
+    // benchmark results
     screen_init();
+    boot_stage("screen_init");
+    serial_init();
     
-    // 4. Initialize devices
-    timer_init(100);
+    // 4. Initialize devices (the keyboard decodes in an async task)
+    async_init();
+    u64 hz = bootinfo_get_number("hz", 100);  // e.g. hz=1000 on the command line
+    timer_init(hz >= 20 && hz <= 10000 ? (u32)hz : 100);
+    boot_stage("timer_init");
     keyboard_init();
+    boot_stage("keyboard_init");
     
-    // 5. Initialize terminal
-    // Wait a moment to ensure all systems are stable
-    for (volatile u64 i = 0; i < 500000; i++) {
-        __asm__ __volatile__("nop");
-    }
+    // Bring up the application processors (needs the timer for delays)
+    // as workers of the parallel task executor
+    idle_init();
+    task_init();
+    boot_stage("task_init");
+    smp_init();
+    boot_stage("smp_init");
+    
+    // Build the physical page bitmap in parallel
+    kernel_init_memory();
+    vmm_init();
+    boot_stage("pmm_init");
+    
+    // Find the disks (their DMA structures come from the page allocator)
+    pci_init();
+    boot_stage("pci_init");
+    ahci_init();
+    boot_stage("ahci_init");
+    virtio_blk_init();
+    boot_stage("virtio_blk_init");
+    bcache_init();
+    boot_stage("bcache_init");
+    
+    // Mount the initrd the loader left in memory, if any
+    vfs_init();
+    boot_stage("vfs_init");
     
-    // Initialize terminal
+    // 5. Initialize terminal (it records the "prompt" stage once the first
+    // prompt is on screen)
     terminal_init();
-
-    // Main loop
-    while (1) {
-        // Poll keyboard
-        keyboard_poll();
-        
-        // Process any keys through the terminal
-        terminal_update();
-        
-        // Small delay to reduce CPU usage
-        for (volatile int i = 0; i < 1000; i++) {
-            __asm__ __volatile__("nop");
-        }
+    boot_stage("terminal_init");
+    
+    // 6. Become the highest priority thread so the shell preempts
+    // background work as soon as a key arrives
+    threads_init();
+    boot_stage("threads_init");
+    
+    // "bench=<name>" (or bench=all) runs the microbenchmarks unattended
+    // and powers QEMU off
+    char bench_filter[32];
+    if (bootinfo_get_param("bench", bench_filter, sizeof(bench_filter))) {
+        bench_boot(bench_filter);
+        console_write("bench: no isa-debug-exit device, staying up\n");
     }
-}
\ No newline at end of file
+
+    // Main loop: run the keyboard, terminal and console tasks, sleeping
+    // while none of them has work
+    async_loop();
+}
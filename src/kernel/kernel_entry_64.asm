@@ -1,8 +1,151 @@
 [bits 32]
 [extern kernel_main]
+[extern __text_start]
+[extern __text_end]
+[extern __rodata_start]
+[extern __rodata_end]
+[extern __rodata_load]
+[extern __data_start]
+[extern __data_end]
+[extern __data_load]
+[extern __load_end]
+[extern __bss_start]
+[extern _end]
+
+AP_TRAMPOLINE_ADDR equ 0x70000     ; Keep in sync with smp.h
+BOOT_STAGES equ 0x500              ; TSC stamps handed to the kernel (boottime.h)
+BOOT_MB_MAGIC equ 0x520            ; Multiboot magic and info address (bootinfo.h)
+BOOT_MB_INFO equ 0x528
+
+; Multiboot headers. Both ask for the flat image (kernel-64.bin) to be
+; loaded MB_LOAD_OFFSET above where it is linked, out of the loader's way:
+; loaders keep their structures and modules clear of the image, but would
+; happily put them in conventional memory where the kernel itself, its
+; page tables and stack go (QEMU puts its memory map at 0x9000). The range
+; declared as .bss also covers the save area for conventional memory, so
+; nothing is loaded there either.
+MB_LOAD_OFFSET equ 0x200000
+BOOT_LOW_SAVE equ 0x300000         ; Conventional memory saved here (bootinfo.h)
+BOOT_LOW_SIZE equ 0xA0000
+MB_TSC_SAVE equ BOOT_LOW_SAVE - 16 ; Entry TSC until the boot stages are safe to write
+
+MB1_MAGIC equ 0x1BADB002
+MB1_FLAGS equ (1 << 0) | (1 << 1) | (1 << 16)  ; Page-aligned modules, memory info, address fields
+MB2_MAGIC equ 0xE85250D6
+MB2_ARCH_I386 equ 0
+
+; Placed first in .text by linker.ld, so _start is at 0x1000
+section .text.entry progbits alloc exec nowrite align=16
 
 global _start
 _start:
+    ; Entered from the boot sector
+    jmp boot_sector_start
+
+; Multiboot2 header (GRUB) - must be 8-byte aligned in the first 32KB
+align 8
+multiboot2_header:
+    dd MB2_MAGIC
+    dd MB2_ARCH_I386
+    dd multiboot2_header_end - multiboot2_header
+    dd 0x100000000 - (MB2_MAGIC + MB2_ARCH_I386 + (multiboot2_header_end - multiboot2_header))
+    ; Address tag: where the image goes
+    align 8
+    dw 2, 0
+    dd 24
+    dd multiboot2_header + MB_LOAD_OFFSET   ; header_addr
+    dd __text_start + MB_LOAD_OFFSET        ; load_addr
+    dd __load_end + MB_LOAD_OFFSET          ; load_end_addr
+    dd BOOT_LOW_SAVE + BOOT_LOW_SIZE        ; bss_end_addr
+    ; Entry address tag
+    align 8
+    dw 3, 0
+    dd 12
+    dd multiboot_start + MB_LOAD_OFFSET
+    ; End tag
+    align 8
+    dw 0, 0
+    dd 8
+multiboot2_header_end:
+
+; Multiboot header (QEMU -kernel) - must be 4-byte aligned in the first 8KB
+align 4
+multiboot1_header:
+    dd MB1_MAGIC
+    dd MB1_FLAGS
+    dd 0x100000000 - (MB1_MAGIC + MB1_FLAGS)
+    dd multiboot1_header + MB_LOAD_OFFSET   ; header_addr
+    dd __text_start + MB_LOAD_OFFSET        ; load_addr
+    dd __load_end + MB_LOAD_OFFSET          ; load_end_addr
+    dd BOOT_LOW_SAVE + BOOT_LOW_SIZE        ; bss_end_addr
+    dd multiboot_start + MB_LOAD_OFFSET     ; entry_addr
+
+; Entered from a Multiboot or Multiboot2 loader in 32-bit protected mode
+; with paging off: EAX holds the loader's magic, EBX the physical address
+; of its boot information. There is no stack yet, and this runs from the
+; staging copy MB_LOAD_OFFSET up, so only relative jumps until the image
+; is in place.
+multiboot_start:
+    mov ebp, eax
+    rdtsc
+    mov [MB_TSC_SAVE], eax
+    mov [MB_TSC_SAVE + 4], edx
+    
+    ; Save conventional memory before anything overwrites it; bootinfo.c
+    ; reads the loader's structures found there from the copy
+    cld
+    xor esi, esi
+    mov edi, BOOT_LOW_SAVE
+    mov ecx, BOOT_LOW_SIZE / 4
+    rep movsd
+    
+    ; Copy the image down to where it is linked
+    mov esi, __text_start + MB_LOAD_OFFSET
+    mov edi, __text_start
+    mov ecx, __load_end
+    sub ecx, edi
+    rep movsb
+    
+    mov esp, 0x90000
+    mov [BOOT_MB_MAGIC], ebp
+    mov dword [BOOT_MB_MAGIC + 4], 0
+    mov [BOOT_MB_INFO], ebx
+    mov dword [BOOT_MB_INFO + 4], 0
+    mov ebp, esp
+    
+    ; No boot sector ran - its stages start and end here
+    mov eax, [MB_TSC_SAVE]
+    mov edx, [MB_TSC_SAVE + 4]
+    mov [BOOT_STAGES], eax
+    mov [BOOT_STAGES + 4], edx
+    mov [BOOT_STAGES + 8], eax
+    mov [BOOT_STAGES + 12], edx
+    mov eax, kernel_start
+    jmp eax
+    
+boot_sector_start:
+    mov dword [BOOT_MB_MAGIC], 0
+    
+kernel_start:
+    ; Boot stage 2: kernel entry
+    rdtsc
+    mov [BOOT_STAGES + 16], eax
+    mov [BOOT_STAGES + 20], edx
+    
+    ; The boot sector loaded the image with .rodata and .data packed after
+    ; .text. Move .data, then .rodata, up to their page-aligned addresses;
+    ; the ranges can overlap, so copy from the top down.
+    mov esi, __data_load
+    mov edi, __data_start
+    mov ecx, __data_end
+    sub ecx, edi
+    call move_section
+    mov esi, __rodata_load
+    mov edi, __rodata_start
+    mov ecx, __rodata_end
+    sub ecx, edi
+    call move_section
+    
     ; Print message before paging setup
     mov esi, MSG_PAGING
     call print_string_pm
@@ -43,90 +186,132 @@ print_string_pm:
     popa
     ret
 
-; Simplified paging setup - only map the first 2MB
+; Copy ECX bytes from ESI to EDI, where EDI >= ESI
+move_section:
+    std
+    lea esi, [esi + ecx - 1]
+    lea edi, [edi + ecx - 1]
+    rep movsb
+    cld
+    ret
+
+; Get the NX bit, as the high dword of a page table entry, or 0 when the
+; CPU doesn't support it
+get_nx_mask:
+    push ebx
+    push ecx
+    push edx
+    mov eax, 0x80000001
+    cpuid
+    xor eax, eax
+    test edx, 1 << 20       ; CPUID.80000001h:EDX.NX
+    jz .done
+    mov eax, 1 << 31
+.done:
+    pop edx
+    pop ecx
+    pop ebx
+    ret
+
+; Paging setup - identity map the low 4GB with 2MB pages so the kernel can
+; reach ACPI tables in high RAM and the local/I/O APIC registers near 4GB
 setup_simple_paging:
-    ; Define addresses for page tables
-    %define PML4_ADDR 0x10000
-    %define PDPT_ADDR 0x11000
-    %define PD_ADDR   0x12000
-    %define PT_ADDR   0x13000
-    
-    ; Clear the PML4 table
+    ; Define addresses for page tables (above the kernel image and .bss,
+    ; which the boot loader keeps below 0x60000)
+    %define PML4_ADDR 0x60000
+    %define PDPT_ADDR 0x61000
+    %define PD_ADDR   0x62000      ; Four page directories, one per GB
+    %define PT_ADDR   0x66000      ; 4KB pages for the first 2MB
+    
+    ; Clear the PML4, PDPT, all four page directories and the page table
     mov edi, PML4_ADDR
-    mov ecx, 1024          ; 4KB / 4 bytes
+    mov ecx, 7 * 1024      ; 7 tables * 4KB / 4 bytes
     xor eax, eax
     rep stosd
     
-    mov esi, MSG_PAGING_2
-    call print_string_pm
-    
     ; Set up PML4 entry (first entry points to PDPT)
     mov edi, PML4_ADDR
     mov eax, PDPT_ADDR
     or eax, 3              ; Present + Writable
     mov [edi], eax
     
-    mov esi, MSG_PAGING_3
-    call print_string_pm
-    
-    ; Clear the PDPT
-    mov edi, PDPT_ADDR
-    mov ecx, 1024          ; 4KB / 4 bytes
-    xor eax, eax
-    rep stosd
-    
-    ; Set up PDPT entry (first entry points to PD)
+    ; Set up PDPT entries 0-3, each pointing to one page directory
     mov edi, PDPT_ADDR
     mov eax, PD_ADDR
     or eax, 3              ; Present + Writable
+    mov ecx, 4
+.map_pdpt_loop:
     mov [edi], eax
+    add eax, 0x1000        ; Next page directory
+    add edi, 8
+    loop .map_pdpt_loop
     
-    mov esi, MSG_PAGING_4
-    call print_string_pm
-    
-    ; Clear the PD
+    ; Fill the page directories with 2MB pages covering 0-4GB
     mov edi, PD_ADDR
-    mov ecx, 1024          ; 4KB / 4 bytes
-    xor eax, eax
-    rep stosd
-    
-    ; Set up PD entry (first entry points to PT)
-    mov edi, PD_ADDR
-    mov eax, PT_ADDR
-    or eax, 3              ; Present + Writable
-    mov [edi], eax
-    
-    mov esi, MSG_PAGING_5
-    call print_string_pm
-    
-    ; Clear the PT
-    mov edi, PT_ADDR
-    mov ecx, 1024          ; 4KB / 4 bytes
-    xor eax, eax
-    rep stosd
-    
-    ; Map the first 2MB (512 pages of 4KB each)
+    mov eax, 0x83          ; Present + Writable + Huge, physical address 0
+    mov ecx, 4 * 512       ; 2048 entries (4GB of memory)
+.map_pd_loop:
+    mov [edi], eax         ; Write the entry (high dword already zero)
+    add eax, 0x200000      ; Next 2MB page
+    add edi, 8             ; Next entry (8 bytes)
+    loop .map_pd_loop
+    
+    ; The top GB holds the APIC and PCI MMIO windows - make it uncached
+    mov edi, PD_ADDR + 3 * 0x1000
+    mov ecx, 512
+.uncache_loop:
+    or dword [edi], 0x18   ; PWT + PCD
+    add edi, 8
+    loop .uncache_loop
+    
+    ; Nothing runs from above 2MB
+    call get_nx_mask
+    mov edx, eax
+    mov edi, PD_ADDR + 8
+    mov ecx, 4 * 512 - 1
+.nx_pd_loop:
+    mov [edi + 4], edx
+    add edi, 8
+    loop .nx_pd_loop
+    
+    ; Split the first 2MB into 4KB pages so the kernel's sections get their
+    ; own permissions: text read-only, rodata read-only and no-execute,
+    ; everything else writable and no-execute except the AP trampoline
+    mov dword [PD_ADDR], PT_ADDR | 3
     mov edi, PT_ADDR
-    mov eax, 0             ; Start physical address
-    or eax, 3              ; Present + Writable
-    
-    mov ecx, 512           ; 512 entries (2MB of memory)
+    xor eax, eax           ; Physical address
 .map_pt_loop:
-    mov [edi], eax         ; Write the entry
-    add eax, 0x1000        ; Next page (4KB)
-    add edi, 8             ; Next entry (8 bytes)
-    loop .map_pt_loop
-    
-    mov esi, MSG_PAGING_6
-    call print_string_pm
+    mov ebx, eax
+    or ebx, 3              ; Present + Writable
+    mov ecx, edx           ; No-execute
+    cmp eax, __text_start
+    jb .pt_store
+    cmp eax, __text_end
+    jae .not_text
+    and ebx, ~2
+    xor ecx, ecx
+    jmp .pt_store
+.not_text:
+    cmp eax, __rodata_end
+    jae .not_rodata
+    and ebx, ~2
+    jmp .pt_store
+.not_rodata:
+    cmp eax, AP_TRAMPOLINE_ADDR
+    jne .pt_store
+    xor ecx, ecx
+.pt_store:
+    mov [edi], ebx
+    mov [edi + 4], ecx
+    add edi, 8
+    add eax, 0x1000
+    cmp eax, 0x200000
+    jb .map_pt_loop
     
     ; Enable paging by setting CR3 register
     mov eax, PML4_ADDR
     mov cr3, eax
     
-    mov esi, MSG_PAGING_7
-    call print_string_pm
-    
     ret
 
 ; Set up the 64-bit GDT
@@ -142,26 +327,24 @@ switch_to_long_mode:
     or eax, 1 << 5          ; Set PAE bit
     mov cr4, eax
     
-    mov esi, MSG_PAE
-    call print_string_pm
-    
-    ; Set long mode bit in EFER MSR
+    ; Set long mode bit in EFER MSR, and NXE when the page tables use NX
+    call get_nx_mask
+    mov ebx, eax
     mov ecx, 0xC0000080     ; EFER MSR number
     rdmsr                   ; Read EFER
     or eax, 1 << 8          ; Set LM bit
+    test ebx, ebx
+    jz .no_nx
+    or eax, 1 << 11         ; Set NXE bit
+.no_nx:
     wrmsr                   ; Write EFER
     
-    mov esi, MSG_EFER
-    call print_string_pm
-    
-    ; Enable paging (this automatically enables long mode)
+    ; Enable paging (this automatically enables long mode), with WP so
+    ; the kernel can't write to its read-only pages either
     mov eax, cr0
-    or eax, 1 << 31         ; Set PG bit
+    or eax, (1 << 31) | (1 << 16)  ; Set PG and WP bits
     mov cr0, eax
     
-    mov esi, MSG_PAGING_ENABLE
-    call print_string_pm
-    
     ; Jump to 64-bit code segment
     jmp CODE_SEG:long_mode_start
 
@@ -175,6 +358,12 @@ long_mode_start:
     mov gs, ax
     mov ss, ax
     
+    ; Boot stage 3: long mode
+    rdtsc
+    shl rdx, 32
+    or rax, rdx
+    mov [BOOT_STAGES + 24], rax
+    
     ; Print success message directly to screen
     mov rdi, 0xB8000
     mov rcx, 25
@@ -187,6 +376,13 @@ long_mode_start:
     mov rax, 0x1F361F361F201F6F  ; "o 64" with blue background
     stosq
     
+    ; Zero .bss - the boot loader only loads the file image
+    mov rdi, __bss_start
+    mov rcx, _end
+    sub rcx, rdi
+    xor eax, eax
+    rep stosb
+    
     ; Set up stack for the C kernel
     mov rsp, 0x90000
     
@@ -204,14 +400,14 @@ gdt64_start:
     dw 0xFFFF               ; Limit (bits 0-15)
     dw 0x0000               ; Base (bits 0-15)
     db 0x00                 ; Base (bits 16-23)
-    db 10011010b            ; Access byte
+    db 10011011b            ; Access byte (accessed preset: the GDT is read-only)
     db 10101111b            ; Flags + Limit (bits 16-19)
     db 0x00                 ; Base (bits 24-31)
     ; Data segment descriptor
     dw 0xFFFF               ; Limit (bits 0-15)
     dw 0x0000               ; Base (bits 0-15)
     db 0x00                 ; Base (bits 16-23)
-    db 10010010b            ; Access byte
+    db 10010011b            ; Access byte (accessed preset)
     db 10101111b            ; Flags + Limit (bits 16-19)
     db 0x00                 ; Base (bits 24-31)
 gdt64_end:
@@ -225,14 +421,5 @@ CODE_SEG equ 8             ; Code segment offset in GDT
 
 ; Debug messages
 MSG_PAGING db "Setting up paging...", 0
-MSG_PAGING_2 db "Paging step 2: PML4 setup", 0
-MSG_PAGING_3 db "Paging step 3: PDPT setup", 0
-MSG_PAGING_4 db "Paging step 4: PD setup", 0
-MSG_PAGING_5 db "Paging step 5: PT setup", 0
-MSG_PAGING_6 db "Paging step 6: Memory mapping complete", 0
-MSG_PAGING_7 db "Paging step 7: CR3 set", 0
 MSG_GDT db "Setting up GDT...", 0
-MSG_LONG_MODE db "Switching to long mode...", 0
-MSG_PAE db "Enabling PAE...", 0
-MSG_EFER db "Setting EFER...", 0
-MSG_PAGING_ENABLE db "Enabling paging...", 0
\ No newline at end of file
+MSG_LONG_MODE db "Switching to long mode...", 0
\ No newline at end of file
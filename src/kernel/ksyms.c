@@ -0,0 +1,39 @@
+#include "ksyms.h"
+
+// Bounds of the kernel's code (linker.ld)
+extern char __text_start[];
+extern char __text_end[];
+
+// Binary search for the last symbol at or below the address
+int ksym_find(u64 address) {
+    if (address < (u64)__text_start || address >= (u64)__text_end) {
+        return -1;
+    }
+
+    u32 low = 0;
+    u32 high = ksym_count;
+    while (low < high) {
+        u32 mid = low + (high - low) / 2;
+        if (ksym_table[mid].address <= address) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return low ? (int)low - 1 : -1;
+}
+
+const char* ksym_name(u32 index) {
+    return index < ksym_count ? ksym_names + ksym_table[index].name : NULL;
+}
+
+const char* ksym_lookup(u64 address, u64* offset) {
+    int index = ksym_find(address);
+    if (index < 0) {
+        return NULL;
+    }
+    if (offset) {
+        *offset = address - ksym_table[index].address;
+    }
+    return ksym_name((u32)index);
+}
@@ -0,0 +1,30 @@
+#ifndef KSYMS_H
+#define KSYMS_H
+
+#include "../include/types.h"
+
+// Kernel symbol table: the code symbols of the linked kernel in address
+// order. tools/mksyms generates it from the symbols of a first link, and
+// the kernel is then linked again with it (see the Makefile).
+typedef struct {
+    u64 address;
+    u32 name;                       // Offset of the name in ksym_names
+} ksym_t;
+
+// Defined by the generated table
+extern const ksym_t ksym_table[];
+extern const u32 ksym_count;
+extern const char ksym_names[];
+
+// Find the function containing an address. Returns its index, or -1 if the
+// address is outside the kernel's code.
+int ksym_find(u64 address);
+
+// Name of a symbol by index
+const char* ksym_name(u32 index);
+
+// Name of the function containing an address and the offset into it
+// (NULL if there is none)
+const char* ksym_lookup(u64 address, u64* offset);
+
+#endif
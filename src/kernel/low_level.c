@@ -36,3 +36,22 @@ u32 port_long_in(u16 port) {
 void port_long_out(u16 port, u32 data) {
     __asm__ __volatile__("outl %0, %1" : : "a"(data), "Nd"(port));
 }
+
+// Execute CPUID for a leaf/subleaf and return all four registers
+void cpu_cpuid(u32 leaf, u32 subleaf, u32* eax, u32* ebx, u32* ecx, u32* edx) {
+    __asm__ __volatile__("cpuid"
+                         : "=a"(*eax), "=b"(*ebx), "=c"(*ecx), "=d"(*edx)
+                         : "a"(leaf), "c"(subleaf));
+}
+
+// Read a model-specific register
+u64 cpu_read_msr(u32 msr) {
+    u32 low, high;
+    __asm__ __volatile__("rdmsr" : "=a"(low), "=d"(high) : "c"(msr));
+    return ((u64)high << 32) | low;
+}
+
+// Write a model-specific register
+void cpu_write_msr(u32 msr, u64 value) {
+    __asm__ __volatile__("wrmsr" : : "c"(msr), "a"((u32)value), "d"((u32)(value >> 32)));
+}
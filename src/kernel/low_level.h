@@ -21,4 +21,61 @@ u32 port_long_in(u16 port);
 // Write a long (4 bytes) to an I/O port
 void port_long_out(u16 port, u32 data);
 
+// Execute CPUID for a leaf/subleaf and return all four registers
+void cpu_cpuid(u32 leaf, u32 subleaf, u32* eax, u32* ebx, u32* ecx, u32* edx);
+
+// Read a model-specific register
+u64 cpu_read_msr(u32 msr);
+
+// Write a model-specific register
+void cpu_write_msr(u32 msr, u64 value);
+
+// Read a 32-bit memory-mapped device register (inline: used on interrupt paths)
+static inline u32 mmio_read32(u64 addr) {
+    return *(volatile u32*)addr;
+}
+
+// Write a 32-bit memory-mapped device register
+static inline void mmio_write32(u64 addr, u32 value) {
+    *(volatile u32*)addr = value;
+}
+
+// Narrower device register accesses (virtio configuration structures)
+static inline u8 mmio_read8(u64 addr) {
+    return *(volatile u8*)addr;
+}
+
+static inline u16 mmio_read16(u64 addr) {
+    return *(volatile u16*)addr;
+}
+
+static inline void mmio_write8(u64 addr, u8 value) {
+    *(volatile u8*)addr = value;
+}
+
+static inline void mmio_write16(u64 addr, u16 value) {
+    *(volatile u16*)addr = value;
+}
+
+// Read the time-stamp counter
+static inline u64 cpu_read_tsc() {
+    u32 low, high;
+    __asm__ __volatile__("rdtsc" : "=a"(low), "=d"(high));
+    return ((u64)high << 32) | low;
+}
+
+// Disable interrupts and return the previous RFLAGS
+static inline u64 cpu_irq_save() {
+    u64 flags;
+    __asm__ __volatile__("pushfq; popq %0; cli" : "=r"(flags) : : "memory");
+    return flags;
+}
+
+// Restore the interrupt flag saved by cpu_irq_save()
+static inline void cpu_irq_restore(u64 flags) {
+    if (flags & (1 << 9)) {
+        __asm__ __volatile__("sti" : : : "memory");
+    }
+}
+
 #endif
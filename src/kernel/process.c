@@ -0,0 +1,168 @@
+#include "process.h"
+#include "syscall.h"
+#include "thread.h"
+#include "low_level.h"
+#include "util.h"
+#include "../memory/physical.h"
+#include "../memory/virtual.h"
+
+// Drop to ring 3 and come back (syscall_entry.asm)
+extern u64 user_enter(process_t* process, u64 rip, u64 rsp, u64 arg);
+extern void user_return(process_t* process, u64 code);
+
+// Programs built into the kernel (src/user/programs.asm)
+extern const u8 user_hello_start[];
+extern const u8 user_hello_end[];
+extern const u8 user_sysbench_start[];
+extern const u8 user_sysbench_end[];
+extern const u8 user_fault_start[];
+extern const u8 user_fault_end[];
+
+static const user_program_t programs[] = {
+    { "hello",    "Print a greeting with SYS_WRITE",                user_hello_start,    user_hello_end },
+    { "sysbench", "Time null system calls (rdi: parameter block)",  user_sysbench_start, user_sysbench_end },
+    { "fault",    "Read kernel memory, which ends in a page fault", user_fault_start,    user_fault_end },
+};
+
+#define PROGRAM_COUNT (sizeof(programs) / sizeof(programs[0]))
+
+static bool process_str_equals(const char* a, const char* b) {
+    while (*a && *a == *b) {
+        a++;
+        b++;
+    }
+    return *a == *b;
+}
+
+const user_program_t* process_program(u32 index) {
+    return index < PROGRAM_COUNT ? &programs[index] : NULL;
+}
+
+const user_program_t* process_find_program(const char* name) {
+    for (u32 i = 0; i < PROGRAM_COUNT; i++) {
+        if (process_str_equals(programs[i].name, name)) {
+            return &programs[i];
+        }
+    }
+    return NULL;
+}
+
+// Allocate a cleared page (0 when out of memory)
+static u64 process_alloc_page() {
+    u64 page = pmm_alloc_page();
+    if (page) {
+        memory_set((char*)page, 0, PAGE_SIZE);
+    }
+    return page;
+}
+
+bool process_create(process_t* process, const user_program_t* program) {
+    u64 size = program->end - program->start;
+    process->rsp = 0;
+    process->program = program;
+    process->exit_code = 0;
+    process->fault = PROCESS_NO_FAULT;
+    process->fault_rip = 0;
+    process->fault_address = 0;
+    process->space = vmm_create_space();
+    process->code_page = process_alloc_page();
+    process->data_page = process_alloc_page();
+    process->stack_page = process_alloc_page();
+
+    if (size > PAGE_SIZE || !process->space || !process->code_page ||
+        !process->data_page || !process->stack_page) {
+        process_destroy(process);
+        return false;
+    }
+    memory_copy((char*)program->start, (char*)process->code_page, (int)size);
+
+    // The code is read-only; only data and stack are writable
+    if (!vmm_map_page_in(process->space, USER_CODE_BASE, process->code_page, PAGE_USER) ||
+        !vmm_map_page_in(process->space, USER_DATA_BASE, process->data_page, PAGE_USER | PAGE_WRITABLE) ||
+        !vmm_map_page_in(process->space, USER_STACK_TOP - PAGE_SIZE, process->stack_page, PAGE_USER | PAGE_WRITABLE)) {
+        process_destroy(process);
+        return false;
+    }
+    return true;
+}
+
+u64 process_run(process_t* process, u64 arg) {
+    kthread_t* thread = kthread_current();
+    process->fault = PROCESS_NO_FAULT;
+
+    // The thread carries the address space and kernel stack across
+    // context switches while the process runs
+    u64 flags = cpu_irq_save();
+    thread->process = process;
+    thread->space = process->space;
+    vmm_switch_space(process->space);
+
+    u64 code = user_enter(process, USER_CODE_BASE, USER_STACK_TOP, arg);
+
+    // Back from process_exit, still with interrupts disabled
+    thread->process = NULL;
+    thread->space = NULL;
+    thread->kernel_rsp = 0;
+    vmm_switch_space(NULL);
+    cpu_irq_restore(flags);
+
+    process->exit_code = code;
+    return code;
+}
+
+void process_destroy(process_t* process) {
+    if (process->space) {
+        vmm_destroy_space(process->space);
+    }
+    if (process->code_page) {
+        pmm_free_page(process->code_page);
+    }
+    if (process->data_page) {
+        pmm_free_page(process->data_page);
+    }
+    if (process->stack_page) {
+        pmm_free_page(process->stack_page);
+    }
+    process->space = NULL;
+    process->code_page = 0;
+    process->data_page = 0;
+    process->stack_page = 0;
+}
+
+process_t* process_current() {
+    kthread_t* thread = kthread_current();
+    return thread ? thread->process : NULL;
+}
+
+void process_exit(u64 code) {
+    __asm__ __volatile__("cli");
+    user_return(process_current(), code);
+}
+
+bool process_user_range(u64 address, u64 length) {
+    u64 end = address + length;
+    if (!process_current() || end < address) {
+        return false;
+    }
+    return (address >= USER_CODE_BASE && end <= USER_CODE_BASE + PAGE_SIZE) ||
+           (address >= USER_DATA_BASE && end <= USER_DATA_BASE + PAGE_SIZE) ||
+           (address >= USER_STACK_TOP - PAGE_SIZE && end <= USER_STACK_TOP);
+}
+
+void process_fault(registers_t* regs) {
+    process_t* process = process_current();
+    if (!process) {
+        return;
+    }
+    process->fault = (u32)regs->int_no;
+    process->fault_rip = regs->rip;
+    if (regs->int_no == 14) {
+        __asm__ __volatile__("mov %%cr2, %0" : "=r"(process->fault_address));
+    }
+    process_exit(PROCESS_EXIT_FAULT + regs->int_no);
+}
+
+void process_set_kernel_stack(u64 rsp) {
+    kthread_current()->kernel_rsp = rsp;
+    syscall_set_kernel_stack(rsp);
+}
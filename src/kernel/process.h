@@ -0,0 +1,70 @@
+#ifndef PROCESS_H
+#define PROCESS_H
+
+#include "../include/types.h"
+#include "../cpu/interrupts.h"
+
+// User processes. Each runs one of the programs built into the kernel
+// (src/user/programs.asm) in ring 3, in an address space of its own that
+// shares the kernel's mappings but can only touch its own pages: code,
+// data and stack, one page each, in a PML4 slot away from the kernel's.
+// A process runs on the kernel thread that starts it, until it exits or
+// faults, and can be run again.
+#define USER_CODE_BASE      0x10000000000ull
+#define USER_DATA_BASE      0x10000100000ull
+#define USER_STACK_TOP      0x10000200000ull
+
+// Exit code of a process killed by an exception: this plus the vector
+#define PROCESS_EXIT_FAULT  128
+#define PROCESS_NO_FAULT    0xFFFFFFFF
+
+typedef struct {
+    const char* name;
+    const char* description;
+    const u8* start;                // Position-independent code, copied to USER_CODE_BASE
+    const u8* end;
+} user_program_t;
+
+typedef struct process {
+    u64 rsp;                        // Kernel stack while in user mode - must stay first (syscall_entry.asm)
+    const user_program_t* program;
+    u64* space;                     // PML4 of the address space
+    u64 code_page;                  // Physical pages mapped at the bases above
+    u64 data_page;
+    u64 stack_page;
+    u64 exit_code;
+    u32 fault;                      // Exception that ended the last run, or PROCESS_NO_FAULT
+    u64 fault_rip;
+    u64 fault_address;              // CR2 of a page fault
+} process_t;
+
+// Built-in programs by index (NULL past the last) or name (NULL if none)
+const user_program_t* process_program(u32 index);
+const user_program_t* process_find_program(const char* name);
+
+// Set up a process running program; false when out of memory
+bool process_create(process_t* process, const user_program_t* program);
+
+// Run the process in user mode on the calling kernel thread, with arg in
+// rdi, until it exits. Returns its exit code.
+u64 process_run(process_t* process, u64 arg);
+
+// Free the pages and page tables of a process
+void process_destroy(process_t* process);
+
+// Process running on the calling thread (NULL in the kernel)
+process_t* process_current();
+
+// End the current process, returning code from process_run (never returns)
+void process_exit(u64 code);
+
+// True if [address, address + length) lies in pages of the current process
+bool process_user_range(u64 address, u64 length);
+
+// Exception hook: end the current process if it raised regs
+void process_fault(registers_t* regs);
+
+// Called by user_enter with the kernel stack below its frame
+void process_set_kernel_stack(u64 rsp);
+
+#endif
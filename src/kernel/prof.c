@@ -0,0 +1,297 @@
+#include "prof.h"
+#include "ksyms.h"
+#include "low_level.h"
+#include "util.h"
+#include "../cpu/apic.h"
+#include "../cpu/percpu.h"
+#include "../cpu/smp.h"
+#include "../drivers/serial.h"
+#include "../drivers/timer.h"
+#include "../memory/kmalloc.h"
+
+// A frame pointer further than this above the one before it is taken as
+// garbage (kernel stacks are 16 KB)
+#define PROF_FRAME_SPAN     0x10000
+
+// Frames must be in the identity map to be read safely
+#define PROF_FRAME_LIMIT    0x100000000ull
+
+// Bounds of the kernel's code (linker.ld)
+extern char __text_start[];
+extern char __text_end[];
+
+typedef struct {
+    prof_sample_t* samples;
+    volatile u32 count;
+    volatile u64 dropped;
+} prof_cpu_t;
+
+static prof_cpu_t* cpus = NULL;
+static u32 cpu_count = 0;
+static volatile bool running = false;
+static bool use_pit = false;
+static u32 rate = 0;
+
+// Per-symbol counters for prof_top, the last one for unknown addresses
+static u32* self_counts = NULL;
+static u32* total_counts = NULL;
+
+static bool prof_in_text(u64 address) {
+    return address >= (u64)__text_start && address < (u64)__text_end;
+}
+
+// Record the interrupted context on the calling CPU
+static void prof_record(registers_t* regs) {
+    u32 index = cpu_current_index();
+    if (!running || index >= cpu_count) {
+        return;
+    }
+    prof_cpu_t* cpu = &cpus[index];
+    if (cpu->count == PROF_SAMPLES) {
+        cpu->dropped++;
+        return;
+    }
+
+    prof_sample_t* sample = &cpu->samples[cpu->count];
+    u32 depth = 0;
+    sample->pc[depth++] = regs->rip;
+
+    // Follow the saved frame pointers up the interrupted kernel stack for as
+    // long as they keep going up and return into the kernel's code
+    if (!(regs->cs & 3)) {
+        u64 low = regs->user_rsp;
+        u64 frame = regs->rbp;
+        while (depth < PROF_DEPTH && frame >= low && frame - low < PROF_FRAME_SPAN &&
+               frame < PROF_FRAME_LIMIT && !(frame & 7)) {
+            u64 ret = ((u64*)frame)[1];
+            if (!prof_in_text(ret)) {
+                break;
+            }
+            sample->pc[depth++] = ret;
+            low = frame + 16;
+            frame = ((u64*)frame)[0];
+        }
+    }
+    sample->depth = depth;
+
+    // Publish the sample only once it is complete
+    __sync_synchronize();
+    cpu->count++;
+}
+
+static void prof_interrupt(registers_t* regs) {
+    prof_record(regs);
+}
+
+void prof_timer_tick(registers_t* regs) {
+    if (use_pit) {
+        prof_record(regs);
+    }
+}
+
+static void prof_cpu_start(u64 hz) {
+    lapic_timer_start(IRQ_LAPIC_TIMER, (u32)hz);
+}
+
+static void prof_cpu_stop(u64 arg) {
+    lapic_timer_stop();
+}
+
+// Run func(arg) on every online CPU, this one included. Interrupts stay off
+// so the caller can't move to another CPU halfway.
+static void prof_on_each_cpu(smp_call_func_t func, u64 arg) {
+    u64 flags = cpu_irq_save();
+    u32 self = cpu_current_index();
+    for (u32 i = 0; i < smp_cpu_count(); i++) {
+        percpu_t* cpu = smp_get_cpu(i);
+        if (i == self || !cpu || !cpu->online) {
+            continue;
+        }
+
+        // The mailbox may still hold an earlier call
+        while (!smp_call_function(i, func, arg) && cpu->online) {
+            __asm__ __volatile__("pause");
+        }
+    }
+    func(arg);
+    cpu_irq_restore(flags);
+}
+
+// Allocate the buffers the first time (kmalloc never frees, so they stay)
+static bool prof_setup() {
+    if (cpus) {
+        return true;
+    }
+    u32 count = smp_cpu_count();
+    if (count == 0) {
+        count = 1;
+    }
+    prof_cpu_t* new_cpus = (prof_cpu_t*)kmalloc(count * sizeof(prof_cpu_t));
+    self_counts = (u32*)kmalloc((ksym_count + 1) * sizeof(u32));
+    total_counts = (u32*)kmalloc((ksym_count + 1) * sizeof(u32));
+    if (!new_cpus || !self_counts || !total_counts) {
+        return false;
+    }
+    for (u32 i = 0; i < count; i++) {
+        new_cpus[i].samples = (prof_sample_t*)kmalloc(PROF_SAMPLES * sizeof(prof_sample_t));
+        new_cpus[i].count = 0;
+        new_cpus[i].dropped = 0;
+        if (!new_cpus[i].samples) {
+            return false;
+        }
+    }
+    cpus = new_cpus;
+    cpu_count = count;
+    register_interrupt_handler(IRQ_LAPIC_TIMER, prof_interrupt);
+    return true;
+}
+
+u32 prof_start(u32 hz) {
+    if (running) {
+        prof_stop();
+    }
+    if (!prof_setup()) {
+        return 0;
+    }
+
+    if (hz == 0) {
+        hz = PROF_DEFAULT_HZ;
+    } else if (hz > PROF_MAX_HZ) {
+        hz = PROF_MAX_HZ;
+    }
+    for (u32 i = 0; i < cpu_count; i++) {
+        cpus[i].count = 0;
+        cpus[i].dropped = 0;
+    }
+
+    // Without a local APIC timer, sample on the tick at whatever rate it has
+    use_pit = !interrupts_using_apic() || !lapic_timer_hz();
+    rate = use_pit ? timer_get_frequency() : hz;
+    __sync_synchronize();
+    running = true;
+    if (!use_pit) {
+        prof_on_each_cpu(prof_cpu_start, hz);
+    }
+    return rate;
+}
+
+void prof_stop() {
+    if (!running) {
+        return;
+    }
+    running = false;
+    if (!use_pit) {
+        prof_on_each_cpu(prof_cpu_stop, 0);
+    }
+    use_pit = false;
+}
+
+bool prof_running() {
+    return running;
+}
+
+u32 prof_hz() {
+    return rate;
+}
+
+u64 prof_sample_count() {
+    u64 total = 0;
+    for (u32 i = 0; i < cpu_count; i++) {
+        total += cpus[i].count;
+    }
+    return total;
+}
+
+u64 prof_dropped() {
+    u64 total = 0;
+    for (u32 i = 0; i < cpu_count; i++) {
+        total += cpus[i].dropped;
+    }
+    return total;
+}
+
+// Counter slot of an address
+static u32 prof_bucket(u64 address) {
+    int index = ksym_find(address);
+    return index < 0 ? ksym_count : (u32)index;
+}
+
+u32 prof_top(prof_entry_t* entries, u32 max) {
+    if (!cpus) {
+        return 0;
+    }
+    memory_set((char*)self_counts, 0, (ksym_count + 1) * sizeof(u32));
+    memory_set((char*)total_counts, 0, (ksym_count + 1) * sizeof(u32));
+
+    for (u32 c = 0; c < cpu_count; c++) {
+        u32 count = cpus[c].count;
+        for (u32 s = 0; s < count; s++) {
+            const prof_sample_t* sample = &cpus[c].samples[s];
+            u32 buckets[PROF_DEPTH];
+            for (u32 d = 0; d < sample->depth; d++) {
+                buckets[d] = prof_bucket(sample->pc[d]);
+
+                // Count a function once per sample however deep it recurses
+                bool seen = false;
+                for (u32 e = 0; e < d && !seen; e++) {
+                    seen = buckets[e] == buckets[d];
+                }
+                if (!seen) {
+                    total_counts[buckets[d]]++;
+                }
+            }
+            self_counts[buckets[0]]++;
+        }
+    }
+
+    // Pick the hottest functions one at a time, clearing each as it is taken
+    u32 found = 0;
+    while (found < max) {
+        u32 best = 0;
+        for (u32 b = 1; b <= ksym_count; b++) {
+            if (self_counts[b] > self_counts[best]) {
+                best = b;
+            }
+        }
+        if (self_counts[best] == 0) {
+            break;
+        }
+        entries[found].name = best < ksym_count ? ksym_name(best) : "[unknown]";
+        entries[found].self = self_counts[best];
+        entries[found].total = total_counts[best];
+        self_counts[best] = 0;
+        found++;
+    }
+    return found;
+}
+
+u64 prof_dump() {
+    serial_write("prof-begin hz=");
+    serial_write_number(rate);
+    serial_write(" cpus=");
+    serial_write_number(cpu_count);
+    serial_write("\n");
+
+    u64 written = 0;
+    for (u32 c = 0; c < cpu_count; c++) {
+        u32 count = cpus[c].count;
+        for (u32 s = 0; s < count; s++) {
+            const prof_sample_t* sample = &cpus[c].samples[s];
+            serial_write("prof ");
+            serial_write_number(c);
+            for (u32 d = 0; d < sample->depth; d++) {
+                serial_write_char(' ');
+                serial_write_hex(sample->pc[d]);
+            }
+            serial_write_char('\n');
+            written++;
+        }
+    }
+
+    serial_write("prof-end samples=");
+    serial_write_number(written);
+    serial_write(" dropped=");
+    serial_write_number(prof_dropped());
+    serial_write("\n");
+    return written;
+}
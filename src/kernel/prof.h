@@ -0,0 +1,58 @@
+#ifndef PROF_H
+#define PROF_H
+
+#include "../include/types.h"
+#include "../cpu/interrupts.h"
+
+// Sampling profiler. Each CPU's local APIC timer interrupts it at the
+// chosen rate, and the interrupted RIP, followed by the return addresses
+// found by walking the frame pointers, goes into a buffer of that CPU.
+// Without a local APIC the PIT tick samples whichever CPU takes it.
+#define PROF_DEPTH          8       // Frames kept per sample, interrupted RIP first
+#define PROF_SAMPLES        4096    // Samples buffered per CPU
+#define PROF_DEFAULT_HZ     997     // Prime, so sampling doesn't run in step with the tick
+#define PROF_MAX_HZ         10000
+
+typedef struct {
+    u32 depth;                      // Frames in pc
+    u32 reserved;
+    u64 pc[PROF_DEPTH];
+} prof_sample_t;
+
+// A function's share of the samples
+typedef struct {
+    const char* name;               // "[unknown]" outside the kernel's code
+    u32 self;                       // Samples taken in the function itself
+    u32 total;                      // Samples with it anywhere on the call chain
+} prof_entry_t;
+
+// Clear the buffers and start sampling every CPU hz times a second (0 for
+// the default). Returns the rate in use, which is the tick rate when there
+// is no local APIC timer, or 0 if there is no memory for the buffers.
+u32 prof_start(u32 hz);
+
+// Stop sampling; the samples stay until the next start
+void prof_stop();
+
+bool prof_running();
+
+// Rate of the last start, samples buffered and samples lost to full buffers
+u32 prof_hz();
+u64 prof_sample_count();
+u64 prof_dropped();
+
+// Aggregate the samples by function: fills up to max entries, most self
+// samples first, and returns how many were filled
+u32 prof_top(prof_entry_t* entries, u32 max);
+
+// Write the raw samples to the serial port, one line per sample:
+//   prof <cpu> <pc> <caller> <caller's caller>...
+// with hex addresses, between "prof-begin" and "prof-end" lines
+// (tools/proffold.c turns them into stacks for a flame graph). Returns
+// the number of samples written.
+u64 prof_dump();
+
+// Called from the PIT tick: takes a sample when there is no local APIC timer
+void prof_timer_tick(registers_t* regs);
+
+#endif
@@ -0,0 +1,164 @@
+#include "../include/types.h"
+#include "softirq.h"
+#include "low_level.h"
+#include "../cpu/acpi.h"
+#include "../cpu/percpu.h"
+
+// Per-CPU bottom-half state
+typedef struct {
+    volatile u32 pending;       // Bitmask of raised softirqs
+    bool active;                // Already running softirqs (no nesting)
+    tasklet_t* head;            // Tasklet queue
+    tasklet_t* tail;
+    softirq_stats_t stats;
+} softirq_cpu_t;
+
+static softirq_action_t softirq_actions[SOFTIRQ_COUNT];
+static softirq_cpu_t softirq_cpus[MAX_CPUS];
+
+// Get the state of the calling CPU
+static inline softirq_cpu_t* local_softirq() {
+    return &softirq_cpus[cpu_current_index()];
+}
+
+// Run the queued tasklets, at most TASKLET_BUDGET of them
+static void tasklet_action() {
+    softirq_cpu_t* cpu = local_softirq();
+
+    for (int budget = TASKLET_BUDGET; budget > 0; budget--) {
+        // Dequeue with interrupts off - top halves may be adding
+        u64 flags = cpu_irq_save();
+        tasklet_t* tasklet = cpu->head;
+        if (tasklet) {
+            cpu->head = tasklet->next;
+            if (!cpu->head) {
+                cpu->tail = NULL;
+            }
+            tasklet->scheduled = false;
+        }
+        cpu_irq_restore(flags);
+
+        if (!tasklet) {
+            return;
+        }
+
+        tasklet->func(tasklet->data);
+        cpu->stats.tasklets++;
+    }
+
+    // Out of budget - leave the rest for the next pass
+    if (cpu->head) {
+        cpu->pending |= (1 << SOFTIRQ_TASKLET);
+    }
+}
+
+// Initialize the softirq/tasklet machinery
+void softirq_init() {
+    for (int i = 0; i < SOFTIRQ_COUNT; i++) {
+        softirq_actions[i] = 0;
+    }
+
+    for (int i = 0; i < MAX_CPUS; i++) {
+        softirq_cpus[i].pending = 0;
+        softirq_cpus[i].active = false;
+        softirq_cpus[i].head = NULL;
+        softirq_cpus[i].tail = NULL;
+        softirq_cpus[i].stats.runs = 0;
+        softirq_cpus[i].stats.tasklets = 0;
+        softirq_cpus[i].stats.deferred = 0;
+    }
+
+    softirq_register(SOFTIRQ_TASKLET, tasklet_action);
+}
+
+// Register the action for a softirq number
+void softirq_register(u32 nr, softirq_action_t action) {
+    if (nr < SOFTIRQ_COUNT) {
+        softirq_actions[nr] = action;
+    }
+}
+
+// Mark a softirq pending on the calling CPU
+void raise_softirq(u32 nr) {
+    u64 flags = cpu_irq_save();
+    local_softirq()->pending |= (1 << nr);
+    cpu_irq_restore(flags);
+}
+
+// Check whether the calling CPU has softirq work pending
+bool softirq_pending() {
+    return local_softirq()->pending != 0;
+}
+
+// Check whether the calling CPU is in the middle of running softirqs
+bool softirq_in_progress() {
+    return local_softirq()->active;
+}
+
+// Run pending softirqs with interrupts enabled, within the budget
+void softirq_run() {
+    u64 flags = cpu_irq_save();
+    softirq_cpu_t* cpu = local_softirq();
+
+    // A nested interrupt arriving while we run leaves its work to us
+    if (cpu->active || !cpu->pending) {
+        cpu_irq_restore(flags);
+        return;
+    }
+    cpu->active = true;
+
+    for (int restart = 0; restart < SOFTIRQ_MAX_RESTART && cpu->pending; restart++) {
+        u32 pending = cpu->pending;
+        cpu->pending = 0;
+
+        __asm__ __volatile__("sti" : : : "memory");
+        for (u32 nr = 0; pending; nr++, pending >>= 1) {
+            if ((pending & 1) && softirq_actions[nr]) {
+                softirq_actions[nr]();
+                cpu->stats.runs++;
+            }
+        }
+        __asm__ __volatile__("cli" : : : "memory");
+    }
+
+    // Anything still pending is picked up by the idle loop
+    if (cpu->pending) {
+        cpu->stats.deferred++;
+    }
+
+    cpu->active = false;
+    cpu_irq_restore(flags);
+}
+
+// Prepare a tasklet
+void tasklet_init(tasklet_t* tasklet, void (*func)(u64), u64 data) {
+    tasklet->next = NULL;
+    tasklet->func = func;
+    tasklet->data = data;
+    tasklet->scheduled = false;
+}
+
+// Queue a tasklet on the calling CPU
+void tasklet_schedule(tasklet_t* tasklet) {
+    u64 flags = cpu_irq_save();
+    softirq_cpu_t* cpu = local_softirq();
+
+    if (!tasklet->scheduled) {
+        tasklet->scheduled = true;
+        tasklet->next = NULL;
+        if (cpu->tail) {
+            cpu->tail->next = tasklet;
+        } else {
+            cpu->head = tasklet;
+        }
+        cpu->tail = tasklet;
+        cpu->pending |= (1 << SOFTIRQ_TASKLET);
+    }
+
+    cpu_irq_restore(flags);
+}
+
+// Get the bottom-half statistics of a CPU
+const softirq_stats_t* softirq_get_stats(u32 cpu) {
+    return &softirq_cpus[cpu < MAX_CPUS ? cpu : 0].stats;
+}
@@ -0,0 +1,62 @@
+#ifndef SOFTIRQ_H
+#define SOFTIRQ_H
+
+#include "../include/types.h"
+
+// Softirq numbers - lower numbers run first
+#define SOFTIRQ_TASKLET    0
+#define SOFTIRQ_COUNT      1
+
+// Bounds on one pass so bottom halves cannot starve the interrupted code.
+// Work left over after the budget is picked up by the idle loop.
+#define SOFTIRQ_MAX_RESTART    8
+#define TASKLET_BUDGET         16
+
+// Deferred action run with interrupts enabled
+typedef void (*softirq_action_t)();
+
+// A queued unit of deferred work
+typedef struct tasklet {
+    struct tasklet* next;
+    void (*func)(u64 data);
+    u64 data;
+    volatile bool scheduled;    // Already on a queue, don't add it twice
+} tasklet_t;
+
+// Per-CPU bottom-half statistics
+typedef struct {
+    u64 runs;                   // Softirq actions executed
+    u64 tasklets;               // Tasklets executed
+    u64 deferred;               // Passes that ran out of budget
+} softirq_stats_t;
+
+// Initialize the softirq/tasklet machinery
+void softirq_init();
+
+// Register the action for a softirq number
+void softirq_register(u32 nr, softirq_action_t action);
+
+// Mark a softirq pending on the calling CPU (safe from interrupt handlers)
+void raise_softirq(u32 nr);
+
+// Run pending softirqs with interrupts enabled, within the budget.
+// Called on the way out of the IRQ path and from the idle loop.
+void softirq_run();
+
+// Check whether the calling CPU has softirq work pending
+bool softirq_pending();
+
+// Check whether the calling CPU is in the middle of running softirqs.
+// Threads must not be switched while this is true.
+bool softirq_in_progress();
+
+// Prepare a tasklet
+void tasklet_init(tasklet_t* tasklet, void (*func)(u64), u64 data);
+
+// Queue a tasklet on the calling CPU (safe from interrupt handlers)
+void tasklet_schedule(tasklet_t* tasklet);
+
+// Get the bottom-half statistics of a CPU
+const softirq_stats_t* softirq_get_stats(u32 cpu);
+
+#endif
@@ -0,0 +1,373 @@
+#include "../include/types.h"
+#include "sync.h"
+#include "low_level.h"
+
+// Keep the compiler from moving memory accesses across this point. x86
+// doesn't reorder loads with loads or stores with stores, so this is all a
+// lock release or a queue publish needs.
+#define compiler_barrier() __asm__ __volatile__("" : : : "memory")
+
+static inline void cpu_relax() {
+    __asm__ __volatile__("pause" : : : "memory");
+}
+
+static lock_stats_t* volatile lock_stats_list = NULL;
+
+// Name a stats block and add it to the registry
+void lock_stats_init(lock_stats_t* stats, const char* name) {
+    stats->name = name;
+    lock_stats_reset(stats);
+
+    lock_stats_t* head;
+    do {
+        head = lock_stats_list;
+        stats->next = head;
+    } while (!__sync_bool_compare_and_swap(&lock_stats_list, head, stats));
+}
+
+// Zero the counters of a stats block
+void lock_stats_reset(lock_stats_t* stats) {
+    stats->acquisitions = 0;
+    stats->contended = 0;
+    stats->wait_cycles_total = 0;
+    stats->wait_cycles_max = 0;
+}
+
+// Iterate over the registered stats
+lock_stats_t* lock_stats_first() {
+    return lock_stats_list;
+}
+
+// Account one acquisition. Called with the lock held, so plain updates are
+// safe for exclusive locks.
+static void lock_stats_record(lock_stats_t* stats, u64 wait_start) {
+    stats->acquisitions++;
+    if (wait_start) {
+        u64 waited = cpu_read_tsc() - wait_start;
+        stats->contended++;
+        stats->wait_cycles_total += waited;
+        if (waited > stats->wait_cycles_max) {
+            stats->wait_cycles_max = waited;
+        }
+    }
+}
+
+// Ticket spinlock
+
+void spin_lock_init(spinlock_t* lock, lock_stats_t* stats) {
+    lock->next = 0;
+    lock->owner = 0;
+    lock->stats = stats;
+}
+
+void spin_lock(spinlock_t* lock) {
+    u32 ticket = __sync_fetch_and_add(&lock->next, 1);
+    u64 wait_start = 0;
+
+    if (lock->owner != ticket) {
+        if (lock->stats) {
+            wait_start = cpu_read_tsc();
+        }
+        while (lock->owner != ticket) {
+            cpu_relax();
+        }
+    }
+    compiler_barrier();
+
+    if (lock->stats) {
+        lock_stats_record(lock->stats, wait_start);
+    }
+}
+
+void spin_unlock(spinlock_t* lock) {
+    compiler_barrier();
+    lock->owner = lock->owner + 1;  // Only the holder writes owner
+}
+
+u64 spin_lock_irqsave(spinlock_t* lock) {
+    u64 flags = cpu_irq_save();
+    spin_lock(lock);
+    return flags;
+}
+
+void spin_unlock_irqrestore(spinlock_t* lock, u64 flags) {
+    spin_unlock(lock);
+    cpu_irq_restore(flags);
+}
+
+// MCS queue lock
+
+void mcs_lock_init(mcs_lock_t* lock, lock_stats_t* stats) {
+    lock->tail = NULL;
+    lock->stats = stats;
+}
+
+void mcs_lock(mcs_lock_t* lock, mcs_node_t* node) {
+    node->next = NULL;
+    node->locked = 1;
+
+    // xchg is a full barrier on x86
+    mcs_node_t* prev = __atomic_exchange_n(&lock->tail, node, __ATOMIC_SEQ_CST);
+    u64 wait_start = 0;
+
+    if (prev) {
+        if (lock->stats) {
+            wait_start = cpu_read_tsc();
+        }
+        prev->next = node;
+        while (node->locked) {
+            cpu_relax();
+        }
+    }
+    compiler_barrier();
+
+    if (lock->stats) {
+        lock_stats_record(lock->stats, wait_start);
+    }
+}
+
+void mcs_unlock(mcs_lock_t* lock, mcs_node_t* node) {
+    if (!node->next) {
+        // No known successor - try to mark the lock free
+        if (__sync_bool_compare_and_swap(&lock->tail, node, NULL)) {
+            return;
+        }
+        // Someone is between the exchange and linking in, wait for them
+        while (!node->next) {
+            cpu_relax();
+        }
+    }
+    compiler_barrier();
+    node->next->locked = 0;
+}
+
+u64 mcs_lock_irqsave(mcs_lock_t* lock, mcs_node_t* node) {
+    u64 flags = cpu_irq_save();
+    mcs_lock(lock, node);
+    return flags;
+}
+
+void mcs_unlock_irqrestore(mcs_lock_t* lock, mcs_node_t* node, u64 flags) {
+    mcs_unlock(lock, node);
+    cpu_irq_restore(flags);
+}
+
+// Reader-writer lock
+
+void rwlock_init(rwlock_t* lock, lock_stats_t* stats) {
+    lock->count = 0;
+    lock->writers_waiting = 0;
+    lock->stats = stats;
+}
+
+void read_lock(rwlock_t* lock) {
+    u64 wait_start = 0;
+
+    while (1) {
+        s32 count = lock->count;
+        if (count >= 0 && !lock->writers_waiting &&
+            __sync_bool_compare_and_swap(&lock->count, count, count + 1)) {
+            break;
+        }
+        if (lock->stats && !wait_start) {
+            wait_start = cpu_read_tsc();
+        }
+        cpu_relax();
+    }
+
+    // Readers share the lock, so their counters need atomic updates
+    lock_stats_t* stats = lock->stats;
+    if (stats) {
+        __sync_fetch_and_add(&stats->acquisitions, 1);
+        if (wait_start) {
+            u64 waited = cpu_read_tsc() - wait_start;
+            __sync_fetch_and_add(&stats->contended, 1);
+            __sync_fetch_and_add(&stats->wait_cycles_total, waited);
+            if (waited > stats->wait_cycles_max) {
+                stats->wait_cycles_max = waited;  // Racy, only ever approximate
+            }
+        }
+    }
+}
+
+void read_unlock(rwlock_t* lock) {
+    __sync_fetch_and_sub(&lock->count, 1);
+}
+
+void write_lock(rwlock_t* lock) {
+    u64 wait_start = 0;
+
+    if (!__sync_bool_compare_and_swap(&lock->count, 0, -1)) {
+        if (lock->stats) {
+            wait_start = cpu_read_tsc();
+        }
+        __sync_fetch_and_add(&lock->writers_waiting, 1);
+        while (!__sync_bool_compare_and_swap(&lock->count, 0, -1)) {
+            cpu_relax();
+        }
+        __sync_fetch_and_sub(&lock->writers_waiting, 1);
+    }
+
+    if (lock->stats) {
+        lock_stats_record(lock->stats, wait_start);
+    }
+}
+
+void write_unlock(rwlock_t* lock) {
+    compiler_barrier();
+    lock->count = 0;
+}
+
+u64 read_lock_irqsave(rwlock_t* lock) {
+    u64 flags = cpu_irq_save();
+    read_lock(lock);
+    return flags;
+}
+
+void read_unlock_irqrestore(rwlock_t* lock, u64 flags) {
+    read_unlock(lock);
+    cpu_irq_restore(flags);
+}
+
+u64 write_lock_irqsave(rwlock_t* lock) {
+    u64 flags = cpu_irq_save();
+    write_lock(lock);
+    return flags;
+}
+
+void write_unlock_irqrestore(rwlock_t* lock, u64 flags) {
+    write_unlock(lock);
+    cpu_irq_restore(flags);
+}
+
+// Sequence lock
+
+void seqlock_init(seqlock_t* lock, lock_stats_t* stats) {
+    lock->sequence = 0;
+    spin_lock_init(&lock->lock, stats);
+}
+
+void write_seqlock(seqlock_t* lock) {
+    spin_lock(&lock->lock);
+    lock->sequence = lock->sequence + 1;
+    compiler_barrier();
+}
+
+void write_sequnlock(seqlock_t* lock) {
+    compiler_barrier();
+    lock->sequence = lock->sequence + 1;
+    spin_unlock(&lock->lock);
+}
+
+u32 read_seqbegin(seqlock_t* lock) {
+    u32 sequence;
+    while ((sequence = lock->sequence) & 1) {
+        cpu_relax();
+    }
+    compiler_barrier();
+    return sequence;
+}
+
+bool read_seqretry(seqlock_t* lock, u32 sequence) {
+    compiler_barrier();
+    return lock->sequence != sequence;
+}
+
+// Single-producer single-consumer ring
+
+void spsc_init(spsc_queue_t* queue, u64* slots, u32 capacity) {
+    queue->slots = slots;
+    queue->mask = capacity - 1;
+    queue->head = 0;
+    queue->tail = 0;
+}
+
+bool spsc_push(spsc_queue_t* queue, u64 value) {
+    u32 head = queue->head;
+    if (head - queue->tail > queue->mask) {
+        return false;  // Full
+    }
+    queue->slots[head & queue->mask] = value;
+    compiler_barrier();
+    queue->head = head + 1;
+    return true;
+}
+
+bool spsc_pop(spsc_queue_t* queue, u64* value) {
+    u32 tail = queue->tail;
+    if (tail == queue->head) {
+        return false;  // Empty
+    }
+    compiler_barrier();
+    *value = queue->slots[tail & queue->mask];
+    compiler_barrier();
+    queue->tail = tail + 1;
+    return true;
+}
+
+bool spsc_empty(spsc_queue_t* queue) {
+    return queue->tail == queue->head;
+}
+
+// Multi-producer multi-consumer queue
+
+void mpmc_init(mpmc_queue_t* queue, mpmc_cell_t* cells, u64 capacity) {
+    queue->cells = cells;
+    queue->mask = capacity - 1;
+    for (u64 i = 0; i < capacity; i++) {
+        cells[i].sequence = i;
+    }
+    queue->enqueue_pos = 0;
+    queue->dequeue_pos = 0;
+}
+
+bool mpmc_push(mpmc_queue_t* queue, u64 value) {
+    mpmc_cell_t* cell;
+    u64 pos = queue->enqueue_pos;
+
+    while (1) {
+        cell = &queue->cells[pos & queue->mask];
+        s64 diff = (s64)cell->sequence - (s64)pos;
+        if (diff == 0) {
+            // Cell is free for this position - claim it
+            if (__sync_bool_compare_and_swap(&queue->enqueue_pos, pos, pos + 1)) {
+                break;
+            }
+            pos = queue->enqueue_pos;
+        } else if (diff < 0) {
+            return false;  // Full
+        } else {
+            pos = queue->enqueue_pos;  // Another producer got there first
+        }
+    }
+
+    cell->value = value;
+    compiler_barrier();
+    cell->sequence = pos + 1;
+    return true;
+}
+
+bool mpmc_pop(mpmc_queue_t* queue, u64* value) {
+    mpmc_cell_t* cell;
+    u64 pos = queue->dequeue_pos;
+
+    while (1) {
+        cell = &queue->cells[pos & queue->mask];
+        s64 diff = (s64)cell->sequence - (s64)(pos + 1);
+        if (diff == 0) {
+            if (__sync_bool_compare_and_swap(&queue->dequeue_pos, pos, pos + 1)) {
+                break;
+            }
+            pos = queue->dequeue_pos;
+        } else if (diff < 0) {
+            return false;  // Empty
+        } else {
+            pos = queue->dequeue_pos;
+        }
+    }
+
+    *value = cell->value;
+    compiler_barrier();
+    cell->sequence = pos + queue->mask + 1;
+    return true;
+}
@@ -0,0 +1,129 @@
+#ifndef SYNC_H
+#define SYNC_H
+
+#include "../include/types.h"
+
+// Contention statistics a lock can optionally record. Locks without stats
+// (stats == NULL) skip the bookkeeping entirely.
+typedef struct lock_stats {
+    const char* name;
+    u64 acquisitions;
+    u64 contended;              // Acquisitions that had to wait
+    u64 wait_cycles_total;      // TSC cycles spent waiting
+    u64 wait_cycles_max;
+    struct lock_stats* next;    // Registry of all named stats
+} lock_stats_t;
+
+// Name a stats block and add it to the registry shown by lockstat
+void lock_stats_init(lock_stats_t* stats, const char* name);
+
+// Zero the counters of a stats block
+void lock_stats_reset(lock_stats_t* stats);
+
+// Iterate over the registered stats
+lock_stats_t* lock_stats_first();
+
+// Ticket spinlock - FIFO fair, one cache line shared by all waiters.
+// A zeroed spinlock_t is valid and unlocked.
+typedef struct {
+    volatile u32 next;          // Next ticket to hand out
+    volatile u32 owner;         // Ticket currently holding the lock
+    lock_stats_t* stats;
+} spinlock_t;
+
+void spin_lock_init(spinlock_t* lock, lock_stats_t* stats);
+void spin_lock(spinlock_t* lock);
+void spin_unlock(spinlock_t* lock);
+
+// Disable interrupts, then take the lock. Use for anything interrupt
+// handlers or the scheduler can also reach.
+u64 spin_lock_irqsave(spinlock_t* lock);
+void spin_unlock_irqrestore(spinlock_t* lock, u64 flags);
+
+// MCS queue lock - each waiter spins on its own node, so heavily contended
+// locks don't bounce one cache line between every CPU. The node lives on the
+// caller's stack for the duration of the critical section.
+typedef struct mcs_node {
+    struct mcs_node* volatile next;
+    volatile u32 locked;
+} mcs_node_t;
+
+typedef struct {
+    mcs_node_t* volatile tail;
+    lock_stats_t* stats;
+} mcs_lock_t;
+
+void mcs_lock_init(mcs_lock_t* lock, lock_stats_t* stats);
+void mcs_lock(mcs_lock_t* lock, mcs_node_t* node);
+void mcs_unlock(mcs_lock_t* lock, mcs_node_t* node);
+u64 mcs_lock_irqsave(mcs_lock_t* lock, mcs_node_t* node);
+void mcs_unlock_irqrestore(mcs_lock_t* lock, mcs_node_t* node, u64 flags);
+
+// Reader-writer spinlock. Waiting writers hold off new readers.
+typedef struct {
+    volatile s32 count;         // Readers inside, or -1 for a writer
+    volatile u32 writers_waiting;
+    lock_stats_t* stats;
+} rwlock_t;
+
+void rwlock_init(rwlock_t* lock, lock_stats_t* stats);
+void read_lock(rwlock_t* lock);
+void read_unlock(rwlock_t* lock);
+void write_lock(rwlock_t* lock);
+void write_unlock(rwlock_t* lock);
+u64 read_lock_irqsave(rwlock_t* lock);
+void read_unlock_irqrestore(rwlock_t* lock, u64 flags);
+u64 write_lock_irqsave(rwlock_t* lock);
+void write_unlock_irqrestore(rwlock_t* lock, u64 flags);
+
+// Sequence lock for small read-mostly data. Readers never block the writer;
+// they retry if a write happened while they were reading:
+//
+//     do {
+//         seq = read_seqbegin(&lock);
+//         copy = data;
+//     } while (read_seqretry(&lock, seq));
+typedef struct {
+    volatile u32 sequence;      // Odd while a write is in progress
+    spinlock_t lock;            // Serializes writers
+} seqlock_t;
+
+void seqlock_init(seqlock_t* lock, lock_stats_t* stats);
+void write_seqlock(seqlock_t* lock);
+void write_sequnlock(seqlock_t* lock);
+u32 read_seqbegin(seqlock_t* lock);
+bool read_seqretry(seqlock_t* lock, u32 sequence);
+
+// Lock-free single-producer single-consumer ring of u64 values. The
+// capacity must be a power of two; the caller provides the storage.
+typedef struct {
+    u64* slots;
+    u32 mask;
+    volatile u32 head;          // Written by the producer only
+    volatile u32 tail;          // Written by the consumer only
+} spsc_queue_t;
+
+void spsc_init(spsc_queue_t* queue, u64* slots, u32 capacity);
+bool spsc_push(spsc_queue_t* queue, u64 value);
+bool spsc_pop(spsc_queue_t* queue, u64* value);
+bool spsc_empty(spsc_queue_t* queue);
+
+// Lock-free bounded multi-producer multi-consumer queue (per-cell sequence
+// numbers). The capacity must be a power of two; the caller provides the cells.
+typedef struct {
+    volatile u64 sequence;
+    u64 value;
+} mpmc_cell_t;
+
+typedef struct {
+    mpmc_cell_t* cells;
+    u64 mask;
+    volatile u64 enqueue_pos;
+    volatile u64 dequeue_pos;
+} mpmc_queue_t;
+
+void mpmc_init(mpmc_queue_t* queue, mpmc_cell_t* cells, u64 capacity);
+bool mpmc_push(mpmc_queue_t* queue, u64 value);
+bool mpmc_pop(mpmc_queue_t* queue, u64* value);
+
+#endif
@@ -0,0 +1,90 @@
+#include "syscall.h"
+#include "process.h"
+#include "thread.h"
+#include "low_level.h"
+#include "../cpu/gdt.h"
+#include "../cpu/percpu.h"
+#include "../drivers/timer.h"
+#include "../terminal/console.h"
+
+#define MSR_EFER            0xC0000080
+#define MSR_STAR            0xC0000081
+#define MSR_LSTAR           0xC0000082
+#define MSR_FMASK           0xC0000084
+#define MSR_KERNEL_GS_BASE  0xC0000102
+
+#define EFER_SCE            (1 << 0)
+
+// RFLAGS bits cleared on entry: TF, IF, DF and AC. Interrupts stay off
+// until syscall_entry is on the kernel stack with the kernel's GS.
+#define SYSCALL_FMASK       ((1 << 8) | (1 << 9) | (1 << 10) | (1 << 18))
+
+typedef u64 (*syscall_func_t)(u64 a0, u64 a1, u64 a2, u64 a3, u64 a4);
+
+// Entry point of SYSCALL (syscall_entry.asm)
+extern void syscall_entry();
+
+static u64 sys_exit(u64 code, u64 a1, u64 a2, u64 a3, u64 a4) {
+    process_exit(code);
+    return 0;
+}
+
+static u64 sys_null(u64 a0, u64 a1, u64 a2, u64 a3, u64 a4) {
+    return 0;
+}
+
+static u64 sys_write(u64 buffer, u64 length, u64 a2, u64 a3, u64 a4) {
+    if (length > SYSCALL_WRITE_MAX || !process_user_range(buffer, length)) {
+        return SYSCALL_ERROR;
+    }
+    const char* text = (const char*)buffer;
+    for (u64 i = 0; i < length; i++) {
+        console_write_char(text[i]);
+    }
+    return length;
+}
+
+static u64 sys_ticks(u64 a0, u64 a1, u64 a2, u64 a3, u64 a4) {
+    return timer_get_ticks();
+}
+
+static u64 sys_yield(u64 a0, u64 a1, u64 a2, u64 a3, u64 a4) {
+    kthread_yield();
+    return 0;
+}
+
+static const syscall_func_t syscall_table[SYS_COUNT] = {
+    [SYS_EXIT]  = sys_exit,
+    [SYS_NULL]  = sys_null,
+    [SYS_WRITE] = sys_write,
+    [SYS_TICKS] = sys_ticks,
+    [SYS_YIELD] = sys_yield,
+};
+
+// Point SYSCALL at syscall_entry on the calling CPU
+void syscall_init_cpu() {
+    // SYSCALL loads CS from STAR[47:32] and SS from the next slot; SYSRET
+    // loads SS from the slot after STAR[63:48] and CS from the one after
+    cpu_write_msr(MSR_STAR, ((u64)(GDT_USER_CODE32 | 3) << 48) | ((u64)GDT_KERNEL_CODE << 32));
+    cpu_write_msr(MSR_LSTAR, (u64)syscall_entry);
+    cpu_write_msr(MSR_FMASK, SYSCALL_FMASK);
+
+    // GS base of user mode, swapped in by SWAPGS on the way out
+    cpu_write_msr(MSR_KERNEL_GS_BASE, 0);
+    cpu_write_msr(MSR_EFER, cpu_read_msr(MSR_EFER) | EFER_SCE);
+}
+
+// Set the kernel stack for entries from user mode on the calling CPU
+void syscall_set_kernel_stack(u64 rsp) {
+    percpu_t* cpu = this_cpu();
+    cpu->syscall_rsp = rsp;
+    cpu->tss.rsp0 = rsp;
+}
+
+// Run a system call (interrupts are enabled again by syscall_entry)
+u64 syscall_dispatch(u64 a0, u64 a1, u64 a2, u64 a3, u64 a4, u64 number) {
+    if (number >= SYS_COUNT) {
+        return SYSCALL_ERROR;
+    }
+    return syscall_table[number](a0, a1, a2, a3, a4);
+}
@@ -0,0 +1,36 @@
+#ifndef SYSCALL_H
+#define SYSCALL_H
+
+#include "../include/types.h"
+
+// System calls from user mode, entered with SYSCALL. The number goes in
+// rax and up to five arguments in rdi, rsi, rdx, r10 and r8 (r10 stands in
+// for rcx, which SYSCALL overwrites with the return address); the result
+// comes back in rax. rcx and r11 are clobbered by the instruction and the
+// other argument registers come back zeroed; rbx, rbp, rsp and r12-r15 are
+// preserved.
+#define SYS_EXIT            0       // exit(code): end the process
+#define SYS_NULL            1       // Do nothing, return 0 (the benchmarked round trip)
+#define SYS_WRITE           2       // write(buffer, length): print to the console, returns length
+#define SYS_TICKS           3       // Timer ticks since boot
+#define SYS_YIELD           4       // Let other threads run
+#define SYS_COUNT           5
+
+// Returned for an unknown number or a bad argument
+#define SYSCALL_ERROR       ((u64)-1)
+
+// Longest write a process can make in one call
+#define SYSCALL_WRITE_MAX   4096
+
+// Point SYSCALL at syscall_entry on the calling CPU (EFER.SCE and MSRs
+// STAR, LSTAR and FMASK)
+void syscall_init_cpu();
+
+// Kernel stack the calling CPU switches to on a system call or an
+// interrupt from user mode (per-CPU syscall_rsp and TSS rsp0)
+void syscall_set_kernel_stack(u64 rsp);
+
+// C half of syscall_entry: look the number up in the table and run it
+u64 syscall_dispatch(u64 a0, u64 a1, u64 a2, u64 a3, u64 a4, u64 number);
+
+#endif
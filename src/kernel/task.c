@@ -0,0 +1,296 @@
+#include "../include/types.h"
+#include "task.h"
+#include "low_level.h"
+#include "softirq.h"
+#include "idle.h"
+#include "../memory/kmalloc.h"
+#include "../cpu/acpi.h"
+#include "../cpu/interrupts.h"
+#include "../cpu/percpu.h"
+#include "../cpu/smp.h"
+
+// Chase-Lev work-stealing deque. The owning CPU pushes and pops at the
+// bottom, other CPUs steal from the top. Indices only ever grow.
+typedef struct {
+    volatile s64 top;
+    volatile s64 bottom;
+    task_t* volatile slots[TASK_DEQUE_SIZE];
+} task_deque_t;
+
+// Per-CPU executor state
+typedef struct {
+    task_deque_t deque;
+    u32 victim;                 // Next CPU to try stealing from
+    task_stats_t stats;
+} task_cpu_t;
+
+static task_cpu_t* task_cpus = NULL;   // MAX_CPUS entries, from kmalloc
+static volatile u32 idle_mask = 0;     // CPUs halted waiting for work
+static bool task_ready = false;
+
+// Get the state of the calling CPU
+static inline task_cpu_t* local_task_cpu() {
+    return &task_cpus[cpu_current_index()];
+}
+
+// Push at the bottom (owner only). Returns false when the deque is full.
+static bool deque_push(task_deque_t* deque, task_t* task) {
+    s64 bottom = deque->bottom;
+    s64 top = deque->top;
+    if (bottom - top >= TASK_DEQUE_SIZE) {
+        return false;
+    }
+
+    deque->slots[bottom % TASK_DEQUE_SIZE] = task;
+    __asm__ __volatile__("" : : : "memory");  // Stores are not reordered on x86
+    deque->bottom = bottom + 1;
+    return true;
+}
+
+// Pop from the bottom (owner only). Races a thief only for the last task.
+static task_t* deque_pop(task_deque_t* deque) {
+    s64 bottom = deque->bottom - 1;
+    deque->bottom = bottom;
+    __sync_synchronize();  // The bottom store must be seen before reading top
+    s64 top = deque->top;
+
+    if (top > bottom) {
+        deque->bottom = bottom + 1;  // Empty
+        return NULL;
+    }
+
+    task_t* task = deque->slots[bottom % TASK_DEQUE_SIZE];
+    if (top == bottom) {
+        // Last task - whoever advances top gets it
+        if (!__sync_bool_compare_and_swap(&deque->top, top, top + 1)) {
+            task = NULL;
+        }
+        deque->bottom = bottom + 1;
+    }
+    return task;
+}
+
+// Steal from the top (any CPU). Sets *lost when a race was lost.
+static task_t* deque_steal(task_deque_t* deque, bool* lost) {
+    s64 top = deque->top;
+    __sync_synchronize();
+    s64 bottom = deque->bottom;
+
+    if (top >= bottom) {
+        return NULL;
+    }
+
+    task_t* task = deque->slots[top % TASK_DEQUE_SIZE];
+    if (!__sync_bool_compare_and_swap(&deque->top, top, top + 1)) {
+        *lost = true;
+        return NULL;
+    }
+    return task;
+}
+
+// Check whether any CPU has queued tasks
+static bool task_work_available() {
+    u32 cpus = smp_cpu_count();
+    for (u32 i = 0; i < cpus; i++) {
+        if (task_cpus[i].deque.top < task_cpus[i].deque.bottom) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Run one task and publish its completion
+static void task_execute(task_cpu_t* cpu, task_t* task) {
+    task->func(task->arg);
+    cpu->stats.executed++;
+    __sync_synchronize();
+    task->done = 1;
+}
+
+// Find one task - own deque first, then the other CPUs - and run it.
+// Returns false if there was nothing to do.
+static bool task_run_one() {
+    u64 flags = cpu_irq_save();  // A preempting thread must not touch our deque
+    u32 self = cpu_current_index();
+    task_cpu_t* cpu = &task_cpus[self];
+    task_t* task = deque_pop(&cpu->deque);
+    cpu_irq_restore(flags);
+
+    if (!task) {
+        u32 cpus = smp_cpu_count();
+        for (u32 i = 0; i < cpus && !task; i++) {
+            u32 victim = (cpu->victim + i) % cpus;
+            if (victim == self) {
+                continue;
+            }
+
+            bool lost = false;
+            task = deque_steal(&task_cpus[victim].deque, &lost);
+            if (task) {
+                cpu->stats.steals++;
+                cpu->victim = victim;  // Likely to have more
+            } else if (lost) {
+                cpu->stats.steal_failed++;
+            }
+        }
+        if (!task) {
+            cpu->victim = (cpu->victim + 1) % cpus;
+            return false;
+        }
+    }
+
+    task_execute(cpu, task);
+    return true;
+}
+
+// Wake one halted CPU, other than the caller, to come and steal
+static void task_wake_idle() {
+    u32 mask = idle_mask & ~(1 << cpu_current_index());
+    if (!mask) {
+        return;
+    }
+
+    u32 cpu = __builtin_ctz(mask);
+    // Only one spawner wakes it; the CPU re-arms its bit when it sleeps again
+    if (__sync_fetch_and_and(&idle_mask, ~(1 << cpu)) & (1 << cpu)) {
+        idle_wake_cpu(cpu);
+    }
+}
+
+// Sleep until woken, unless work shows up first
+static void task_idle(u32 self) {
+    __asm__ __volatile__("cli");
+    __sync_fetch_and_or(&idle_mask, 1 << self);
+
+    // Spawners push before reading idle_mask, so this check closes the race
+    if (task_work_available() || softirq_pending()) {
+        __sync_fetch_and_and(&idle_mask, ~(1 << self));
+        __asm__ __volatile__("sti");
+        return;
+    }
+
+    cpu_idle();
+    __sync_fetch_and_and(&idle_mask, ~(1 << self));
+}
+
+// IPI handler - nothing to do, the worker loop picks up the work
+static void task_wake_handler(registers_t* regs) {
+    local_task_cpu()->stats.wakeups++;
+}
+
+// Initialize the executor
+void task_init() {
+    // Kept out of .bss, which has to fit in low memory below the page tables
+    task_cpus = (task_cpu_t*)kmalloc(MAX_CPUS * sizeof(task_cpu_t));
+    for (int i = 0; i < MAX_CPUS; i++) {
+        task_cpus[i].deque.top = 0;
+        task_cpus[i].deque.bottom = 0;
+        task_cpus[i].victim = i + 1;
+        task_cpus[i].stats.spawned = 0;
+        task_cpus[i].stats.inline_runs = 0;
+        task_cpus[i].stats.executed = 0;
+        task_cpus[i].stats.steals = 0;
+        task_cpus[i].stats.steal_failed = 0;
+        task_cpus[i].stats.wakeups = 0;
+    }
+
+    register_interrupt_handler(IPI_WAKE, task_wake_handler);
+    task_ready = true;
+}
+
+// Queue a task on the calling CPU
+void task_spawn(task_t* task, void (*func)(u64), u64 arg) {
+    task->func = func;
+    task->arg = arg;
+    task->done = 0;
+
+    // Before task_init there is nowhere to queue it
+    if (!task_ready) {
+        func(arg);
+        task->done = 1;
+        return;
+    }
+
+    u64 flags = cpu_irq_save();
+    task_cpu_t* cpu = local_task_cpu();
+    bool queued = deque_push(&cpu->deque, task);
+    cpu_irq_restore(flags);
+
+    if (!queued) {
+        cpu->stats.inline_runs++;
+        task_execute(cpu, task);
+        return;
+    }
+
+    cpu->stats.spawned++;
+    __sync_synchronize();  // Push before reading idle_mask (see task_idle)
+    task_wake_idle();
+}
+
+// Wait for a task to finish, running other tasks meanwhile
+void task_wait(task_t* task) {
+    while (!task->done) {
+        if (!task_run_one()) {
+            __asm__ __volatile__("pause");
+        }
+    }
+    __sync_synchronize();  // See the task's results
+}
+
+// Right half of a split parallel_for range
+typedef struct {
+    u64 begin;
+    u64 end;
+    u64 grain;
+    parallel_for_func_t fn;
+    u64 arg;
+} parallel_range_t;
+
+static void parallel_for_task(u64 data);
+
+// Split the range in halves until it is small enough, spawning the right
+// halves so idle CPUs can steal the biggest pieces first
+static void parallel_for_split(u64 begin, u64 end, u64 grain, parallel_for_func_t fn, u64 arg) {
+    if (end - begin <= grain) {
+        fn(begin, end, arg);
+        return;
+    }
+
+    u64 mid = begin + (end - begin) / 2;
+    parallel_range_t right = { mid, end, grain, fn, arg };
+    task_t task;
+
+    task_spawn(&task, parallel_for_task, (u64)&right);
+    parallel_for_split(begin, mid, grain, fn, arg);
+    task_wait(&task);
+}
+
+static void parallel_for_task(u64 data) {
+    parallel_range_t* range = (parallel_range_t*)data;
+    parallel_for_split(range->begin, range->end, range->grain, range->fn, range->arg);
+}
+
+// Run fn over [begin, end) in pieces of at most grain, spread over all CPUs
+void parallel_for(u64 begin, u64 end, u64 grain, parallel_for_func_t fn, u64 arg) {
+    if (begin >= end) {
+        return;
+    }
+    parallel_for_split(begin, end, grain ? grain : 1, fn, arg);
+}
+
+// Worker loop of an application processor
+void task_worker() {
+    percpu_t* percpu = this_cpu();
+
+    while (1) {
+        softirq_run();
+        if (!task_run_one()) {
+            task_idle(percpu->index);
+        }
+    }
+}
+
+// Get the executor statistics of a CPU
+const task_stats_t* task_get_stats(u32 cpu) {
+    return &task_cpus[cpu < MAX_CPUS ? cpu : 0].stats;
+}
@@ -0,0 +1,50 @@
+#ifndef TASK_H
+#define TASK_H
+
+#include "../include/types.h"
+
+// Slots in each CPU's work-stealing deque. Spawning into a full deque runs
+// the task inline instead.
+#define TASK_DEQUE_SIZE 256
+
+// A unit of parallel work. The storage belongs to the spawner and must stay
+// valid until task_wait returns.
+typedef struct {
+    void (*func)(u64 arg);
+    u64 arg;
+    volatile u32 done;
+} task_t;
+
+// Body of a parallel_for: handles the half-open range [begin, end)
+typedef void (*parallel_for_func_t)(u64 begin, u64 end, u64 arg);
+
+// Per-CPU executor statistics
+typedef struct {
+    u64 spawned;                // Tasks pushed on this CPU's deque
+    u64 inline_runs;            // Spawns run inline because the deque was full
+    u64 executed;               // Tasks run by this CPU
+    u64 steals;                 // Tasks taken from another CPU's deque
+    u64 steal_failed;           // Steals that lost a race
+    u64 wakeups;                // Wake IPIs received (HLT idle only)
+} task_stats_t;
+
+// Initialize the executor. Call before smp_init so APs join as workers.
+void task_init();
+
+// Queue a task on the calling CPU; idle CPUs are woken to steal it
+void task_spawn(task_t* task, void (*func)(u64), u64 arg);
+
+// Wait for a task to finish, running other tasks meanwhile
+void task_wait(task_t* task);
+
+// Run fn over [begin, end) in pieces of at most grain, spread over all CPUs.
+// Returns once every piece has finished.
+void parallel_for(u64 begin, u64 end, u64 grain, parallel_for_func_t fn, u64 arg);
+
+// Worker loop of an application processor (never returns)
+void task_worker();
+
+// Get the executor statistics of a CPU
+const task_stats_t* task_get_stats(u32 cpu);
+
+#endif
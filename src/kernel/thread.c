@@ -0,0 +1,377 @@
+#include "../include/types.h"
+#include "thread.h"
+#include "low_level.h"
+#include "softirq.h"
+#include "idle.h"
+#include "syscall.h"
+#include "../cpu/percpu.h"
+#include "../memory/kmalloc.h"
+#include "../memory/virtual.h"
+#include "../drivers/timer.h"
+
+// Save callee-saved registers and stack of one thread, resume another
+extern void context_switch(u64* old_rsp, u64 new_rsp);
+
+// First code run by a new thread: calls kthread_entry(fn, arg)
+extern void kthread_start();
+
+// Per-priority FIFO run queues
+typedef struct {
+    kthread_t* head;
+    kthread_t* tail;
+} run_queue_t;
+
+static run_queue_t run_queues[KTHREAD_PRIO_LEVELS];
+static kthread_t* current = NULL;
+static kthread_t* all_threads = NULL;
+static kthread_t* sleepers = NULL;      // Sorted by wake_tick
+static kthread_t* dead_threads = NULL;  // Reused by kthread_create
+
+static kthread_t main_thread;
+static u32 next_thread_id = 0;
+static volatile bool need_resched = false;
+static u32 timeslice = KTHREAD_DEFAULT_SLICE;
+static u32 slice_left = KTHREAD_DEFAULT_SLICE;
+
+static kthread_switch_stats_t switch_stats;
+static u64 switch_start_tsc = 0;
+
+// Put a thread at the tail of its run queue
+static void enqueue(kthread_t* thread) {
+    run_queue_t* queue = &run_queues[thread->priority];
+    thread->state = KTHREAD_READY;
+    thread->next = NULL;
+    if (queue->tail) {
+        queue->tail->next = thread;
+    } else {
+        queue->head = thread;
+    }
+    queue->tail = thread;
+}
+
+// Take the first thread of the highest non-empty priority
+static kthread_t* dequeue() {
+    for (int prio = 0; prio < KTHREAD_PRIO_LEVELS; prio++) {
+        run_queue_t* queue = &run_queues[prio];
+        kthread_t* thread = queue->head;
+        if (thread) {
+            queue->head = thread->next;
+            if (!queue->head) {
+                queue->tail = NULL;
+            }
+            thread->next = NULL;
+            return thread;
+        }
+    }
+    return NULL;
+}
+
+// Make a thread ready and ask for a reschedule if it outranks the current one
+static void make_ready(kthread_t* thread) {
+    enqueue(thread);
+    if (current && thread->priority < current->priority) {
+        need_resched = true;
+    }
+}
+
+// Bookkeeping done by a thread right after it is switched in
+static void switch_finish() {
+    u64 now = cpu_read_tsc();
+    u64 cycles = now - switch_start_tsc;
+
+    switch_stats.count++;
+    switch_stats.cycles_total += cycles;
+    if (cycles < switch_stats.cycles_min || switch_stats.cycles_min == 0) {
+        switch_stats.cycles_min = cycles;
+    }
+    if (cycles > switch_stats.cycles_max) {
+        switch_stats.cycles_max = cycles;
+    }
+
+    current->run_start = now;
+    current->switches++;
+}
+
+// Pick the next thread and switch to it. Call with interrupts disabled.
+static void schedule() {
+    kthread_t* prev = current;
+    if (prev->state == KTHREAD_RUNNING) {
+        enqueue(prev);
+    }
+
+    kthread_t* next = dequeue();
+    need_resched = false;
+    slice_left = timeslice;
+
+    if (next == prev) {
+        prev->state = KTHREAD_RUNNING;
+        return;
+    }
+
+    next->state = KTHREAD_RUNNING;
+    current = next;
+
+    // A thread running a user process takes its address space along, and
+    // entries from user mode need its kernel stack
+    if (next->space != prev->space) {
+        vmm_switch_space(next->space);
+    }
+    if (next->kernel_rsp) {
+        syscall_set_kernel_stack(next->kernel_rsp);
+    }
+
+    switch_start_tsc = cpu_read_tsc();
+    prev->runtime_cycles += switch_start_tsc - prev->run_start;
+    context_switch(&prev->rsp, next->rsp);
+
+    // Back in prev, switched in by some later schedule()
+    switch_finish();
+}
+
+// C entry point of a new thread (called from kthread_start)
+void kthread_entry(void (*fn)(u64), u64 arg) {
+    switch_finish();
+    __asm__ __volatile__("sti");
+
+    fn(arg);
+    kthread_exit();
+}
+
+// Idle thread - runs only when nothing else is ready
+static void idle_thread(u64 arg) {
+    while (1) {
+        // A softirq may have woken a thread; switch to it before sleeping.
+        // cpu_idle enables interrupts atomically with the sleep, so no
+        // wakeup can slip in unnoticed.
+        __asm__ __volatile__("cli");
+        softirq_run();
+        kthread_preempt();
+        cpu_idle();
+    }
+}
+
+// Copy a thread name, truncating it to fit
+static void set_name(kthread_t* thread, const char* name) {
+    int i;
+    for (i = 0; name[i] && i < KTHREAD_NAME_LEN - 1; i++) {
+        thread->name[i] = name[i];
+    }
+    thread->name[i] = '\0';
+}
+
+// Turn the calling context into the "main" thread and start the idle thread
+void threads_init() {
+    for (int i = 0; i < KTHREAD_PRIO_LEVELS; i++) {
+        run_queues[i].head = NULL;
+        run_queues[i].tail = NULL;
+    }
+
+    main_thread.id = next_thread_id++;
+    set_name(&main_thread, "main");
+    main_thread.priority = KTHREAD_PRIO_HIGH;
+    main_thread.state = KTHREAD_RUNNING;
+    main_thread.stack = NULL;
+    main_thread.runtime_cycles = 0;
+    main_thread.run_start = cpu_read_tsc();
+    main_thread.switches = 1;
+    main_thread.space = NULL;
+    main_thread.kernel_rsp = 0;
+    main_thread.process = NULL;
+    main_thread.next = NULL;
+    main_thread.all_next = NULL;
+    all_threads = &main_thread;
+
+    switch_stats.count = 0;
+    switch_stats.cycles_total = 0;
+    switch_stats.cycles_min = 0;
+    switch_stats.cycles_max = 0;
+
+    current = &main_thread;
+    kthread_create("idle", idle_thread, 0, KTHREAD_PRIO_IDLE);
+}
+
+// Create a thread running fn(arg)
+kthread_t* kthread_create(const char* name, void (*fn)(u64), u64 arg, u8 priority) {
+    if (priority >= KTHREAD_PRIO_LEVELS) {
+        priority = KTHREAD_PRIO_LOW;
+    }
+
+    // Reuse an exited thread if there is one, otherwise allocate
+    u64 flags = cpu_irq_save();
+    kthread_t* thread = dead_threads;
+    if (thread) {
+        dead_threads = thread->next;
+    }
+    cpu_irq_restore(flags);
+
+    if (!thread) {
+        thread = (kthread_t*)kmalloc(sizeof(kthread_t));
+        if (!thread) {
+            return NULL;
+        }
+        thread->stack = kmalloc(KTHREAD_STACK_SIZE);
+        if (!thread->stack) {
+            return NULL;
+        }
+        flags = cpu_irq_save();
+        thread->all_next = all_threads;
+        all_threads = thread;
+        cpu_irq_restore(flags);
+    }
+
+    thread->id = next_thread_id++;
+    set_name(thread, name);
+    thread->priority = priority;
+    thread->runtime_cycles = 0;
+    thread->switches = 0;
+    thread->space = NULL;
+    thread->kernel_rsp = 0;
+    thread->process = NULL;
+
+    // Initial frame popped by context_switch: r15 r14 r13 r12 rbp rbx, then
+    // the return into kthread_start, which moves r12/r13 into the arguments.
+    // The return leaves rsp at the 16-byte aligned top, so kthread_start's
+    // call enters kthread_entry with rsp = 8 mod 16 as the ABI expects.
+    u64* sp = (u64*)(((u64)thread->stack + KTHREAD_STACK_SIZE) & ~0xFULL);
+    *--sp = (u64)kthread_start;
+    *--sp = 0;                      // rbx
+    *--sp = 0;                      // rbp
+    *--sp = (u64)fn;                // r12
+    *--sp = arg;                    // r13
+    *--sp = 0;                      // r14
+    *--sp = 0;                      // r15
+    thread->rsp = (u64)sp;
+
+    flags = cpu_irq_save();
+    make_ready(thread);
+    cpu_irq_restore(flags);
+
+    return thread;
+}
+
+// Give up the CPU to another ready thread
+void kthread_yield() {
+    if (!current || cpu_current_index() != 0) {
+        return;
+    }
+
+    u64 flags = cpu_irq_save();
+    schedule();
+    cpu_irq_restore(flags);
+}
+
+// Sleep for at least the given number of milliseconds
+void kthread_sleep(u32 ms) {
+    if (!current || cpu_current_index() != 0) {
+        timer_sleep(ms);
+        return;
+    }
+
+    u64 ticks = ((u64)ms * timer_get_frequency() + 999) / 1000;
+    u64 flags = cpu_irq_save();
+
+    current->state = KTHREAD_SLEEPING;
+    current->wake_tick = timer_get_ticks() + (ticks ? ticks : 1);
+
+    // Keep the sleep list sorted so the tick handler only checks the head
+    kthread_t** link = &sleepers;
+    while (*link && (*link)->wake_tick <= current->wake_tick) {
+        link = &(*link)->next;
+    }
+    current->next = *link;
+    *link = current;
+
+    schedule();
+    cpu_irq_restore(flags);
+}
+
+// Terminate the calling thread
+void kthread_exit() {
+    __asm__ __volatile__("cli");
+
+    current->state = KTHREAD_DEAD;
+    current->next = dead_threads;
+    dead_threads = current;
+
+    schedule();
+    while (1) {
+        __asm__ __volatile__("hlt");  // Never reached
+    }
+}
+
+// Get the running thread
+kthread_t* kthread_current() {
+    return current;
+}
+
+// Set the preemption time slice in timer ticks
+void kthread_set_timeslice(u32 ticks) {
+    timeslice = ticks ? ticks : 1;
+}
+
+// Block on a wait queue (interrupts must be disabled)
+void kthread_wait(wait_queue_t* queue) {
+    // Before threading is up, or on an AP, just wait for the next interrupt
+    if (!current || cpu_current_index() != 0) {
+        cpu_idle();
+        __asm__ __volatile__("cli");
+        return;
+    }
+
+    current->state = KTHREAD_BLOCKED;
+    current->next = queue->head;
+    queue->head = current;
+    schedule();
+}
+
+// Wake every thread on a wait queue
+void kthread_wake_all(wait_queue_t* queue) {
+    u64 flags = cpu_irq_save();
+    kthread_t* thread = queue->head;
+    queue->head = NULL;
+
+    while (thread) {
+        kthread_t* next = thread->next;
+        make_ready(thread);
+        thread = next;
+    }
+    cpu_irq_restore(flags);
+}
+
+// Timer tick hook: wake sleepers and expire the time slice
+void kthread_tick() {
+    if (!current || cpu_current_index() != 0) {
+        return;
+    }
+
+    u64 now = timer_get_ticks();
+    while (sleepers && sleepers->wake_tick <= now) {
+        kthread_t* thread = sleepers;
+        sleepers = thread->next;
+        make_ready(thread);
+    }
+
+    if (slice_left > 0) {
+        slice_left--;
+    }
+    if (slice_left == 0) {
+        need_resched = true;
+    }
+}
+
+// Switch threads if the current one should be preempted
+void kthread_preempt() {
+    if (need_resched && current && cpu_current_index() == 0) {
+        schedule();
+    }
+}
+
+// Iterate over all threads
+kthread_t* kthread_first() {
+    return all_threads;
+}
+
+// Get the context switch cost statistics
+const kthread_switch_stats_t* kthread_get_switch_stats() {
+    return &switch_stats;
+}
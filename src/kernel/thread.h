@@ -0,0 +1,97 @@
+#ifndef THREAD_H
+#define THREAD_H
+
+#include "../include/types.h"
+
+// Thread priorities - lower numbers always run first
+#define KTHREAD_PRIO_HIGH     0
+#define KTHREAD_PRIO_NORMAL   1
+#define KTHREAD_PRIO_LOW      2
+#define KTHREAD_PRIO_IDLE     3
+#define KTHREAD_PRIO_LEVELS   4
+
+// Thread states
+#define KTHREAD_READY         0
+#define KTHREAD_RUNNING       1
+#define KTHREAD_SLEEPING      2
+#define KTHREAD_BLOCKED       3
+#define KTHREAD_DEAD          4
+
+#define KTHREAD_STACK_SIZE    (16 * 1024)
+#define KTHREAD_NAME_LEN      16
+
+// Default time slice in timer ticks
+#define KTHREAD_DEFAULT_SLICE 2
+
+typedef struct kthread {
+    u64 rsp;                        // Saved stack pointer while switched out
+    u32 id;
+    char name[KTHREAD_NAME_LEN];
+    u8 priority;
+    u8 state;
+    u64 wake_tick;                  // When a sleeping thread becomes ready
+    void* stack;                    // Base of the stack allocation (NULL for main)
+    u64 runtime_cycles;             // TSC cycles spent running
+    u64 run_start;                  // TSC when last switched in
+    u64 switches;                   // Times switched in
+    u64* space;                     // Address space loaded while it runs (NULL = kernel)
+    u64 kernel_rsp;                 // Stack for entries from user mode (0 = none)
+    struct process* process;        // User process it is running, if any
+    struct kthread* next;           // Run queue, wait queue or sleep list link
+    struct kthread* all_next;       // List of every thread
+} kthread_t;
+
+// Threads blocked until some event happens
+typedef struct {
+    kthread_t* head;
+} wait_queue_t;
+
+// Context switch cost, measured from switch-out to switch-in
+typedef struct {
+    u64 count;
+    u64 cycles_total;
+    u64 cycles_min;
+    u64 cycles_max;
+} kthread_switch_stats_t;
+
+// Turn the calling context into the "main" thread and start the idle thread
+void threads_init();
+
+// Create a thread running fn(arg), returns NULL when out of memory
+kthread_t* kthread_create(const char* name, void (*fn)(u64), u64 arg, u8 priority);
+
+// Give up the CPU to another ready thread of the same or higher priority
+void kthread_yield();
+
+// Sleep for at least the given number of milliseconds
+void kthread_sleep(u32 ms);
+
+// Terminate the calling thread
+void kthread_exit();
+
+// Get the running thread (NULL before threads_init)
+kthread_t* kthread_current();
+
+// Set the preemption time slice in timer ticks
+void kthread_set_timeslice(u32 ticks);
+
+// Block on a wait queue. Call with interrupts disabled after checking the
+// condition; returns with interrupts disabled once woken.
+void kthread_wait(wait_queue_t* queue);
+
+// Wake every thread on a wait queue (safe from interrupt context)
+void kthread_wake_all(wait_queue_t* queue);
+
+// Timer tick hook: wake sleepers and expire the time slice
+void kthread_tick();
+
+// Switch threads if the current one should be preempted (IRQ exit path)
+void kthread_preempt();
+
+// Iterate over all threads
+kthread_t* kthread_first();
+
+// Get the context switch cost statistics
+const kthread_switch_stats_t* kthread_get_switch_stats();
+
+#endif
@@ -0,0 +1,216 @@
+#include "trace.h"
+#include "low_level.h"
+#include "../cpu/percpu.h"
+#include "../cpu/smp.h"
+#include "../drivers/serial.h"
+#include "../drivers/timer.h"
+#include "../memory/kmalloc.h"
+#include "../memory/physical.h"
+
+#define TRACE_BIT(event)    (1u << (event))
+
+// How an event's argument is stored and printed
+#define TRACE_ARG_NUMBER    0
+#define TRACE_ARG_PAGE      1       // Address, kept as a page number
+#define TRACE_ARG_NAME      2       // Pointer to a static string
+
+typedef struct {
+    const char* name;
+    char phase;                     // 'B'egin, 'E'nd or 'i'nstant
+    u8 arg;
+} trace_event_info_t;
+
+static const trace_event_info_t event_info[TRACE_EVENT_COUNT] = {
+    [TRACE_IRQ_ENTRY]     = { "irq",        'B', TRACE_ARG_NUMBER },
+    [TRACE_IRQ_EXIT]      = { "irq",        'E', TRACE_ARG_NUMBER },
+    [TRACE_KEY]           = { "key",        'i', TRACE_ARG_NUMBER },
+    [TRACE_COMMAND_START] = { "command",    'B', TRACE_ARG_NAME },
+    [TRACE_COMMAND_END]   = { "command",    'E', TRACE_ARG_NAME },
+    [TRACE_CONSOLE_START] = { "console",    'B', TRACE_ARG_NUMBER },
+    [TRACE_CONSOLE_END]   = { "console",    'E', TRACE_ARG_NUMBER },
+    [TRACE_PAGE_ALLOC]    = { "page_alloc", 'i', TRACE_ARG_PAGE },
+    [TRACE_PAGE_FREE]     = { "page_free",  'i', TRACE_ARG_PAGE },
+    [TRACE_PAGE_MAP]      = { "page_map",   'i', TRACE_ARG_PAGE },
+    [TRACE_PAGE_UNMAP]    = { "page_unmap", 'i', TRACE_ARG_PAGE },
+    [TRACE_PAGE_TABLE]    = { "page_table", 'i', TRACE_ARG_PAGE },
+};
+
+typedef struct {
+    const char* name;
+    u32 mask;
+} trace_group_t;
+
+static const trace_group_t groups[] = {
+    { "irq",     TRACE_BIT(TRACE_IRQ_ENTRY) | TRACE_BIT(TRACE_IRQ_EXIT) },
+    { "key",     TRACE_BIT(TRACE_KEY) },
+    { "command", TRACE_BIT(TRACE_COMMAND_START) | TRACE_BIT(TRACE_COMMAND_END) },
+    { "console", TRACE_BIT(TRACE_CONSOLE_START) | TRACE_BIT(TRACE_CONSOLE_END) },
+    { "page",    TRACE_BIT(TRACE_PAGE_ALLOC) | TRACE_BIT(TRACE_PAGE_FREE) },
+    { "vmm",     TRACE_BIT(TRACE_PAGE_MAP) | TRACE_BIT(TRACE_PAGE_UNMAP) | TRACE_BIT(TRACE_PAGE_TABLE) },
+    { "all",     TRACE_BIT(TRACE_EVENT_COUNT) - 1 },
+};
+
+// Ring of one CPU; head counts every event ever recorded, so the ones
+// still held are the last TRACE_EVENTS before it
+typedef struct {
+    trace_record_t* records;
+    volatile u32 head;
+} trace_ring_t;
+
+volatile u32 trace_mask = 0;
+
+static trace_ring_t* rings = NULL;
+static u32 ring_count = 0;
+
+static bool trace_str_equals(const char* a, const char* b) {
+    while (*a && *a == *b) {
+        a++;
+        b++;
+    }
+    return *a == *b;
+}
+
+void trace_record(u32 event, u64 arg) {
+    if (event >= TRACE_EVENT_COUNT) {
+        return;
+    }
+    if (event_info[event].arg == TRACE_ARG_PAGE) {
+        arg /= PAGE_SIZE;
+    }
+
+    // Interrupts off: an interrupt's events must not land in the middle of
+    // this one, and the thread must not move to another CPU
+    u64 flags = cpu_irq_save();
+    u32 index = cpu_current_index();
+    if (index < ring_count) {
+        trace_ring_t* ring = &rings[index];
+        trace_record_t* record = &ring->records[ring->head & (TRACE_EVENTS - 1)];
+        record->tsc = cpu_read_tsc();
+        record->event = event;
+        record->arg = (u32)arg;
+        ring->head++;
+    }
+    cpu_irq_restore(flags);
+}
+
+u32 trace_group_mask(const char* name) {
+    for (u32 i = 0; i < sizeof(groups) / sizeof(groups[0]); i++) {
+        if (trace_str_equals(groups[i].name, name)) {
+            return groups[i].mask;
+        }
+    }
+    return 0;
+}
+
+// Allocate the rings the first time (kmalloc never frees, so they stay)
+static bool trace_setup() {
+    if (rings) {
+        return true;
+    }
+    u32 count = smp_cpu_count();
+    if (count == 0) {
+        count = 1;
+    }
+    trace_ring_t* new_rings = (trace_ring_t*)kmalloc(count * sizeof(trace_ring_t));
+    if (!new_rings) {
+        return false;
+    }
+    for (u32 i = 0; i < count; i++) {
+        new_rings[i].records = (trace_record_t*)kmalloc(TRACE_EVENTS * sizeof(trace_record_t));
+        new_rings[i].head = 0;
+        if (!new_rings[i].records) {
+            return false;
+        }
+    }
+    rings = new_rings;
+    ring_count = count;
+    return true;
+}
+
+bool trace_start(u32 mask) {
+    trace_mask = 0;
+    if (!trace_setup()) {
+        return false;
+    }
+    for (u32 i = 0; i < ring_count; i++) {
+        rings[i].head = 0;
+    }
+    __sync_synchronize();
+    trace_mask = mask;
+    return true;
+}
+
+void trace_stop() {
+    trace_mask = 0;
+    __sync_synchronize();
+}
+
+u64 trace_event_count() {
+    u64 total = 0;
+    for (u32 i = 0; i < ring_count; i++) {
+        u32 head = rings[i].head;
+        total += head < TRACE_EVENTS ? head : TRACE_EVENTS;
+    }
+    return total;
+}
+
+u64 trace_lost() {
+    u64 total = 0;
+    for (u32 i = 0; i < ring_count; i++) {
+        u32 head = rings[i].head;
+        total += head > TRACE_EVENTS ? head - TRACE_EVENTS : 0;
+    }
+    return total;
+}
+
+static void trace_write_record(u32 cpu, const trace_record_t* record) {
+    if (record->event >= TRACE_EVENT_COUNT) {
+        return;
+    }
+    const trace_event_info_t* info = &event_info[record->event];
+    serial_write("t ");
+    serial_write_number(cpu);
+    serial_write_char(' ');
+    serial_write_hex(record->tsc);
+    serial_write_char(' ');
+    serial_write_char(info->phase);
+    serial_write_char(' ');
+    serial_write(info->name);
+    serial_write_char(' ');
+    if (info->arg == TRACE_ARG_NAME) {
+        serial_write(record->arg ? (const char*)(u64)record->arg : "?");
+    } else if (info->arg == TRACE_ARG_PAGE) {
+        serial_write("0x");
+        serial_write_hex((u64)record->arg * PAGE_SIZE);
+    } else {
+        serial_write_number(record->arg);
+    }
+    serial_write_char('\n');
+}
+
+u64 trace_dump() {
+    trace_stop();
+
+    serial_write("trace-begin cpus=");
+    serial_write_number(ring_count);
+    serial_write(" tsc_hz=");
+    serial_write_number(timer_get_tsc_hz());
+    serial_write("\n");
+
+    u64 written = 0;
+    for (u32 cpu = 0; cpu < ring_count; cpu++) {
+        u32 head = rings[cpu].head;
+        u32 first = head > TRACE_EVENTS ? head - TRACE_EVENTS : 0;
+        for (u32 i = first; i != head; i++) {
+            trace_write_record(cpu, &rings[cpu].records[i & (TRACE_EVENTS - 1)]);
+            written++;
+        }
+    }
+
+    serial_write("trace-end events=");
+    serial_write_number(written);
+    serial_write(" lost=");
+    serial_write_number(trace_lost());
+    serial_write("\n");
+    return written;
+}
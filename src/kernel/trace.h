@@ -0,0 +1,74 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include "../include/types.h"
+
+// Static tracepoints. TRACE() records a 16-byte event with a TSC timestamp
+// into a ring of the calling CPU when its event is enabled; when it isn't,
+// the cost is one load and a branch. The rings keep the most recent events
+// and are written to the serial port as text by trace_dump(), which
+// tools/trace2json.c turns into a Chrome/Perfetto timeline.
+#define TRACE_EVENTS        8192    // Events kept per CPU (power of two)
+
+// Events. Begin/end pairs become slices on the CPU's timeline, the rest
+// instants; the table in trace.c has their names and argument kinds.
+typedef enum {
+    TRACE_IRQ_ENTRY = 0,            // Vector
+    TRACE_IRQ_EXIT,
+    TRACE_KEY,                      // Scancode
+    TRACE_COMMAND_START,            // Command name
+    TRACE_COMMAND_END,
+    TRACE_CONSOLE_START,            // Console flushed to its screen page
+    TRACE_CONSOLE_END,
+    TRACE_PAGE_ALLOC,               // Physical page
+    TRACE_PAGE_FREE,
+    TRACE_PAGE_MAP,                 // Virtual page
+    TRACE_PAGE_UNMAP,
+    TRACE_PAGE_TABLE,               // Page table created, its physical page
+    TRACE_EVENT_COUNT
+} trace_event_t;
+
+typedef struct {
+    u64 tsc;
+    u32 event;
+    u32 arg;                        // Pages as page numbers, names as pointers
+} trace_record_t;
+
+// Mask of the enabled events, tested by TRACE()
+extern volatile u32 trace_mask;
+
+#define TRACE(event, arg)                                                   \
+    do {                                                                    \
+        if (__builtin_expect(trace_mask & (1u << (event)), 0)) {            \
+            trace_record((event), (u64)(arg));                              \
+        }                                                                   \
+    } while (0)
+
+// Record an event on the calling CPU (use TRACE()). Names must be static
+// strings of the kernel image, which sits below 4 GB.
+void trace_record(u32 event, u64 arg);
+
+// Events enabled by a group name ("irq", "key", "command", "console",
+// "page", "vmm" or "all"), 0 if there is no such group
+u32 trace_group_mask(const char* name);
+
+// Clear the rings and enable the events in mask; false if there is no
+// memory for the rings
+bool trace_start(u32 mask);
+
+// Disable every event; the rings keep what they have until the next start
+void trace_stop();
+
+// Events in the rings, and events overwritten because a ring was full
+u64 trace_event_count();
+u64 trace_lost();
+
+// Stop tracing and write the rings to the serial port:
+//   trace-begin cpus=<n> tsc_hz=<hz>
+//   t <cpu> <tsc> <B|E|i> <name> <arg>
+// with the TSC in hex, addresses as 0x<hex> and other numbers in decimal.
+//   trace-end events=<n> lost=<n>
+// Returns the number of events written.
+u64 trace_dump();
+
+#endif
@@ -1,20 +1,32 @@
 #include "../include/types.h"
 #include "physical.h"
 #include "kmalloc.h"
+#include "../kernel/sync.h"
 
 // Simple bump allocator
-static void* next_free = (void*)0x400000;  // 4MB mark
+static u64 heap_base = KMALLOC_HEAP_BASE;
+static void* next_free = (void*)KMALLOC_HEAP_BASE;
+static spinlock_t kmalloc_lock;
+static lock_stats_t kmalloc_lock_stats;
 
-void kmalloc_init() {
-    // Nothing to do for a bump allocator
+void kmalloc_init(u64 base) {
+    heap_base = base;
+    next_free = (void*)base;
+    lock_stats_init(&kmalloc_lock_stats, "kmalloc");
+    spin_lock_init(&kmalloc_lock, &kmalloc_lock_stats);
 }
 
 void* kmalloc(size_t size) {
     // Round up to 8-byte alignment
     size = (size + 7) & ~7;
     
-    void* result = next_free;
-    next_free = (void*)((u64)next_free + size);
+    u64 flags = spin_lock_irqsave(&kmalloc_lock);
+    void* result = NULL;
+    if (size <= heap_base + KMALLOC_HEAP_SIZE - (u64)next_free) {
+        result = next_free;
+        next_free = (void*)((u64)next_free + size);
+    }
+    spin_unlock_irqrestore(&kmalloc_lock, flags);
     
     return result;
 }
@@ -3,10 +3,16 @@
 
 #include "../include/types.h"
 
-// Initialize the kernel memory allocator
-void kmalloc_init();
+// Fixed-size heap the bump allocator carves from, at KMALLOC_HEAP_BASE
+// unless boot modules are in the way. kernel_init_memory reserves it in
+// the physical allocator so its pages are never handed out twice.
+#define KMALLOC_HEAP_BASE 0x400000                  // 4MB mark
+#define KMALLOC_HEAP_SIZE (32ULL * 1024 * 1024)
 
-// Allocate memory
+// Initialize the kernel memory allocator with its heap at base
+void kmalloc_init(u64 base);
+
+// Allocate memory, NULL once the heap is used up
 void* kmalloc(size_t size);
 
 // Free memory (stub - this simple allocator can't really free)
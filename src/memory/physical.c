@@ -1,61 +1,136 @@
 #include "../include/types.h"
 #include "physical.h"
+#include "../kernel/task.h"
+#include "../kernel/sync.h"
+#include "../kernel/trace.h"
+
+// Bitmap bytes / pages handled by one parallel task
+#define PMM_BITMAP_GRAIN 512
+#define PMM_ZERO_GRAIN   16
 
 static u8* memory_bitmap = NULL;
 static u64 total_pages = 0;
 static u64 free_pages = 0;
 
-void pmm_init(u64 mem_size) {
+// Guards the bitmap and free_pages. An MCS lock because every CPU may be
+// allocating at once and the bitmap scan can hold it for a while.
+static mcs_lock_t pmm_lock;
+static lock_stats_t pmm_lock_stats;
+
+// Clear a slice of the bitmap (parallel_for body)
+static void pmm_clear_bitmap(u64 begin, u64 end, u64 arg) {
+    u8* bitmap = (u8*)arg;
+    for (u64 i = begin; i < end; i++) {
+        bitmap[i] = 0;
+    }
+}
+
+// Zero a run of pages (parallel_for body)
+static void pmm_zero_range(u64 begin, u64 end, u64 base) {
+    u64* p = (u64*)(base + begin * PAGE_SIZE);
+    u64* stop = (u64*)(base + end * PAGE_SIZE);
+    while (p < stop) {
+        *p++ = 0;
+    }
+}
+
+void pmm_init(u64 mem_size, u64 bitmap) {
     // Simple initialization
-    memory_bitmap = (u8*)0x100000;  // 1MB mark
+    lock_stats_init(&pmm_lock_stats, "pmm");
+    mcs_lock_init(&pmm_lock, &pmm_lock_stats);
+    
+    memory_bitmap = (u8*)bitmap;
     total_pages = mem_size / PAGE_SIZE;
     free_pages = total_pages;
     
-    // Clear bitmap
-    for (u64 i = 0; i < (total_pages + 7) / 8; i++) {
-        memory_bitmap[i] = 0;
-    }
+    // Clear bitmap, split across every online CPU
+    parallel_for(0, (total_pages + 7) / 8, PMM_BITMAP_GRAIN, pmm_clear_bitmap, (u64)memory_bitmap);
     
-    // Mark first 2MB as used
+    // Mark first 2MB as used - a whole number of bitmap bytes
     u64 reserved = 2 * 1024 * 1024 / PAGE_SIZE;
-    for (u64 i = 0; i < reserved; i++) {
-        u64 byte = i / 8;
-        u8 bit = i % 8;
-        memory_bitmap[byte] |= (1 << bit);
+    for (u64 i = 0; i < reserved / 8; i++) {
+        memory_bitmap[i] = 0xFF;
     }
     
     free_pages -= reserved;
+    
+    // The bitmap's own pages, when they lie above that
+    u64 first = bitmap / PAGE_SIZE;
+    u64 last = (bitmap + (total_pages + 7) / 8 + PAGE_SIZE - 1) / PAGE_SIZE;
+    for (u64 i = first < reserved ? reserved : first; i < last && i < total_pages; i++) {
+        memory_bitmap[i / 8] |= 1 << (i % 8);
+        free_pages--;
+    }
 }
 
 u64 pmm_alloc_page() {
-    if (free_pages == 0) return 0;
+    mcs_node_t node;
+    u64 flags = mcs_lock_irqsave(&pmm_lock, &node);
+    u64 addr = 0;
     
-    for (u64 i = 0; i < total_pages; i++) {
-        u64 byte = i / 8;
-        u8 bit = i % 8;
-        
-        if (!(memory_bitmap[byte] & (1 << bit))) {
-            memory_bitmap[byte] |= (1 << bit);
-            free_pages--;
-            return i * PAGE_SIZE;
+    if (free_pages != 0) {
+        for (u64 i = 0; i < total_pages; i++) {
+            u64 byte = i / 8;
+            u8 bit = i % 8;
+            
+            if (!(memory_bitmap[byte] & (1 << bit))) {
+                memory_bitmap[byte] |= (1 << bit);
+                free_pages--;
+                addr = i * PAGE_SIZE;
+                break;
+            }
         }
     }
     
-    return 0;
+    mcs_unlock_irqrestore(&pmm_lock, &node, flags);
+    if (addr) {
+        TRACE(TRACE_PAGE_ALLOC, addr);
+    }
+    return addr;
 }
 
 void pmm_free_page(u64 addr) {
     u64 page = addr / PAGE_SIZE;
     
     if (page >= total_pages) return;
+    TRACE(TRACE_PAGE_FREE, addr);
     
     u64 byte = page / 8;
     u8 bit = page % 8;
     
+    mcs_node_t node;
+    u64 flags = mcs_lock_irqsave(&pmm_lock, &node);
     if (memory_bitmap[byte] & (1 << bit)) {
         memory_bitmap[byte] &= ~(1 << bit);
         free_pages++;
     }
+    mcs_unlock_irqrestore(&pmm_lock, &node, flags);
+}
+
+// Mark every page overlapping a physical range as used
+void pmm_reserve_range(u64 base, u64 length) {
+    u64 first = base / PAGE_SIZE;
+    u64 last = (base + length + PAGE_SIZE - 1) / PAGE_SIZE;
+    if (last > total_pages) {
+        last = total_pages;
+    }
+    
+    mcs_node_t node;
+    u64 flags = mcs_lock_irqsave(&pmm_lock, &node);
+    for (u64 page = first; page < last; page++) {
+        u64 byte = page / 8;
+        u8 bit = page % 8;
+        if (!(memory_bitmap[byte] & (1 << bit))) {
+            memory_bitmap[byte] |= (1 << bit);
+            free_pages--;
+        }
+    }
+    mcs_unlock_irqrestore(&pmm_lock, &node, flags);
+}
+
+// Zero a physically contiguous range of pages using every online CPU
+void pmm_zero_pages(u64 addr, u64 count) {
+    parallel_for(0, count, PMM_ZERO_GRAIN, pmm_zero_range, addr);
 }
 
 // Get the total number of free pages
@@ -70,7 +145,10 @@ u64 pmm_get_total_pages() {
 
 // Get memory usage statistics
 void pmm_get_stats(u64* total, u64* free, u64* used) {
+    mcs_node_t node;
+    u64 flags = mcs_lock_irqsave(&pmm_lock, &node);
     *total = total_pages;
     *free = free_pages;
     *used = total_pages - free_pages;
+    mcs_unlock_irqrestore(&pmm_lock, &node, flags);
 }
\ No newline at end of file
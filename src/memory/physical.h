@@ -6,8 +6,13 @@
 // The physical memory manager works with 4KB pages
 #define PAGE_SIZE 4096
 
-// Initialize the physical memory manager
-void pmm_init(u64 mem_size);
+// Where the page bitmap goes unless boot modules are in the way
+#define PMM_BITMAP_ADDR 0x100000                    // 1MB mark
+
+// Initialize the physical memory manager with its bitmap (one bit per
+// page of mem_size) at the identity-mapped address bitmap, which is
+// reserved along with the first 2MB
+void pmm_init(u64 mem_size, u64 bitmap);
 
 // Allocate a physical page, returns the physical address
 u64 pmm_alloc_page();
@@ -15,6 +20,14 @@ u64 pmm_alloc_page();
 // Free a previously allocated page
 void pmm_free_page(u64 addr);
 
+// Mark every page overlapping a physical range as used (firmware areas,
+// boot modules)
+void pmm_reserve_range(u64 base, u64 length);
+
+// Zero a physically contiguous range of pages using every online CPU
+// (the range must be identity mapped)
+void pmm_zero_pages(u64 addr, u64 count);
+
 // Get the total number of free pages
 u64 pmm_get_free_pages();
 
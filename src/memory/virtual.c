@@ -1,19 +1,65 @@
 #include "../include/types.h"
 #include "physical.h"
 #include "virtual.h"
+#include "../kernel/sync.h"
+#include "../kernel/trace.h"
 
 // Page table structure pointers
 static u64* pml4_table = NULL;
 
+// Next virtual address handed out by vmm_alloc_page
+static u64 next_vaddr = VMM_ALLOC_BASE;
+
+// Guards the page tables and next_vaddr
+static spinlock_t vmm_lock;
+static lock_stats_t vmm_lock_stats;
+
 // Helper function to get various page table indices
 static inline u64 pml4_index(u64 addr) { return (addr >> 39) & 0x1FF; }
 static inline u64 pdpt_index(u64 addr) { return (addr >> 30) & 0x1FF; }
 static inline u64 pd_index(u64 addr)   { return (addr >> 21) & 0x1FF; }
 static inline u64 pt_index(u64 addr)   { return (addr >> 12) & 0x1FF; }
 
-// Get or create page table
-static u64* get_next_level(u64* table, u64 index, bool create) {
-    if (!(table[index] & PAGE_PRESENT)) {
+// Drop a stale translation from the TLB (the hosted build in tools/hosted
+// runs these page tables in a plain arena, with no MMU behind them)
+static inline void vmm_flush_page(u64 virt_addr) {
+#ifndef HOSTED
+    __asm__ __volatile__("invlpg (%0)" : : "r"(virt_addr) : "memory");
+#endif
+}
+
+// Replace the 2MB page of a page directory entry with a page table of
+// 4KB pages mapping the same memory with the same flags (the boot identity
+// map is built from 2MB pages). False when out of memory.
+static bool split_huge_page(u64* entry) {
+    u64 table_phys = pmm_alloc_page();
+    if (!table_phys) {
+        return false;
+    }
+    
+    u64* table = (u64*)table_phys;
+    u64 base = *entry & PAGE_HUGE_ADDR_MASK;
+    u64 flags = *entry & (PAGE_NX | (0xFFF & ~PAGE_HUGE));
+    for (int i = 0; i < 512; i++) {
+        table[i] = (base + (u64)i * PAGE_SIZE) | flags;
+    }
+    
+    // The new entries carry the permissions; the directory entry only
+    // lets them through
+    *entry = table_phys | PAGE_PRESENT | PAGE_WRITABLE | (*entry & PAGE_USER);
+    TRACE(TRACE_PAGE_TABLE, table_phys);
+    return true;
+}
+
+// Get or create page table. A user mapping needs PAGE_USER at every level,
+// so flags passes it on to the entry. A 2MB page in the way is split when
+// creating, and ends the walk otherwise.
+static u64* get_next_level(u64* table, u64 index, bool create, u64 flags) {
+    if ((table[index] & (PAGE_PRESENT | PAGE_HUGE)) == (PAGE_PRESENT | PAGE_HUGE)) {
+        if (!create || !split_huge_page(&table[index])) {
+            return NULL;
+        }
+    } else if (!(table[index] & PAGE_PRESENT)) {
         if (!create) {
             return NULL;
         }
@@ -32,43 +78,67 @@ static u64* get_next_level(u64* table, u64 index, bool create) {
         
         // Add entry to the parent table
         table[index] = new_table_phys | PAGE_PRESENT | PAGE_WRITABLE;
+        TRACE(TRACE_PAGE_TABLE, new_table_phys);
+    }
+    if (flags & PAGE_USER) {
+        table[index] |= PAGE_USER;
     }
     
     // Return the next level table
-    return (u64*)(table[index] & ~0xFFF);
+    return (u64*)(table[index] & PAGE_ADDR_MASK);
 }
 
 // Initialize the virtual memory manager
 void vmm_init() {
+#ifdef HOSTED
+    // No CR3 to take over: start from an empty PML4
+    pml4_table = (u64*)pmm_alloc_page();
+    for (int i = 0; i < 512; i++) {
+        pml4_table[i] = 0;
+    }
+#else
     // Use the existing PML4 table
     u64 cr3_value;
     __asm__ __volatile__("mov %%cr3, %0" : "=r"(cr3_value));
     pml4_table = (u64*)(cr3_value & ~0xFFF);
+#endif
+    
+    lock_stats_init(&vmm_lock_stats, "vmm");
+    spin_lock_init(&vmm_lock, &vmm_lock_stats);
 }
 
 // Map a virtual address to a physical address
 bool vmm_map_page(u64 virt_addr, u64 phys_addr, u64 flags) {
+    return vmm_map_page_in(pml4_table, virt_addr, phys_addr, flags);
+}
+
+// Map a page in an address space
+bool vmm_map_page_in(u64* space, u64 virt_addr, u64 phys_addr, u64 flags) {
     // Ensure addresses are page-aligned
     virt_addr &= ~0xFFF;
     phys_addr &= ~0xFFF;
     
-    // Get or create page tables
-    u64* pdpt = get_next_level(pml4_table, pml4_index(virt_addr), true);
-    if (!pdpt) return false;
-    
-    u64* pd = get_next_level(pdpt, pdpt_index(virt_addr), true);
-    if (!pd) return false;
-    
-    u64* pt = get_next_level(pd, pd_index(virt_addr), true);
-    if (!pt) return false;
+    u64 lock_flags = spin_lock_irqsave(&vmm_lock);
     
-    // Set the page table entry
-    pt[pt_index(virt_addr)] = phys_addr | flags | PAGE_PRESENT;
+    // Get or create page tables
+    u64* pt = NULL;
+    u64* pdpt = get_next_level(space, pml4_index(virt_addr), true, flags);
+    u64* pd = pdpt ? get_next_level(pdpt, pdpt_index(virt_addr), true, flags) : NULL;
+    if (pd) {
+        pt = get_next_level(pd, pd_index(virt_addr), true, flags);
+    }
     
-    // Invalidate TLB for this address
-    __asm__ __volatile__("invlpg (%0)" : : "r"(virt_addr) : "memory");
+    if (pt) {
+        // Set the page table entry
+        pt[pt_index(virt_addr)] = phys_addr | flags | PAGE_PRESENT;
+        TRACE(TRACE_PAGE_MAP, virt_addr);
+        
+        // Invalidate TLB for this address
+        vmm_flush_page(virt_addr);
+    }
     
-    return true;
+    spin_unlock_irqrestore(&vmm_lock, lock_flags);
+    return pt != NULL;
 }
 
 // Unmap a virtual address
@@ -76,21 +146,26 @@ void vmm_unmap_page(u64 virt_addr) {
     // Ensure address is page-aligned
     virt_addr &= ~0xFFF;
     
-    // Get the page tables
-    u64* pdpt = get_next_level(pml4_table, pml4_index(virt_addr), false);
-    if (!pdpt) return;
-    
-    u64* pd = get_next_level(pdpt, pdpt_index(virt_addr), false);
-    if (!pd) return;
+    u64 lock_flags = spin_lock_irqsave(&vmm_lock);
     
-    u64* pt = get_next_level(pd, pd_index(virt_addr), false);
-    if (!pt) return;
+    // Get the page tables
+    u64* pt = NULL;
+    u64* pdpt = get_next_level(pml4_table, pml4_index(virt_addr), false, 0);
+    u64* pd = pdpt ? get_next_level(pdpt, pdpt_index(virt_addr), false, 0) : NULL;
+    if (pd) {
+        pt = get_next_level(pd, pd_index(virt_addr), false, 0);
+    }
     
-    // Clear the page table entry
-    pt[pt_index(virt_addr)] = 0;
+    if (pt) {
+        // Clear the page table entry
+        pt[pt_index(virt_addr)] = 0;
+        TRACE(TRACE_PAGE_UNMAP, virt_addr);
+        
+        // Invalidate TLB for this address
+        vmm_flush_page(virt_addr);
+    }
     
-    // Invalidate TLB for this address
-    __asm__ __volatile__("invlpg (%0)" : : "r"(virt_addr) : "memory");
+    spin_unlock_irqrestore(&vmm_lock, lock_flags);
 }
 
 // Get the physical address for a virtual address
@@ -98,13 +173,19 @@ u64 vmm_get_physical_address(u64 virt_addr) {
     u64 page_offset = virt_addr & 0xFFF;
     
     // Get the page tables
-    u64* pdpt = get_next_level(pml4_table, pml4_index(virt_addr), false);
+    u64* pdpt = get_next_level(pml4_table, pml4_index(virt_addr), false, 0);
     if (!pdpt) return 0;
     
-    u64* pd = get_next_level(pdpt, pdpt_index(virt_addr), false);
+    u64* pd = get_next_level(pdpt, pdpt_index(virt_addr), false, 0);
     if (!pd) return 0;
     
-    u64* pt = get_next_level(pd, pd_index(virt_addr), false);
+    // A 2MB page of the identity map
+    u64 pde = pd[pd_index(virt_addr)];
+    if ((pde & (PAGE_PRESENT | PAGE_HUGE)) == (PAGE_PRESENT | PAGE_HUGE)) {
+        return (pde & PAGE_HUGE_ADDR_MASK) | (virt_addr & (PAGE_HUGE_SIZE - 1));
+    }
+    
+    u64* pt = get_next_level(pd, pd_index(virt_addr), false, 0);
     if (!pt) return 0;
     
     // Get the page table entry
@@ -112,104 +193,73 @@ u64 vmm_get_physical_address(u64 virt_addr) {
     if (!(pte & PAGE_PRESENT)) return 0;
     
     // Return the physical address
-    return (pte & ~0xFFF) | page_offset;
+    return (pte & PAGE_ADDR_MASK) | page_offset;
 }
 
-// Allocate a page and map it
-void* vmm_alloc_page() {
-    // Debug message
-    volatile char* debug_mem = (volatile char*)0xB8000 + 12 * 160; // Row 12
-    const char* msg = "VMM: Allocating page...";
-    int i = 0;
-    while (msg[i]) {
-        debug_mem[i*2] = msg[i];
-        debug_mem[i*2+1] = 0x0F;
-        i++;
+// Create an address space sharing the kernel's mappings
+u64* vmm_create_space() {
+    u64* space = (u64*)pmm_alloc_page();
+    if (!space) {
+        return NULL;
     }
     
+    // The lower tables are shared, so later kernel mappings show up too as
+    // long as they go in PML4 slots already in use
+    u64 lock_flags = spin_lock_irqsave(&vmm_lock);
+    for (int i = 0; i < 512; i++) {
+        space[i] = pml4_table[i];
+    }
+    space[pml4_index(VMM_USER_BASE)] = 0;
+    spin_unlock_irqrestore(&vmm_lock, lock_flags);
+    return space;
+}
+
+// Free the page tables of an address space's user slot, then its PML4
+void vmm_destroy_space(u64* space) {
+    u64* pdpt = get_next_level(space, pml4_index(VMM_USER_BASE), false, 0);
+    if (pdpt) {
+        for (int i = 0; i < 512; i++) {
+            u64* pd = get_next_level(pdpt, i, false, 0);
+            if (!pd) {
+                continue;
+            }
+            for (int j = 0; j < 512; j++) {
+                u64* pt = get_next_level(pd, j, false, 0);
+                if (pt) {
+                    pmm_free_page((u64)pt);
+                }
+            }
+            pmm_free_page((u64)pd);
+        }
+        pmm_free_page((u64)pdpt);
+    }
+    pmm_free_page((u64)space);
+}
+
+// Load an address space on the calling CPU
+void vmm_switch_space(u64* space) {
+#ifndef HOSTED
+    u64 cr3 = (u64)(space ? space : pml4_table);
+    __asm__ __volatile__("mov %0, %%cr3" : : "r"(cr3) : "memory");
+#endif
+}
+
+// Allocate a page and map it
+void* vmm_alloc_page() {
     // Find a free virtual address (this is a simple implementation)
-    static u64 next_vaddr = 0x400000; // 4MB (above kernel space)
-    
+    u64 lock_flags = spin_lock_irqsave(&vmm_lock);
     u64 virt_addr = next_vaddr;
     next_vaddr += PAGE_SIZE;
-    
-    // Debug message
-    debug_mem = (volatile char*)0xB8000 + 13 * 160; // Row 13
-    char addr_str[20] = "VMM: vaddr=";
-    char* ptr = addr_str + 11;
-    
-    // Convert address to hex string (simplified)
-    u64 temp = virt_addr;
-    for (int j = 0; j < 8; j++) {
-        int digit = temp % 16;
-        if (digit < 10)
-            ptr[7-j] = '0' + digit;
-        else
-            ptr[7-j] = 'A' + (digit - 10);
-        temp /= 16;
-    }
-    ptr[8] = '\0';
-    
-    i = 0;
-    while (addr_str[i]) {
-        debug_mem[i*2] = addr_str[i];
-        debug_mem[i*2+1] = 0x0F;
-        i++;
-    }
+    spin_unlock_irqrestore(&vmm_lock, lock_flags);
     
     // Allocate a physical page
     u64 phys_addr = pmm_alloc_page();
-    
-    // Debug message
-    debug_mem = (volatile char*)0xB8000 + 14 * 160; // Row 14
-    char phys_str[20] = "VMM: paddr=";
-    ptr = phys_str + 11;
-    
-    // Convert address to hex string (simplified)
-    temp = phys_addr;
-    for (int j = 0; j < 8; j++) {
-        int digit = temp % 16;
-        if (digit < 10)
-            ptr[7-j] = '0' + digit;
-        else
-            ptr[7-j] = 'A' + (digit - 10);
-        temp /= 16;
-    }
-    ptr[8] = '\0';
-    
-    i = 0;
-    while (phys_str[i]) {
-        debug_mem[i*2] = phys_str[i];
-        debug_mem[i*2+1] = 0x0F;
-        i++;
-    }
-    
     if (!phys_addr) {
-        debug_mem = (volatile char*)0xB8000 + 15 * 160; // Row 15
-        const char* err_msg = "VMM: Failed to allocate physical page!";
-        i = 0;
-        while (err_msg[i]) {
-            debug_mem[i*2] = err_msg[i];
-            debug_mem[i*2+1] = 0x0F;
-            i++;
-        }
         return NULL; // Out of memory
     }
     
     // Map the virtual address to the physical address
-    bool success = vmm_map_page(virt_addr, phys_addr, PAGE_WRITABLE);
-    
-    // Debug message
-    debug_mem = (volatile char*)0xB8000 + 15 * 160; // Row 15
-    const char* map_msg = success ? "VMM: Mapping successful" : "VMM: Mapping failed!";
-    i = 0;
-    while (map_msg[i]) {
-        debug_mem[i*2] = map_msg[i];
-        debug_mem[i*2+1] = 0x0F;
-        i++;
-    }
-    
-    if (!success) {
+    if (!vmm_map_page(virt_addr, phys_addr, PAGE_WRITABLE)) {
         pmm_free_page(phys_addr);
         return NULL;
     }
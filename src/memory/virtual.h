@@ -9,11 +9,19 @@
 #define PAGE_WRITABLE (1ULL << 1)
 #define PAGE_USER     (1ULL << 2)
 #define PAGE_HUGE     (1ULL << 7)
+#define PAGE_NX       (1ULL << 63)
+
+// Physical address bits of an entry (the flags above and NX masked off),
+// and of a 2MB page's entry
+#define PAGE_ADDR_MASK       0x000FFFFFFFFFF000ULL
+#define PAGE_HUGE_ADDR_MASK  0x000FFFFFFFE00000ULL
+#define PAGE_HUGE_SIZE       0x200000ULL
 
 // Initialize the virtual memory manager
 void vmm_init();
 
-// Map a virtual address to a physical address
+// Map a virtual address to a physical address in the kernel's address
+// space. Tables created on the way get PAGE_USER if flags has it.
 bool vmm_map_page(u64 virt_addr, u64 phys_addr, u64 flags);
 
 // Unmap a virtual address
@@ -22,7 +30,28 @@ void vmm_unmap_page(u64 virt_addr);
 // Get the physical address for a virtual address
 u64 vmm_get_physical_address(u64 virt_addr);
 
-// Allocate a page and map it (used by the heap)
+// Address spaces: a PML4 of their own that shares every kernel mapping.
+// Pages mapped with PAGE_USER go in the PML4 slot of VMM_USER_BASE, which
+// the kernel leaves empty, so each space has its own.
+#define VMM_USER_BASE 0x10000000000ULL
+#define VMM_USER_END  0x18000000000ULL
+
+// Create an address space; NULL when out of memory
+u64* vmm_create_space();
+
+// Free the page tables of an address space (not the pages mapped in it)
+void vmm_destroy_space(u64* space);
+
+// Map a page in an address space, like vmm_map_page
+bool vmm_map_page_in(u64* space, u64 virt_addr, u64 phys_addr, u64 flags);
+
+// Load an address space on the calling CPU (NULL for the kernel's)
+void vmm_switch_space(u64* space);
+
+// Allocate a page and map it (used by the heap). Pages are handed out from
+// VMM_ALLOC_BASE up, a PML4 slot of their own above the identity map.
+#define VMM_ALLOC_BASE 0x18000000000ULL
+
 void* vmm_alloc_page();
 
 // Free a page and unmap it
@@ -0,0 +1,283 @@
+#include "command.h"
+#include "command_hash.h"
+#include "console.h"
+#include "../kernel/trace.h"
+#include "../memory/kmalloc.h"
+
+// Ends of the .commands section (linker.ld)
+extern const command_t __commands_start[];
+extern const command_t __commands_end[];
+
+// Prefix trie over the names. Siblings are kept in character order so a
+// depth-first walk visits the names sorted.
+typedef struct trie_node {
+    char c;
+    u32 count;                      // Commands at or below this node
+    const command_t* command;       // The command whose name ends here
+    struct trie_node* child;
+    struct trie_node* sibling;
+} trie_node_t;
+
+static const command_t* slots[COMMAND_HASH_SIZE];
+static bool hash_valid = false;
+static trie_node_t trie_root;
+static bool trie_valid = true;          // False if a node couldn't be allocated
+static const command_t** sorted = NULL;  // By name, for help
+static u32 sorted_count = 0;
+
+static bool command_str_equals(const char* a, const char* b) {
+    while (*a && *a == *b) {
+        a++;
+        b++;
+    }
+    return *a == *b;
+}
+
+u32 command_count() {
+    return (u32)(__commands_end - __commands_start);
+}
+
+const command_t* command_get(u32 index) {
+    // Link order when there was no memory to sort
+    if (!sorted) {
+        return index < command_count() ? &__commands_start[index] : NULL;
+    }
+    return index < sorted_count ? sorted[index] : NULL;
+}
+
+// Does name start with the first length characters of prefix?
+static bool command_has_prefix(const char* name, const char* prefix, u32 length) {
+    for (u32 i = 0; i < length; i++) {
+        if (name[i] != prefix[i]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Add a name to the trie; false when out of memory, which leaves the trie
+// unusable (trie_valid)
+static bool trie_insert(const command_t* command) {
+    trie_node_t* node = &trie_root;
+    node->count++;
+    for (const char* p = command->name; *p; p++) {
+        trie_node_t** link = &node->child;
+        while (*link && (*link)->c < *p) {
+            link = &(*link)->sibling;
+        }
+        if (!*link || (*link)->c != *p) {
+            trie_node_t* child = (trie_node_t*)kmalloc(sizeof(trie_node_t));
+            if (!child) {
+                return false;
+            }
+            child->c = *p;
+            child->count = 0;
+            child->command = NULL;
+            child->child = NULL;
+            child->sibling = *link;
+            *link = child;
+        }
+        node = *link;
+        node->count++;
+    }
+    node->command = command;
+    return true;
+}
+
+static void trie_walk(const trie_node_t* node, void (*fn)(const command_t*)) {
+    if (node->command) {
+        fn(node->command);
+    }
+    for (const trie_node_t* child = node->child; child; child = child->sibling) {
+        trie_walk(child, fn);
+    }
+}
+
+static void sorted_append(const command_t* command) {
+    sorted[sorted_count++] = command;
+}
+
+void command_init() {
+    // The generated seed only fits the commands it was generated from; if
+    // the sources changed without a rebuild of command_hash.h, fall back to
+    // a linear search rather than dispatch the wrong command
+    hash_valid = command_count() == COMMAND_HASH_COUNT;
+    for (u32 i = 0; i < command_count(); i++) {
+        const command_t* command = &__commands_start[i];
+        u32 slot = command_hash(command->name, COMMAND_HASH_SEED) & (COMMAND_HASH_SIZE - 1);
+        if (slots[slot]) {
+            hash_valid = false;
+        }
+        slots[slot] = command;
+        if (trie_valid) {
+            trie_valid = trie_insert(command);
+        }
+    }
+
+    // The section is in link order; the trie gives name order. Without
+    // memory for either, completion and help scan the section instead.
+    if (trie_valid) {
+        sorted = (const command_t**)kmalloc(command_count() * sizeof(command_t*));
+    }
+    if (sorted) {
+        trie_walk(&trie_root, sorted_append);
+    }
+}
+
+const command_t* command_find(const char* name) {
+    if (hash_valid) {
+        const command_t* command = slots[command_hash(name, COMMAND_HASH_SEED) & (COMMAND_HASH_SIZE - 1)];
+        return command && command_str_equals(command->name, name) ? command : NULL;
+    }
+    for (u32 i = 0; i < command_count(); i++) {
+        if (command_str_equals(__commands_start[i].name, name)) {
+            return &__commands_start[i];
+        }
+    }
+    return NULL;
+}
+
+int command_tokenize(char* line, char** argv, int max) {
+    int argc = 0;
+    char* in = line;
+    while (argc < max) {
+        while (*in == ' ') in++;
+        if (*in == '\0') {
+            break;
+        }
+
+        // Copy the word down over itself, dropping the quotes
+        char* out = in;
+        argv[argc++] = out;
+        bool quoted = false;
+        while (*in && (quoted || *in != ' ')) {
+            if (*in == '"') {
+                quoted = !quoted;
+                in++;
+                continue;
+            }
+            *out++ = *in++;
+        }
+        if (*in) {
+            in++;
+        }
+        *out = '\0';
+    }
+    return argc;
+}
+
+bool command_execute(char* line) {
+    char* argv[COMMAND_MAX_ARGS + 1];
+    int argc = command_tokenize(line, argv, COMMAND_MAX_ARGS);
+    if (argc == 0) {
+        return true;
+    }
+    argv[argc] = NULL;
+
+    const command_t* command = command_find(argv[0]);
+    if (!command) {
+        return false;
+    }
+    if (argc - 1 < command->min_args || argc - 1 > command->max_args) {
+        console_write("Usage: ");
+        console_write(command->name);
+        if (command->args[0]) {
+            console_write(" ");
+            console_write(command->args);
+        }
+        console_write("\n");
+        return true;
+    }
+    TRACE(TRACE_COMMAND_START, command->name);
+    command->handler(argc, argv);
+    TRACE(TRACE_COMMAND_END, command->name);
+    return true;
+}
+
+// Find the trie node for a prefix
+static const trie_node_t* trie_find(const char* prefix, u32 length) {
+    const trie_node_t* node = &trie_root;
+    for (u32 i = 0; i < length && node; i++) {
+        node = node->child;
+        while (node && node->c != prefix[i]) {
+            node = node->sibling;
+        }
+    }
+    return node;
+}
+
+// command_complete without the trie: the matches' longest common prefix
+static u32 command_complete_linear(const char* prefix, u32 length, char* extension, u32 size) {
+    const char* first = NULL;
+    u32 common = 0;
+    u32 count = 0;
+    for (u32 i = 0; i < command_count(); i++) {
+        const char* name = __commands_start[i].name;
+        if (!command_has_prefix(name, prefix, length)) {
+            continue;
+        }
+        if (!first) {
+            first = name;
+            for (common = length; first[common]; common++);
+        }
+        u32 same = length;
+        while (same < common && name[same] == first[same]) same++;
+        common = same;
+        count++;
+    }
+
+    u32 used = 0;
+    for (u32 i = length; i < common && used + 1 < size; i++) {
+        extension[used++] = first[i];
+    }
+    if (count == 1 && used == common - length && used + 1 < size) {
+        extension[used++] = ' ';
+    }
+    if (size) {
+        extension[used] = '\0';
+    }
+    return count;
+}
+
+u32 command_complete(const char* prefix, u32 length, char* extension, u32 size) {
+    if (!trie_valid) {
+        return command_complete_linear(prefix, length, extension, size);
+    }
+    const trie_node_t* node = trie_find(prefix, length);
+    u32 used = 0;
+    if (size) {
+        extension[0] = '\0';
+    }
+    if (!node || node->count == 0) {
+        return 0;
+    }
+
+    // Follow the trie while there is only one way to go
+    while (!node->command && node->child && !node->child->sibling && used + 1 < size) {
+        node = node->child;
+        extension[used++] = node->c;
+    }
+    if (node->count == 1 && node->command && used + 1 < size) {
+        extension[used++] = ' ';
+    }
+    if (size) {
+        extension[used] = '\0';
+    }
+    return node->count;
+}
+
+void command_for_each_match(const char* prefix, u32 length, void (*fn)(const command_t*)) {
+    if (!trie_valid) {
+        // In link order
+        for (u32 i = 0; i < command_count(); i++) {
+            if (command_has_prefix(__commands_start[i].name, prefix, length)) {
+                fn(&__commands_start[i]);
+            }
+        }
+        return;
+    }
+    const trie_node_t* node = trie_find(prefix, length);
+    if (node) {
+        trie_walk(node, fn);
+    }
+}
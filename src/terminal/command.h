@@ -0,0 +1,68 @@
+#ifndef COMMAND_H
+#define COMMAND_H
+
+#include "../include/types.h"
+
+// Shell commands are declared once, anywhere, with COMMAND(). The
+// declarations are collected into the .commands section by the linker, and
+// tools/mkcmdhash finds them in the sources at build time to pick a hash
+// seed with no collisions, so a lookup is one hash and one compare.
+#define COMMAND_MAX_ARGS    16
+
+typedef struct {
+    const char* name;
+    void (*handler)(int argc, char** argv);
+    const char* args;               // Argument spec shown in usage, e.g. "[disk]"
+    const char* help;
+    u8 min_args;                    // Not counting the command name
+    u8 max_args;
+} command_t;
+
+// Declare a command. The name is a bare identifier so the hash generator
+// can find it; min/max bound the number of arguments.
+#define COMMAND(cmd_name, fn, min, max, spec, text)                         \
+    static const command_t command_##cmd_name                               \
+        __attribute__((used, section(".commands"), aligned(8))) =           \
+        { #cmd_name, fn, spec, text, min, max }
+
+// FNV-1a with a seed and a final mix (tools/mkcmdhash.c has a copy, keep
+// them in sync)
+static inline u32 command_hash(const char* name, u32 seed) {
+    u32 hash = 2166136261u ^ seed;
+    while (*name) {
+        hash ^= (u8)*name++;
+        hash *= 16777619u;
+    }
+    hash ^= hash >> 16;
+    hash *= 0x85EBCA6Bu;
+    hash ^= hash >> 13;
+    return hash;
+}
+
+// Index the commands: fill the hash slots and build the completion trie
+void command_init();
+
+// Number of commands, and each in name order
+u32 command_count();
+const command_t* command_get(u32 index);
+
+// Look up a command by name, NULL if there is none
+const command_t* command_find(const char* name);
+
+// Split a line in place into words; double quotes group words. Returns the
+// number of words (at most max).
+int command_tokenize(char* line, char** argv, int max);
+
+// Tokenize and run a line. Returns false if the line named no command.
+bool command_execute(char* line);
+
+// Complete a command name prefix. Writes what every match has in common
+// beyond the prefix to extension (plus a space when the match is unique)
+// and returns the number of matches.
+u32 command_complete(const char* prefix, u32 length, char* extension, u32 size);
+
+// Call fn for every command starting with prefix, in name order (link order
+// if there was no memory to index the names)
+void command_for_each_match(const char* prefix, u32 length, void (*fn)(const command_t*));
+
+#endif
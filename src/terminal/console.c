@@ -0,0 +1,146 @@
+#include "console.h"
+#include "../kernel/trace.h"
+
+typedef struct {
+    char ring[CONSOLE_BUFFER_SIZE];
+    u32 head;                       // Next write position
+    u32 tail;                       // Next position to flush
+} console_t;
+
+static console_t consoles[CONSOLE_COUNT];
+static console_t* current = &consoles[0];
+
+static async_event_t output_event;
+static async_event_t drained_event;
+static async_task_t flush_task;
+
+static bool console_pending(const console_t* console) {
+    return console->tail != console->head;
+}
+
+// Copy up to max queued characters of a console to its page
+static void console_drain(console_t* console, u32 max) {
+    u32 page = (u32)(console - consoles);
+    char chunk[CONSOLE_FLUSH_CHUNK + 1];
+    u32 length = 0;
+    if (!console_pending(console)) {
+        return;
+    }
+    TRACE(TRACE_CONSOLE_START, page);
+
+    for (u32 done = 0; done < max && console_pending(console); done++) {
+        char c = console->ring[console->tail & (CONSOLE_BUFFER_SIZE - 1)];
+        console->tail++;
+
+        // Backspace is a cursor operation, write out what came before it
+        if (c == '\b' || length == CONSOLE_FLUSH_CHUNK) {
+            chunk[length] = '\0';
+            screen_page_print(page, chunk);
+            length = 0;
+        }
+        if (c == '\b') {
+            screen_page_backspace(page);
+        } else {
+            chunk[length++] = c;
+        }
+    }
+
+    if (length) {
+        chunk[length] = '\0';
+        screen_page_print(page, chunk);
+    }
+    TRACE(TRACE_CONSOLE_END, page);
+}
+
+static bool console_any_pending() {
+    for (u32 i = 0; i < CONSOLE_COUNT; i++) {
+        if (console_pending(&consoles[i])) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Flush task - writes a chunk per console per pass so other tasks run in
+// between; the visible console goes first
+static int console_flush_poll(async_task_t* task) {
+    ASYNC_BEGIN(task);
+    while (1) {
+        AWAIT_EVENT(task, &output_event, console_any_pending());
+        console_drain(&consoles[screen_visible_page()], CONSOLE_FLUSH_CHUNK);
+        for (u32 i = 0; i < CONSOLE_COUNT; i++) {
+            if (i != screen_visible_page()) {
+                console_drain(&consoles[i], CONSOLE_FLUSH_CHUNK);
+            }
+        }
+        async_signal(&drained_event);
+        ASYNC_YIELD(task);
+    }
+    ASYNC_END(task);
+}
+
+// Start the flush task
+void console_init() {
+    for (u32 i = 0; i < CONSOLE_COUNT; i++) {
+        consoles[i].head = 0;
+        consoles[i].tail = 0;
+    }
+    current = &consoles[0];
+    async_event_init(&output_event);
+    async_event_init(&drained_event);
+    async_spawn(&flush_task, "console", console_flush_poll, 0);
+}
+
+void console_select(u32 index) {
+    if (index < CONSOLE_COUNT) {
+        current = &consoles[index];
+    }
+}
+
+u32 console_current() {
+    return (u32)(current - consoles);
+}
+
+// Queue one character
+void console_write_char(char c) {
+    if (current->head - current->tail == CONSOLE_BUFFER_SIZE) {
+        console_flush();
+    }
+    current->ring[current->head & (CONSOLE_BUFFER_SIZE - 1)] = c;
+    current->head++;
+    async_signal(&output_event);
+}
+
+// Queue a string
+void console_write(const char* str) {
+    while (*str) {
+        if (current->head - current->tail == CONSOLE_BUFFER_SIZE) {
+            console_flush();
+        }
+        current->ring[current->head & (CONSOLE_BUFFER_SIZE - 1)] = *str++;
+        current->head++;
+    }
+    async_signal(&output_event);
+}
+
+// Write everything queued to the screen now
+void console_flush() {
+    console_drain(current, CONSOLE_BUFFER_SIZE);
+    async_signal(&drained_event);
+}
+
+// Flush, then clear the console's page
+void console_clear() {
+    console_flush();
+    screen_page_clear(console_current());
+}
+
+// Free space in the ring
+u32 console_space() {
+    return CONSOLE_BUFFER_SIZE - (current->head - current->tail);
+}
+
+// Event signalled after each flush pass
+async_event_t* console_drained_event() {
+    return &drained_event;
+}
@@ -0,0 +1,43 @@
+#ifndef CONSOLE_H
+#define CONSOLE_H
+
+#include "../include/types.h"
+#include "../kernel/async.h"
+#include "../drivers/screen64.h"
+
+// Buffered terminal output. Text is queued in a ring and copied to the
+// screen by an async flush task a chunk at a time, so long output doesn't
+// hold up input handling. Only the async executor thread may write.
+#define CONSOLE_BUFFER_SIZE  4096   // Must be a power of two
+#define CONSOLE_FLUSH_CHUNK  256    // Characters written per flush pass
+
+// Virtual consoles, one per screen page. Each has its own ring, so a
+// console in the background keeps printing into its page while another is
+// shown.
+#define CONSOLE_COUNT        SCREEN_PAGES
+
+// Start the flush task
+void console_init();
+
+// Direct the writes below to a console (the caller is working on its
+// behalf until the next select)
+void console_select(u32 index);
+u32 console_current();
+
+// Queue text. If the ring is full it is flushed synchronously first.
+void console_write(const char* str);
+void console_write_char(char c);
+
+// Write everything queued to the screen now
+void console_flush();
+
+// Flush, then clear the console's page
+void console_clear();
+
+// Free space in the ring
+u32 console_space();
+
+// Event signalled after each flush pass
+async_event_t* console_drained_event();
+
+#endif
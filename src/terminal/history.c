@@ -0,0 +1,156 @@
+#include "history.h"
+
+// Entry slot of a line number
+static u32 history_slot(u32 number) {
+    return number & (HISTORY_MAX - 1);
+}
+
+static u64 history_mask(const char* text) {
+    u64 mask = 0;
+    for (; *text; text++) {
+        mask |= 1ull << ((u8)*text % 64);
+    }
+    return mask;
+}
+
+static bool history_equals(const char* a, const char* b) {
+    while (*a && *a == *b) {
+        a++;
+        b++;
+    }
+    return *a == *b;
+}
+
+void history_init(history_t* history) {
+    history->arena_head = 0;
+    history->oldest = 1;
+    history->next = 1;
+}
+
+void history_add(history_t* history, const char* line) {
+    u32 length = 0;
+    while (line[length] && length < HISTORY_LINE_MAX - 1) length++;
+    if (length == 0) {
+        return;
+    }
+    if (history->next > history->oldest &&
+        history_equals(history->arena + history->entries[history_slot(history->next - 1)].offset, line)) {
+        return;
+    }
+
+    // Lines are contiguous: one that doesn't fit before the end of the
+    // arena starts over at the beginning, and the lines left between the
+    // head and the end (the oldest ones) go
+    if (history->arena_head + length + 1 > HISTORY_ARENA_SIZE) {
+        while (history->oldest < history->next &&
+               history->entries[history_slot(history->oldest)].offset >= history->arena_head) {
+            history->oldest++;
+        }
+        history->arena_head = 0;
+    }
+
+    // Lines sit in the arena in the order they were added, so the space
+    // after the head belongs to the oldest ones; evict until it is free
+    u32 head = history->arena_head;
+    while (history->oldest < history->next) {
+        history_entry_t* entry = &history->entries[history_slot(history->oldest)];
+        bool overlaps = entry->offset < head + length + 1 &&
+                        head < (u32)entry->offset + entry->length + 1;
+        if (!overlaps && history->next - history->oldest < HISTORY_MAX) {
+            break;
+        }
+        history->oldest++;
+    }
+
+    history_entry_t* entry = &history->entries[history_slot(history->next++)];
+    entry->offset = (u16)head;
+    entry->length = (u16)length;
+    for (u32 i = 0; i < length; i++) {
+        history->arena[head + i] = line[i];
+    }
+    history->arena[head + length] = '\0';
+    entry->mask = history_mask(history->arena + head);
+    history->arena_head += length + 1;
+}
+
+u32 history_first(const history_t* history) {
+    return history->oldest;
+}
+
+u32 history_end(const history_t* history) {
+    return history->next;
+}
+
+const char* history_get(const history_t* history, u32 number) {
+    if (number < history->oldest || number >= history->next) {
+        return NULL;
+    }
+    return history->arena + history->entries[history_slot(number)].offset;
+}
+
+// Does text contain query?
+static bool history_contains(const char* text, u32 length, const char* query, u32 query_length) {
+    for (u32 start = 0; start + query_length <= length; start++) {
+        u32 i = 0;
+        while (i < query_length && text[start + i] == query[i]) i++;
+        if (i == query_length) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Does line number contain query (with the given mask and length)?
+static bool history_matches(const history_t* history, u32 number, const char* query, u64 mask, u32 query_length) {
+    const history_entry_t* entry = &history->entries[history_slot(number)];
+    return (entry->mask & mask) == mask &&
+           history_contains(history->arena + entry->offset, entry->length, query, query_length);
+}
+
+static u32 history_length(const char* text) {
+    u32 length = 0;
+    while (text[length]) length++;
+    return length;
+}
+
+void history_search_start(const history_t* history, history_search_t* search, const char* query) {
+    u64 mask = history_mask(query);
+    u32 query_length = history_length(query);
+
+    search->count = 0;
+    for (u32 number = history->next; number-- > history->oldest;) {
+        if (history_matches(history, number, query, mask, query_length)) {
+            search->matches[search->count++] = number;
+        }
+    }
+}
+
+void history_search_narrow(const history_t* history, history_search_t* search, const char* query) {
+    u64 mask = history_mask(query);
+    u32 query_length = history_length(query);
+
+    // Lines evicted since the last call drop out too
+    u32 kept = 0;
+    for (u32 i = 0; i < search->count; i++) {
+        u32 number = search->matches[i];
+        if (number >= history->oldest && history_matches(history, number, query, mask, query_length)) {
+            search->matches[kept++] = number;
+        }
+    }
+    search->count = kept;
+}
+
+u32 history_search_next(const history_search_t* search, u32 before) {
+    // Binary search of the matches, which are in descending order
+    u32 low = 0;
+    u32 high = search->count;
+    while (low < high) {
+        u32 middle = (low + high) / 2;
+        if (search->matches[middle] >= before) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    return low < search->count ? search->matches[low] : 0;
+}
@@ -0,0 +1,60 @@
+#ifndef HISTORY_H
+#define HISTORY_H
+
+#include "../include/types.h"
+
+// Command history. Lines are packed end to end in a byte arena used as a
+// ring, so adding one only ever evicts the oldest lines; numbers keep
+// counting up from 1 as old lines drop out.
+#define HISTORY_ARENA_SIZE  16384
+#define HISTORY_MAX         1024    // Lines remembered at most (power of two)
+#define HISTORY_LINE_MAX    256     // Longer lines are cut
+
+typedef struct {
+    u16 offset;                     // Into the arena
+    u16 length;                     // Without the NUL
+    u64 mask;                       // Bit (c % 64) set for every character c
+} history_entry_t;
+
+// One history (each virtual console keeps its own)
+typedef struct {
+    char arena[HISTORY_ARENA_SIZE];
+    u32 arena_head;                 // Where the next line goes
+    history_entry_t entries[HISTORY_MAX];
+    u32 oldest;                     // Number of the oldest line
+    u32 next;                       // Number the next line gets
+} history_t;
+
+// Start empty
+void history_init(history_t* history);
+
+// Remember a line (empty lines and repeats of the newest are skipped)
+void history_add(history_t* history, const char* line);
+
+// Number of the oldest line still remembered, and one past the newest
+u32 history_first(const history_t* history);
+u32 history_end(const history_t* history);
+
+// Get a line by number, NULL if it is out of range or was evicted
+const char* history_get(const history_t* history, u32 number);
+
+// An incremental search: the numbers of the lines that contain the query,
+// newest first. A line that contains a longer query contains every prefix
+// of it, so as the query grows only these lines are looked at again.
+typedef struct {
+    u32 matches[HISTORY_MAX];
+    u32 count;
+} history_search_t;
+
+// Start a search for query, collecting every line that contains it. Each
+// line keeps a mask of the characters in it, so most lines are rejected
+// without looking at their text.
+void history_search_start(const history_t* history, history_search_t* search, const char* query);
+
+// The query grew by some characters: keep the matches that still contain it
+void history_search_narrow(const history_t* history, history_search_t* search, const char* query);
+
+// Number of the newest match before number 'before', 0 if none
+u32 history_search_next(const history_search_t* search, u32 before);
+
+#endif
@@ -1,19 +1,87 @@
 #include "terminal64.h"
+#include "console.h"
+#include "command.h"
+#include "history.h"
 #include "../drivers/screen64.h"
 #include "../drivers/keyboard.h"
 #include "../include/types.h"
+#include "../kernel/util.h"
+#include "../cpu/interrupts.h"
+#include "../cpu/acpi.h"
+#include "../cpu/smp.h"
+#include "../drivers/timer.h"
+#include "../drivers/block.h"
+#include "../fs/bcache.h"
+#include "../fs/vfs.h"
+#include "../kernel/thread.h"
+#include "../kernel/task.h"
+#include "../kernel/sync.h"
+#include "../kernel/idle.h"
+#include "../kernel/async.h"
+#include "../kernel/boottime.h"
+#include "../kernel/bootinfo.h"
+#include "../kernel/low_level.h"
+#include "../kernel/bench.h"
+#include "../kernel/prof.h"
+#include "../kernel/trace.h"
+#include "../kernel/process.h"
+#include "../memory/physical.h"
+#include "../memory/kmalloc.h"
 
 #define CMD_BUFFER_SIZE 256
-#define CMD_HISTORY_SIZE 10  // Store up to 10 commands in history
+#define SEARCH_QUERY_MAX 64
+#define TERMINAL_KEYS 64                // Keys queued for one console
 
-// Command buffer
-static char cmd_buffer[CMD_BUFFER_SIZE];
-static int cmd_position = 0;
-static bool prompt_shown = false;
+// The shell of one virtual console. Each has its own input line, history
+// and running command; keys go to the one on screen.
+typedef struct {
+    u32 index;                          // Console and screen page
+    history_t* history;                 // NULL if there was no memory for it
+    
+    // Command buffer
+    char cmd_buffer[CMD_BUFFER_SIZE];
+    int cmd_position;
+    bool prompt_shown;
+    
+    // Characters of the input line on screen after the prompt
+    int line_shown;
+    
+    // Up/Down recall: the history line being shown (0 when not browsing)
+    // and the line that was being typed before
+    u32 history_browse;
+    char saved_line[CMD_BUFFER_SIZE];
+    
+    // Ctrl-R reverse search. search_matches[n] is the match shown for the
+    // first n characters of the query, so Backspace returns to it.
+    // search holds every line containing the query: each new character
+    // narrows it, and only Backspace goes back over the whole history.
+    bool searching;
+    char search_query[SEARCH_QUERY_MAX + 1];
+    int search_length;
+    u32 search_matches[SEARCH_QUERY_MAX + 1];
+    history_search_t search;
+    
+    // Keys typed on this console, waiting for its task
+    char keys[TERMINAL_KEYS];
+    u32 key_head;
+    u32 key_tail;
+    async_event_t key_event;
+    
+    async_task_t task;
+    async_task_t command_task;
+    async_event_t command_event;        // Signalled when a streamed command ends
+    volatile bool command_running;
+    u64 stream;                         // What the streamed command prints
+    int stream_line;                    // Its next line
+} terminal_t;
 
-// Command history
-static char cmd_history[CMD_HISTORY_SIZE][CMD_BUFFER_SIZE];
-static int history_count = 0;          // Number of commands in history
+static terminal_t terminals[CONSOLE_COUNT];
+static terminal_t* term = &terminals[0];   // The one being served
+static u32 focused = 0;                     // The one on screen
+
+// Interrupt counts at the previous irqstat call, for rates
+static u64 irqstat_last_count[256];
+static u64 irqstat_last_tick = 0;
 
 // Basic string comparison (simplified)
 static bool terminal_str_equals(const char* str1, const char* str2) {
@@ -29,200 +97,1357 @@ static bool terminal_str_equals(const char* str1, const char* str2) {
     return (str1[i] == '\0' && str2[i] == '\0');
 }
 
-// Add a command to history
-static void add_to_history(const char* cmd) {
-    // Don't add empty commands
-    if (cmd[0] == '\0') {
+// Print a number right-aligned in a field of the given width
+static void terminal_print_padded(u64 value, int width) {
+    char buf[24];
+    uint64_to_str(value, buf);
+    for (int i = str_length(buf); i < width; i++) {
+        console_write_char(' ');
+    }
+    console_write(buf);
+}
+
+// Show per-vector interrupt counts, rates since the last call and handler cost
+static void terminal_cmd_irqstat(int argc, char** argv) {
+    u64 now = timer_get_ticks();
+    u64 elapsed = now - irqstat_last_tick;
+    u32 hz = timer_get_frequency();
+    u32 cpus = irq_stats_cpu_count();
+    
+    // The per-CPU table is allocated at boot and may be missing
+    if (!irq_get_stats(0, 0)) {
+        console_write("irq statistics unavailable\n");
         return;
     }
     
-    // Don't add duplicate of the most recent command
-    if (history_count > 0 && terminal_str_equals(cmd_history[history_count - 1], cmd)) {
+    console_write(" VEC       COUNT    RATE/s   AVG CYC   MAX CYC\n");
+    for (int vector = 0; vector < 256; vector++) {
+        u64 count = 0, cycles = 0, max = 0;
+        for (u32 cpu = 0; cpu < cpus; cpu++) {
+            const irq_stats_t* stats = irq_get_stats(cpu, (u8)vector);
+            if (!stats) {
+                continue;
+            }
+            count += stats->count;
+            cycles += stats->cycles_total;
+            if (stats->cycles_max > max) {
+                max = stats->cycles_max;
+            }
+        }
+        if (count == 0) {
+            continue;
+        }
+        
+        u64 delta = count - irqstat_last_count[vector];
+        irqstat_last_count[vector] = count;
+        
+        terminal_print_padded(vector, 4);
+        terminal_print_padded(count, 12);
+        terminal_print_padded(elapsed ? delta * hz / elapsed : 0, 10);
+        terminal_print_padded(cycles / count, 10);
+        terminal_print_padded(max, 10);
+        console_write("\n");
+        
+        // Break the count down by CPU when there is more than one
+        if (cpus > 1) {
+            console_write("     ");
+            for (u32 cpu = 0; cpu < cpus; cpu++) {
+                const irq_stats_t* stats = irq_get_stats(cpu, (u8)vector);
+                console_write(" cpu");
+                terminal_print_padded(cpu, 1);
+                console_write(":");
+                terminal_print_padded(stats ? stats->count : 0, 1);
+            }
+            console_write("\n");
+        }
+    }
+    
+    console_write("Spurious: ");
+    terminal_print_padded(irq_get_spurious_count(), 1);
+    console_write("  Interval: ");
+    terminal_print_padded(elapsed * 1000 / hz, 1);
+    console_write(" ms\n");
+    
+    irqstat_last_tick = now;
+}
+
+COMMAND(irqstat, terminal_cmd_irqstat, 0, 0, "", "Show interrupt counts, rates and handler cycles");
+
+// List the CPUs and whether they are online
+static void terminal_cmd_cpus(int argc, char** argv) {
+    u32 count = smp_cpu_count();
+    
+    console_write("CPU  APIC ID  STATUS    IPIS\n");
+    for (u32 i = 0; i < count; i++) {
+        percpu_t* cpu = smp_get_cpu(i);
+        terminal_print_padded(i, 3);
+        terminal_print_padded(cpu->apic_id, 9);
+        console_write(cpu->online ? "  online " : "  offline");
+        terminal_print_padded(cpu->ipi_count, 7);
+        console_write(i == 0 ? "  (BSP)\n" : "\n");
+    }
+    
+    terminal_print_padded(smp_online_count(), 1);
+    console_write(" of ");
+    terminal_print_padded(count, 1);
+    console_write(" CPUs online\n");
+}
+
+COMMAND(cpus, terminal_cmd_cpus, 0, 0, "", "List the processors and their state");
+
+// Parse a decimal number, returning 0 for anything that isn't one
+static u64 terminal_parse_number(const char* str) {
+    u64 value = 0;
+    while (*str >= '0' && *str <= '9') {
+        value = value * 10 + (*str - '0');
+        str++;
+    }
+    return value;
+}
+
+// List the kernel threads and the measured context switch cost
+static void terminal_cmd_threads(int argc, char** argv) {
+    static const char* state_names[] = { "ready  ", "running", "sleep  ", "blocked", "dead   " };
+    
+    console_write(" ID  NAME            PRI  STATE    SWITCHES   RUNTIME MCYC\n");
+    for (kthread_t* thread = kthread_first(); thread; thread = thread->all_next) {
+        terminal_print_padded(thread->id, 3);
+        console_write("  ");
+        console_write(thread->name);
+        for (int i = str_length(thread->name); i < KTHREAD_NAME_LEN; i++) {
+            console_write_char(' ');
+        }
+        terminal_print_padded(thread->priority, 3);
+        console_write("  ");
+        console_write(state_names[thread->state]);
+        terminal_print_padded(thread->switches, 10);
+        terminal_print_padded(thread->runtime_cycles / 1000000, 15);
+        console_write("\n");
+    }
+    
+    const kthread_switch_stats_t* stats = kthread_get_switch_stats();
+    console_write("Context switches: ");
+    terminal_print_padded(stats->count, 1);
+    if (stats->count) {
+        console_write("  cycles avg ");
+        terminal_print_padded(stats->cycles_total / stats->count, 1);
+        console_write(" min ");
+        terminal_print_padded(stats->cycles_min, 1);
+        console_write(" max ");
+        terminal_print_padded(stats->cycles_max, 1);
+    }
+    console_write("\n");
+}
+
+COMMAND(threads, terminal_cmd_threads, 0, 0, "", "List kernel threads and context switch cost");
+
+// Background busy loop used to check that the shell stays responsive
+static void spin_thread(u64 seconds) {
+    u64 end = timer_get_ticks() + seconds * timer_get_frequency();
+    while (timer_get_ticks() < end) {
+        for (volatile int i = 0; i < 1000; i++) {
+            __asm__ __volatile__("nop");
+        }
+    }
+}
+
+// Start a low priority thread that burns CPU for a number of seconds
+static void terminal_cmd_spin(int argc, char** argv) {
+    u64 seconds = argc > 1 ? terminal_parse_number(argv[1]) : 0;
+    if (seconds == 0) {
+        seconds = 10;
+    }
+    
+    if (kthread_create("spin", spin_thread, seconds, KTHREAD_PRIO_LOW)) {
+        console_write("Spinning in the background for ");
+        terminal_print_padded(seconds, 1);
+        console_write(" s\n");
+    } else {
+        console_write("Out of memory\n");
+    }
+}
+
+COMMAND(spin, terminal_cmd_spin, 0, 1, "[seconds]", "Run a background busy thread for N seconds");
+
+// Show the parallel executor statistics of every CPU
+static void terminal_cmd_tasks(int argc, char** argv) {
+    u32 count = smp_cpu_count();
+    u64 elapsed = cpu_read_tsc() - idle_get_start_tsc();
+    
+    console_write("CPU   SPAWNED  EXECUTED    STEALS    FAILED   WAKEUPS  IDLE%\n");
+    for (u32 i = 0; i < count; i++) {
+        const task_stats_t* stats = task_get_stats(i);
+        terminal_print_padded(i, 3);
+        terminal_print_padded(stats->spawned, 10);
+        terminal_print_padded(stats->executed, 10);
+        terminal_print_padded(stats->steals, 10);
+        terminal_print_padded(stats->steal_failed, 10);
+        terminal_print_padded(stats->wakeups, 10);
+        terminal_print_padded(elapsed ? idle_get_stats(i)->idle_cycles * 100 / elapsed : 0, 7);
+        console_write("\n");
+    }
+}
+
+COMMAND(tasks, terminal_cmd_tasks, 0, 0, "", "Show parallel executor steals and idle time");
+
+// Zero a scratch buffer with every CPU and show how the work was shared
+static void terminal_cmd_pzero(int argc, char** argv) {
+    static u64 scratch = 0;
+    static u64 scratch_pages = 0;
+    
+    u64 megabytes = argc > 1 ? terminal_parse_number(argv[1]) : 0;
+    if (megabytes == 0) {
+        megabytes = 16;
+    }
+    if (megabytes > 64) {
+        megabytes = 64;
+    }
+    u64 pages = megabytes * 1024 * 1024 / PAGE_SIZE;
+    
+    // kmalloc never frees, so keep one buffer and grow it when needed
+    if (pages > scratch_pages) {
+        u64 buffer = (u64)kmalloc((pages + 1) * PAGE_SIZE);
+        if (!buffer) {
+            console_write("Not enough heap for that, try fewer megabytes\n");
+            return;
+        }
+        scratch = (buffer + PAGE_SIZE - 1) & ~(u64)(PAGE_SIZE - 1);
+        scratch_pages = pages;
+    }
+    
+    u32 cpus = smp_cpu_count();
+    u64 before[MAX_CPUS];
+    for (u32 i = 0; i < cpus; i++) {
+        before[i] = task_get_stats(i)->executed;
+    }
+    
+    u64 start = cpu_read_tsc();
+    pmm_zero_pages(scratch, pages);
+    u64 cycles = cpu_read_tsc() - start;
+    
+    terminal_print_padded(megabytes, 1);
+    console_write(" MB zeroed in ");
+    terminal_print_padded(cycles, 1);
+    console_write(" cycles (");
+    terminal_print_padded(cycles / pages, 1);
+    console_write(" per page) on ");
+    terminal_print_padded(smp_online_count(), 1);
+    console_write(" CPUs\nTasks per CPU:");
+    for (u32 i = 0; i < cpus; i++) {
+        console_write(" ");
+        terminal_print_padded(task_get_stats(i)->executed - before[i], 1);
+    }
+    console_write("\n");
+}
+
+COMMAND(pzero, terminal_cmd_pzero, 0, 1, "[megabytes]", "Zero N MB with all CPUs and time it");
+
+// Show acquisitions, contention and wait cycles of every named lock
+static void terminal_cmd_lockstat(int argc, char** argv) {
+    bool reset = argc > 1 && terminal_str_equals(argv[1], "reset");
+    
+    console_write("LOCK            ACQUIRED  CONTENDED    AVG WAIT    MAX WAIT\n");
+    for (lock_stats_t* stats = lock_stats_first(); stats; stats = stats->next) {
+        console_write(stats->name);
+        for (int i = str_length((char*)stats->name); i < 12; i++) {
+            console_write_char(' ');
+        }
+        terminal_print_padded(stats->acquisitions, 12);
+        terminal_print_padded(stats->contended, 11);
+        terminal_print_padded(stats->contended ? stats->wait_cycles_total / stats->contended : 0, 12);
+        terminal_print_padded(stats->wait_cycles_max, 12);
+        console_write("\n");
+        
+        if (reset) {
+            lock_stats_reset(stats);
+        }
+    }
+    if (reset) {
+        console_write("Counters reset\n");
+    }
+}
+
+COMMAND(lockstat, terminal_cmd_lockstat, 0, 1, "[reset]", "Show lock contention ('lockstat reset' clears)");
+
+// Show idle residency and what woke each CPU
+static void terminal_cmd_idle(int argc, char** argv) {
+    u32 count = smp_cpu_count();
+    u64 elapsed = cpu_read_tsc() - idle_get_start_tsc();
+    
+    console_write("Idle method: ");
+    console_write(idle_using_mwait() ? "MONITOR/MWAIT\n" : "HLT\n");
+    console_write("CPU  IDLE%   ENTRIES  AVG RESID  TIMER    KBD    IPI    IRQ    MON  OTHER\n");
+    for (u32 i = 0; i < count; i++) {
+        const idle_stats_t* stats = idle_get_stats(i);
+        terminal_print_padded(i, 3);
+        terminal_print_padded(elapsed ? stats->idle_cycles * 100 / elapsed : 0, 7);
+        terminal_print_padded(stats->entries, 10);
+        terminal_print_padded(stats->entries ? stats->idle_cycles / stats->entries : 0, 11);
+        for (int reason = 0; reason < IDLE_WAKE_REASONS; reason++) {
+            terminal_print_padded(stats->wakeups[reason], 7);
+        }
+        console_write("\n");
+    }
+    console_write("Residency is in TSC cycles per sleep\n");
+}
+
+COMMAND(idle, terminal_cmd_idle, 0, 0, "", "Show idle residency and wakeup reasons per CPU");
+
+// Show the time since boot
+static void terminal_cmd_uptime(int argc, char** argv) {
+    u64 us = timer_get_time_us();
+    terminal_print_padded(us / 1000000, 1);
+    console_write(".");
+    u64 frac = us % 1000000;
+    for (u64 digit = 100000; digit > frac && digit > 1; digit /= 10) {
+        console_write_char('0');
+    }
+    terminal_print_padded(frac, 1);
+    console_write(" s\n");
+}
+
+COMMAND(uptime, terminal_cmd_uptime, 0, 0, "", "Show the time since boot");
+
+// Print a TSC interval in microseconds with three decimals of milliseconds
+static void terminal_print_cycles_ms(u64 cycles, u64 hz, int width) {
+    u64 us = cycles * 1000 / (hz / 1000);
+    terminal_print_padded(us / 1000, width - 4);
+    console_write_char('.');
+    u64 frac = us % 1000;
+    console_write_char('0' + frac / 100);
+    console_write_char('0' + frac / 10 % 10);
+    console_write_char('0' + frac % 10);
+}
+
+// Show how long each boot stage took, from the boot sector to the prompt
+static void terminal_cmd_boottime(int argc, char** argv) {
+    u64 hz = timer_get_tsc_hz();
+    u32 count = boot_stage_count();
+    if (count == 0) {
+        return;
+    }
+    
+    u64 first = boot_stage_get(0)->tsc;
+    console_write("STAGE             STAGE MS    TOTAL MS\n");
+    for (u32 i = 0; i < count; i++) {
+        const boot_stage_t* stage = boot_stage_get(i);
+        u64 previous = i ? boot_stage_get(i - 1)->tsc : stage->tsc;
+        
+        console_write(stage->name);
+        for (int pad = str_length((char*)stage->name); pad < 16; pad++) {
+            console_write_char(' ');
+        }
+        if (hz) {
+            terminal_print_cycles_ms(stage->tsc - previous, hz, 10);
+            terminal_print_cycles_ms(stage->tsc - first, hz, 12);
+        } else {
+            terminal_print_padded(stage->tsc - previous, 10);
+            terminal_print_padded(stage->tsc - first, 12);
+        }
+        console_write("\n");
+    }
+    if (!hz) {
+        console_write("TSC not calibrated, times are in cycles\n");
+    }
+}
+
+COMMAND(boottime, terminal_cmd_boottime, 0, 0, "", "Show how long each boot stage took");
+
+// Print a value as 0x followed by hex digits
+static void terminal_print_hex(u64 value) {
+    static const char digits[] = "0123456789ABCDEF";
+    char buf[19];
+    int shift = 60;
+    int i = 0;
+    
+    buf[i++] = '0';
+    buf[i++] = 'x';
+    while (shift > 0 && ((value >> shift) & 0xF) == 0) {
+        shift -= 4;
+    }
+    for (; shift >= 0; shift -= 4) {
+        buf[i++] = digits[(value >> shift) & 0xF];
+    }
+    buf[i] = '\0';
+    console_write(buf);
+}
+
+// Show how the kernel was loaded: loader, command line, memory map, modules
+static void terminal_cmd_bootinfo(int argc, char** argv) {
+    static const char* loader_names[] = { "boot sector", "Multiboot", "Multiboot2" };
+    const boot_info_t* info = bootinfo_get();
+    
+    console_write("Loader: ");
+    console_write(loader_names[info->loader]);
+    if (info->loader != BOOT_LOADER_SECTOR && info->loader_name[0]) {
+        console_write(" (");
+        console_write(info->loader_name);
+        console_write(")");
+    }
+    console_write("\nCommand line: ");
+    console_write(info->cmdline);
+    console_write("\n");
+    
+    if (info->mmap_count == 0) {
+        console_write("No memory map, assuming 128 MB\n");
+    }
+    for (u32 i = 0; i < info->mmap_count; i++) {
+        const boot_mmap_entry_t* entry = &info->mmap[i];
+        console_write("  ");
+        terminal_print_hex(entry->base);
+        console_write(" - ");
+        terminal_print_hex(entry->base + entry->length);
+        console_write(entry->type == BOOT_MMAP_AVAILABLE ? "  available\n" : "  reserved\n");
+    }
+    
+    for (u32 i = 0; i < info->module_count; i++) {
+        const boot_module_t* module = &info->modules[i];
+        console_write("Module ");
+        terminal_print_hex(module->start);
+        console_write(" - ");
+        terminal_print_hex(module->end);
+        console_write("  ");
+        console_write(module->name);
+        console_write("\n");
+    }
+}
+
+COMMAND(bootinfo, terminal_cmd_bootinfo, 0, 0, "", "Show the loader, command line, memory map and modules");
+
+// List the async tasks and what they have cost
+static void terminal_cmd_async(int argc, char** argv) {
+    static const char* state_names[] = { "ready   ", "running ", "blocked ", "sleeping", "finished" };
+    
+    console_write("NAME        STATE        POLLS   AVG CYC\n");
+    for (async_task_t* task = async_first(); task; task = task->all_next) {
+        console_write(task->name);
+        for (int i = str_length((char*)task->name); i < 12; i++) {
+            console_write_char(' ');
+        }
+        console_write(state_names[task->state]);
+        terminal_print_padded(task->polls, 10);
+        terminal_print_padded(task->polls ? task->cycles / task->polls : 0, 10);
+        console_write("\n");
+    }
+}
+
+COMMAND(async, terminal_cmd_async, 0, 0, "", "List async tasks with their polls and cycles");
+
+// Print a value given in hundredths as n.nn, right aligned
+static void terminal_print_hundredths(u64 value, int width) {
+    terminal_print_padded(value / 100, width - 3);
+    console_write_char('.');
+    console_write_char('0' + (value / 10) % 10);
+    console_write_char('0' + value % 10);
+}
+
+// Run length of each blkbench measurement
+#define BLKBENCH_RUN_MS 250
+
+// Random reads at a few queue depths and request sizes
+static void terminal_cmd_blkbench(int argc, char** argv) {
+    static const u32 depths[] = { 1, 4, 16, 32 };
+    static const u32 sizes[] = { 8, 128 };     // Sectors: 4 KB and 64 KB
+    
+    blk_device_t* dev = argc > 1 ? blk_find(argv[1]) : blk_first();
+    if (!dev) {
+        console_write("No such block device\n");
+        return;
+    }
+    u64 hz = timer_get_tsc_hz();
+    if (!hz) {
+        console_write("TSC not calibrated\n");
         return;
     }
     
-    // If history is full, shift everything down
-    if (history_count == CMD_HISTORY_SIZE) {
-        for (int i = 0; i < CMD_HISTORY_SIZE - 1; i++) {
-            int j;
-            for (j = 0; j < CMD_BUFFER_SIZE; j++) {
-                cmd_history[i][j] = cmd_history[i + 1][j];
-                if (cmd_history[i][j] == '\0') break;
+    console_write(dev->name);
+    console_write(": ");
+    console_write(dev->model);
+    console_write(", ");
+    terminal_print_padded(dev->sectors * BLK_SECTOR_SIZE / (1024 * 1024), 1);
+    console_write(" MB, queue depth ");
+    terminal_print_padded(dev->queue_depth, 1);
+    console_write(dev->interrupts ? ", interrupts\n" : ", polled\n");
+    console_write(" QD  SIZE KB      IOPS      MB/s  AVG LAT us  KICK/IO  IRQ/IO  ERRORS\n");
+    
+    for (u32 s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        for (u32 d = 0; d < sizeof(depths) / sizeof(depths[0]); d++) {
+            blk_bench_result_t result;
+            if (!blk_bench(dev, depths[d], sizes[s], BLKBENCH_RUN_MS, &result)) {
+                console_write("Benchmark failed\n");
+                return;
             }
-            cmd_history[i][j] = '\0';
+            
+            terminal_print_padded(depths[d], 3);
+            terminal_print_padded(sizes[s] * BLK_SECTOR_SIZE / 1024, 9);
+            terminal_print_padded(result.ios * hz / result.cycles, 10);
+            terminal_print_padded(result.bytes / 1024 * hz / result.cycles / 1024, 10);
+            terminal_print_padded(result.ios ? result.latency_cycles / result.ios * 1000000 / hz : 0, 12);
+            terminal_print_hundredths(result.ios ? result.kicks * 100 / result.ios : 0, 9);
+            terminal_print_hundredths(result.ios ? result.irqs * 100 / result.ios : 0, 8);
+            terminal_print_padded(result.errors, 8);
+            console_write("\n");
+            
+            // Show each row as soon as it is measured
+            console_flush();
         }
-        history_count--;
     }
+}
+
+COMMAND(blkbench, terminal_cmd_blkbench, 0, 1, "[disk]", "Measure random reads on a disk at several queue depths");
+
+// Results are kept until the run is over, since the screen benchmarks
+// draw over the display
+#define BENCH_RESULTS_MAX 32
+
+static bench_result_t bench_results[BENCH_RESULTS_MAX];
+static u32 bench_result_count;
+
+static void terminal_bench_report(const bench_result_t* result) {
+    if (bench_result_count < BENCH_RESULTS_MAX) {
+        bench_results[bench_result_count++] = *result;
+    }
+}
+
+static void terminal_cmd_bench(int argc, char** argv) {
+    console_write("Running benchmarks...\n");
+    console_flush();
     
-    // Add the new command to history
-    int i;
-    for (i = 0; cmd[i] != '\0' && i < CMD_BUFFER_SIZE - 1; i++) {
-        cmd_history[history_count][i] = cmd[i];
+    bench_result_count = 0;
+    if (bench_run(argc > 1 ? argv[1] : "", terminal_bench_report) == 0) {
+        console_write("No such benchmark\n");
+        return;
     }
-    cmd_history[history_count][i] = '\0';
     
-    history_count++;
+    console_write("BENCHMARK               BATCH       MIN    MEDIAN       P99       MAX\n");
+    for (u32 i = 0; i < bench_result_count; i++) {
+        const bench_result_t* result = &bench_results[i];
+        console_write(result->name);
+        for (int pad = str_length((char*)result->name); pad < 22; pad++) {
+            console_write_char(' ');
+        }
+        terminal_print_padded(result->batch, 7);
+        terminal_print_padded(result->min, 10);
+        terminal_print_padded(result->median, 10);
+        terminal_print_padded(result->p99, 10);
+        terminal_print_padded(result->max, 10);
+        console_write("\n");
+    }
+    console_write("(cycles per operation; also written to the serial port as JSON)\n");
 }
 
-// Initialize the terminal
-void terminal_init() {
-    // Clear the screen
-    screen_clear();
+COMMAND(bench, terminal_cmd_bench, 0, 1, "[name]", "Run kernel microbenchmarks (cycles per operation)");
+
+// Functions listed by prof top unless asked for more
+#define PROF_TOP_DEFAULT 15
+#define PROF_TOP_MAX 40
+
+// Print part/whole as a percentage with one decimal, right-aligned
+static void terminal_print_percent(u64 part, u64 whole, int width) {
+    u64 tenths = whole ? part * 1000 / whole : 0;
+    terminal_print_padded(tenths / 10, width - 2);
+    console_write_char('.');
+    console_write_char('0' + tenths % 10);
+}
+
+static void terminal_prof_status() {
+    console_write("Samples: ");
+    terminal_print_padded(prof_sample_count(), 1);
+    console_write(" (");
+    terminal_print_padded(prof_dropped(), 1);
+    console_write(" dropped) at ");
+    terminal_print_padded(prof_hz(), 1);
+    console_write(prof_running() ? " Hz, running\n" : " Hz, stopped\n");
+}
+
+static void terminal_prof_top(u64 count) {
+    static prof_entry_t entries[PROF_TOP_MAX];
+    if (count == 0) {
+        count = PROF_TOP_DEFAULT;
+    } else if (count > PROF_TOP_MAX) {
+        count = PROF_TOP_MAX;
+    }
     
-    // Display welcome message
-    screen_print("CustomOS 64-bit Terminal v1.0\n\n");
-    screen_print("Welcome to CustomOS! Type 'help' for available commands.\n\n");
+    terminal_prof_status();
+    u64 samples = prof_sample_count();
+    u32 found = prof_top(entries, (u32)count);
+    if (found == 0) {
+        console_write("No samples, use 'prof start' first\n");
+        return;
+    }
+    console_write(" SELF%  TOTAL%  SAMPLES  FUNCTION\n");
+    for (u32 i = 0; i < found; i++) {
+        terminal_print_percent(entries[i].self, samples, 6);
+        terminal_print_percent(entries[i].total, samples, 8);
+        terminal_print_padded(entries[i].self, 9);
+        console_write("  ");
+        console_write(entries[i].name);
+        console_write("\n");
+    }
+}
+
+// Sampling profiler: start/stop it, show the hottest functions or send the
+// raw samples to the serial port
+static void terminal_cmd_prof(int argc, char** argv) {
+    if (argc == 1) {
+        terminal_prof_status();
+    } else if (terminal_str_equals(argv[1], "start")) {
+        u32 hz = prof_start(argc > 2 ? (u32)terminal_parse_number(argv[2]) : 0);
+        if (hz == 0) {
+            console_write("Out of memory\n");
+            return;
+        }
+        console_write("Sampling at ");
+        terminal_print_padded(hz, 1);
+        console_write(" Hz\n");
+    } else if (terminal_str_equals(argv[1], "stop") && argc == 2) {
+        prof_stop();
+        terminal_prof_status();
+    } else if (terminal_str_equals(argv[1], "top")) {
+        terminal_prof_top(argc > 2 ? terminal_parse_number(argv[2]) : 0);
+    } else if (terminal_str_equals(argv[1], "dump") && argc == 2) {
+        console_write("Writing samples to the serial port...\n");
+        console_flush();
+        terminal_print_padded(prof_dump(), 1);
+        console_write(" samples written\n");
+    } else {
+        console_write("Usage: prof [start [hz] | stop | top [count] | dump]\n");
+    }
+}
+
+COMMAND(prof, terminal_cmd_prof, 0, 2, "[start [hz] | stop | top [count] | dump]", "Sample where the kernel spends its time");
+
+static void terminal_trace_status() {
+    console_write("Events: ");
+    terminal_print_padded(trace_event_count(), 1);
+    console_write(" (");
+    terminal_print_padded(trace_lost(), 1);
+    console_write(trace_mask ? " overwritten), tracing\n" : " overwritten), stopped\n");
+}
+
+// Tracepoints: enable groups of events, stop, or stream the rings to the
+// serial port
+static void terminal_cmd_trace(int argc, char** argv) {
+    if (argc == 1) {
+        terminal_trace_status();
+    } else if (terminal_str_equals(argv[1], "start")) {
+        u32 mask = argc == 2 ? trace_group_mask("all") : 0;
+        for (int i = 2; i < argc; i++) {
+            u32 group = trace_group_mask(argv[i]);
+            if (group == 0) {
+                console_write("Unknown event group: ");
+                console_write(argv[i]);
+                console_write("\nGroups: irq key command console page vmm all\n");
+                return;
+            }
+            mask |= group;
+        }
+        console_write(trace_start(mask) ? "Tracing\n" : "Out of memory\n");
+    } else if (terminal_str_equals(argv[1], "stop") && argc == 2) {
+        trace_stop();
+        terminal_trace_status();
+    } else if (terminal_str_equals(argv[1], "dump") && argc == 2) {
+        console_write("Writing events to the serial port...\n");
+        console_flush();
+        terminal_print_padded(trace_dump(), 1);
+        console_write(" events written\n");
+    } else {
+        console_write("Usage: trace [start [group...] | stop | dump]\n");
+    }
+}
+
+COMMAND(trace, terminal_cmd_trace, 0, COMMAND_MAX_ARGS, "[start [group...] | stop | dump]", "Record tracepoint events for a timeline");
+
+// Run a built-in program in user mode, or list them
+static void terminal_cmd_user(int argc, char** argv) {
+    if (argc == 1) {
+        const user_program_t* program;
+        for (u32 i = 0; (program = process_program(i)) != NULL; i++) {
+            console_write(program->name);
+            for (int pad = str_length((char*)program->name); pad < 10; pad++) {
+                console_write_char(' ');
+            }
+            console_write(program->description);
+            console_write("\n");
+        }
+        return;
+    }
+    
+    const user_program_t* program = process_find_program(argv[1]);
+    if (!program) {
+        console_write("No such program, 'user' lists them\n");
+        return;
+    }
+    process_t process;
+    if (!process_create(&process, program)) {
+        console_write("Out of memory\n");
+        return;
+    }
+    
+    u64 code = process_run(&process, argc > 2 ? terminal_parse_number(argv[2]) : 0);
+    if (process.fault != PROCESS_NO_FAULT) {
+        console_write("Killed by exception ");
+        terminal_print_padded(process.fault, 1);
+        console_write(" at ");
+        terminal_print_hex(process.fault_rip);
+        if (process.fault == 14) {
+            console_write(", address ");
+            terminal_print_hex(process.fault_address);
+        }
+        console_write("\n");
+    }
+    console_write("Exit code ");
+    terminal_print_padded(code, 1);
+    console_write("\n");
+    process_destroy(&process);
+}
+
+COMMAND(user, terminal_cmd_user, 0, 2, "[program [arg]]", "Run a program in user mode (ring 3)");
+
+// Show the buffer cache counters
+static void terminal_print_bcache_stats() {
+    const bcache_stats_t* stats = bcache_get_stats();
+    u64 lookups = stats->hits + stats->misses;
+    
+    console_write("Buffers:    ");
+    terminal_print_padded(stats->buffers, 1);
+    console_write(" of ");
+    terminal_print_padded(stats->max_buffers, 1);
+    console_write(" (");
+    terminal_print_padded((u64)stats->buffers * BCACHE_BLOCK_SIZE / 1024, 1);
+    console_write(" KB), ");
+    terminal_print_padded(stats->dirty, 1);
+    console_write(" dirty\nHits:       ");
+    terminal_print_padded(stats->hits, 1);
+    console_write(" (");
+    terminal_print_padded(lookups ? stats->hits * 100 / lookups : 0, 1);
+    console_write("%)\nMisses:     ");
+    terminal_print_padded(stats->misses, 1);
+    console_write("\nRead-ahead: ");
+    terminal_print_padded(stats->readahead, 1);
+    console_write(" blocks, ");
+    terminal_print_padded(stats->readahead_hits, 1);
+    console_write(" used\nEvictions:  ");
+    terminal_print_padded(stats->evictions, 1);
+    console_write("\nWritebacks: ");
+    terminal_print_padded(stats->writebacks, 1);
+    console_write("\nErrors:     ");
+    terminal_print_padded(stats->errors, 1);
+    console_write("\n");
+}
+
+// Read blocks in order through the cache and time it
+static void terminal_bcache_read(int argc, char** argv) {
+    u64 first = argc > 3 ? terminal_parse_number(argv[3]) : 0;
+    u64 count = argc > 4 ? terminal_parse_number(argv[4]) : 0;
+    if (count == 0) {
+        count = 256;
+    }
+    
+    blk_device_t* dev = argc > 2 ? blk_find(argv[2]) : blk_first();
+    if (!dev) {
+        console_write("No such block device\n");
+        return;
+    }
+    u64 hz = timer_get_tsc_hz();
+    
+    const bcache_stats_t* stats = bcache_get_stats();
+    u64 hits = stats->hits;
+    u64 readahead_hits = stats->readahead_hits;
+    u64 start = cpu_read_tsc();
+    u64 done = 0;
+    for (; done < count; done++) {
+        buffer_t* buf = bcache_read(dev, first + done);
+        if (!buf) {
+            break;
+        }
+        bcache_release(buf);
+    }
+    u64 cycles = cpu_read_tsc() - start;
+    
+    terminal_print_padded(done, 1);
+    console_write(" blocks, ");
+    terminal_print_padded(stats->hits - hits, 1);
+    console_write(" hits (");
+    terminal_print_padded(stats->readahead_hits - readahead_hits, 1);
+    console_write(" read ahead)");
+    if (hz && cycles) {
+        console_write(", ");
+        terminal_print_padded(cycles * 1000000 / hz, 1);
+        console_write(" us, ");
+        terminal_print_padded(done * BCACHE_BLOCK_SIZE / 1024 * hz / cycles / 1024, 1);
+        console_write(" MB/s");
+    }
+    console_write("\n");
+    if (done < count) {
+        console_write("Read failed at block ");
+        terminal_print_padded(first + done, 1);
+        console_write("\n");
+    }
+}
+
+// Buffer cache counters, timed sequential reads and sync
+static void terminal_cmd_bcache(int argc, char** argv) {
+    if (argc == 1) {
+        terminal_print_bcache_stats();
+    } else if (terminal_str_equals(argv[1], "read")) {
+        terminal_bcache_read(argc, argv);
+    } else if (terminal_str_equals(argv[1], "sync") && argc == 2) {
+        bcache_sync();
+        console_write("Dirty buffers written\n");
+    } else {
+        console_write("Usage: bcache [read [disk] [block] [count] | sync]\n");
+    }
+}
+
+COMMAND(bcache, terminal_cmd_bcache, 0, 4, "[read [disk] [block] [count] | sync]", "Show buffer cache stats, time cached reads or write back");
+
+// List a directory of the initrd (or show a single file)
+static void terminal_cmd_ls(int argc, char** argv) {
+    const char* path = argc > 1 ? argv[1] : "/";
+    vfs_stat_t stat;
+    if (vfs_stat(path, &stat) != 0) {
+        console_write("No such file or directory (is an initrd loaded?)\n");
+        return;
+    }
+    if (stat.type == VFS_FILE) {
+        terminal_print_padded(stat.size, 10);
+        console_write("  ");
+        console_write(path);
+        console_write("\n");
+        return;
+    }
+    
+    int fd = vfs_open(path);
+    if (fd < 0) {
+        console_write("Cannot open directory\n");
+        return;
+    }
+    vfs_dirent_t entry;
+    while (vfs_readdir(fd, &entry) == 1) {
+        if (entry.type == VFS_DIR) {
+            console_write("     <DIR>  ");
+        } else {
+            terminal_print_padded(entry.size, 10);
+            console_write("  ");
+        }
+        console_write(entry.name);
+        console_write(entry.type == VFS_DIR ? "/\n" : "\n");
+    }
+    vfs_close(fd);
+}
+
+COMMAND(ls, terminal_cmd_ls, 0, 1, "[path]", "List a directory of the initrd");
+
+// Print a file from the initrd, straight from the image
+static void terminal_cmd_cat(int argc, char** argv) {
+    int fd = vfs_open(argv[1]);
+    if (fd < 0) {
+        console_write("No such file\n");
+        return;
+    }
+    
+    const void* data;
+    s64 length;
+    bool newline = true;
+    while ((length = vfs_read(fd, &data, PAGE_SIZE)) > 0) {
+        const char* text = (const char*)data;
+        for (s64 i = 0; i < length; i++) {
+            console_write_char(text[i]);
+        }
+        newline = text[length - 1] == '\n';
+    }
+    if (length == VFS_EISDIR) {
+        console_write("Is a directory\n");
+    } else if (!newline) {
+        console_write("\n");
+    }
+    vfs_close(fd);
+}
+
+COMMAND(cat, terminal_cmd_cat, 1, 1, "<file>", "Print a file from the initrd");
+
+// Commands whose output is streamed line by line by the command task
+#define STREAM_HELP    0
+#define STREAM_HISTORY 1
+
+// Room left in the console ring before the next streamed line is queued
+#define STREAM_MIN_SPACE 512
+
+static async_task_t terminal_task;
+
+// Serve a console: its state and its output from here on
+static void terminal_serve(terminal_t* terminal) {
+    term = terminal;
+    console_select(terminal->index);
+}
+
+// Number of lines a streamed command prints
+static int terminal_stream_count(u64 stream) {
+    if (stream == STREAM_HELP) {
+        return command_count() + 1;
+    }
+    u32 count = term->history ? history_end(term->history) - history_first(term->history) : 0;
+    return count ? count : 1;
+}
+
+// Queue one line of a streamed command
+static void terminal_stream_print(u64 stream, int line) {
+    if (stream == STREAM_HELP) {
+        if (line == 0) {
+            console_write("Available Commands:\n");
+            return;
+        }
+        const command_t* command = command_get(line - 1);
+        console_write(command->name);
+        for (int i = str_length((char*)command->name); i < 8; i++) {
+            console_write_char(' ');
+        }
+        console_write(" - ");
+        console_write(command->help);
+        console_write("\n");
+        return;
+    }
     
-    // Display prompt
-    screen_print("> ");
-    prompt_shown = true;
+    if (!term->history || history_end(term->history) == history_first(term->history)) {
+        console_write("No commands in history.\n");
+        return;
+    }
     
-    // Initialize command buffer
-    cmd_position = 0;
-    cmd_buffer[0] = '\0';
+    u32 number = history_first(term->history) + line;
+    terminal_print_padded(number, 5);
+    console_write("  ");
+    console_write(history_get(term->history, number));
+    console_write("\n");
+}
+
+// Command task - prints a long listing a line at a time, waiting for the
+// console to drain rather than flushing it synchronously
+static int terminal_stream_poll(async_task_t* task) {
+    terminal_serve(&terminals[task->arg]);
+    ASYNC_BEGIN(task);
+    for (term->stream_line = 0; term->stream_line < terminal_stream_count(term->stream); term->stream_line++) {
+        AWAIT_EVENT(task, console_drained_event(), console_space() >= STREAM_MIN_SPACE);
+        terminal_stream_print(term->stream, term->stream_line);
+    }
     
-    // Initialize history
-    history_count = 0;
+    console_write("> ");
+    term->prompt_shown = true;
+    term->command_running = false;
+    async_signal(&term->command_event);
+    ASYNC_END(task);
+}
+
+// Run a streamed command on the command task
+static void terminal_start_stream(u64 stream) {
+    term->command_running = true;
+    term->stream = stream;
+    async_spawn(&term->command_task, "command", terminal_stream_poll, term->index);
 }
 
 // Execute a Command
 static void terminal_execute_command(char* cmd) {
+    char line[CMD_BUFFER_SIZE];
+    
     // Skip leading spaces
     while (*cmd == ' ') cmd++;
     
-    // Add to history first (before we potentially modify cmd)
-    add_to_history(cmd);
+    // !n runs history line n again, !! the last one
+    if (cmd[0] == '!') {
+        const char* recalled = NULL;
+        if (term->history) {
+            u32 number = cmd[1] == '!' ? history_end(term->history) - 1 : (u32)terminal_parse_number(cmd + 1);
+            recalled = number ? history_get(term->history, number) : NULL;
+        }
+        if (!recalled) {
+            console_write("No such history line\n> ");
+            term->prompt_shown = true;
+            return;
+        }
+        int i = 0;
+        for (; recalled[i] && i < CMD_BUFFER_SIZE - 1; i++) {
+            line[i] = recalled[i];
+        }
+        line[i] = '\0';
+        cmd = line;
+        console_write(cmd);
+        console_write("\n");
+    }
     
-    // Empty command
-    if (*cmd == '\0') {
-        // Show the prompt for the next command
-        screen_print("> ");
-        prompt_shown = true;
-        return;
+    // Add to history first (the line is split up in place below)
+    if (term->history) {
+        history_add(term->history, cmd);
     }
     
-    // Find command end and arguments start
-    char* args = cmd;
-    while (*args != ' ' && *args != '\0') args++;
+    if (!command_execute(cmd)) {
+        console_write("Unknown command: ");
+        console_write(cmd);
+        console_write("\nType 'help' for a list of commands.\n");
+    }
     
-    // If we have arguments, null-terminate the command and point to args
-    bool has_args = (*args != '\0');
-    if (has_args) {
-        *args = '\0';  // Null-terminate the command
-        args++;        // Move to arguments
-        
-        // Skip leading spaces in arguments
-        while (*args == ' ') args++;
-    } else {
-        args = "";     // No arguments
+    // A streamed command shows the prompt when it is done
+    if (term->command_running) {
+        return;
+    }
+    console_write("> ");
+    term->prompt_shown = true;
+}
+
+static void terminal_cmd_help(int argc, char** argv) {
+    terminal_start_stream(STREAM_HELP);
+}
+
+COMMAND(help, terminal_cmd_help, 0, 0, "", "Display this help message");
+
+static void terminal_cmd_clear(int argc, char** argv) {
+    // Clear this console's page completely, after anything still queued
+    console_clear();
+    
+    // Optional: Re-display a minimal header
+    console_write("CustomOS 64-bit Terminal v1.0\n\n");
+}
+
+COMMAND(clear, terminal_cmd_clear, 0, 0, "", "Clear the screen");
+
+static void terminal_cmd_about(int argc, char** argv) {
+    console_write("CustomOS 64-bit v1.0\n");
+    console_write("A simple 64-bit operating system built from scratch\n\n");
+    console_write("Features:\n");
+    console_write("- 64-bit long mode operation\n");
+    console_write("- Protected memory management\n");
+    console_write("- Keyboard input with shift support\n");
+    console_write("- Command history with recall and reverse search\n");
+    console_write("- Four virtual consoles, switched with Alt+F1-F4\n");
+    console_write("- Sampling profiler with a symbolized hot-spot report\n");
+    console_write("- Tracepoints with a timeline export\n");
+    console_write("- Ring 3 processes with SYSCALL/SYSRET system calls\n");
+    console_write("- Command-line interface\n");
+    console_write("- Basic text-based shell\n");
+}
+
+COMMAND(about, terminal_cmd_about, 0, 0, "", "Display information about CustomOS");
+
+static void terminal_cmd_echo(int argc, char** argv) {
+    for (int i = 1; i < argc; i++) {
+        if (i > 1) {
+            console_write_char(' ');
+        }
+        console_write(argv[i]);
+    }
+    console_write("\n");
+}
+
+COMMAND(echo, terminal_cmd_echo, 0, COMMAND_MAX_ARGS, "[text]", "Display the provided text");
+
+static void terminal_cmd_history(int argc, char** argv) {
+    terminal_start_stream(STREAM_HISTORY);
+}
+
+COMMAND(history, terminal_cmd_history, 0, 0, "", "Show command history");
+
+// Print one Tab completion candidate
+static void terminal_print_match(const command_t* command) {
+    console_write(command->name);
+    console_write("  ");
+}
+
+// Complete the command name being typed: as far as the candidates agree,
+// or list them when they don't
+static void terminal_complete() {
+    // Only the first word is a command name
+    for (int i = 0; i < term->cmd_position; i++) {
+        if (term->cmd_buffer[i] == ' ') {
+            return;
+        }
     }
     
-    // Process commands
-    if (terminal_str_equals(cmd, "help")) {
-        screen_print("Available Commands:\n");
-        screen_print("help    - Display this help message\n");
-        screen_print("clear   - Clear the screen\n");
-        screen_print("about   - Display information about CustomOS\n");
-        screen_print("echo    - Display the provided text\n");
-        screen_print("history - Show command history\n");
+    char extension[CMD_BUFFER_SIZE];
+    u32 matches = command_complete(term->cmd_buffer, term->cmd_position, extension, sizeof(extension));
+    if (extension[0]) {
+        for (int i = 0; extension[i] && term->cmd_position < CMD_BUFFER_SIZE - 1; i++) {
+            term->cmd_buffer[term->cmd_position++] = extension[i];
+            console_write_char(extension[i]);
+        }
+        term->cmd_buffer[term->cmd_position] = '\0';
+    } else if (matches > 1) {
+        console_write("\n");
+        command_for_each_match(term->cmd_buffer, term->cmd_position, terminal_print_match);
+        console_write("\n> ");
+        console_write(term->cmd_buffer);
     }
-    else if (terminal_str_equals(cmd, "clear")) {
-        // Clear screen completely
-        screen_clear();
-        
-        // Optional: Re-display a minimal header
-        screen_print("CustomOS 64-bit Terminal v1.0\n\n");
-    }
-    else if (terminal_str_equals(cmd, "about")) {
-        screen_print("CustomOS 64-bit v1.0\n");
-        screen_print("A simple 64-bit operating system built from scratch\n\n");
-        screen_print("Features:\n");
-        screen_print("- 64-bit long mode operation\n");
-        screen_print("- Protected memory management\n");
-        screen_print("- Keyboard input with shift support\n");
-        screen_print("- Command history\n");
-        screen_print("- Command-line interface\n");
-        screen_print("- Basic text-based shell\n");
-    }
-    else if (terminal_str_equals(cmd, "echo")) {
-        screen_print(args);
-        screen_print("\n");
-    }
-    else if (terminal_str_equals(cmd, "history")) {
-        // Display command history
-        if (history_count == 0) {
-            screen_print("No commands in history.\n");
-        } else {
-            for (int i = 0; i < history_count; i++) {
-                // Convert index to string (simple conversion for small numbers)
-                char index_str[4] = {'0' + i / 10, '0' + i % 10, '.', ' '};
-                if (i < 10) { // Only single digit
-                    index_str[0] = ' ';
-                    index_str[1] = '0' + i;
-                }
-                
-                screen_print(index_str);
-                screen_print(cmd_history[i]);
-                screen_print("\n");
+}
+
+// Replace the input line on screen (the prompt stays)
+static void terminal_show_line(const char* text) {
+    for (; term->line_shown > 0; term->line_shown--) {
+        console_write_char('\b');
+    }
+    console_write(text);
+    term->line_shown = str_length((char*)text);
+}
+
+// Make text the line being edited
+static void terminal_set_line(const char* text) {
+    term->cmd_position = 0;
+    for (; text[term->cmd_position] && term->cmd_position < CMD_BUFFER_SIZE - 1; term->cmd_position++) {
+        term->cmd_buffer[term->cmd_position] = text[term->cmd_position];
+    }
+    term->cmd_buffer[term->cmd_position] = '\0';
+    terminal_show_line(term->cmd_buffer);
+}
+
+// Up/Down: step through the history, back to the typed line at the bottom
+static void terminal_history_step(bool older) {
+    if (!term->history) {
+        return;
+    }
+    u32 current = term->history_browse ? term->history_browse : history_end(term->history);
+    if (older && current > history_first(term->history)) {
+        if (!term->history_browse) {
+            int i = 0;
+            for (; term->cmd_buffer[i]; i++) {
+                term->saved_line[i] = term->cmd_buffer[i];
             }
+            term->saved_line[i] = '\0';
+        }
+        term->history_browse = current - 1;
+        terminal_set_line(history_get(term->history, term->history_browse));
+    } else if (!older && term->history_browse) {
+        term->history_browse++;
+        if (term->history_browse == history_end(term->history)) {
+            term->history_browse = 0;
+            terminal_set_line(term->saved_line);
+        } else {
+            terminal_set_line(history_get(term->history, term->history_browse));
         }
     }
-    else {
-        screen_print("Unknown command: ");
-        screen_print(cmd);
-        screen_print("\nType 'help' for a list of commands.\n");
+}
+
+// Show the search prompt with the current match
+static void terminal_show_search() {
+    char text[CMD_BUFFER_SIZE + SEARCH_QUERY_MAX + 24];
+    const char* parts[] = { "(reverse-i-search)`", term->search_query, "': ",
+                            term->search_matches[term->search_length] ? history_get(term->history, term->search_matches[term->search_length]) : "" };
+    int length = 0;
+    for (u32 p = 0; p < sizeof(parts) / sizeof(parts[0]); p++) {
+        for (const char* c = parts[p]; *c && length < (int)sizeof(text) - 1; c++) {
+            text[length++] = *c;
+        }
     }
+    text[length] = '\0';
     
-    // Always show the prompt after executing a command
-    screen_print("> ");
-    prompt_shown = true;
+    // Keep it on one line so backspacing over it works
+    if (length > 76) {
+        text[76] = '\0';
+    }
+    terminal_show_line(text);
+}
+
+// Leave search mode, taking the match as the line being edited
+static void terminal_end_search(bool accept) {
+    term->searching = false;
+    u32 match = term->search_matches[term->search_length];
+    terminal_set_line(accept && match ? history_get(term->history, match) : term->cmd_buffer);
+}
+
+// Handle a key while searching
+static void terminal_search_key(char key) {
+    if (key == KEY_CTRL('r')) {
+        // The next older match of the same query
+        u32 current = term->search_matches[term->search_length];
+        u32 older = term->search_length && current ? history_search_next(&term->search, current) : 0;
+        if (older) {
+            term->search_matches[term->search_length] = older;
+        }
+    } else if (key == '\b') {
+        if (term->search_length > 0) {
+            term->search_query[--term->search_length] = '\0';
+            if (term->search_length > 0) {
+                history_search_start(term->history, &term->search, term->search_query);
+            }
+        }
+    } else if (key >= 32 && key <= 126) {
+        if (term->search_length < SEARCH_QUERY_MAX) {
+            // A line matching the longer query also matches the shorter
+            // one, so nothing newer than the current match can
+            u32 current = term->search_matches[term->search_length];
+            term->search_query[term->search_length++] = key;
+            term->search_query[term->search_length] = '\0';
+            if (term->search_length == 1) {
+                history_search_start(term->history, &term->search, term->search_query);
+            } else {
+                history_search_narrow(term->history, &term->search, term->search_query);
+            }
+            term->search_matches[term->search_length] = history_search_next(&term->search, current ? current + 1 : history_end(term->history));
+        }
+    } else if (key == KEY_ESCAPE || key == KEY_CTRL('g')) {
+        terminal_end_search(false);
+        return;
+    } else {
+        terminal_end_search(true);
+        if (key == '\n') {
+            terminal_process_keypress(key);
+        }
+        return;
+    }
+    terminal_show_search();
 }
 
 // Process a keypress
 void terminal_process_keypress(char key) {
+    if (term->searching) {
+        terminal_search_key(key);
+        return;
+    }
+    
     if (key == '\n') {
         // Enter key
-        screen_print("\n");
+        console_write("\n");
         
         // Null-terminate and execute command
-        cmd_buffer[cmd_position] = '\0';
-        prompt_shown = false;  // Clear prompt flag before executing command
-        terminal_execute_command(cmd_buffer);
+        term->cmd_buffer[term->cmd_position] = '\0';
+        term->prompt_shown = false;  // Clear prompt flag before executing command
+        term->line_shown = 0;
+        term->history_browse = 0;
+        terminal_execute_command(term->cmd_buffer);
         
         // Reset buffer
-        cmd_position = 0;
-        cmd_buffer[0] = '\0';
+        term->cmd_position = 0;
+        term->cmd_buffer[0] = '\0';
     } else if (key == '\b') {
         // Backspace
-        if (cmd_position > 0) {
-            cmd_position--;
-            cmd_buffer[cmd_position] = '\0';
-            screen_backspace();
+        if (term->cmd_position > 0) {
+            term->cmd_position--;
+            term->cmd_buffer[term->cmd_position] = '\0';
+            console_write_char('\b');
+            term->line_shown--;
         }
+    } else if (key == '\t') {
+        terminal_complete();
+        term->line_shown = term->cmd_position;
+    } else if (key == KEY_UP || key == KEY_DOWN) {
+        terminal_history_step(key == KEY_UP);
+    } else if (key == KEY_CTRL('r') && term->history) {
+        term->searching = true;
+        term->search_length = 0;
+        term->search_query[0] = '\0';
+        term->search_matches[0] = 0;
+        terminal_show_search();
     } else if (key >= 32 && key <= 126) {
         // Regular printable character
-        if (cmd_position < CMD_BUFFER_SIZE - 1) {
-            cmd_buffer[cmd_position] = key;
-            cmd_position++;
-            cmd_buffer[cmd_position] = '\0';
-            screen_print_char(key);
+        if (term->cmd_position < CMD_BUFFER_SIZE - 1) {
+            term->cmd_buffer[term->cmd_position] = key;
+            term->cmd_position++;
+            term->cmd_buffer[term->cmd_position] = '\0';
+            console_write_char(key);
+            term->line_shown++;
+        }
+    }
+}
+
+// Show another console; its page is already up to date, so this is one
+// CRTC write whatever is on it
+static void terminal_switch(u32 index) {
+    if (index < CONSOLE_COUNT && index != focused) {
+        focused = index;
+        screen_show_page(index);
+    }
+}
+
+// Console task - handles every key queued for its console per pass. Keys
+// typed while a streamed command runs stay queued until it finishes.
+static int terminal_console_poll(async_task_t* task) {
+    terminal_serve(&terminals[task->arg]);
+    ASYNC_BEGIN(task);
+    while (1) {
+        AWAIT_EVENT(task, &term->key_event, term->key_tail != term->key_head);
+        while (term->key_tail != term->key_head && !term->command_running) {
+            char key = term->keys[term->key_tail % TERMINAL_KEYS];
+            term->key_tail++;
+            terminal_process_keypress(key);
         }
+        AWAIT_EVENT(task, &term->command_event, !term->command_running);
     }
+    ASYNC_END(task);
 }
 
-// Update the terminal
-void terminal_update() {
-    // If prompt needs to be shown, show it
-    if (!prompt_shown) {
-        screen_print("> ");
-        prompt_shown = true;
+// Input task - switches consoles on Alt+Fn and hands every other key to
+// the console on screen
+static int terminal_poll(async_task_t* task) {
+    ASYNC_BEGIN(task);
+    
+    // Boot ends when the first prompt is on screen
+    console_select(0);
+    console_flush();
+    boot_stage("prompt");
+    
+    while (1) {
+        AWAIT_EVENT(task, keyboard_get_key_event(), keyboard_has_key());
+        while (keyboard_has_key()) {
+            char key = keyboard_get_last_key();
+            if (KEY_IS_CONSOLE(key)) {
+                terminal_switch((u8)key - (u8)KEY_CONSOLE(0));
+                continue;
+            }
+            terminal_t* terminal = &terminals[focused];
+            if (terminal->key_head - terminal->key_tail < TERMINAL_KEYS) {
+                terminal->keys[terminal->key_head % TERMINAL_KEYS] = key;
+                terminal->key_head++;
+                async_signal(&terminal->key_event);
+            }
+        }
     }
+    ASYNC_END(task);
+}
+
+// Initialize the terminal
+void terminal_init() {
+    static const char* names[CONSOLE_COUNT] = { "tty1", "tty2", "tty3", "tty4" };
+    
+    // Clear the screen
+    screen_clear();
     
-    // Get the last key press
-    char key = keyboard_get_last_key();
+    // Output goes through the console rings from here on
+    console_init();
+    command_init();
     
-    // If we got a key, process it
-    if (key != 0) {
-        terminal_process_keypress(key);
+    for (u32 i = 0; i < CONSOLE_COUNT; i++) {
+        terminal_t* terminal = &terminals[i];
+        terminal->index = i;
+        terminal->history = (history_t*)kmalloc(sizeof(history_t));
+        if (terminal->history) {
+            history_init(terminal->history);
+        }
+        terminal_serve(terminal);
+        
+        // Display welcome message
+        console_write("CustomOS 64-bit Terminal v1.0 (");
+        console_write(names[i]);
+        console_write(", Alt+F1-F4 switch consoles)\n\n");
+        console_write("Welcome to CustomOS! Type 'help' for available commands.\n\n");
+        
+        // The console still works, just without recall and search
+        if (!terminal->history) {
+            console_write("Not enough memory for command history on this console.\n\n");
+        }
+        
+        // Display prompt
+        console_write("> ");
+        term->prompt_shown = true;
+        
+        // Initialize command buffer
+        term->cmd_position = 0;
+        term->cmd_buffer[0] = '\0';
+        
+        // Handle this console's keys on the async executor
+        term->key_head = term->key_tail = 0;
+        term->command_running = false;
+        async_event_init(&term->key_event);
+        async_event_init(&term->command_event);
+        async_spawn(&term->task, names[i], terminal_console_poll, i);
     }
-}
\ No newline at end of file
+    
+    focused = 0;
+    terminal_serve(&terminals[0]);
+    async_spawn(&terminal_task, "terminal", terminal_poll, 0);
+}
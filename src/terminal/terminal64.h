@@ -3,13 +3,10 @@
 
 #include "../include/types.h"
 
-// Initialize the terminal
+// Initialize the terminal and start its input task on the async executor
 void terminal_init();
 
 // Process a single keypress
 void terminal_process_keypress(char key);
 
-// Main terminal update function - call regularly
-void terminal_update();
-
 #endif // TERMINAL64_H
\ No newline at end of file
@@ -0,0 +1,89 @@
+; User programs built into the kernel. process_create copies one to a
+; page of its own at USER_CODE_BASE and runs it in ring 3, so each must be
+; position independent (RIP-relative addressing only) and fit in a page.
+; They start with their argument in rdi and end with SYS_EXIT.
+; Never run in place, so they live with the read-only data.
+
+[bits 64]
+
+; System call numbers (src/kernel/syscall.h)
+SYS_EXIT    equ 0
+SYS_NULL    equ 1
+SYS_WRITE   equ 2
+
+section .rodata
+
+global user_hello_start
+global user_hello_end
+global user_sysbench_start
+global user_sysbench_end
+global user_fault_start
+global user_fault_end
+
+; Print a greeting and exit with status 0
+user_hello_start:
+    lea rdi, [rel .message]
+    mov esi, .message_end - .message
+    mov eax, SYS_WRITE
+    syscall
+
+    xor edi, edi
+    mov eax, SYS_EXIT
+    syscall
+.message:
+    db "Hello from ring 3", 10
+.message_end:
+user_hello_end:
+
+; Time null system calls for the syscall_null benchmark. rdi points to a
+; parameter block in the data page: the number of samples, the calls per
+; sample, then room for the TSC cycles each sample took.
+user_sysbench_start:
+    mov r12, rdi
+    mov r13, [r12]          ; Samples left
+    lea r14, [r12 + 16]     ; Next result
+
+.sample:
+    test r13, r13
+    jz .done
+    lfence
+    rdtsc
+    lfence
+    shl rdx, 32
+    or rax, rdx
+    mov r15, rax            ; Start of the sample
+    mov rbx, [r12 + 8]
+
+    ; rbx and r12-r15 survive system calls
+.call:
+    mov eax, SYS_NULL
+    syscall
+    dec rbx
+    jnz .call
+
+    lfence
+    rdtsc
+    lfence
+    shl rdx, 32
+    or rax, rdx
+    sub rax, r15
+    mov [r14], rax
+    add r14, 8
+    dec r13
+    jmp .sample
+
+.done:
+    xor edi, edi
+    mov eax, SYS_EXIT
+    syscall
+user_sysbench_end:
+
+; Read a kernel address, which has no PAGE_USER mapping: the page fault
+; ends the process before it gets to exit
+user_fault_start:
+    mov rax, 0x100000
+    mov rax, [rax]
+    mov rdi, rax
+    mov eax, SYS_EXIT
+    syscall
+user_fault_end:
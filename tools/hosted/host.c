@@ -0,0 +1,102 @@
+// C library side of the hosted build (see host.h). Built with the system
+// headers, so it can't include the kernel's types.h; the prototypes below
+// must match host.h.
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+
+#define HOST_ARENA_BASE 0x10000
+
+int host_map_arena(uint64_t size) {
+    if (size <= HOST_ARENA_BASE) {
+        return 0;
+    }
+    void* arena = mmap((void*)HOST_ARENA_BASE, size - HOST_ARENA_BASE, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED_NOREPLACE, -1, 0);
+    return arena == (void*)HOST_ARENA_BASE;
+}
+
+uint64_t host_cycles() {
+    uint32_t low, high;
+    __asm__ __volatile__("lfence; rdtsc; lfence" : "=a"(low), "=d"(high) : : "memory");
+    return ((uint64_t)high << 32) | low;
+}
+
+uint64_t host_time_ns() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+
+void host_write(const char* text) {
+    fputs(text, stdout);
+}
+
+void host_write_number(uint64_t value) {
+    printf("%llu", (unsigned long long)value);
+}
+
+void host_fail(const char* message) {
+    fflush(stdout);
+    fprintf(stderr, "%s: %s\n", program_invocation_short_name, message);
+    exit(1);
+}
+
+void* host_alloc(uint64_t size) {
+    void* ptr = calloc(1, size);
+    if (!ptr) {
+        host_fail("out of memory");
+    }
+    return ptr;
+}
+
+void host_free(void* ptr) {
+    free(ptr);
+}
+
+char* host_read_file(const char* path, uint64_t* size) {
+    FILE* file = fopen(path, "rb");
+    if (!file) {
+        return NULL;
+    }
+    uint64_t used = 0, capacity = 65536;
+    char* data = malloc(capacity + 1);
+    size_t n;
+    while (data && (n = fread(data + used, 1, capacity - used, file)) > 0) {
+        used += n;
+        if (used == capacity) {
+            capacity *= 2;
+            data = realloc(data, capacity + 1);
+        }
+    }
+    fclose(file);
+    if (!data) {
+        host_fail("out of memory");
+    }
+    data[used] = '\0';
+    *size = used;
+    return data;
+}
+
+int host_write_file(const char* path, const char* data, uint64_t size) {
+    FILE* file = fopen(path, "wb");
+    if (!file) {
+        return 0;
+    }
+    int ok = fwrite(data, 1, size, file) == size;
+    return fclose(file) == 0 && ok;
+}
+
+static int host_compare(const void* a, const void* b) {
+    uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+    return x < y ? -1 : x > y;
+}
+
+void host_sort(uint64_t* values, uint64_t count) {
+    qsort(values, count, sizeof(uint64_t), host_compare);
+}
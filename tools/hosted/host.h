@@ -0,0 +1,44 @@
+#ifndef HOST_H
+#define HOST_H
+
+#include "../../src/include/types.h"
+
+// The hosted build (make memperf, make test) compiles the kernel's memory manager and
+// util.c unchanged into a Linux program. Those files and the driver are
+// built freestanding against the kernel's own headers; this is the only
+// interface to the C library, implemented in host.c.
+
+// "Physical" memory is an anonymous mapping at its real addresses, so the
+// allocators' identity-mapped pointers (pmm bitmap at 1 MB, kmalloc at
+// 4 MB, page tables anywhere) work as they do in the kernel. Linux keeps
+// the lowest 64 KB unmappable; the kernel never uses it.
+#define HOST_ARENA_BASE     0x10000
+
+// Map [HOST_ARENA_BASE, size); false if the range is taken
+bool host_map_arena(u64 size);
+
+// Cycle counter (fenced RDTSC) and monotonic time
+u64 host_cycles();
+u64 host_time_ns();
+
+// Output to stdout
+void host_write(const char* text);
+void host_write_number(u64 value);
+
+// Print a message to stderr, after the program's name, and exit with
+// status 1
+void host_fail(const char* message);
+
+// Zeroed memory outside the arena (the driver's own bookkeeping)
+void* host_alloc(u64 size);
+void host_free(void* ptr);
+
+// Read a whole file into a NUL-terminated buffer (host_free it), NULL if it
+// can't be read; write one out
+char* host_read_file(const char* path, u64* size);
+bool host_write_file(const char* path, const char* data, u64 size);
+
+// Sort in ascending order
+void host_sort(u64* values, u64 count);
+
+#endif
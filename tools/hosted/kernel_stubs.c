@@ -0,0 +1,53 @@
+// Stand-ins for the kernel services the memory manager calls, for the
+// hosted build. The driver is single threaded, so the locks only need to
+// exist, and parallel_for runs its pieces in order.
+#include "../../src/include/types.h"
+#include "../../src/kernel/sync.h"
+#include "../../src/kernel/task.h"
+#include "../../src/kernel/trace.h"
+
+// Tracepoints stay disabled
+volatile u32 trace_mask = 0;
+
+void trace_record(u32 event, u64 arg) {
+}
+
+void lock_stats_init(lock_stats_t* stats, const char* name) {
+    stats->name = name;
+    stats->acquisitions = 0;
+    stats->contended = 0;
+    stats->wait_cycles_total = 0;
+    stats->wait_cycles_max = 0;
+    stats->next = NULL;
+}
+
+void spin_lock_init(spinlock_t* lock, lock_stats_t* stats) {
+    lock->next = 0;
+    lock->owner = 0;
+    lock->stats = stats;
+}
+
+u64 spin_lock_irqsave(spinlock_t* lock) {
+    return 0;
+}
+
+void spin_unlock_irqrestore(spinlock_t* lock, u64 flags) {
+}
+
+void mcs_lock_init(mcs_lock_t* lock, lock_stats_t* stats) {
+    lock->tail = NULL;
+    lock->stats = stats;
+}
+
+u64 mcs_lock_irqsave(mcs_lock_t* lock, mcs_node_t* node) {
+    return 0;
+}
+
+void mcs_unlock_irqrestore(mcs_lock_t* lock, mcs_node_t* node, u64 flags) {
+}
+
+void parallel_for(u64 begin, u64 end, u64 grain, parallel_for_func_t fn, u64 arg) {
+    for (u64 piece = begin; piece < end; piece += grain) {
+        fn(piece, piece + grain < end ? piece + grain : end, arg);
+    }
+}
@@ -0,0 +1,598 @@
+// Replay allocation traces against the kernel's allocators on the host
+// (hosted build, see host.h), and time memory_copy/memory_set.
+//
+//   memperf [-a pmm|kmalloc|vmm|copy|all] [-p random|fifo|lifo] [-n ops]
+//           [-l live] [-s seed] [-m MB] [-t trace] [-w trace]
+//
+// A trace is text, one operation per line: "a <id> <bytes>" allocates and
+// "f <id>" frees what allocation id got ('#' starts a comment). Without -t
+// a synthetic trace is generated from the pattern, at most -l allocations
+// live at once; -w saves it for later runs. The page allocators (pmm, vmm)
+// take one page per allocation whatever its size.
+//
+// Each run prints one JSON line: throughput, alloc and free latency
+// percentiles in cycles (including the fenced timer read), and the
+// fragmentation of what is left live at the end. Every allocation is also
+// checked against a shadow map of the memory, so an allocator handing out
+// overlapping or out-of-range memory stops the run.
+#include "host.h"
+#include "../../src/kernel/util.h"
+#include "../../src/memory/physical.h"
+#include "../../src/memory/kmalloc.h"
+#include "../../src/memory/virtual.h"
+
+#define DEFAULT_OPS         100000
+#define DEFAULT_LIVE        4096
+#define DEFAULT_MEMORY_MB   256
+#define MAX_MEMORY_MB       4096    // What the kernel's identity map covers
+#define MAX_TRACE_IDS       (1u << 24)
+
+// Pages the physical allocator never hands out (pmm_init)
+#define PMM_RESERVED        (2 * 1024 * 1024)
+
+// vmm allocations are mapped at VMM_BASE + id pages, in a PML4 slot of
+// their own
+#define VMM_BASE            0x8000000000ull
+
+#define COPY_MAX            (1 << 20)
+
+#define OP_ALLOC            'a'
+#define OP_FREE             'f'
+
+typedef struct {
+    u8 kind;
+    u32 id;
+    u32 size;
+} trace_op_t;
+
+typedef struct {
+    const char* name;
+    trace_op_t* ops;
+    u64 count;
+    u32 ids;                        // Highest id + 1
+} trace_t;
+
+typedef struct {
+    const char* name;
+    u32 granule;                    // Shadow map resolution in bytes
+    void (*reset)();
+    u64 (*alloc)(u32 id, u32 size); // Address, 0 if out of memory
+    void (*free)(u32 id, u64 addr, u32 size);
+    void (*check)(u32 id, u64 addr, bool live);
+    u64 (*overhead)(u64 live_count); // Bytes of allocator metadata
+} allocator_t;
+
+static u64 memory_size = (u64)DEFAULT_MEMORY_MB * 1024 * 1024;
+static u64 tsc_hz;
+static u64 rng_state;
+
+static bool str_equals(const char* a, const char* b) {
+    while (*a && *a == *b) {
+        a++;
+        b++;
+    }
+    return *a == *b;
+}
+
+static u64 rng_next() {
+    // xorshift64*
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return rng_state * 0x2545F4914F6CDD1Dull;
+}
+
+static void write_field(const char* key, u64 value) {
+    host_write(",\"");
+    host_write(key);
+    host_write("\":");
+    host_write_number(value);
+}
+
+static void write_string_field(const char* key, const char* value) {
+    host_write(",\"");
+    host_write(key);
+    host_write("\":\"");
+    host_write(value);
+    host_write("\"");
+}
+
+// Parse a decimal number, advancing *text past it; false if there is none
+static bool parse_number(const char** text, u64* value) {
+    const char* p = *text;
+    while (*p == ' ' || *p == '\t') p++;
+    if (*p < '0' || *p > '9') {
+        return false;
+    }
+    *value = 0;
+    while (*p >= '0' && *p <= '9') {
+        *value = *value * 10 + (*p++ - '0');
+    }
+    *text = p;
+    return true;
+}
+
+// Measure the TSC against the monotonic clock over 50 ms
+static void calibrate_tsc() {
+    u64 start_ns = host_time_ns();
+    u64 start = host_cycles();
+    while (host_time_ns() - start_ns < 50000000) {
+    }
+    u64 cycles = host_cycles() - start;
+    tsc_hz = cycles * 1000000000 / (host_time_ns() - start_ns);
+}
+
+// Mostly small objects, with the occasional multi-page buffer
+static u32 trace_size() {
+    u64 r = rng_next();
+    if ((r & 15) == 0) {
+        return 4096 + (u32)((r >> 8) % 8192);
+    }
+    return (u32)(8 + (r >> 8) % 56) << ((r >> 16) & 3);
+}
+
+// Build a synthetic trace. "random" frees a random live allocation, "lifo"
+// the newest and "fifo" the oldest; random and lifo flip a coin between
+// allocating and freeing, fifo allocates until live is reached, then frees
+// one for every allocation.
+static void trace_generate(trace_t* trace, const char* pattern, u64 count, u32 live_max) {
+    bool fifo = str_equals(pattern, "fifo");
+    bool lifo = str_equals(pattern, "lifo");
+    if (!fifo && !lifo && !str_equals(pattern, "random")) {
+        host_fail("unknown pattern (random, fifo or lifo)");
+    }
+
+    u32* live = (u32*)host_alloc((u64)live_max * sizeof(u32));
+    u32 live_count = 0, oldest = 0;
+    u32 next_id = 0;
+
+    trace->name = pattern;
+    trace->ops = (trace_op_t*)host_alloc(count * sizeof(trace_op_t));
+    trace->count = count;
+    for (u64 i = 0; i < count; i++) {
+        trace_op_t* op = &trace->ops[i];
+        bool alloc;
+        if (fifo) {
+            alloc = live_count < live_max;
+        } else {
+            alloc = live_count == 0 || (live_count < live_max && (rng_next() & 1));
+        }
+
+        // fifo keeps the live ids as a ring from oldest, the others as a
+        // dense array (oldest stays 0)
+        if (alloc) {
+            op->kind = OP_ALLOC;
+            op->id = next_id++;
+            op->size = trace_size();
+            live[(oldest + live_count++) % live_max] = op->id;
+        } else if (fifo) {
+            op->kind = OP_FREE;
+            op->id = live[oldest];
+            op->size = 0;
+            oldest = (oldest + 1) % live_max;
+            live_count--;
+        } else {
+            u32 slot = lifo ? live_count - 1 : (u32)(rng_next() % live_count);
+            op->kind = OP_FREE;
+            op->id = live[slot];
+            op->size = 0;
+            live[slot] = live[--live_count];
+        }
+    }
+    trace->ids = next_id;
+    host_free(live);
+}
+
+static void trace_load(trace_t* trace, const char* path) {
+    u64 size;
+    char* text = host_read_file(path, &size);
+    if (!text) {
+        host_fail("can't read the trace");
+    }
+
+    // One operation per line at most
+    u64 lines = 1;
+    for (u64 i = 0; i < size; i++) {
+        lines += text[i] == '\n';
+    }
+    trace->name = path;
+    trace->ops = (trace_op_t*)host_alloc(lines * sizeof(trace_op_t));
+    trace->count = 0;
+    trace->ids = 0;
+
+    const char* p = text;
+    while (*p) {
+        while (*p == ' ' || *p == '\t') p++;
+        char kind = *p;
+        if (kind == OP_ALLOC || kind == OP_FREE) {
+            p++;
+            u64 id, bytes = 0;
+            if (!parse_number(&p, &id) || id >= MAX_TRACE_IDS ||
+                (kind == OP_ALLOC && (!parse_number(&p, &bytes) || bytes == 0 || bytes > 0xFFFFFFFF))) {
+                host_fail("malformed trace line");
+            }
+            trace_op_t* op = &trace->ops[trace->count++];
+            op->kind = kind;
+            op->id = (u32)id;
+            op->size = (u32)bytes;
+            if (id + 1 > trace->ids) {
+                trace->ids = (u32)id + 1;
+            }
+        } else if (kind != '#' && kind != '\n' && kind != '\r' && kind != '\0') {
+            host_fail("malformed trace line");
+        }
+        while (*p && *p != '\n') p++;
+        if (*p) p++;
+    }
+    host_free(text);
+}
+
+static void trace_save(const trace_t* trace, const char* path) {
+    // "a " + two numbers of at most 10 digits + separators
+    char* text = (char*)host_alloc(trace->count * 26 + 64);
+    u64 used = 0;
+    char number[24];
+    const char* header = "# memperf trace\n";
+    memory_copy((char*)header, text, str_length((char*)header));
+    used += str_length((char*)header);
+    for (u64 i = 0; i < trace->count; i++) {
+        const trace_op_t* op = &trace->ops[i];
+        text[used++] = op->kind;
+        text[used++] = ' ';
+        uint64_to_str(op->id, number);
+        memory_copy(number, text + used, str_length(number));
+        used += str_length(number);
+        if (op->kind == OP_ALLOC) {
+            text[used++] = ' ';
+            uint64_to_str(op->size, number);
+            memory_copy(number, text + used, str_length(number));
+            used += str_length(number);
+        }
+        text[used++] = '\n';
+    }
+    if (!host_write_file(path, text, used)) {
+        host_fail("can't write the trace");
+    }
+    host_free(text);
+}
+
+// Allocators
+
+static void pmm_reset() {
+    pmm_init(memory_size, PMM_BITMAP_ADDR);
+}
+
+static u64 pmm_trace_alloc(u32 id, u32 size) {
+    return pmm_alloc_page();
+}
+
+static void pmm_trace_free(u32 id, u64 addr, u32 size) {
+    pmm_free_page(addr);
+}
+
+static void kmalloc_reset() {
+    // Rewinds the bump pointer to the start of the heap
+    kmalloc_init(KMALLOC_HEAP_BASE);
+}
+
+static u64 kmalloc_trace_alloc(u32 id, u32 size) {
+    return (u64)kmalloc(size);
+}
+
+static void kmalloc_trace_free(u32 id, u64 addr, u32 size) {
+    kfree((void*)addr);
+}
+
+static void vmm_reset() {
+    pmm_init(memory_size, PMM_BITMAP_ADDR);
+    vmm_init();
+}
+
+static u64 vmm_trace_alloc(u32 id, u32 size) {
+    u64 page = pmm_alloc_page();
+    if (page && !vmm_map_page(VMM_BASE + (u64)id * PAGE_SIZE, page, PAGE_WRITABLE)) {
+        pmm_free_page(page);
+        page = 0;
+    }
+    return page;
+}
+
+static void vmm_trace_free(u32 id, u64 addr, u32 size) {
+    vmm_unmap_page(VMM_BASE + (u64)id * PAGE_SIZE);
+    pmm_free_page(addr);
+}
+
+static void vmm_check(u32 id, u64 addr, bool live) {
+    u64 phys = vmm_get_physical_address(VMM_BASE + (u64)id * PAGE_SIZE);
+    if (phys != (live ? addr : 0)) {
+        host_fail(live ? "vmm: mapping doesn't translate to its page" : "vmm: unmapped page still translates");
+    }
+}
+
+// Page table pages: everything taken from pmm beyond the mapped pages
+static u64 vmm_overhead(u64 live_count) {
+    u64 used = pmm_get_total_pages() - pmm_get_free_pages() - PMM_RESERVED / PAGE_SIZE;
+    return (used - live_count) * PAGE_SIZE;
+}
+
+static const allocator_t allocators[] = {
+    { "pmm",     PAGE_SIZE, pmm_reset,     pmm_trace_alloc,     pmm_trace_free,     NULL,      NULL },
+    { "kmalloc", 8,         kmalloc_reset, kmalloc_trace_alloc, kmalloc_trace_free, NULL,      NULL },
+    { "vmm",     PAGE_SIZE, vmm_reset,     vmm_trace_alloc,     vmm_trace_free,     vmm_check, vmm_overhead },
+};
+
+// Shadow map: one bit per granule of memory, set while allocated
+
+static u8* shadow;
+static u32 shadow_granule;
+
+static bool shadow_test(u64 granule) {
+    return shadow[granule / 8] & (1 << (granule % 8));
+}
+
+static void shadow_mark(u64 addr, u64 size, bool set) {
+    if (addr < HOST_ARENA_BASE || addr + size > memory_size || addr + size < addr) {
+        host_fail("allocation outside memory (raise -m?)");
+    }
+    u64 first = addr / shadow_granule;
+    u64 last = (addr + size + shadow_granule - 1) / shadow_granule;
+    for (u64 g = first; g < last; g++) {
+        if (set && shadow_test(g)) {
+            host_fail("allocation overlaps a live one");
+        }
+        if (set) {
+            shadow[g / 8] |= 1 << (g % 8);
+        } else {
+            shadow[g / 8] &= ~(1 << (g % 8));
+        }
+    }
+}
+
+static void write_percentiles(const char* key, u64* cycles, u64 count) {
+    host_sort(cycles, count);
+    host_write(",\"");
+    host_write(key);
+    host_write("\":{\"min\":");
+    host_write_number(count ? cycles[0] : 0);
+    write_field("median", count ? cycles[count / 2] : 0);
+    write_field("p99", count ? cycles[count * 99 / 100] : 0);
+    write_field("max", count ? cycles[count - 1] : 0);
+    host_write("}");
+}
+
+static void replay(const allocator_t* allocator, const trace_t* trace) {
+    u64* addrs = (u64*)host_alloc((u64)trace->ids * sizeof(u64));
+    u32* sizes = (u32*)host_alloc((u64)trace->ids * sizeof(u32));
+    u64* alloc_cycles = (u64*)host_alloc(trace->count * sizeof(u64));
+    u64* free_cycles = (u64*)host_alloc(trace->count * sizeof(u64));
+    u64 allocs = 0, frees = 0, failed = 0, total_cycles = 0;
+    u64 live_count = 0, live_bytes = 0, peak_bytes = 0;
+    u64 low = memory_size, high = 0;
+
+    shadow_granule = allocator->granule;
+    shadow = (u8*)host_alloc(memory_size / shadow_granule / 8 + 1);
+    allocator->reset();
+
+    for (u64 i = 0; i < trace->count; i++) {
+        const trace_op_t* op = &trace->ops[i];
+        if (op->kind == OP_ALLOC) {
+            if (addrs[op->id]) {
+                host_fail("trace allocates a live id");
+            }
+            u32 size = allocator->granule == PAGE_SIZE ? PAGE_SIZE : op->size;
+            u64 start = host_cycles();
+            u64 addr = allocator->alloc(op->id, size);
+            u64 cycles = host_cycles() - start;
+            alloc_cycles[allocs++] = cycles;
+            total_cycles += cycles;
+            if (!addr) {
+                failed++;
+                continue;
+            }
+            shadow_mark(addr, size, true);
+            if (allocator->check) {
+                allocator->check(op->id, addr, true);
+            }
+            addrs[op->id] = addr;
+            sizes[op->id] = size;
+            live_count++;
+            live_bytes += size;
+            if (live_bytes > peak_bytes) {
+                peak_bytes = live_bytes;
+            }
+            if (addr < low) {
+                low = addr;
+            }
+            if (addr + size > high) {
+                high = addr + size;
+            }
+        } else {
+            // Frees of failed allocations are skipped
+            u64 addr = op->id < trace->ids ? addrs[op->id] : 0;
+            if (!addr) {
+                continue;
+            }
+            u64 start = host_cycles();
+            allocator->free(op->id, addr, sizes[op->id]);
+            u64 cycles = host_cycles() - start;
+            free_cycles[frees++] = cycles;
+            total_cycles += cycles;
+            shadow_mark(addr, sizes[op->id], false);
+            if (allocator->check) {
+                allocator->check(op->id, addr, false);
+            }
+            addrs[op->id] = 0;
+            live_count--;
+            live_bytes -= sizes[op->id];
+        }
+    }
+
+    // External fragmentation of the span the allocator has used: how much
+    // of the free memory inside it is not in the largest free extent
+    u64 extents = 0, largest = 0, run = 0;
+    for (u64 g = low / shadow_granule; g < (high + shadow_granule - 1) / shadow_granule; g++) {
+        if (shadow_test(g)) {
+            run = 0;
+            continue;
+        }
+        extents += run == 0;
+        run++;
+        if (run > largest) {
+            largest = run;
+        }
+    }
+    u64 span = high > low ? high - low : 0;
+    u64 free_bytes = span > live_bytes ? span - live_bytes : 0;
+    largest *= shadow_granule;
+    if (largest > free_bytes) {
+        largest = free_bytes;
+    }
+
+    host_write("{\"allocator\":\"");
+    host_write(allocator->name);
+    host_write("\"");
+    write_string_field("trace", trace->name);
+    write_field("ops", allocs + frees);
+    write_field("allocs", allocs);
+    write_field("frees", frees);
+    write_field("failed", failed);
+    write_field("ops_per_sec", total_cycles ? (allocs + frees) * tsc_hz / total_cycles : 0);
+    write_percentiles("alloc_cycles", alloc_cycles, allocs);
+    write_percentiles("free_cycles", free_cycles, frees);
+    write_field("peak_live_bytes", peak_bytes);
+    write_field("live_bytes", live_bytes);
+    write_field("span_bytes", span);
+    write_field("free_extents", extents);
+    write_field("largest_free_bytes", largest);
+    write_field("frag_pct", free_bytes ? 100 - largest * 100 / free_bytes : 0);
+    write_field("overhead_bytes", allocator->overhead ? allocator->overhead(live_count) : 0);
+    host_write("}\n");
+
+    host_free(shadow);
+    host_free(addrs);
+    host_free(sizes);
+    host_free(alloc_cycles);
+    host_free(free_cycles);
+}
+
+// memory_copy and memory_set, per call
+
+static void bench_copy() {
+    static const u32 sizes[] = { 64, 4096, 65536, COPY_MAX };
+    char* source = (char*)host_alloc(COPY_MAX);
+    char* dest = (char*)host_alloc(COPY_MAX);
+    u64* cycles = (u64*)host_alloc(1024 * sizeof(u64));
+
+    for (u32 op = 0; op < 2; op++) {
+        for (u32 s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+            u32 size = sizes[s];
+            u32 samples = size >= COPY_MAX ? 64 : 1024;
+            for (u32 i = 0; i < 16 + samples; i++) {
+                u64 start = host_cycles();
+                if (op == 0) {
+                    memory_copy(source, dest, size);
+                } else {
+                    memory_set(dest, (char)i, size);
+                }
+                if (i >= 16) {
+                    cycles[i - 16] = host_cycles() - start;
+                }
+            }
+            host_sort(cycles, samples);
+
+            char number[24];
+            uint64_to_str(size, number);
+            host_write("{\"bench\":\"");
+            host_write(op == 0 ? "memory_copy_" : "memory_set_");
+            host_write(number);
+            host_write("\"");
+            write_field("samples", samples);
+            write_field("min", cycles[0]);
+            write_field("median", cycles[samples / 2]);
+            write_field("p99", cycles[samples * 99 / 100]);
+            write_field("max", cycles[samples - 1]);
+            write_field("mb_per_sec", (u64)size * tsc_hz / cycles[samples / 2] / (1024 * 1024));
+            host_write("}\n");
+        }
+    }
+    host_free(source);
+    host_free(dest);
+    host_free(cycles);
+}
+
+static void usage() {
+    host_fail("usage: memperf [-a pmm|kmalloc|vmm|copy|all] [-p random|fifo|lifo] [-n ops]\n"
+              "               [-l live] [-s seed] [-m MB] [-t trace] [-w trace]");
+}
+
+int main(int argc, char** argv) {
+    const char* which = "all";
+    const char* pattern = "random";
+    const char* load = NULL;
+    const char* save = NULL;
+    u64 ops = DEFAULT_OPS, live = DEFAULT_LIVE, seed = 1, memory_mb = DEFAULT_MEMORY_MB;
+
+    for (int i = 1; i < argc; i++) {
+        const char* option = argv[i];
+        if (option[0] != '-' || option[1] == '\0' || option[2] != '\0' || i + 1 >= argc) {
+            usage();
+        }
+        const char* value = argv[++i];
+        u64* number = NULL;
+        switch (option[1]) {
+            case 'a': which = value; break;
+            case 'p': pattern = value; break;
+            case 't': load = value; break;
+            case 'w': save = value; break;
+            case 'n': number = &ops; break;
+            case 'l': number = &live; break;
+            case 's': number = &seed; break;
+            case 'm': number = &memory_mb; break;
+            default: usage();
+        }
+        if (number && (!parse_number(&value, number) || *value != '\0')) {
+            usage();
+        }
+    }
+    if (ops == 0 || live == 0 || live > MAX_TRACE_IDS || memory_mb < 8 || memory_mb > MAX_MEMORY_MB) {
+        host_fail("-n and -l must be positive, -m between 8 and 4096");
+    }
+    memory_size = memory_mb * 1024 * 1024;
+    rng_state = seed ? seed : 1;
+
+    if (!host_map_arena(memory_size)) {
+        host_fail("can't map the memory arena at its physical addresses");
+    }
+    calibrate_tsc();
+
+    trace_t trace;
+    if (load) {
+        trace_load(&trace, load);
+    } else {
+        if (ops > MAX_TRACE_IDS) {
+            host_fail("-n is limited to 16M operations");
+        }
+        trace_generate(&trace, pattern, ops, (u32)live);
+    }
+    if (save) {
+        trace_save(&trace, save);
+    }
+
+    bool all = str_equals(which, "all");
+    bool ran = false;
+    for (u32 i = 0; i < sizeof(allocators) / sizeof(allocators[0]); i++) {
+        if (all || str_equals(which, allocators[i].name)) {
+            replay(&allocators[i], &trace);
+            ran = true;
+        }
+    }
+    if (all || str_equals(which, "copy")) {
+        bench_copy();
+        ran = true;
+    }
+    if (!ran) {
+        usage();
+    }
+    host_free(trace.ops);
+    return 0;
+}
@@ -0,0 +1,281 @@
+// Unit tests of the kernel's memory manager and memory_copy/memory_set on
+// the host (hosted build, see host.h). Each failed check is printed with
+// its line; the program exits with status 1 if there was one.
+//
+//   memtest
+#include "host.h"
+#include "../../src/kernel/util.h"
+#include "../../src/memory/physical.h"
+#include "../../src/memory/kmalloc.h"
+#include "../../src/memory/virtual.h"
+
+#define TEST_MEMORY         (64ULL * 1024 * 1024)
+#define TEST_PAGES          (TEST_MEMORY / PAGE_SIZE)
+
+// Pages the physical allocator never hands out (pmm_init)
+#define PMM_RESERVED_PAGES  (2 * 1024 * 1024 / PAGE_SIZE)
+
+// Mappings go in a PML4 slot of their own, away from the user slot
+#define VMM_BASE            0x8000000000ull
+
+#define COPY_MAX            4200
+#define COPY_GUARD          16
+
+static u32 checks;
+static u32 failures;
+
+#define CHECK(condition) check((condition), #condition, __LINE__)
+
+static void check(bool ok, const char* what, u32 line) {
+    checks++;
+    if (!ok) {
+        failures++;
+        host_write("FAIL line ");
+        host_write_number(line);
+        host_write(": ");
+        host_write(what);
+        host_write("\n");
+    }
+}
+
+// Hand out every free page; returns how many there were
+static u64 pmm_drain() {
+    u64 count = 0;
+    while (pmm_alloc_page()) {
+        count++;
+    }
+    return count;
+}
+
+static void test_pmm() {
+    pmm_init(TEST_MEMORY, PMM_BITMAP_ADDR);
+    CHECK(pmm_get_total_pages() == TEST_PAGES);
+    CHECK(pmm_get_free_pages() == TEST_PAGES - PMM_RESERVED_PAGES);
+
+    // Lowest free page first, never one in the first 2MB
+    u64 first = pmm_alloc_page();
+    u64 second = pmm_alloc_page();
+    CHECK(first == PMM_RESERVED_PAGES * PAGE_SIZE);
+    CHECK(second == first + PAGE_SIZE);
+    CHECK(pmm_get_free_pages() == TEST_PAGES - PMM_RESERVED_PAGES - 2);
+
+    // A freed page is handed out again; freeing twice or past the end of
+    // memory changes nothing
+    pmm_free_page(first);
+    pmm_free_page(first);
+    pmm_free_page(TEST_MEMORY);
+    CHECK(pmm_get_free_pages() == TEST_PAGES - PMM_RESERVED_PAGES - 1);
+    CHECK(pmm_alloc_page() == first);
+    pmm_free_page(first);
+    pmm_free_page(second);
+
+    u64 total, free, used;
+    pmm_get_stats(&total, &free, &used);
+    CHECK(total == TEST_PAGES && free == TEST_PAGES - PMM_RESERVED_PAGES && used == PMM_RESERVED_PAGES);
+
+    // Reserving covers every page the range touches, counts each once and
+    // stops at the end of memory
+    u64 before = pmm_get_free_pages();
+    pmm_reserve_range(first + 0x800, PAGE_SIZE);
+    CHECK(pmm_get_free_pages() == before - 2);
+    pmm_reserve_range(first, 2 * PAGE_SIZE);
+    CHECK(pmm_get_free_pages() == before - 2);
+    pmm_reserve_range(TEST_MEMORY - PAGE_SIZE, 16 * PAGE_SIZE);
+    CHECK(pmm_get_free_pages() == before - 3);
+    pmm_reserve_range(0, PAGE_SIZE);
+    CHECK(pmm_get_free_pages() == before - 3);
+    CHECK(pmm_alloc_page() == first + 2 * PAGE_SIZE);
+
+    // Exhaustion, then the one page freed is the one handed out
+    u64 drained = pmm_drain();
+    CHECK(drained == before - 4);
+    CHECK(pmm_get_free_pages() == 0);
+    CHECK(pmm_alloc_page() == 0);
+    pmm_free_page(TEST_MEMORY / 2);
+    CHECK(pmm_alloc_page() == TEST_MEMORY / 2);
+    CHECK(pmm_alloc_page() == 0);
+
+    // A bitmap above the first 2MB reserves its own pages
+    u64 bitmap = 8 * 1024 * 1024;
+    pmm_init(TEST_MEMORY, bitmap);
+    CHECK(pmm_get_free_pages() == TEST_PAGES - PMM_RESERVED_PAGES - 1);
+    bool handed_out = false;
+    for (u64 page = pmm_alloc_page(); page; page = pmm_alloc_page()) {
+        handed_out |= page == bitmap;
+    }
+    CHECK(!handed_out);
+}
+
+static void test_kmalloc() {
+    kmalloc_init(KMALLOC_HEAP_BASE);
+
+    // Everything is 8-byte aligned and packed in order
+    u64 expected = KMALLOC_HEAP_BASE;
+    bool aligned = true, packed = true;
+    for (u32 size = 1; size <= 100; size++) {
+        u64 block = (u64)kmalloc(size);
+        aligned &= (block & 7) == 0;
+        packed &= block == expected;
+        expected += (size + 7) & ~7;
+    }
+    CHECK(aligned);
+    CHECK(packed);
+
+    // NULL once the heap is used up, exactly at its end
+    CHECK(kmalloc(KMALLOC_HEAP_SIZE) == NULL);
+    CHECK((u64)kmalloc(KMALLOC_HEAP_BASE + KMALLOC_HEAP_SIZE - expected) == expected);
+    CHECK(kmalloc(1) == NULL);
+
+    // Init rewinds to the base it is given
+    kmalloc_init(KMALLOC_HEAP_BASE + 0x100000);
+    CHECK((u64)kmalloc(24) == KMALLOC_HEAP_BASE + 0x100000);
+    CHECK((u64)kmalloc(KMALLOC_HEAP_SIZE - 24) == KMALLOC_HEAP_BASE + 0x100000 + 24);
+    CHECK(kmalloc(8) == NULL);
+    kmalloc_init(KMALLOC_HEAP_BASE);
+}
+
+static void test_vmm() {
+    pmm_init(TEST_MEMORY, PMM_BITMAP_ADDR);
+    vmm_init();
+
+    u64 page = pmm_alloc_page();
+    u64 other = pmm_alloc_page();
+    CHECK(vmm_get_physical_address(VMM_BASE) == 0);
+
+    // The first mapping in a PML4 slot builds a PDPT, PD and PT; the offset
+    // in the page carries through the translation
+    u64 before = pmm_get_free_pages();
+    CHECK(vmm_map_page(VMM_BASE + 0x234, page, PAGE_WRITABLE));
+    CHECK(pmm_get_free_pages() == before - 3);
+    CHECK(vmm_get_physical_address(VMM_BASE + 0x123) == page + 0x123);
+    CHECK(vmm_get_physical_address(VMM_BASE + PAGE_SIZE) == 0);
+
+    // A neighbour shares the tables
+    CHECK(vmm_map_page(VMM_BASE + PAGE_SIZE, other, PAGE_WRITABLE));
+    CHECK(pmm_get_free_pages() == before - 3);
+    CHECK(vmm_get_physical_address(VMM_BASE + PAGE_SIZE + 8) == other + 8);
+
+    // Unmapping clears one page only, remapping replaces the translation
+    vmm_unmap_page(VMM_BASE);
+    CHECK(vmm_get_physical_address(VMM_BASE) == 0);
+    CHECK(vmm_get_physical_address(VMM_BASE + PAGE_SIZE) == other);
+    CHECK(vmm_map_page(VMM_BASE + PAGE_SIZE, page, PAGE_WRITABLE));
+    CHECK(vmm_get_physical_address(VMM_BASE + PAGE_SIZE) == page);
+
+    // Nothing to unmap where no tables exist
+    vmm_unmap_page(VMM_BASE + 0x40000000);
+    CHECK(vmm_get_physical_address(VMM_BASE + 0x40000000) == 0);
+    CHECK(pmm_get_free_pages() == before - 3);
+
+    // A user mapping in an address space of its own stays out of the
+    // kernel's tables, and destroying the space frees its tables
+    before = pmm_get_free_pages();
+    u64* space = vmm_create_space();
+    CHECK(space != NULL);
+    CHECK(vmm_map_page_in(space, VMM_USER_BASE, page, PAGE_USER | PAGE_WRITABLE));
+    CHECK(pmm_get_free_pages() == before - 4);
+    CHECK(vmm_get_physical_address(VMM_USER_BASE) == 0);
+    vmm_destroy_space(space);
+    CHECK(pmm_get_free_pages() == before);
+
+    // 2MB pages like the boot identity map's, put in the kernel's page
+    // directory by hand (an address space shares its tables)
+    space = vmm_create_space();
+    u64* pdpt = (u64*)(space[VMM_BASE >> 39] & PAGE_ADDR_MASK);
+    u64* pd = (u64*)(pdpt[0] & PAGE_ADDR_MASK);
+    vmm_destroy_space(space);
+    u64 huge = VMM_BASE + 8 * PAGE_HUGE_SIZE;
+    u64 frame = 16 * PAGE_HUGE_SIZE;
+    pd[8] = frame | PAGE_NX | PAGE_HUGE | PAGE_WRITABLE | PAGE_PRESENT;
+    pd[9] = (frame + PAGE_HUGE_SIZE) | PAGE_NX | PAGE_HUGE | PAGE_WRITABLE | PAGE_PRESENT;
+    CHECK(vmm_get_physical_address(huge + 0x12345) == frame + 0x12345);
+
+    // Mapping a 4KB page in one splits it, keeping the rest as it was
+    before = pmm_get_free_pages();
+    CHECK(vmm_map_page(huge + 0x5000, page, PAGE_WRITABLE));
+    CHECK(pmm_get_free_pages() == before - 1);
+    CHECK(!(pd[8] & PAGE_HUGE));
+    CHECK(vmm_get_physical_address(huge + 0x5010) == page + 0x10);
+    CHECK(vmm_get_physical_address(huge + 0x6010) == frame + 0x6010);
+    CHECK(vmm_get_physical_address(huge + PAGE_HUGE_SIZE - 1) == frame + PAGE_HUGE_SIZE - 1);
+
+    // Unmapping leaves a 2MB page alone
+    vmm_unmap_page(huge + PAGE_HUGE_SIZE);
+    CHECK(pd[9] & PAGE_HUGE);
+    CHECK(vmm_get_physical_address(huge + PAGE_HUGE_SIZE) == frame + PAGE_HUGE_SIZE);
+
+    // Mapping fails cleanly when there is no page left for a table
+    pmm_drain();
+    CHECK(!vmm_map_page(VMM_BASE + 0x40000000, page, PAGE_WRITABLE));
+    CHECK(vmm_get_physical_address(VMM_BASE + 0x40000000) == 0);
+    CHECK(vmm_map_page(VMM_BASE + 2 * PAGE_SIZE, other, PAGE_WRITABLE));
+}
+
+// Byte i of the copy source at offset
+static char pattern(u32 i, u32 offset) {
+    return (char)(i * 7 + offset + 1);
+}
+
+static void test_copy_set() {
+    static const u32 sizes[] = { 0, 1, 7, 8, 9, 63, 64, 65, 4095, 4096, 4097 };
+    char* source = (char*)host_alloc(COPY_MAX + 2 * COPY_GUARD);
+    char* dest = (char*)host_alloc(COPY_MAX + 2 * COPY_GUARD);
+    bool copied = true, set = true, guarded = true;
+
+    for (u32 s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        u32 size = sizes[s];
+        for (u32 from = 0; from < 8; from++) {
+            for (u32 to = 0; to < 8; to++) {
+                // Every alignment of source and destination, with untouched
+                // guard bytes on both sides of the destination
+                for (u32 i = 0; i < COPY_MAX + 2 * COPY_GUARD; i++) {
+                    source[i] = pattern(i, from);
+                    dest[i] = (char)0xAA;
+                }
+                memory_copy(source + COPY_GUARD + from, dest + COPY_GUARD + to, (int)size);
+                for (u32 i = 0; i < COPY_MAX + 2 * COPY_GUARD; i++) {
+                    u32 start = COPY_GUARD + to;
+                    if (i >= start && i < start + size) {
+                        copied &= dest[i] == pattern(i - start + COPY_GUARD + from, from);
+                    } else {
+                        guarded &= dest[i] == (char)0xAA;
+                    }
+                }
+
+                char value = (char)(0x5C + from * 0x20);
+                memory_set(dest + COPY_GUARD + to, value, (int)size);
+                for (u32 i = COPY_GUARD + to; i < COPY_GUARD + to + size; i++) {
+                    set &= dest[i] == value;
+                }
+                guarded &= dest[COPY_GUARD + to - 1] == (char)0xAA;
+                guarded &= dest[COPY_GUARD + to + size] == (char)0xAA;
+            }
+        }
+    }
+    CHECK(copied);
+    CHECK(set);
+    CHECK(guarded);
+
+    host_free(source);
+    host_free(dest);
+}
+
+int main(int argc, char** argv) {
+    if (!host_map_arena(TEST_MEMORY)) {
+        host_fail("can't map the memory arena at its physical addresses");
+    }
+
+    test_pmm();
+    test_kmalloc();
+    test_vmm();
+    test_copy_set();
+
+    host_write_number(checks - failures);
+    host_write(" of ");
+    host_write_number(checks);
+    host_write(" checks passed\n");
+    if (failures) {
+        host_fail("memtest failed");
+    }
+    return 0;
+}
@@ -0,0 +1,123 @@
+// Generate a perfect hash for the shell command names (host tool).
+//
+//   mkcmdhash <output.h> <source.c>...
+//
+// Collects the names from the COMMAND(name, ...) declarations in the
+// sources and searches for the seed that gives every name its own slot in
+// the smallest power-of-two table at least twice as large as the command
+// count. The hash must match command_hash() in src/terminal/command.h.
+#include <ctype.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MAX_COMMANDS 1024
+#define MAX_NAME     64
+#define MAX_SEEDS    1000000
+
+static char names[MAX_COMMANDS][MAX_NAME];
+static int count = 0;
+
+static uint32_t command_hash(const char* name, uint32_t seed) {
+    uint32_t hash = 2166136261u ^ seed;
+    while (*name) {
+        hash ^= (uint8_t)*name++;
+        hash *= 16777619u;
+    }
+    hash ^= hash >> 16;
+    hash *= 0x85EBCA6Bu;
+    hash ^= hash >> 13;
+    return hash;
+}
+
+// Pick up "COMMAND(name," at the start of a line
+static void scan(const char* path) {
+    FILE* in = fopen(path, "r");
+    if (!in) {
+        perror(path);
+        exit(1);
+    }
+    char line[1024];
+    while (fgets(line, sizeof(line), in)) {
+        const char* p = line;
+        while (*p == ' ' || *p == '\t') p++;
+        if (strncmp(p, "COMMAND(", 8) != 0) {
+            continue;
+        }
+        p += 8;
+        while (*p == ' ') p++;
+        int length = 0;
+        while ((isalnum((unsigned char)p[length]) || p[length] == '_') && length < MAX_NAME - 1) {
+            length++;
+        }
+        if (length == 0 || count == MAX_COMMANDS) {
+            continue;
+        }
+        memcpy(names[count], p, length);
+        names[count][length] = '\0';
+        count++;
+    }
+    fclose(in);
+}
+
+static int collision_free(uint32_t seed, uint32_t size, unsigned char* used) {
+    memset(used, 0, size);
+    for (int i = 0; i < count; i++) {
+        uint32_t slot = command_hash(names[i], seed) & (size - 1);
+        if (used[slot]) {
+            return 0;
+        }
+        used[slot] = 1;
+    }
+    return 1;
+}
+
+int main(int argc, char** argv) {
+    if (argc < 3) {
+        fprintf(stderr, "usage: mkcmdhash <output.h> <source.c>...\n");
+        return 1;
+    }
+    for (int i = 2; i < argc; i++) {
+        scan(argv[i]);
+    }
+
+    uint32_t size = 16;
+    while (size < 2u * (uint32_t)count) {
+        size *= 2;
+    }
+    unsigned char* used = NULL;
+    uint32_t seed = 0;
+    for (;;) {
+        used = realloc(used, size);
+        if (!used) {
+            fprintf(stderr, "mkcmdhash: out of memory\n");
+            return 1;
+        }
+        for (seed = 0; seed < MAX_SEEDS; seed++) {
+            if (collision_free(seed, size, used)) {
+                break;
+            }
+        }
+        if (seed < MAX_SEEDS) {
+            break;
+        }
+        size *= 2;
+    }
+
+    FILE* out = fopen(argv[1], "w");
+    if (!out) {
+        perror(argv[1]);
+        return 1;
+    }
+    fprintf(out, "// Generated by tools/mkcmdhash from the COMMAND() declarations, do not edit\n");
+    fprintf(out, "#ifndef COMMAND_HASH_H\n#define COMMAND_HASH_H\n\n");
+    fprintf(out, "#define COMMAND_HASH_SEED   0x%08Xu\n", seed);
+    fprintf(out, "#define COMMAND_HASH_SIZE   %u\n", size);
+    fprintf(out, "#define COMMAND_HASH_COUNT  %d\n", count);
+    fprintf(out, "\n#endif\n");
+    fclose(out);
+
+    printf("mkcmdhash: %d commands, %u slots, seed %u\n", count, size, seed);
+    return 0;
+}
@@ -0,0 +1,226 @@
+// Build an initrd image from a directory tree (host tool).
+//
+//   mkinitrd <output> <directory>
+//
+// The layout must match src/fs/initrd.h: a header, the entry table in
+// breadth-first order (so every directory's children are contiguous and
+// come after it), sorted by name within a directory, the names, then the
+// file data with every file starting on a page boundary.
+#include <dirent.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define INITRD_MAGIC 0x31445249
+#define INITRD_ALIGN 4096
+#define INITRD_FILE  1
+#define INITRD_DIR   2
+
+typedef struct {
+    uint32_t magic;
+    uint32_t count;
+    uint32_t names_offset;
+    uint32_t names_size;
+    uint64_t size;
+} __attribute__((packed)) initrd_header_t;
+
+typedef struct {
+    uint32_t name;
+    uint32_t type;
+    uint64_t offset;
+    uint64_t size;
+} __attribute__((packed)) initrd_entry_t;
+
+typedef struct node {
+    char* name;
+    char* source;                   // Host path
+    int is_dir;
+    uint64_t size;
+    struct node** children;
+    size_t child_count;
+} node_t;
+
+static void* xmalloc(size_t size) {
+    void* p = malloc(size ? size : 1);
+    if (!p) {
+        fprintf(stderr, "mkinitrd: out of memory\n");
+        exit(1);
+    }
+    return p;
+}
+
+static char* join(const char* dir, const char* name) {
+    char* path = xmalloc(strlen(dir) + strlen(name) + 2);
+    sprintf(path, "%s/%s", dir, name);
+    return path;
+}
+
+static int compare_nodes(const void* a, const void* b) {
+    return strcmp((*(node_t* const*)a)->name, (*(node_t* const*)b)->name);
+}
+
+// Read a directory tree (hidden files are skipped)
+static node_t* scan(const char* source, const char* name) {
+    struct stat st;
+    if (stat(source, &st) != 0) {
+        perror(source);
+        exit(1);
+    }
+
+    node_t* node = xmalloc(sizeof(node_t));
+    memset(node, 0, sizeof(node_t));
+    node->name = strdup(name);
+    node->source = strdup(source);
+    node->is_dir = S_ISDIR(st.st_mode);
+    node->size = node->is_dir ? 0 : (uint64_t)st.st_size;
+    if (!node->is_dir) {
+        return node;
+    }
+
+    DIR* dir = opendir(source);
+    if (!dir) {
+        perror(source);
+        exit(1);
+    }
+    struct dirent* de;
+    size_t capacity = 0;
+    while ((de = readdir(dir)) != NULL) {
+        if (de->d_name[0] == '.') {
+            continue;
+        }
+        if (node->child_count == capacity) {
+            capacity = capacity ? capacity * 2 : 8;
+            node->children = realloc(node->children, capacity * sizeof(node_t*));
+            if (!node->children) {
+                fprintf(stderr, "mkinitrd: out of memory\n");
+                exit(1);
+            }
+        }
+        char* path = join(source, de->d_name);
+        node->children[node->child_count++] = scan(path, de->d_name);
+        free(path);
+    }
+    closedir(dir);
+
+    qsort(node->children, node->child_count, sizeof(node_t*), compare_nodes);
+    node->size = node->child_count;
+    return node;
+}
+
+static uint64_t align_up(uint64_t value) {
+    return (value + INITRD_ALIGN - 1) & ~(uint64_t)(INITRD_ALIGN - 1);
+}
+
+int main(int argc, char** argv) {
+    if (argc != 3) {
+        fprintf(stderr, "usage: mkinitrd <output> <directory>\n");
+        return 1;
+    }
+
+    node_t* root = scan(argv[2], "");
+    if (!root->is_dir) {
+        fprintf(stderr, "mkinitrd: %s is not a directory\n", argv[2]);
+        return 1;
+    }
+
+    // Breadth-first order: the queue is the entry table
+    size_t count = 1;
+    size_t capacity = 64;
+    node_t** order = xmalloc(capacity * sizeof(node_t*));
+    order[0] = root;
+    uint64_t* first_child = xmalloc(capacity * sizeof(uint64_t));
+    for (size_t i = 0; i < count; i++) {
+        node_t* node = order[i];
+        first_child[i] = count;
+        for (size_t c = 0; c < node->child_count; c++) {
+            if (count == capacity) {
+                capacity *= 2;
+                order = realloc(order, capacity * sizeof(node_t*));
+                first_child = realloc(first_child, capacity * sizeof(uint64_t));
+                if (!order || !first_child) {
+                    fprintf(stderr, "mkinitrd: out of memory\n");
+                    return 1;
+                }
+            }
+            order[count++] = node->children[c];
+        }
+    }
+
+    // Lay out the names and the file data
+    uint32_t* name_offsets = xmalloc(count * sizeof(uint32_t));
+    uint64_t names_size = 0;
+    for (size_t i = 0; i < count; i++) {
+        name_offsets[i] = (uint32_t)names_size;
+        names_size += strlen(order[i]->name) + 1;
+    }
+    uint64_t names_offset = sizeof(initrd_header_t) + count * sizeof(initrd_entry_t);
+
+    initrd_entry_t* entries = xmalloc(count * sizeof(initrd_entry_t));
+    uint64_t end = align_up(names_offset + names_size);
+    for (size_t i = 0; i < count; i++) {
+        node_t* node = order[i];
+        entries[i].name = name_offsets[i];
+        entries[i].type = node->is_dir ? INITRD_DIR : INITRD_FILE;
+        entries[i].size = node->size;
+        if (node->is_dir) {
+            entries[i].offset = first_child[i];
+        } else {
+            entries[i].offset = end;
+            end = align_up(end + node->size);
+        }
+    }
+
+    initrd_header_t header = {
+        .magic = INITRD_MAGIC,
+        .count = (uint32_t)count,
+        .names_offset = (uint32_t)names_offset,
+        .names_size = (uint32_t)names_size,
+        .size = end,
+    };
+
+    FILE* out = fopen(argv[1], "wb");
+    if (!out) {
+        perror(argv[1]);
+        return 1;
+    }
+    fwrite(&header, sizeof(header), 1, out);
+    fwrite(entries, sizeof(initrd_entry_t), count, out);
+    for (size_t i = 0; i < count; i++) {
+        fwrite(order[i]->name, strlen(order[i]->name) + 1, 1, out);
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        node_t* node = order[i];
+        if (node->is_dir) {
+            continue;
+        }
+        fseek(out, (long)entries[i].offset, SEEK_SET);
+        FILE* in = fopen(node->source, "rb");
+        if (!in) {
+            perror(node->source);
+            return 1;
+        }
+        char buffer[65536];
+        size_t n;
+        while ((n = fread(buffer, 1, sizeof(buffer), in)) > 0) {
+            fwrite(buffer, 1, n, out);
+        }
+        fclose(in);
+    }
+
+    // Pad the last file out to the recorded size. Extending the file
+    // leaves what was written alone, unlike writing a zero at end - 1
+    // when the last file already ends there.
+    fflush(out);
+    if (ftruncate(fileno(out), (off_t)end) != 0) {
+        perror(argv[1]);
+        return 1;
+    }
+    fclose(out);
+
+    printf("mkinitrd: %zu entries, %llu bytes\n", count, (unsigned long long)end);
+    return 0;
+}
@@ -0,0 +1,99 @@
+// Generate the kernel symbol table (host tool).
+//
+//   nm -n kernel-64-nosyms.elf | mksyms <output.c>
+//
+// Keeps the code symbols from the nm listing, one per address, and writes
+// them as the ksym_table/ksym_names arrays of src/kernel/ksyms.h. With an
+// empty listing the table is empty, which is what the first link uses.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MAX_NAME    256
+
+typedef struct {
+    unsigned long long address;
+    char* name;
+} symbol_t;
+
+static symbol_t* symbols = NULL;
+static int count = 0;
+static int capacity = 0;
+
+// Linker-defined section markers such as __text_start are not functions
+static int is_marker(const char* name) {
+    return strncmp(name, "__", 2) == 0 &&
+           (strstr(name, "_start") || strstr(name, "_end") || strstr(name, "_load"));
+}
+
+static void add(unsigned long long address, const char* name) {
+    // nm -n sorts by address; of several names at one address keep the
+    // first one that isn't a marker
+    if (count && symbols[count - 1].address == address) {
+        if (is_marker(symbols[count - 1].name) && !is_marker(name)) {
+            free(symbols[count - 1].name);
+            symbols[count - 1].name = strdup(name);
+        }
+        return;
+    }
+    if (count == capacity) {
+        capacity = capacity ? capacity * 2 : 1024;
+        symbols = realloc(symbols, capacity * sizeof(symbol_t));
+        if (!symbols) {
+            fprintf(stderr, "mksyms: out of memory\n");
+            exit(1);
+        }
+    }
+    symbols[count].address = address;
+    symbols[count].name = strdup(name);
+    count++;
+}
+
+int main(int argc, char** argv) {
+    if (argc != 2) {
+        fprintf(stderr, "usage: nm -n kernel.elf | mksyms <output.c>\n");
+        return 1;
+    }
+
+    char line[1024];
+    while (fgets(line, sizeof(line), stdin)) {
+        unsigned long long address;
+        char type;
+        char name[MAX_NAME];
+        if (sscanf(line, "%llx %c %255s", &address, &type, name) != 3) {
+            continue;  // Undefined symbols have no address
+        }
+        if (type != 'T' && type != 't' && type != 'W' && type != 'w') {
+            continue;
+        }
+        add(address, name);
+    }
+
+    FILE* out = fopen(argv[1], "w");
+    if (!out) {
+        perror(argv[1]);
+        return 1;
+    }
+    fprintf(out, "// Generated by tools/mksyms from the kernel's symbols, do not edit\n");
+    fprintf(out, "#include \"src/kernel/ksyms.h\"\n\n");
+    fprintf(out, "const u32 ksym_count = %d;\n\n", count);
+
+    // A zero entry at the end keeps the array non-empty
+    fprintf(out, "const ksym_t ksym_table[] = {\n");
+    unsigned long offset = 0;
+    for (int i = 0; i < count; i++) {
+        fprintf(out, "    { 0x%llx, %lu },\n", symbols[i].address, offset);
+        offset += strlen(symbols[i].name) + 1;
+    }
+    fprintf(out, "    { 0, 0 }\n};\n\n");
+
+    fprintf(out, "const char ksym_names[] =\n");
+    for (int i = 0; i < count; i++) {
+        fprintf(out, "    \"%s\\0\"\n", symbols[i].name);
+    }
+    fprintf(out, "    \"\";\n");
+    fclose(out);
+
+    printf("mksyms: %d symbols, %lu bytes of names\n", count, offset);
+    return 0;
+}
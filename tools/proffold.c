@@ -0,0 +1,150 @@
+// Fold profiler samples into stacks for a flame graph (host tool).
+//
+//   proffold <kernel-64.sym> [serial.log]
+//
+// Reads the "prof <cpu> <pc>..." lines that `prof dump` writes to the
+// serial port (from the log file, or stdin), names each address with the
+// kernel's symbols (nm -n output, as the build leaves in kernel-64.sym) and
+// prints one "outermost;...;innermost count" line per distinct stack, the
+// input flamegraph.pl expects.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MAX_NAME    256
+#define MAX_DEPTH   64
+#define MAX_STACK   (MAX_DEPTH * (MAX_NAME + 1))
+
+typedef struct {
+    unsigned long long address;
+    char* name;
+} symbol_t;
+
+static symbol_t* symbols = NULL;
+static int symbol_count = 0;
+
+static char** stacks = NULL;
+static int stack_count = 0;
+static int stack_capacity = 0;
+
+static void* grow(void* array, int* capacity, size_t size) {
+    *capacity = *capacity ? *capacity * 2 : 1024;
+    array = realloc(array, *capacity * size);
+    if (!array) {
+        fprintf(stderr, "proffold: out of memory\n");
+        exit(1);
+    }
+    return array;
+}
+
+// Code symbols in address order, as mksyms keeps them
+static void load_symbols(const char* path) {
+    FILE* in = fopen(path, "r");
+    if (!in) {
+        perror(path);
+        exit(1);
+    }
+    int capacity = 0;
+    char line[1024];
+    while (fgets(line, sizeof(line), in)) {
+        unsigned long long address;
+        char type;
+        char name[MAX_NAME];
+        if (sscanf(line, "%llx %c %255s", &address, &type, name) != 3) {
+            continue;
+        }
+        if (type != 'T' && type != 't' && type != 'W' && type != 'w') {
+            continue;
+        }
+        if (symbol_count && symbols[symbol_count - 1].address == address) {
+            continue;
+        }
+        if (symbol_count == capacity) {
+            symbols = grow(symbols, &capacity, sizeof(symbol_t));
+        }
+        symbols[symbol_count].address = address;
+        symbols[symbol_count].name = strdup(name);
+        symbol_count++;
+    }
+    fclose(in);
+}
+
+// Name of the function holding an address (NULL before the first symbol)
+static const char* lookup(unsigned long long address) {
+    int low = 0;
+    int high = symbol_count;
+    while (low < high) {
+        int mid = low + (high - low) / 2;
+        if (symbols[mid].address <= address) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return low ? symbols[low - 1].name : NULL;
+}
+
+// Turn one sample line into a folded stack, outermost frame first
+static void fold(char* line) {
+    unsigned long long pcs[MAX_DEPTH];
+    int depth = 0;
+    char* word = strtok(line + 5, " \t\r\n");  // CPU number
+    while ((word = strtok(NULL, " \t\r\n")) && depth < MAX_DEPTH) {
+        pcs[depth++] = strtoull(word, NULL, 16);
+    }
+    if (depth == 0) {
+        return;
+    }
+
+    char stack[MAX_STACK];
+    size_t length = 0;
+    for (int d = depth - 1; d >= 0; d--) {
+        char unknown[32];
+        const char* name = lookup(pcs[d]);
+        if (!name) {
+            snprintf(unknown, sizeof(unknown), "[%llx]", pcs[d]);
+            name = unknown;
+        }
+        length += snprintf(stack + length, sizeof(stack) - length, "%s%s", length ? ";" : "", name);
+    }
+
+    if (stack_count == stack_capacity) {
+        stacks = grow(stacks, &stack_capacity, sizeof(char*));
+    }
+    stacks[stack_count++] = strdup(stack);
+}
+
+static int compare(const void* a, const void* b) {
+    return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+int main(int argc, char** argv) {
+    if (argc < 2 || argc > 3) {
+        fprintf(stderr, "usage: proffold <kernel-64.sym> [serial.log]\n");
+        return 1;
+    }
+    load_symbols(argv[1]);
+
+    FILE* in = stdin;
+    if (argc == 3 && !(in = fopen(argv[2], "r"))) {
+        perror(argv[2]);
+        return 1;
+    }
+    char line[4096];
+    while (fgets(line, sizeof(line), in)) {
+        if (strncmp(line, "prof ", 5) == 0) {
+            fold(line);
+        }
+    }
+
+    // Identical stacks end up next to each other
+    qsort(stacks, stack_count, sizeof(char*), compare);
+    for (int i = 0; i < stack_count;) {
+        int j = i + 1;
+        while (j < stack_count && strcmp(stacks[i], stacks[j]) == 0) j++;
+        printf("%s %d\n", stacks[i], j - i);
+        i = j;
+    }
+    fprintf(stderr, "proffold: %d samples\n", stack_count);
+    return 0;
+}
@@ -0,0 +1,115 @@
+// Convert a trace dump to Chrome trace JSON (host tool).
+//
+//   trace2json [serial.log] > trace.json
+//
+// Reads the lines `trace dump` writes to the serial port (from the log
+// file, or stdin) and prints them in the Trace Event Format that
+// chrome://tracing and ui.perfetto.dev open. Each CPU becomes a thread of
+// one process; begin/end events become slices named "<event> <arg>", the
+// rest instant events carrying their argument.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MAX_CPUS    256
+#define MAX_NAME    64
+
+typedef struct {
+    unsigned cpu;
+    unsigned long long tsc;
+    char phase;
+    char name[MAX_NAME];
+    char arg[MAX_NAME];
+} event_t;
+
+static event_t* events = NULL;
+static int count = 0;
+static int capacity = 0;
+
+static void add(const event_t* event) {
+    if (count == capacity) {
+        capacity = capacity ? capacity * 2 : 4096;
+        events = realloc(events, capacity * sizeof(event_t));
+        if (!events) {
+            fprintf(stderr, "trace2json: out of memory\n");
+            exit(1);
+        }
+    }
+    events[count++] = *event;
+}
+
+int main(int argc, char** argv) {
+    if (argc > 2) {
+        fprintf(stderr, "usage: trace2json [serial.log] > trace.json\n");
+        return 1;
+    }
+    FILE* in = stdin;
+    if (argc == 2 && !(in = fopen(argv[1], "r"))) {
+        perror(argv[1]);
+        return 1;
+    }
+
+    unsigned long long tsc_hz = 0;
+    unsigned cpus = 0;
+    char line[512];
+    while (fgets(line, sizeof(line), in)) {
+        event_t event;
+        if (strncmp(line, "trace-begin", 11) == 0) {
+            sscanf(line, "trace-begin cpus=%u tsc_hz=%llu", &cpus, &tsc_hz);
+            count = 0;  // A later dump replaces an earlier one
+        } else if (sscanf(line, "t %u %llx %c %63s %63s", &event.cpu, &event.tsc,
+                          &event.phase, event.name, event.arg) == 5 && event.cpu < MAX_CPUS) {
+            add(&event);
+        }
+    }
+    if (tsc_hz == 0) {
+        fprintf(stderr, "trace2json: no TSC rate in the dump, assuming 1 GHz\n");
+        tsc_hz = 1000000000ull;
+    }
+
+    unsigned long long base = count ? events[0].tsc : 0;
+    for (int i = 1; i < count; i++) {
+        if (events[i].tsc < base) {
+            base = events[i].tsc;
+        }
+    }
+
+    // Name each CPU's timeline
+    int written = 0;
+    printf("{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+    for (unsigned cpu = 0; cpu < cpus && cpu < MAX_CPUS; cpu++) {
+        printf("%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":0,\"tid\":%u,\"args\":{\"name\":\"cpu %u\"}}",
+               written++ ? ",\n" : "", cpu, cpu);
+    }
+
+    // A ring that wrapped can start inside a slice; its end has no begin
+    static int depth[MAX_CPUS];
+    int converted = 0;
+    for (int i = 0; i < count; i++) {
+        const event_t* event = &events[i];
+        double us = (double)(event->tsc - base) * 1e6 / (double)tsc_hz;
+        if (event->phase == 'E') {
+            if (depth[event->cpu] == 0) {
+                continue;
+            }
+            depth[event->cpu]--;
+        } else if (event->phase == 'B') {
+            depth[event->cpu]++;
+        }
+
+        printf("%s", written++ ? ",\n" : "");
+        converted++;
+        if (event->phase == 'i') {
+            printf("{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"i\",\"s\":\"t\",\"ts\":%.3f,"
+                   "\"pid\":0,\"tid\":%u,\"args\":{\"arg\":\"%s\"}}",
+                   event->name, event->name, us, event->cpu, event->arg);
+        } else {
+            printf("{\"name\":\"%s %s\",\"cat\":\"%s\",\"ph\":\"%c\",\"ts\":%.3f,\"pid\":0,\"tid\":%u}",
+                   event->name, event->arg, event->name, event->phase, us, event->cpu);
+        }
+    }
+    printf("\n]}\n");
+
+    fprintf(stderr, "trace2json: %d events\n", converted);
+    return 0;
+}